@@ -0,0 +1,71 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "core/cpu.h"
+
+// Gives the microbenchmarks access to the CPU internals
+struct BenchAccess {
+    static MemMap decodeAddr(CPU& cpu, uint32_t addr) {
+        return cpu.decodeAddr(addr);
+    }
+    static uint32_t load32(CPU& cpu, uint32_t addr) {
+        return cpu.load<uint32_t>(addr);
+    }
+    static void store32(CPU& cpu, uint32_t addr, uint32_t val) {
+        cpu.store<uint32_t>(addr, val);
+    }
+    static const Bios& bios(CPU& cpu) {
+        return *cpu.bios;
+    }
+    static void setR(CPU& cpu, RegAlias reg, uint32_t val) {
+        cpu.setR(reg, val);
+    }
+};
+
+struct BenchResult {
+    std::string name;
+    double ns_per_op;
+    uint64_t ops;
+};
+
+class BenchRunner {
+public:
+    // Times fn, which performs ops operations per call, and keeps the best
+    // of a few repetitions. setup runs untimed before each of them.
+    template<typename S, typename F>
+    void measure(const std::string& name, uint64_t ops, S&& setup, F&& fn) {
+        constexpr int repetitions = 5;
+        double best = 0;
+        for(int i = 0; i < repetitions; ++i) {
+            setup();
+            const auto start = std::chrono::steady_clock::now();
+            fn();
+            const double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+            if(i == 0 || ns < best)
+                best = ns;
+        }
+        add({name, best / ops, ops});
+    }
+    template<typename F>
+    void measure(const std::string& name, uint64_t ops, F&& fn) {
+        measure(name, ops, [] {}, std::forward<F>(fn));
+    }
+
+    void add(BenchResult result);
+    // Writes all results as JSON, to stdout if path is "-"
+    bool writeJson(const std::string& path) const;
+
+private:
+    std::vector<BenchResult> results;
+};
+
+void runThroughputBenches(BenchRunner& runner);
+void runMicroBenches(BenchRunner& runner);
+
+#endif // BENCH_H
@@ -0,0 +1,57 @@
+#include <fmt/core.h>
+
+#include <cstdio>
+#include <memory>
+#include <vector>
+
+#include "bench.h"
+#include "workloads/workloads.h"
+
+namespace {
+    // Runs until the workload stops the cpu
+    constexpr uint64_t cycle_budget = 1'000'000'000;
+
+    struct Backend {
+        CPUMode mode;
+        const char* name;
+        bool fastmem;
+    };
+
+    void runBench(BenchRunner& runner, const Workload& workload, uint64_t instructions, const std::string& path,
+                  const Backend& backend) {
+        std::unique_ptr<CPU> cpu;
+        const auto setup = [&] {
+            cpu = std::make_unique<CPU>(path);
+            if(backend.fastmem)
+                cpu->enableFastmem();
+            cpu->setMode(backend.mode);
+        };
+        runner.measure(fmt::format("{}/{}", workload.name, backend.name), instructions, setup, [&] {
+            cpu->run(cycle_budget);
+        });
+    }
+} // Anonymous namespace
+
+void runThroughputBenches(BenchRunner& runner) {
+    const Backend backends[] = {
+        {CPUMode::Interpreter, "interpreter", false},
+        {CPUMode::CachedInterpreter, "cached", false},
+        {CPUMode::Recompiler, "recompiler", false},
+        {CPUMode::Recompiler, "fastmem", true},
+    };
+    for(const Workload& workload : workloadCorpus()) {
+        const std::string path = writeBiosImage(buildWorkloadBios(workload), "prosur_bench_bios.bin");
+
+        // Every backend executes the same instructions, count them once
+        uint64_t instructions;
+        {
+            CPU cpu(path);
+            cpu.run(cycle_budget);
+            instructions = cpu.getStats().instructions;
+        }
+        for(const Backend& backend : backends) {
+            runBench(runner, workload, instructions, path, backend);
+        }
+        std::remove(path.c_str());
+    }
+}
@@ -0,0 +1,56 @@
+#include <fmt/core.h>
+#include <fmt/os.h>
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+#include "bench.h"
+
+void BenchRunner::add(BenchResult result) {
+    fmt::print("{:<32} {:10.2f} ns/op {:10.2f} Mop/s\n", result.name, result.ns_per_op, 1e3 / result.ns_per_op);
+    results.push_back(std::move(result));
+}
+
+bool BenchRunner::writeJson(const std::string& path) const {
+    std::string json = "{\n  \"benchmarks\": [\n";
+    for(size_t i = 0; i < results.size(); ++i) {
+        const BenchResult& result = results[i];
+        json += fmt::format("    {{\"name\": \"{}\", \"ns_per_op\": {:.4f}, \"ops\": {}}}{}\n", result.name,
+                            result.ns_per_op, result.ops, i + 1 < results.size() ? "," : "");
+    }
+    json += "  ]\n}\n";
+
+    if(path == "-") {
+        fmt::print("{}", json);
+        return true;
+    }
+    std::ofstream file(path, std::ios::out | std::ios::binary);
+    file << json;
+    return static_cast<bool>(file);
+}
+
+int main(int argc, char* args[]) {
+    std::string json_path;
+    for(int i = 1; i < argc; ++i) {
+        if(std::strcmp(args[i], "--json") == 0 && i + 1 < argc) {
+            json_path = args[++i];
+        }
+        else {
+            fmt::print("Usage: {} [--json <file>]\n"
+                       "Runs the CPU benchmarks, --json also writes the results to file, or stdout for -\n",
+                       args[0]);
+            return -1;
+        }
+    }
+
+    BenchRunner runner;
+    runMicroBenches(runner);
+    runThroughputBenches(runner);
+
+    if(!json_path.empty() && !runner.writeJson(json_path)) {
+        fmt::print("Failed to write {}\n", json_path);
+        return -1;
+    }
+    return 0;
+}
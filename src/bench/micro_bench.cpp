@@ -0,0 +1,236 @@
+#include <fmt/core.h>
+
+#include <cstdio>
+#include <filesystem>
+#include <memory>
+#include <vector>
+
+#include "bench.h"
+#include "workloads/workloads.h"
+
+namespace {
+    constexpr uint64_t iterations = 1 << 20;
+    // Keeps results alive so the loops aren't optimized away
+    volatile uint32_t sink;
+
+    using Reg = RegAlias;
+
+    struct OpClass {
+        const char* name;
+        void (*emit)(Assembler& as);
+    };
+
+    void benchDecodeExecute(BenchRunner& runner, CPU& cpu) {
+        // t0 points to RAM so memory ops stay on the fast path. The branch
+        // compares t1 with itself, so it is never taken.
+        const OpClass classes[] = {
+            {"shift", [](Assembler& as) { as.sll(Reg::t2, Reg::t1, 3); }},
+            {"alu_reg", [](Assembler& as) { as.addu(Reg::t2, Reg::t1, Reg::t2); }},
+            {"alu_imm", [](Assembler& as) { as.addiu(Reg::t2, Reg::t2, 1); }},
+            {"logic_imm", [](Assembler& as) { as.ori(Reg::t2, Reg::t2, 0xff); }},
+            {"lui", [](Assembler& as) { as.lui(Reg::t2, 0x1234); }},
+            {"load", [](Assembler& as) { as.lw(Reg::t2, 0x40, Reg::t0); }},
+            {"load_byte", [](Assembler& as) { as.lbu(Reg::t2, 0x41, Reg::t0); }},
+            {"store", [](Assembler& as) { as.sw(Reg::t1, 0x40, Reg::t0); }},
+            {"store_byte", [](Assembler& as) { as.sb(Reg::t1, 0x41, Reg::t0); }},
+            {"branch", [](Assembler& as) {
+                const auto next = as.newLabel();
+                as.bne(Reg::t1, Reg::t1, next);
+                as.bind(next);
+            }},
+            {"cop0", [](Assembler& as) { as.mtc0(Reg::t1, Cop0RegAlias::SR); }},
+        };
+
+        for(const OpClass& op_class : classes) {
+            Assembler as(0);
+            op_class.emit(as);
+            const Instruction instruction(as.finish()[0]);
+            const auto setup = [&] {
+                BenchAccess::setR(cpu, Reg::t0, 0x80000000);
+                BenchAccess::setR(cpu, Reg::t1, 0);
+                BenchAccess::setR(cpu, Reg::t2, 0);
+            };
+            runner.measure(fmt::format("decodeExecute/{}", op_class.name), iterations, setup, [&] {
+                for(uint64_t i = 0; i < iterations; ++i) {
+                    cpu.decodeExecute(instruction);
+                }
+            });
+        }
+    }
+
+    void benchDecodeAddr(BenchRunner& runner, CPU& cpu) {
+        const uint32_t addrs[] = {0x00001000, 0x1f000000, 0x1f800000, 0x1f801810, 0x1fc00100, 0xfffe0130};
+        runner.measure("decodeAddr", iterations * std::size(addrs), [&] {
+            uint32_t acc = 0;
+            for(uint64_t i = 0; i < iterations; ++i) {
+                for(const uint32_t addr : addrs) {
+                    acc += static_cast<uint32_t>(BenchAccess::decodeAddr(cpu, addr + (i & 0xfc)));
+                }
+            }
+            sink = acc;
+        });
+    }
+
+    struct Region {
+        const char* name;
+        uint32_t addr;
+        bool store;
+    };
+
+    void benchMemory(BenchRunner& runner, CPU& cpu) {
+        // Only regions with defined accesses, the rest halt the CPU
+        const Region regions[] = {
+            {"load32/main_kseg0", 0x80000000, false},
+            {"load32/main_kuseg_mirror", 0x00600000, false},
+            {"load32/bios", 0xbfc00000, false},
+            {"store32/main_kseg0", 0x80000000, true},
+            {"store32/main_kseg1", 0xa0000000, true},
+            {"store32/hardware_regs", 0x1f801000, true},
+        };
+
+        for(const Region& region : regions) {
+            // Hardware register writes are logged, don't run the log out of space
+            const uint64_t count = region.addr == 0x1f801000 ? iterations / 64 : iterations;
+            runner.measure(region.name, count, [&] {
+                uint32_t acc = 0;
+                for(uint64_t i = 0; i < count; ++i) {
+                    const uint32_t addr = region.addr + static_cast<uint32_t>((i * 4) & 0xffc);
+                    if(region.store)
+                        BenchAccess::store32(cpu, addr, static_cast<uint32_t>(i));
+                    else
+                        acc += BenchAccess::load32(cpu, addr);
+                }
+                sink = acc;
+            });
+        }
+
+        const Bios& bios = BenchAccess::bios(cpu);
+        runner.measure("Bios::load32", iterations, [&] {
+            uint32_t acc = 0;
+            for(uint64_t i = 0; i < iterations; ++i) {
+                acc += bios.load<uint32_t>(static_cast<uint32_t>((i * 4) & (bios_size - 1)));
+            }
+            sink = acc;
+        });
+    }
+
+    void benchMainLoop(BenchRunner& runner) {
+        // ADDIU t2, t2, 1 then jump back with a NOP in the delay slot
+        Assembler as(bios_addr);
+        const auto loop = as.bindNew();
+        as.addiu(Reg::t2, Reg::t2, 1);
+        as.j(loop);
+        as.nop();
+        const std::string path = writeBiosImage(buildBiosImage(as.finish()), "prosur_bench_loop.bin");
+        std::unique_ptr<CPU> cpu;
+        runner.measure("mainLoop/interpreter_step", iterations, [&] { cpu = std::make_unique<CPU>(path); }, [&] {
+            for(uint64_t i = 0; i < iterations; ++i) {
+                cpu->mainLoop();
+            }
+        });
+        std::remove(path.c_str());
+    }
+
+    // Whole machine round trips, in memory and through a file
+    void benchSavestate(BenchRunner& runner, CPU& cpu) {
+        constexpr uint64_t states = 64;
+        runner.measure("savestate/save", states, [&] {
+            for(uint64_t i = 0; i < states; ++i) {
+                sink = static_cast<uint32_t>(cpu.saveState().size());
+            }
+        });
+        const std::vector<uint8_t> state = cpu.saveState();
+        runner.measure("savestate/load", states, [&] {
+            for(uint64_t i = 0; i < states; ++i) {
+                sink = cpu.loadState(state.data(), state.size());
+            }
+        });
+
+        const std::string path = (std::filesystem::temp_directory_path() / "prosur_bench.state").string();
+        runner.measure("savestate/save_file", states, [&] {
+            for(uint64_t i = 0; i < states; ++i) {
+                sink = cpu.saveState(path);
+            }
+        });
+        runner.measure("savestate/load_file", states, [&] {
+            for(uint64_t i = 0; i < states; ++i) {
+                sink = cpu.loadState(path);
+            }
+        });
+        std::remove(path.c_str());
+    }
+
+    // 256x256 quads through GP0 at each span kernel level, ops are pixels.
+    // Textures come from the left half of VRAM, quads go to the right.
+    void benchRaster(BenchRunner& runner, CPU& cpu) {
+        struct Primitive {
+            const char* name;
+            std::vector<uint32_t> words;
+        };
+        const Primitive primitives[] = {
+            {"flat", {0x28808080, 0x00000000, 0x00000100, 0x01000000, 0x01000100}},
+            {"gouraud", {0x38ff0000, 0x00000000, 0x0000ff00, 0x00000100, 0x000000ff, 0x01000000, 0x00808080, 0x01000100}},
+            {"gouraud_blend", {0x3aff0000, 0x00000000, 0x0000ff00, 0x00000100, 0x000000ff, 0x01000000, 0x00808080, 0x01000100}},
+            {"textured_4bit", {0x2c808080, 0x00000000, 0x78000000, 0x00000100, 0x000000ff, 0x01000000, 0x0000ff00,
+                               0x01000100, 0x0000ffff}},
+            {"textured_15bit", {0x2c808080, 0x00000000, 0x00000000, 0x00000100, 0x010000ff, 0x01000000, 0x0000ff00,
+                                0x01000100, 0x0000ffff}},
+        };
+        constexpr uint64_t draws = 64;
+        constexpr uint64_t pixels = 256 * 256;
+
+        Gpu& gpu = cpu.getGpu();
+        for(const uint32_t word : {0xe1000200u, 0xe3000000u, 0xe4000000u | 1023 | 511 << 10, 0xe5000000u | 512}) {
+            gpu.write(gpu_gp0, word);
+        }
+        const auto draw = [&](const Primitive& primitive) {
+            for(uint64_t i = 0; i < draws; ++i) {
+                for(const uint32_t word : primitive.words) {
+                    gpu.write(gpu_gp0, word);
+                }
+            }
+            // Draws what the raster threads still have batched
+            gpu.getVRAM();
+        };
+        for(const SimdLevel level : {SimdLevel::Scalar, SimdLevel::SSE41, SimdLevel::AVX2}) {
+            if(supportedSimdLevel(level) != level)
+                continue;
+            gpu.setSimdLevel(level);
+            for(const Primitive& primitive : primitives) {
+                runner.measure(fmt::format("raster/{}/{}", primitive.name, simdLevelName(level)), draws * pixels,
+                               [&] { draw(primitive); });
+            }
+        }
+        gpu.setSimdLevel(hostSimdLevel());
+
+        // The same at the best level, shared between raster threads
+        for(const uint32_t threads : {2u, 4u}) {
+            gpu.setRasterThreads(threads);
+            for(const Primitive& primitive : primitives) {
+                runner.measure(fmt::format("raster/{}/{}x{}", primitive.name, simdLevelName(hostSimdLevel()), threads),
+                               draws * pixels, [&] { draw(primitive); });
+            }
+        }
+        gpu.setRasterThreads(1);
+
+        // CLUT textures looked up texel by texel, as without the cache
+        const Primitive& textured_4bit = primitives[3];
+        gpu.setTextureCaching(false);
+        runner.measure(fmt::format("raster/{}/{}/uncached", textured_4bit.name, simdLevelName(hostSimdLevel())),
+                       draws * pixels, [&] { draw(textured_4bit); });
+        gpu.setTextureCaching(true);
+    }
+} // Anonymous namespace
+
+void runMicroBenches(BenchRunner& runner) {
+    const std::string path = writeBiosImage(buildBiosImage({}), "prosur_bench_bios.bin");
+    CPU cpu(path);
+    std::remove(path.c_str());
+
+    benchDecodeExecute(runner, cpu);
+    benchDecodeAddr(runner, cpu);
+    benchMemory(runner, cpu);
+    benchMainLoop(runner);
+    benchSavestate(runner, cpu);
+    benchRaster(runner, cpu);
+}
@@ -1,38 +1,149 @@
+#include <algorithm>
+#include <filesystem>
 #include <fstream>
+#include <mutex>
+#include <unordered_map>
 #include <fmt/core.h>
 
 #include "bios.h"
 #include "mips.h"
 #include "log.h"
 
-Bios::Bios(std::string filepath) {
-    std::ifstream file(filepath, std::ios::in | std::ios::binary);
-    if (file.is_open()) {
-        // get length of file:
-        file.seekg (0, file.end);
-        auto length = file.tellg();
-        file.seekg (0, file.beg);
-
-        if (length == bios_size) {
-            LOG("Reading bios...\n", length);
-            file.read((char*) memory, length);
-
-            if (file) {
-                LOG("all characters read successfully.\n");
-            }
-            else {
-                LOG("error: only {} could be read.\n", file.gcount());
-            }
+#if defined(__unix__) || defined(__APPLE__)
+#define BIOS_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+    uint64_t fnv1a(const uint8_t* data, size_t size) {
+        uint64_t hash = 0xcbf29ce484222325;
+        for(size_t i = 0; i < size; ++i) {
+            hash = (hash ^ data[i]) * 0x100000001b3;
         }
-        else {
-            LOG("File size invalid.\n");
+        return hash;
+    }
+
+    // Identifies a file, and changes when it's replaced or modified.
+    // Empty if the file doesn't exist.
+    std::string fileKey(const std::string& path) {
+        std::error_code error;
+        const auto canonical = std::filesystem::canonical(path, error);
+        if(error)
+            return "";
+        const auto time = std::filesystem::last_write_time(canonical, error);
+        if(error)
+            return "";
+        return fmt::format("{}:{}", canonical.string(), time.time_since_epoch().count());
+    }
+
+    // Images open in this process by file and by contents, they go away
+    // with their last CPU
+    std::mutex images_mutex;
+    std::unordered_map<std::string, std::weak_ptr<const Bios>> images;
+    std::unordered_map<uint64_t, std::weak_ptr<const Bios>> images_by_hash;
+
+    template<typename Map>
+    void dropExpired(Map& map) {
+        for(auto it = map.begin(); it != map.end();) {
+            it = it->second.expired() ? map.erase(it) : std::next(it);
+        }
+    }
+} // Anonymous namespace
+
+Bios::~Bios() {
+#ifdef BIOS_MMAP
+    if(mapping)
+        munmap(mapping, bios_size);
+    if(file >= 0)
+        close(file);
+#endif
+}
+
+std::shared_ptr<const Bios> Bios::open(const std::string& filepath) {
+    const std::string key = fileKey(filepath);
+
+    std::lock_guard<std::mutex> lock(images_mutex);
+    if(!key.empty()) {
+        const auto it = images.find(key);
+        if(it != images.end()) {
+            if(auto image = it->second.lock())
+                return image;
         }
+    }
+
+    std::shared_ptr<Bios> image(new Bios());
+    if(!image->map(filepath)) {
+        image->owned = std::make_unique<uint8_t[]>(bios_size);
+        image->memory = image->owned.get();
+    }
+    image->content_hash = fnv1a(image->memory, bios_size);
+    if(!image->loaded)
+        return image;
+    LOG("BIOS: Loaded {}, hash {:016x}\n", filepath, image->content_hash);
 
-        file.close();
+    dropExpired(images);
+    dropExpired(images_by_hash);
+    // A copy of an image already open, the new mapping goes away
+    std::shared_ptr<const Bios> shared = image;
+    const auto same = images_by_hash.find(image->content_hash);
+    if(same != images_by_hash.end()) {
+        auto other = same->second.lock();
+        if(other && std::equal(other->memory, other->memory + bios_size, image->memory))
+            shared = std::move(other);
+    }
+    else {
+        images_by_hash[image->content_hash] = image;
     }
+    if(!key.empty())
+        images[key] = shared;
+    return shared;
 }
 
-uint32_t Bios::load32(uint32_t offset) {
-    LOG_DEBUG("BIOS: Fetching from {:#x}\n", offset);
-    return build32(memory[offset],memory[offset+1],memory[offset+2], memory[offset+3]);
+bool Bios::map(const std::string& filepath) {
+#ifdef BIOS_MMAP
+    const int fd = ::open(filepath.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0) {
+        LOG("BIOS: Can't open {}\n", filepath);
+        return false;
+    }
+    struct stat info;
+    if(fstat(fd, &info) != 0 || info.st_size != bios_size) {
+        LOG("BIOS: {} isn't {} bytes\n", filepath, bios_size);
+        close(fd);
+        return false;
+    }
+    // Shared, so every process mapping the file uses the same pages
+    void* view = mmap(nullptr, bios_size, PROT_READ, MAP_SHARED, fd, 0);
+    if(view == MAP_FAILED) {
+        LOG("BIOS: Failed to map {}\n", filepath);
+        close(fd);
+        return false;
+    }
+    mapping = view;
+    file = fd;
+    memory = static_cast<const uint8_t*>(view);
+#else
+    std::ifstream file(filepath, std::ios::in | std::ios::binary | std::ios::ate);
+    if(!file) {
+        LOG("BIOS: Can't open {}\n", filepath);
+        return false;
+    }
+    if(file.tellg() != bios_size) {
+        LOG("BIOS: {} isn't {} bytes\n", filepath, bios_size);
+        return false;
+    }
+    owned = std::make_unique<uint8_t[]>(bios_size);
+    file.seekg(0);
+    if(!file.read(reinterpret_cast<char*>(owned.get()), bios_size)) {
+        LOG("BIOS: Failed to read {}\n", filepath);
+        owned.reset();
+        return false;
+    }
+    memory = owned.get();
+#endif
+    loaded = true;
+    return true;
 }
@@ -1,23 +1,66 @@
 #ifndef BIOS_H
 #define BIOS_H
 
-#include <string>
 #include <cstdint>
+#include <memory>
+#include <string>
+
+#include "mips.h"
 
 constexpr uint32_t bios_size = 512 * 1024;
 
+// A read only BIOS image. The file is mapped rather than copied where the
+// host supports it, and every CPU of the process opening the same file
+// shares one image, so extra instances cost no memory and the page cache
+// is shared with other processes too. Files are told apart by path and
+// modification time, and mustn't be written to while they're in use.
+// Different files with the same contents share an image as well.
 class Bios {
-    uint8_t memory[bios_size]{0};
-    
 public:
-    Bios(std::string filepath);
+    ~Bios();
 
     Bios(const Bios&) = delete;
     Bios& operator=(const Bios&) = delete;
 
-    uint32_t load32(uint32_t offset);
-};
+    // Returns the image of the file at filepath. A file that can't be
+    // read or isn't bios_size bytes is logged and gives an image of zeros,
+    // check valid().
+    static std::shared_ptr<const Bios> open(const std::string& filepath);
 
+    template<typename T>
+    T load(uint32_t offset) const {
+        return readLE<T>(memory + offset);
+    }
 
+    const uint8_t* data() const {
+        return memory;
+    }
+    // The open file the image is mapped from, for mapping it elsewhere
+    // like the fastmem arena. -1 if the image isn't a file mapping.
+    int fd() const {
+        return file;
+    }
+
+    bool valid() const {
+        return loaded;
+    }
+    // 64 bit FNV-1a of the contents, identifies the image
+    uint64_t hash() const {
+        return content_hash;
+    }
+
+private:
+    Bios() = default;
+    // Maps or reads the file, returns false if it can't be used
+    bool map(const std::string& filepath);
+
+    const uint8_t* memory = nullptr;
+    // Either the mapping of the file or a heap copy of it
+    void* mapping = nullptr;
+    int file = -1;
+    std::unique_ptr<uint8_t[]> owned;
+    bool loaded = false;
+    uint64_t content_hash = 0;
+};
 
-#endif //BIOS_H
\ No newline at end of file
+#endif //BIOS_H
@@ -0,0 +1,67 @@
+#include "block_cache.h"
+#include "log.h"
+
+BlockCache::BlockCache() = default;
+
+Block* BlockCache::findSlow(uint32_t addr) {
+    const auto it = blocks.find(addr);
+    if(it == blocks.end())
+        return nullptr;
+
+    fast_lookup[fastIndex(addr)] = it->second.get();
+    return it->second.get();
+}
+
+Block* BlockCache::insert(std::unique_ptr<Block> block, bool in_ram, uint32_t ram_offset) {
+    Block* ptr = block.get();
+    const uint32_t addr = block->addr;
+
+    if(in_ram) {
+        const uint32_t first_page = ram_offset >> block_page_shift;
+        const uint32_t last_page = (ram_offset + 4 * (block->ops.size() - 1)) >> block_page_shift;
+        for(uint32_t page = first_page; page <= last_page; ++page) {
+            page_blocks[page % page_count].push_back(addr);
+            code_pages[page % page_count] = 1;
+        }
+    }
+
+    auto& slot = blocks[addr];
+    if(slot)
+        retired.push_back(std::move(slot));
+    slot = std::move(block);
+    fast_lookup[fastIndex(addr)] = ptr;
+
+    LOG_DEBUG("BlockCache: Compiled block at {:#x} with {} ops\n", addr, ptr->ops.size());
+    return ptr;
+}
+
+void BlockCache::invalidatePage(uint32_t page) {
+    LOG_DEBUG("BlockCache: Invalidating page {:#x}\n", page);
+    for(const uint32_t addr : page_blocks[page]) {
+        const auto it = blocks.find(addr);
+        if(it == blocks.end())
+            continue;
+
+        auto& fast = fast_lookup[fastIndex(addr)];
+        if(fast == it->second.get())
+            fast = nullptr;
+        retired.push_back(std::move(it->second));
+        blocks.erase(it);
+    }
+    page_blocks[page].clear();
+    code_pages[page] = 0;
+    was_invalidated = true;
+}
+
+void BlockCache::clear() {
+    for(auto& [addr, block] : blocks) {
+        retired.push_back(std::move(block));
+    }
+    blocks.clear();
+    fast_lookup.fill(nullptr);
+    for(auto& page : page_blocks) {
+        page.clear();
+    }
+    code_pages.fill(0);
+    was_invalidated = true;
+}
@@ -0,0 +1,121 @@
+#ifndef BLOCK_CACHE_H
+#define BLOCK_CACHE_H
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "mips.h"
+
+class CPU;
+
+// An instruction decoded once into the handler that executes it and
+// its pre-extracted fields, so it can be executed repeatedly without
+// going through the decoder again.
+struct DecodedOp {
+    using Handler = void (CPU::*)(const DecodedOp&);
+
+    enum Flags : uint8_t {
+        None = 0,
+        Branch = 1 << 0,    // Has a delay slot, ends the block after it
+        Unhandled = 1 << 1, // Stops the cpu, ends the block
+    };
+
+    Handler handler = nullptr;
+    Instruction instruction{0};
+    uint8_t rs = 0;
+    uint8_t rt = 0;
+    uint8_t rd = 0;
+    uint8_t shamt = 0;
+    uint32_t imm = 0;  // zero extended immediate
+    int32_t simm = 0;  // sign extended immediate
+    uint8_t flags = None;
+};
+
+// A load of an idle loop, from R[base] + offset. Base 0 is a constant
+// address.
+struct IdleLoad {
+    uint8_t base;
+    uint32_t offset;
+};
+
+// A straight run of guest code, up to and including the delay slot of
+// the first branch found.
+struct Block {
+    // Native code for the block, returns how many ops were executed
+    using CompiledCode = uint32_t (*)(CPU*);
+
+    uint32_t addr = 0; // Virtual address of the first instruction
+    std::vector<DecodedOp> ops;
+    CompiledCode code = nullptr; // Set by the recompiler
+    bool idle = false; // See isIdleLoop
+    std::vector<IdleLoad> idle_loads;
+};
+
+constexpr uint32_t block_page_shift = 12;
+constexpr uint32_t block_max_ops = 128;
+
+class BlockCache {
+public:
+    BlockCache();
+
+    BlockCache(const BlockCache&) = delete;
+    BlockCache& operator=(const BlockCache&) = delete;
+
+    Block* find(uint32_t addr) {
+        Block* block = fast_lookup[fastIndex(addr)];
+        if(block && block->addr == addr)
+            return block;
+        return findSlow(addr);
+    }
+
+    // ram_offset is the offset into main memory backing the block, if any
+    Block* insert(std::unique_ptr<Block> block, bool in_ram, uint32_t ram_offset);
+
+    // Called on every write to main memory
+    void invalidate(uint32_t ram_offset) {
+        const uint32_t page = (ram_offset >> block_page_shift) % page_count;
+        if(code_pages[page])
+            invalidatePage(page);
+    }
+
+    // One byte per page of main memory, non-zero if blocks were compiled from it
+    const uint8_t* codePages() const {
+        return code_pages.data();
+    }
+
+    void clear();
+
+    // Whether any block was invalidated since the last call to resetInvalidated.
+    // Blocks are kept alive until then, so a running block can finish safely.
+    bool invalidated() const {
+        return was_invalidated;
+    }
+    void resetInvalidated() {
+        was_invalidated = false;
+        retired.clear();
+    }
+
+private:
+    static constexpr uint32_t page_count = (2 * 1024 * 1024) >> block_page_shift;
+    static constexpr uint32_t fast_lookup_size = 4096;
+
+    static constexpr uint32_t fastIndex(uint32_t addr) {
+        return (addr >> 2) % fast_lookup_size;
+    }
+
+    Block* findSlow(uint32_t addr);
+    void invalidatePage(uint32_t page);
+
+    std::unordered_map<uint32_t, std::unique_ptr<Block>> blocks;
+    std::array<Block*, fast_lookup_size> fast_lookup{};
+    // Virtual addresses of the blocks backed by each page of main memory
+    std::array<std::vector<uint32_t>, page_count> page_blocks;
+    std::array<uint8_t, page_count> code_pages{};
+    std::vector<std::unique_ptr<Block>> retired;
+    bool was_invalidated = false;
+};
+
+#endif // BLOCK_CACHE_H
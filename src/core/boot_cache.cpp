@@ -0,0 +1,36 @@
+#include <filesystem>
+
+#include <fmt/core.h>
+
+#include "boot_cache.h"
+#include "cpu.h"
+#include "log.h"
+
+BootCache::BootCache(std::string directory) : directory(std::move(directory)) {}
+
+std::string BootCache::pathFor(uint64_t bios_hash) const {
+    return (std::filesystem::path(directory) / fmt::format("boot_{:016x}.snap", bios_hash)).string();
+}
+
+bool BootCache::restore(CPU& cpu) const {
+    const std::string path = pathFor(cpu.getBios().hash());
+    if(!cpu.loadState(path))
+        return false;
+    LOG("BootCache: Restored {}\n", path);
+    return true;
+}
+
+bool BootCache::save(const CPU& cpu) const {
+    const std::string path = pathFor(cpu.getBios().hash());
+    if(!cpu.saveState(path))
+        return false;
+    LOG("BootCache: Saved {}\n", path);
+    return true;
+}
+
+bool runBoot(CPU& cpu, uint64_t max_cycles) {
+    cpu.setEntryBreakpoint(boot_done_pc);
+    const RunResult result = cpu.run(max_cycles);
+    cpu.clearEntryBreakpoint();
+    return result.reason == StopReason::Breakpoint;
+}
@@ -0,0 +1,35 @@
+#ifndef BOOT_CACHE_H
+#define BOOT_CACHE_H
+
+#include <cstdint>
+#include <string>
+
+class CPU;
+
+// Where the BIOS jumps once it initialized the machine, to the shell it
+// loaded there. Games and sideloaded executables take over from here.
+constexpr uint32_t boot_done_pc = 0x80030000;
+
+// Savestates of the machine at boot_done_pc, one file per BIOS hash in a
+// directory, so later starts with the same BIOS skip the boot entirely.
+// States are published atomically, so instances can share the directory.
+
+class BootCache {
+public:
+    explicit BootCache(std::string directory);
+
+    std::string pathFor(uint64_t bios_hash) const;
+
+    // Returns false if there's no usable snapshot for the BIOS of cpu
+    bool restore(CPU& cpu) const;
+    bool save(const CPU& cpu) const;
+
+private:
+    std::string directory;
+};
+
+// Runs cpu until it's about to execute boot_done_pc, for at most
+// max_cycles. Returns false if the BIOS didn't get there.
+bool runBoot(CPU& cpu, uint64_t max_cycles);
+
+#endif // BOOT_CACHE_H
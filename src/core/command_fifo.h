@@ -0,0 +1,49 @@
+#ifndef COMMAND_FIFO_H
+#define COMMAND_FIFO_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+// Single producer, single consumer ring of GP0 words, from the thread
+// running the CPU to the one running the renderer. Neither side ever
+// waits on the other, a full ring just refuses the word.
+class CommandFifo {
+public:
+    static constexpr size_t capacity = 1 << 16;
+
+    // Producer side, false if the ring is full
+    bool push(uint32_t word) {
+        const uint64_t pos = head.load(std::memory_order_relaxed);
+        if(pos - tail.load(std::memory_order_acquire) == capacity)
+            return false;
+        words[pos % capacity] = word;
+        head.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side, moves up to max words to out and returns how many
+    size_t pop(uint32_t* out, size_t max) {
+        const uint64_t pos = tail.load(std::memory_order_relaxed);
+        const size_t count = static_cast<size_t>(std::min<uint64_t>(head.load(std::memory_order_acquire) - pos, max));
+        for(size_t i = 0; i < count; ++i) {
+            out[i] = words[(pos + i) % capacity];
+        }
+        tail.store(pos + count, std::memory_order_release);
+        return count;
+    }
+
+    bool empty() const {
+        return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+    }
+
+private:
+    std::unique_ptr<uint32_t[]> words = std::make_unique<uint32_t[]>(capacity);
+    // Kept on their own cache lines, each side writes one of them
+    alignas(64) std::atomic<uint64_t> head{0}; // Written by the producer
+    alignas(64) std::atomic<uint64_t> tail{0}; // Written by the consumer
+};
+
+#endif // COMMAND_FIFO_H
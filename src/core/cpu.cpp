@@ -3,9 +3,12 @@
 #include <fmt/format.h>
 #include <fmt/ostream.h>
 #include <algorithm>
+#include <chrono>
+#include <cstring>
 #include <limits>
 
 #include "cpu.h"
+#include "idle_loop.h"
 #include "mips.h"
 #include "log.h"
 
@@ -20,11 +23,70 @@ namespace {
     };
 } // Anonymous namespace
 
-CPU::CPU(std::string bios_path) {
-    bios = std::make_unique<Bios>(bios_path);
+CPU::CPU(std::string bios_path)
+    : dma(scheduler, [this](uint32_t offset, uint32_t size) { ramWritten(offset, size); }), gpu(scheduler) {
+    bios = Bios::open(bios_path);
+    owned_memory = std::make_unique<uint8_t[]>(memory_size);
+    memory = owned_memory.get();
+    dma.setRAM(memory);
+    dma.connect(DmaChannel::GPU, &gpu);
 
     R.fill(0xdeadbeef);
     R[0] = 0;
+
+    mapPages();
+}
+
+CPU::~CPU() = default;
+
+void CPU::mapPages() {
+    // KUSEG, KSEG0 and KSEG1 all see the same physical memory
+    constexpr uint32_t segments[] = {0x00000000, 0x80000000, 0xa0000000};
+    // The 2 MiB of RAM are mirrored across the first 8 MiB
+    constexpr uint32_t ram_window = 0x00800000;
+    constexpr uint32_t bios_base = 0x1fc00000;
+
+    read_pages.fill(nullptr);
+    write_pages.fill(nullptr);
+    // Traced accesses are recorded on the slow path
+    scratchpad_mapped = !trace;
+    if(trace)
+        return;
+
+    for(const uint32_t segment : segments) {
+        for(uint32_t offset = 0; offset < ram_window; offset += mem_page_size) {
+            const uint32_t page = (segment + offset) >> mem_page_shift;
+            read_pages[page] = memory + offset % memory_size;
+            write_pages[page] = memory + offset % memory_size;
+        }
+        for(uint32_t offset = 0; offset < bios_size; offset += mem_page_size) {
+            read_pages[(segment + bios_base + offset) >> mem_page_shift] = bios->data() + offset;
+        }
+    }
+}
+
+bool CPU::enableFastmem() {
+    if(fastmem)
+        return true;
+
+    fastmem = Fastmem::create(memory_size, scratchpad_size, *bios);
+    if(!fastmem) {
+        LOG("Fastmem isn't available on this host\n");
+        return false;
+    }
+
+    std::copy(memory, memory + memory_size, fastmem->ram());
+    memory = fastmem->ram();
+    owned_memory.reset();
+    std::copy(scratchpad, scratchpad + scratchpad_size, fastmem->scratchpad());
+    scratchpad = fastmem->scratchpad();
+    dma.setRAM(memory);
+    mapPages();
+    // Compiled code doesn't know about fastmem yet
+    block_cache.clear();
+    if(recompiler)
+        recompiler->reset();
+    return true;
 }
 
 MemMap CPU::decodeAddr(uint32_t paddr) {
@@ -58,9 +120,10 @@ MemMap CPU::decodeAddr(uint32_t paddr) {
     }
 }
 
-uint32_t CPU::load32(uint32_t addr) {
-    if(addr % 4 != 0) {
-        LOG("Unaligned memory read at {:#x}\n", addr);
+template<typename T>
+T CPU::loadSlow(uint32_t addr) {
+    if(addr % sizeof(T) != 0) {
+        LOG("Unaligned {} bit read at {:#x}\n", 8 * sizeof(T), addr);
         running = false;
         return 0;
     }
@@ -70,341 +133,1063 @@ uint32_t CPU::load32(uint32_t addr) {
 
     LOG_DEBUG("CPU: Reading from {:#x}. Paddr: {:#x}\n", addr, paddr);
 
+    T val = 0;
     switch (decodeAddr(paddr)) {
     case MemMap::Main:
-    {
-        const uint32_t offset = paddr & 0x1ffffc;
-        return build32(memory[offset], memory[offset + 1], memory[offset + 2], memory[offset + 3]);
-    }
+        val = readLE<T>(memory + (paddr & (memory_size - 1)));
+        break;
     case MemMap::BIOS:
-        return bios->load32(paddr & 0x7fffc);
+        val = bios->load<T>(paddr & (bios_size - 1));
+        break;
+    case MemMap::HardwareRegs:
+        val = static_cast<T>(readHardware(paddr & ~3u) >> (8 * (paddr & 3)));
+        break;
+    case MemMap::Scratchpad:
+        if(inScratchpad(addr)) {
+            val = readLE<T>(scratchpad + (paddr & (scratchpad_size - 1)));
+            break;
+        }
+        [[fallthrough]];
     case MemMap::Unmapped:
         // fallthrough
     default:
-        LOG("Unhandled memory read at {:#x}, decoded as {}\n", addr, decodeAddr(paddr));
+        LOG("Unhandled {} bit read at {:#x}, decoded as {}\n", 8 * sizeof(T), addr, decodeAddr(paddr));
         running = false;
         break;
     }
+    if(trace_memory)
+        trace->memAccess(false, sizeof(T), addr, val);
+    return val;
 }
 
-// Vide comment on store16
-void CPU::store8(uint32_t addr, uint8_t val) {
+template<typename T>
+void CPU::storeSlow(uint32_t addr, T val) {
+    if(addr % sizeof(T) != 0) {
+        LOG("Unaligned {} bit store at {:#x}\n", 8 * sizeof(T), addr);
+        running = false;
+        return;
+    }
+
     const uint8_t region_bits = addr >> 29;
     const uint32_t paddr = addr & REGION_MASKS[region_bits];
 
-    LOG_DEBUG("CPU: Storing byte {:#x} to {:#x}. Paddr: {:#x}\n", val, addr, paddr);
+    LOG_DEBUG("CPU: Storing {:#x} to {:#x}. Paddr: {:#x}\n", val, addr, paddr);
+
+    if(trace_memory)
+        trace->memAccess(true, sizeof(T), addr, val);
 
     switch (decodeAddr(paddr)) {
     case MemMap::Main:
     {
-        LOG("Ignoring byte writes to memory for now.\n");
-        const uint32_t offset = paddr & 0x1ffffc;
-        //memory[offset] = getFirstByte(val);
+        const uint32_t offset = paddr & (memory_size - 1);
+        block_cache.invalidate(offset);
+        dirty_pages[offset >> dirty_page_shift] = 1;
+        writeLE<T>(memory + offset, val);
     }
         break;
     case MemMap::HardwareRegs:
-        LOG("Ignoring byte writes to hardware regs for now.\n");
+        if(sizeof(T) == 4) {
+            writeHardware(paddr, val);
+        }
+        else if(Gpu::contains(paddr)) {
+            // Reading GPUREAD back would move a transfer along, and GP0 and
+            // GP1 only take whole words anyway
+            writeHardware(paddr & ~3u, static_cast<uint32_t>(val) << (8 * (paddr & 3)));
+        }
+        else {
+            // Narrow writes only change their part of the register
+            const uint32_t shift = 8 * (paddr & 3);
+            const uint32_t mask = static_cast<T>(~T(0)) << shift;
+            const uint32_t word = readHardware(paddr & ~3u);
+            writeHardware(paddr & ~3u, (word & ~mask) | (static_cast<uint32_t>(val) << shift));
+        }
         break;
     case MemMap::BIOS:
         LOG("Can't write to bios!\n");
         break;
     case MemMap::IO:
-        LOG("Ignoring byte writes to IO for now.\n");
+        LOG("Ignoring {} bit writes to IO for now.\n", 8 * sizeof(T));
         break;
+    case MemMap::Scratchpad:
+        if(inScratchpad(addr)) {
+            writeLE<T>(scratchpad + (paddr & (scratchpad_size - 1)), val);
+            break;
+        }
+        [[fallthrough]];
     default:
-        LOG("Unhandled byte store at {:#x}, decoded as: {}\n", addr, decodeAddr(paddr));
+        LOG("Unhandled {} bit store at {:#x}, decoded as: {}\n", 8 * sizeof(T), addr, decodeAddr(paddr));
         running = false;
         break;
     }
 }
 
-// There is duplicate code from the store32 function, maybe the RAM writes should be abstracted away
-// and merge the functions with overloading/templates
-void CPU::store16(uint32_t addr, uint16_t val) {
-    if(addr % 2 != 0) {
-        LOG("Unaligned halfword store at {:#x}\n", addr);
-        running = false;
-        return;
-    }
-
-    const uint8_t region_bits = addr >> 29;
-    const uint32_t paddr = addr & REGION_MASKS[region_bits];
-
-    LOG_DEBUG("CPU: Storing halfword {:#x} to {:#x}. Paddr: {:#x}\n", val, addr, paddr);
+bool CPU::isMemory(uint32_t addr) {
+    const uint32_t paddr = addr & REGION_MASKS[addr >> 29];
+    const MemMap map = decodeAddr(paddr);
+    return map == MemMap::Main || (map == MemMap::Scratchpad && inScratchpad(addr));
+}
 
-    switch (decodeAddr(paddr)) {
-    case MemMap::Main:
-    {
-        LOG("Ignoring halfword writes to memory for now.\n");
-        const uint32_t offset = paddr & 0x1ffffc;
-        //memory[offset] = getFirstByte(val);
-        //memory[offset+1] = getSecondByte(val);
-    }
+void CPU::storePartial(uint32_t addr, uint32_t val, uint32_t count) {
+    switch(count) {
+    case 1:
+        store<uint8_t>(addr, val);
         break;
-    case MemMap::HardwareRegs:
-        LOG("Ignoring halfword writes to hardware regs for now.\n");
+    case 2:
+        store<uint16_t>(addr, val);
         break;
-    case MemMap::BIOS:
-        LOG("Can't write to bios!\n");
-        break;
-    case MemMap::IO:
-        LOG("Ignoring halfword writes to IO for now.\n");
+    case 4:
+        store<uint32_t>(addr, val);
         break;
     default:
-        LOG("Unhandled halfword store at {:#x}, decoded as: {}\n", addr, decodeAddr(paddr));
-        running = false;
+        LOG("Ignoring {} byte unaligned store at {:#x}\n", count, addr);
         break;
     }
 }
 
-void CPU::store32(uint32_t addr, uint32_t val) {
-    if(addr % 4 != 0) {
-        LOG("Unaligned memory store at {:#x}\n", addr);
-        running = false;
+uint32_t CPU::readHardware(uint32_t paddr) {
+    if(Dma::contains(paddr))
+        return dma.read(paddr);
+    if(Gpu::contains(paddr))
+        return gpu.read(paddr);
+    // Polled in tight loops, so this only shows up in debug builds
+    LOG_DEBUG("Ignoring reads from hardware reg {:#x} for now.\n", paddr);
+    return 0;
+}
+
+void CPU::writeHardware(uint32_t paddr, uint32_t val) {
+    if(Dma::contains(paddr)) {
+        dma.write(paddr, val);
+        return;
+    }
+    if(Gpu::contains(paddr)) {
+        gpu.write(paddr, val);
         return;
     }
+    LOG("Ignoring writes of {:#x} to hardware reg {:#x} for now.\n", val, paddr);
+}
 
-    const uint8_t region_bits = addr >> 29;
-    const uint32_t paddr = addr & REGION_MASKS[region_bits];
+template uint8_t CPU::loadSlow<uint8_t>(uint32_t addr);
+template uint16_t CPU::loadSlow<uint16_t>(uint32_t addr);
+template uint32_t CPU::loadSlow<uint32_t>(uint32_t addr);
+template void CPU::storeSlow<uint8_t>(uint32_t addr, uint8_t val);
+template void CPU::storeSlow<uint16_t>(uint32_t addr, uint16_t val);
+template void CPU::storeSlow<uint32_t>(uint32_t addr, uint32_t val);
 
-    LOG_DEBUG("CPU: Storing {:#x} to {:#x}. Paddr: {:#x}\n", val, addr, paddr);
+// Dispatch tables, indexed directly by the instruction fields. Entries of the
+// primary table can point to a secondary table selected by another field.
+struct CPU::OpTables {
+    struct Entry {
+        DecodedOp::Handler handler = nullptr;
+        uint8_t flags = DecodedOp::None;
+        const Entry* table = nullptr;
+        uint8_t shift = 0;
+        uint8_t mask = 0;
+    };
 
-    switch (decodeAddr(paddr)) {
-    case MemMap::Main:
-    {
-        const uint32_t offset = paddr & 0x1ffffc;
-        memory[offset] = getFirstByte(val);
-        memory[offset+1] = getSecondByte(val);
-        memory[offset+2] = getThirdByte(val);
-        memory[offset+3] = getFourthByte(val);
+    template<size_t N>
+    using Table = std::array<Entry, N>;
+
+    template<size_t N>
+    static constexpr Table<N> makeTable(DecodedOp::Handler unhandled) {
+        Table<N> table{};
+        for(auto& entry : table) {
+            entry = {unhandled, DecodedOp::Unhandled};
+        }
+        return table;
     }
-        break;
-    case MemMap::HardwareRegs:
-        LOG("Ignoring writes to hardware regs for now.\n");
-        break;
-    case MemMap::BIOS:
-        LOG("Can't write to bios!\n");
-        break;
-    case MemMap::IO:
-        LOG("Ignoring writes to IO for now.\n");
-        break;
-    default:
-        LOG("Unhandled memory store at {:#x}, decoded as: {}\n", addr, decodeAddr(paddr));
-        running = false;
-        break;
+
+    static constexpr Table<64> makeSpecial() {
+        auto table = makeTable<64>(&CPU::opUnhandledSpecial);
+        table[0x00] = {&CPU::opSLL};
+        table[0x08] = {&CPU::opJR, DecodedOp::Branch};
+        table[0x21] = {&CPU::opADDU};
+        table[0x25] = {&CPU::opOR};
+        table[0x2b] = {&CPU::opSLTU};
+        return table;
     }
+
+    static constexpr Table<32> makeRegimm() {
+        return makeTable<32>(&CPU::opUnhandled);
+    }
+
+    static constexpr Table<32> makeCop0() {
+        auto table = makeTable<32>(&CPU::opUnhandledCop);
+        table[0x04] = {&CPU::opMTC0};
+        return table;
+    }
+
+    static constexpr Table<32> makeCop2() {
+        return makeTable<32>(&CPU::opUnhandledCop);
+    }
+
+    static const Table<64> special;
+    static const Table<32> regimm;
+    static const Table<32> cop0;
+    static const Table<32> cop2;
+
+    static constexpr Table<64> makePrimary() {
+        auto table = makeTable<64>(&CPU::opUnhandled);
+        // SPECIAL, selected by funct
+        table[0x00] = {nullptr, DecodedOp::None, special.data(), 0, 0x3f};
+        // REGIMM, selected by rt
+        table[0x01] = {nullptr, DecodedOp::None, regimm.data(), 16, 0x1f};
+        table[0x02] = {&CPU::opJ, DecodedOp::Branch};
+        table[0x03] = {&CPU::opJAL, DecodedOp::Branch};
+        table[0x05] = {&CPU::opBNE, DecodedOp::Branch};
+        table[0x08] = {&CPU::opADDI};
+        table[0x09] = {&CPU::opADDIU};
+        table[0x0c] = {&CPU::opANDI};
+        table[0x0d] = {&CPU::opORI};
+        table[0x0f] = {&CPU::opLUI};
+        // COP0 and COP2, selected by the cop opcode
+        table[0x10] = {nullptr, DecodedOp::None, cop0.data(), 21, 0x1f};
+        table[0x12] = {nullptr, DecodedOp::None, cop2.data(), 21, 0x1f};
+        table[0x20] = {&CPU::opLB};
+        table[0x21] = {&CPU::opLH};
+        table[0x22] = {&CPU::opLWL};
+        table[0x23] = {&CPU::opLW};
+        table[0x24] = {&CPU::opLBU};
+        table[0x25] = {&CPU::opLHU};
+        table[0x26] = {&CPU::opLWR};
+        table[0x28] = {&CPU::opSB};
+        table[0x29] = {&CPU::opSH};
+        table[0x2a] = {&CPU::opSWL};
+        table[0x2b] = {&CPU::opSW};
+        table[0x2e] = {&CPU::opSWR};
+        return table;
+    }
+
+    static const Table<64> primary;
+};
+
+constexpr CPU::OpTables::Table<64> CPU::OpTables::special = makeSpecial();
+constexpr CPU::OpTables::Table<32> CPU::OpTables::regimm = makeRegimm();
+constexpr CPU::OpTables::Table<32> CPU::OpTables::cop0 = makeCop0();
+constexpr CPU::OpTables::Table<32> CPU::OpTables::cop2 = makeCop2();
+constexpr CPU::OpTables::Table<64> CPU::OpTables::primary = makePrimary();
+
+DecodedOp CPU::decode(Instruction instruction) const {
+    const OpTables::Entry* entry = &OpTables::primary[instruction.getBits<26,6>()];
+    if(entry->table)
+        entry = &entry->table[(instruction.whole >> entry->shift) & entry->mask];
+
+    DecodedOp op;
+    op.handler = entry->handler;
+    op.flags = entry->flags;
+    op.instruction = instruction;
+    op.rs = instruction.getRS();
+    op.rt = instruction.getRT();
+    op.rd = instruction.getRD();
+    op.shamt = instruction.getShamt();
+    op.imm = instruction.getImmediate();
+    op.simm = instruction.getImmediateS();
+    return op;
 }
 
 void CPU::decodeExecute(Instruction instruction) {
-    switch (instruction.getOpcode())
-    {
-    case 0x00:
-        // SPECIAL
-        switch(instruction.getFunct()) {
-            case 0x0:
-                // SLL - Shift Logical Left
-                LOG_DEBUG("SLL: rt:{:#x}, rd:{:#x}, sa:{:#x}\n", instruction.getRT(), instruction.getRD(), instruction.getShamt());
-                setR(instruction.getRD(), getR(instruction.getRT()) << instruction.getShamt());
-                break;
-            case 0x08:
-                // JR - Jump Register
-                LOG_DEBUG("JR: rs:{:#x}, addr:{:#x}, curr_pc:{:#x}\n", instruction.getRS(), getR(instruction.getRS()), pc);
-                pc = getR(instruction.getRS());
-                break;
-            case 0x25:
-                // OR - Bitwise OR
-                LOG_DEBUG("OR: rs:{:#x}, rt:{:#x}, rd:{:#x}\n", instruction.getRS(), instruction.getRT(), instruction.getRD());
-                setR(instruction.getRD(), getR(instruction.getRS()) | getR(instruction.getRT()));
-                break;
-            case 0x21:
-                // ADDU - Add Unsigned
-                LOG_DEBUG("ADDU: rs:{:#x}, rt:{:#x}, rd:{:#x}\n", instruction.getRS(), instruction.getRT(), instruction.getRD());
-                setR(instruction.getRD(), getR(instruction.getRS()) + getR(instruction.getRT()));
-                break;
-            case 0x2b:
-                // SLTU - Set on Less Than Unsigned
-                LOG_DEBUG("SLTU: rs:{:#x}, rt:{:#x}, rd:{:#x}\n", instruction.getRS(), instruction.getRT(), instruction.getRD());
-                setR(instruction.getRD(), getR(instruction.getRS()) < getR(instruction.getRT()));
+    execute(decode(instruction));
+}
+
+void CPU::opSLL(const DecodedOp& op) {
+    // SLL - Shift Logical Left
+    LOG_DEBUG("SLL: rt:{:#x}, rd:{:#x}, sa:{:#x}\n", op.rt, op.rd, op.shamt);
+    setR(op.rd, getR(op.rt) << op.shamt);
+}
+
+void CPU::opJR(const DecodedOp& op) {
+    // JR - Jump Register
+    LOG_DEBUG("JR: rs:{:#x}, addr:{:#x}, curr_pc:{:#x}\n", op.rs, getR(op.rs), pc);
+    pc = getR(op.rs);
+}
+
+void CPU::opOR(const DecodedOp& op) {
+    // OR - Bitwise OR
+    LOG_DEBUG("OR: rs:{:#x}, rt:{:#x}, rd:{:#x}\n", op.rs, op.rt, op.rd);
+    setR(op.rd, getR(op.rs) | getR(op.rt));
+}
+
+void CPU::opADDU(const DecodedOp& op) {
+    // ADDU - Add Unsigned
+    LOG_DEBUG("ADDU: rs:{:#x}, rt:{:#x}, rd:{:#x}\n", op.rs, op.rt, op.rd);
+    setR(op.rd, getR(op.rs) + getR(op.rt));
+}
+
+void CPU::opSLTU(const DecodedOp& op) {
+    // SLTU - Set on Less Than Unsigned
+    LOG_DEBUG("SLTU: rs:{:#x}, rt:{:#x}, rd:{:#x}\n", op.rs, op.rt, op.rd);
+    setR(op.rd, getR(op.rs) < getR(op.rt));
+}
+
+void CPU::opJ(const DecodedOp& op) {
+    // J - Jump
+    LOG_DEBUG("J: addr:{:#x}\n", op.instruction.getAddress());
+    const auto addr = op.instruction.getAddress() << 2;
+    const uint32_t mask = 0xf0000000;
+    pc = (pc & mask) | addr;
+}
+
+void CPU::opJAL(const DecodedOp& op) {
+    // JAL - Jump And Link
+    LOG_DEBUG("JAL: addr:{:#x}, curr_pc:{:#x}\n", op.instruction.getAddress(), pc);
+    const auto addr = op.instruction.getAddress() << 2;
+    const uint32_t mask = 0xf0000000;
+    setR(RegAlias::ra, pc);
+    pc = (pc & mask) | addr;
+}
+
+void CPU::opBNE(const DecodedOp& op) {
+    // BNE - Branch Not Equal
+    LOG_DEBUG("BNE: rs:{:#x}, rt:{:#x}, offset:{:#x}\n", op.rs, op.rt, op.simm);
+    if(getR(op.rs) != getR(op.rt)){
+        pc = pc + (op.simm << 2) - 4;
+    }
+}
+
+void CPU::opADDI(const DecodedOp& op) {
+    // ADDI - Add Immediate Word
+    LOG_DEBUG("ADDI: rt:{:#x}, rs:{:#x}, I {:#x}\n", op.rt, op.rs, op.imm);
+    const int32_t operand1 = getR(op.rs);
+    const int32_t operand2 = op.simm;
+    const int64_t sumE = static_cast<int64_t>(operand1) + static_cast<int64_t>(operand2);
+    if(sumE > std::numeric_limits<int32_t>::max() || sumE < std::numeric_limits<int32_t>::min()) {
+        // exception
+        LOG("ADDI Overflow! I need to implement exceptions!\n");
+        running = false;
+    }
+    else {
+        setR(op.rt, operand1 + operand2);
+    }
+}
+
+void CPU::opADDIU(const DecodedOp& op) {
+    // ADDIU - Add Immediate Unsigned Word
+    LOG_DEBUG("ADDIU: rt:{:#x}, rs:{:#x}, I {:#x}\n", op.rt, op.rs, op.imm);
+    setR(op.rt, getR(op.rs) + op.simm);
+}
+
+void CPU::opLUI(const DecodedOp& op) {
+    // LUI - Load Upper Immediate
+    LOG_DEBUG("LUI: rt:{:#x}, I {:#x}\n", op.rt, op.imm);
+    setR(op.rt, op.imm << 16);
+}
+
+void CPU::opANDI(const DecodedOp& op) {
+    // ANDI - And Immediate
+    LOG_DEBUG("ANDI: rs:{:#x}, rt:{:#x}, I {:#x}\n", op.rs, op.rt, op.imm);
+    setR(op.rt, op.imm & getR(op.rs));
+}
+
+void CPU::opORI(const DecodedOp& op) {
+    // ORI - Bitwise OR Immediate
+    LOG_DEBUG("ORI: rs:{:#x}, rt:{:#x}, I {:#x}\n", op.rs, op.rt, op.imm);
+    setR(op.rt, op.imm | getR(op.rs));
+}
+
+void CPU::opMTC0(const DecodedOp& op) {
+    // MTC0 - Move To Coprocessor 0
+    LOG_DEBUG("MTC0: rt:{:#x}, rd:{:#x}\n", op.rt, op.rd);
+    switch(static_cast<Cop0RegAlias>(op.rd)){
+        case Cop0RegAlias::SR:
+            Cop0R[op.rd] = getR(op.rt);
+            break;
+        default:
+            LOG("Unhandled write to COP0 Register {:#x}, val:{:#x}\n", op.rd, getR(op.rt));
+    }
+}
+
+void CPU::opLB(const DecodedOp& op) {
+    // LB - Load Byte
+    LOG_DEBUG("LB: base:{:#x}, rt:{:#x}, offset {:#x}\n", op.rs, op.rt, op.simm);
+    if(cacheIsolated()) {
+        LOG_DEBUG("Ignoring loads from isolated cache\n");
+        return;
+    }
+    const uint32_t base_addr = getR(op.rs);
+    const uint32_t val = static_cast<int32_t>(load<int8_t>(base_addr + op.simm));
+    if(op.rt)
+        pending_load = {op.rt, val};
+}
+
+void CPU::opLH(const DecodedOp& op) {
+    // LH - Load Halfword
+    LOG_DEBUG("LH: base:{:#x}, rt:{:#x}, offset {:#x}\n", op.rs, op.rt, op.simm);
+    if(cacheIsolated()) {
+        LOG_DEBUG("Ignoring loads from isolated cache\n");
+        return;
+    }
+    const uint32_t base_addr = getR(op.rs);
+    const uint32_t val = static_cast<int32_t>(load<int16_t>(base_addr + op.simm));
+    if(op.rt)
+        pending_load = {op.rt, val};
+}
+
+void CPU::opLWL(const DecodedOp& op) {
+    // LWL - Load Word Left
+    LOG_DEBUG("LWL: base:{:#x}, rt:{:#x}, offset {:#x}\n", op.rs, op.rt, op.simm);
+    if(cacheIsolated()) {
+        LOG_DEBUG("Ignoring loads from isolated cache\n");
+        return;
+    }
+    const uint32_t addr = getR(op.rs) + op.simm;
+    const uint32_t word = load<uint32_t>(addr & ~3u);
+    const uint32_t cur = getLoadingR(op.rt);
+    // Fills rt from the top with the bytes up to addr
+    const uint32_t shift = 8 * (3 - addr % 4);
+    const uint32_t val = (cur & ~(0xffffffffu << shift)) | (word << shift);
+    if(op.rt)
+        pending_load = {op.rt, val};
+}
+
+void CPU::opLW(const DecodedOp& op) {
+    // LW - Load Word
+    LOG_DEBUG("LW: base:{:#x}, rt:{:#x}, offset {:#x}\n", op.rs, op.rt, op.simm);
+    if(cacheIsolated()) {
+        LOG_DEBUG("Ignoring loads from isolated cache\n");
+        return;
+    }
+    const uint32_t base_addr = getR(op.rs);
+    const uint32_t val = load<uint32_t>(base_addr + op.simm);
+    if(op.rt)
+        pending_load = {op.rt, val};
+}
+
+void CPU::opLBU(const DecodedOp& op) {
+    // LBU - Load Byte Unsigned
+    LOG_DEBUG("LBU: base:{:#x}, rt:{:#x}, offset {:#x}\n", op.rs, op.rt, op.simm);
+    if(cacheIsolated()) {
+        LOG_DEBUG("Ignoring loads from isolated cache\n");
+        return;
+    }
+    const uint32_t base_addr = getR(op.rs);
+    const uint32_t val = load<uint8_t>(base_addr + op.simm);
+    if(op.rt)
+        pending_load = {op.rt, val};
+}
+
+void CPU::opLHU(const DecodedOp& op) {
+    // LHU - Load Halfword Unsigned
+    LOG_DEBUG("LHU: base:{:#x}, rt:{:#x}, offset {:#x}\n", op.rs, op.rt, op.simm);
+    if(cacheIsolated()) {
+        LOG_DEBUG("Ignoring loads from isolated cache\n");
+        return;
+    }
+    const uint32_t base_addr = getR(op.rs);
+    const uint32_t val = load<uint16_t>(base_addr + op.simm);
+    if(op.rt)
+        pending_load = {op.rt, val};
+}
+
+void CPU::opLWR(const DecodedOp& op) {
+    // LWR - Load Word Right
+    LOG_DEBUG("LWR: base:{:#x}, rt:{:#x}, offset {:#x}\n", op.rs, op.rt, op.simm);
+    if(cacheIsolated()) {
+        LOG_DEBUG("Ignoring loads from isolated cache\n");
+        return;
+    }
+    const uint32_t addr = getR(op.rs) + op.simm;
+    const uint32_t word = load<uint32_t>(addr & ~3u);
+    const uint32_t cur = getLoadingR(op.rt);
+    // Fills rt from the bottom with the bytes from addr on
+    const uint32_t shift = 8 * (addr % 4);
+    const uint32_t val = (cur & ~(0xffffffffu >> shift)) | (word >> shift);
+    if(op.rt)
+        pending_load = {op.rt, val};
+}
+
+void CPU::opSB(const DecodedOp& op) {
+    // SB - Store Byte
+    LOG_DEBUG("SB: base:{:#x}, rt:{:#x}, offset {:#x}\n", op.rs, op.rt, op.simm);
+    if(cacheIsolated()) {
+        LOG_DEBUG("Ignoring writes to isolated cache\n");
+        return;
+    }
+    const uint8_t rt_val = getR(op.rt);
+    const uint32_t base_addr = getR(op.rs);
+    store<uint8_t>(base_addr + op.simm, rt_val);
+}
+
+void CPU::opSH(const DecodedOp& op) {
+    // SH - Store Halfword
+    LOG_DEBUG("SH: base:{:#x}, rt:{:#x}, offset {:#x}\n", op.rs, op.rt, op.simm);
+    if(cacheIsolated()) {
+        LOG_DEBUG("Ignoring writes to isolated cache\n");
+        return;
+    }
+    const uint16_t rt_val = getR(op.rt);
+    const uint32_t base_addr = getR(op.rs);
+    store<uint16_t>(base_addr + op.simm, rt_val);
+}
+
+void CPU::opSWL(const DecodedOp& op) {
+    // SWL - Store Word Left
+    LOG_DEBUG("SWL: base:{:#x}, rt:{:#x}, offset {:#x}\n", op.rs, op.rt, op.simm);
+    if(cacheIsolated()) {
+        LOG_DEBUG("Ignoring writes to isolated cache\n");
+        return;
+    }
+    const uint32_t addr = getR(op.rs) + op.simm;
+    // Stores the top bytes of rt to the bytes up to addr
+    const uint32_t shift = 8 * (3 - addr % 4);
+    if(!isMemory(addr)) {
+        storePartial(addr & ~3u, getR(op.rt) >> shift, addr % 4 + 1);
+        return;
+    }
+    const uint32_t word = load<uint32_t>(addr & ~3u);
+    const uint32_t val = (word & ~(0xffffffffu >> shift)) | (getR(op.rt) >> shift);
+    store<uint32_t>(addr & ~3u, val);
+}
+
+void CPU::opSW(const DecodedOp& op) {
+    // SW - Store Word
+    LOG_DEBUG("SW: base:{:#x}, rt:{:#x}, offset {:#x}\n", op.rs, op.rt, op.simm);
+    if(cacheIsolated()) {
+        LOG_DEBUG("Ignoring writes to isolated cache\n");
+        return;
+    }
+    const uint32_t rt_val = getR(op.rt);
+    const uint32_t base_addr = getR(op.rs);
+    store<uint32_t>(base_addr + op.simm, rt_val);
+}
+
+void CPU::opSWR(const DecodedOp& op) {
+    // SWR - Store Word Right
+    LOG_DEBUG("SWR: base:{:#x}, rt:{:#x}, offset {:#x}\n", op.rs, op.rt, op.simm);
+    if(cacheIsolated()) {
+        LOG_DEBUG("Ignoring writes to isolated cache\n");
+        return;
+    }
+    const uint32_t addr = getR(op.rs) + op.simm;
+    // Stores the bottom bytes of rt to the bytes from addr on
+    const uint32_t shift = 8 * (addr % 4);
+    if(!isMemory(addr)) {
+        storePartial(addr, getR(op.rt), 4 - addr % 4);
+        return;
+    }
+    const uint32_t word = load<uint32_t>(addr & ~3u);
+    const uint32_t val = (word & ~(0xffffffffu << shift)) | (getR(op.rt) << shift);
+    store<uint32_t>(addr & ~3u, val);
+}
+
+void CPU::opUnhandled(const DecodedOp& op) {
+    LOG("Unhandled instruction: {:#x}, opcode:{:#x}\n", op.instruction.whole, op.instruction.getOpcode());
+    halt_reason = StopReason::UnhandledOp;
+    running = false;
+}
+
+void CPU::opUnhandledSpecial(const DecodedOp& op) {
+    LOG("Unhandled instruction: {:#x}, opcode: SPECIAL, func: {:#x}\n", op.instruction.whole, op.instruction.getFunct());
+    halt_reason = StopReason::UnhandledOp;
+    running = false;
+}
+
+void CPU::opUnhandledCop(const DecodedOp& op) {
+    LOG("Unhandled instruction: {:#x}, opcode:{:#x}, copopcode:{:#x}\n", op.instruction.whole, op.instruction.getOpcode(), op.instruction.getCopOpcode());
+    halt_reason = StopReason::UnhandledOp;
+    running = false;
+}
+
+void CPU::setMode(CPUMode new_mode) {
+    if(new_mode == CPUMode::Recompiler && !Recompiler::supported()) {
+        LOG("The recompiler isn't supported on this host, using the cached interpreter\n");
+        new_mode = CPUMode::CachedInterpreter;
+    }
+    if(new_mode != mode)
+        block_cache.clear();
+    if(new_mode == CPUMode::Recompiler && !recompiler)
+        recompiler = std::make_unique<Recompiler>(*this);
+    mode = new_mode;
+}
+
+RunResult CPU::run(uint64_t cycle_budget) {
+    if(!breakpoints.empty() || trace)
+        return runStepped(cycle_budget);
+
+    const uint64_t start = scheduler.now();
+    const uint64_t end = start + cycle_budget;
+    const uint64_t idle_before = stats.idle_cycles;
+    switch(mode) {
+    case CPUMode::Interpreter:
+        while(running && scheduler.now() < end) {
+            scheduler.advance(step());
+            if(next_instruction_addr == entry_breakpoint)
                 break;
-            default:
-                LOG("Unhandled instruction: {:#x}, opcode: SPECIAL, func: {:#x}\n", instruction.whole, instruction.getFunct());
-                running = false;
-        }
-        break;
-    case 0x02:
-        // J - Jump
-        LOG_DEBUG("J: addr:{:#x}\n", instruction.getAddress());
-        {
-            const auto addr = instruction.getAddress() << 2;
-            const uint32_t mask = 0xf0000000;
-            pc = (pc & mask) | addr;
         }
         break;
-    case 0x03:
-        // JAL - Jump And Link
-        LOG_DEBUG("JAL: addr:{:#x}, curr_pc:{:#x}\n", instruction.getAddress(), pc);
-        {
-            const auto addr = instruction.getAddress() << 2;
-            const uint32_t mask = 0xf0000000;
-            setR(RegAlias::ra, pc);
-            pc = (pc & mask) | addr;
-        }
-        break;
-    case 0x05:
-        // BNE - Branch Not Equal
-        LOG_DEBUG("BNE: rs:{:#x}, rt:{:#x}, offset:{:#x}\n", instruction.getRS(), instruction.getRT(), instruction.getOffset());
-        if(getR(instruction.getRS()) != getR(instruction.getRT())){
-            const int32_t offset = instruction.getOffset();
-            pc = pc + (offset << 2) - 4;
+    case CPUMode::CachedInterpreter:
+        while(running && scheduler.now() < end) {
+            scheduler.advance(runBlock());
+            if(next_instruction_addr == entry_breakpoint)
+                break;
+            if(in_idle_loop)
+                skipIdleLoop(end);
         }
         break;
-    case 0x08:
-        // ADDI - Add Immediate Word
-        LOG_DEBUG("ADDI: rt:{:#x}, rs:{:#x}, I {:#x}\n", instruction.getRT(), instruction.getRS(), instruction.getImmediate());
-        {
-            const int32_t operand1 = getR(instruction.getRS());
-            const int32_t operand2 = instruction.getImmediateS();
-            const int64_t sumE = static_cast<int64_t>(operand1) + static_cast<int64_t>(operand2);
-            if(sumE > std::numeric_limits<int32_t>::max() || sumE < std::numeric_limits<int32_t>::min()) {
-                // exception
-                LOG("ADDI Overflow! I need to implement exceptions!\n");
-                running = false;
-            }
-            else {
-                setR(instruction.getRT(), operand1 + operand2);
-            }
+    case CPUMode::Recompiler:
+        while(running && scheduler.now() < end) {
+            scheduler.advance(runCompiledBlock());
+            if(next_instruction_addr == entry_breakpoint)
+                break;
+            if(in_idle_loop)
+                skipIdleLoop(end);
         }
         break;
-    case 0x09:
-        // ADDIU - Add Immediate Unsigned Word
-        LOG_DEBUG("ADDIU: rt:{:#x}, rs:{:#x}, I {:#x}\n", instruction.getRT(), instruction.getRS(), instruction.getImmediate());
-        {
-            const int32_t operand1 = getR(instruction.getRS());
-            const int32_t operand2 = instruction.getImmediateS();
-            setR(instruction.getRT(), operand1 + operand2);
+    }
+    const uint64_t cycles = scheduler.now() - start;
+    stats.instructions += cycles - (stats.idle_cycles - idle_before);
+
+    if(!running)
+        return {halt_reason, cycles};
+    if(cycles && next_instruction_addr == entry_breakpoint)
+        return {StopReason::Breakpoint, cycles};
+    return {StopReason::BudgetExhausted, cycles};
+}
+
+// Called once the cpu is in an idle loop. Nothing changes until the next
+// event, so time jumps straight to it, or to end if that comes first.
+void CPU::skipIdleLoop(uint64_t end) {
+    const uint64_t target = std::min(end, scheduler.nextEvent());
+    if(target <= scheduler.now())
+        return;
+    LOG_DEBUG("CPU: Idle loop at {:#x}, skipping {} cycles\n", next_instruction_addr, target - scheduler.now());
+    stats.idle_cycles += target - scheduler.now();
+    scheduler.advance(target - scheduler.now());
+}
+
+// Single steps so every instruction can be checked against the
+// breakpoints and traced
+RunResult CPU::runStepped(uint64_t cycle_budget) {
+    const uint64_t start = scheduler.now();
+    const uint64_t end = start + cycle_budget;
+    while(running && scheduler.now() < end) {
+        // Don't stop again on the breakpoint we're resuming from
+        if(scheduler.now() != start && breakpoints.count(next_instruction_addr)) {
+            stats.instructions += scheduler.now() - start;
+            return {StopReason::Breakpoint, scheduler.now() - start};
         }
+        scheduler.advance(trace ? traceStep() : step());
+    }
+    const uint64_t cycles = scheduler.now() - start;
+    stats.instructions += cycles;
+
+    if(!running)
+        return {halt_reason, cycles};
+    return {StopReason::BudgetExhausted, cycles};
+}
+
+namespace {
+    constexpr uint32_t bios_section = sectionTag("BIOS");
+    constexpr uint32_t cpu_section = sectionTag("CPU ");
+    constexpr uint32_t time_section = sectionTag("TIME");
+    constexpr uint32_t ram_section = sectionTag("RAM ");
+} // Anonymous namespace
+
+void CPU::saveState(SavestateWriter& writer, bool with_ram) const {
+    writer.beginSection(bios_section, 1);
+    writer.put(bios->hash());
+
+    writer.beginSection(cpu_section, state_version);
+    writer.put(pc);
+    writer.put(next_instruction.whole);
+    writer.put(next_instruction_addr);
+    for(const uint32_t reg : R) {
+        writer.put(reg);
+    }
+    writer.put(hi);
+    writer.put(lo);
+    writer.put(pending_load.first);
+    writer.put(pending_load.second);
+    for(const uint32_t reg : Cop0R) {
+        writer.put(reg);
+    }
+    writer.putBytes(scratchpad, scratchpad_size);
+
+    writer.beginSection(time_section, 1);
+    writer.put(scheduler.now());
+
+    dma.saveState(writer);
+    gpu.saveState(writer, with_ram);
+
+    if(with_ram) {
+        writer.beginSection(ram_section, 1);
+        writer.putBytes(memory, memory_size);
+    }
+}
+
+std::vector<uint8_t> CPU::saveState() const {
+    SavestateWriter writer;
+    saveState(writer);
+    return writer.finish();
+}
+
+bool CPU::saveState(const std::string& path) const {
+    SavestateWriter writer;
+    saveState(writer);
+    return writer.finishToFile(path);
+}
+
+bool CPU::loadState(const SavestateReader& reader, bool with_ram) {
+    const SavestateSection* bios_state = reader.find(bios_section, 1);
+    const SavestateSection* cpu_state = reader.find(cpu_section, state_version);
+    const SavestateSection* time_state = reader.find(time_section, 1);
+    const SavestateSection* ram_state = reader.find(ram_section, 1);
+    if(!bios_state || bios_state->size != 8 || !cpu_state || cpu_state->size != state_size ||
+       !time_state || time_state->size != 8 || (with_ram && (!ram_state || ram_state->size != memory_size))) {
+        LOG("CPU: Not a state this version can load\n");
+        return false;
+    }
+    if(readLE<uint64_t>(bios_state->data) != bios->hash()) {
+        LOG("CPU: The state was saved with another BIOS\n");
+        return false;
+    }
+    // Past pc, the next instruction, the registers, hi and lo: a load into
+    // a register the CPU doesn't have would write past R
+    if(cpu_state->data[3 * 4 + 32 * 4 + 2 * 4] >= R.size()) {
+        LOG("CPU: The state is damaged\n");
+        return false;
+    }
+    // The last checks, devices only change once all of their states are valid
+    if(!Dma::checkState(reader) || !Gpu::checkState(reader, with_ram))
+        return false;
+
+    const uint8_t* pos = cpu_state->data;
+    const auto get = [&](auto& val) {
+        val = readLE<std::remove_reference_t<decltype(val)>>(pos);
+        pos += sizeof(val);
+    };
+    get(pc);
+    get(next_instruction.whole);
+    get(next_instruction_addr);
+    for(uint32_t& reg : R) {
+        get(reg);
+    }
+    R[0] = 0;
+    get(hi);
+    get(lo);
+    get(pending_load.first);
+    get(pending_load.second);
+    retiring_load = {0, 0};
+    for(uint32_t& reg : Cop0R) {
+        get(reg);
+    }
+    std::memcpy(scratchpad, pos, scratchpad_size);
+
+    scheduler.setNow(readLE<uint64_t>(time_state->data));
+    dma.loadState(reader);
+    gpu.loadState(reader, with_ram);
+    in_idle_loop = false;
+    running = true;
+    if(!with_ram)
+        return true;
+
+    std::memcpy(memory, ram_state->data, memory_size);
+    dirty_pages.fill(1);
+    // Nothing compiled from the old RAM is valid anymore
+    block_cache.clear();
+    if(recompiler)
+        recompiler->reset();
+    return true;
+}
+
+bool CPU::loadState(const uint8_t* state, size_t size) {
+    SavestateReader reader;
+    return reader.parse(state, size) && loadState(reader);
+}
+
+bool CPU::loadState(const std::string& path) {
+    SavestateReader reader;
+    return reader.open(path) && loadState(reader);
+}
+
+void CPU::writeRAM(uint32_t addr, const uint8_t* data, size_t size) {
+    uint32_t offset = addr % memory_size;
+    while(size) {
+        const size_t count = std::min<size_t>(size, memory_size - offset);
+        std::copy(data, data + count, memory + offset);
+        ramWritten(offset, static_cast<uint32_t>(count));
+        data += count;
+        size -= count;
+        offset = 0;
+    }
+}
+
+void CPU::ramWritten(uint32_t offset, uint32_t size) {
+    if(!size)
+        return;
+    for(uint32_t page = offset; page < offset + size; page += 1 << block_page_shift) {
+        block_cache.invalidate(page);
+    }
+    block_cache.invalidate(offset + size - 1);
+    std::fill(dirty_pages.begin() + (offset >> dirty_page_shift),
+              dirty_pages.begin() + ((offset + size - 1) >> dirty_page_shift) + 1, 1);
+}
+
+void CPU::setRegister(RegAlias reg, uint32_t val) {
+    if(reg != RegAlias::zero)
+        R[static_cast<size_t>(reg)] = val;
+}
+
+void CPU::jumpTo(uint32_t addr) {
+    // Whatever was in flight lands first
+    if(pending_load.first)
+        R[pending_load.first] = pending_load.second;
+    pending_load = {0, 0};
+    next_instruction_addr = addr;
+    next_instruction = load<uint32_t>(addr);
+    pc = addr + 4;
+    in_idle_loop = false;
+}
+
+void CPU::addBreakpoint(uint32_t addr) {
+    breakpoints.insert(addr);
+}
+
+void CPU::removeBreakpoint(uint32_t addr) {
+    breakpoints.erase(addr);
+}
+
+void CPU::setEntryBreakpoint(uint32_t addr) {
+    if(addr == entry_breakpoint)
+        return;
+    entry_breakpoint = addr;
+    // Blocks compiled so far may run past it
+    block_cache.clear();
+    if(recompiler)
+        recompiler->reset();
+}
+
+void CPU::mainLoop() {
+    if(trace) {
+        scheduler.advance(traceStep());
+        return;
+    }
+    switch(mode) {
+    case CPUMode::Interpreter:
+        scheduler.advance(step());
         break;
-    case 0x0f:
-        // LUI - Load Upper Immediate
-        LOG_DEBUG("LUI: rt:{:#x}, I {:#x}\n", instruction.getRT(), instruction.getImmediate());
-        {
-            const uint32_t imm = instruction.getImmediate() << 16;
-            setR(instruction.getRT(), imm);
-        }
+    case CPUMode::CachedInterpreter:
+        scheduler.advance(runBlock());
         break;
-    case 0x0c:
-        // ANDI - And Immediate
-        LOG_DEBUG("ANDI: rs:{:#x}, rt:{:#x}, I {:#x}\n", instruction.getRS(), instruction.getRT(), instruction.getImmediate());
-        {
-            const uint32_t imm = instruction.getImmediate();
-            const uint32_t rt_val = getR(instruction.getRS());
-            setR(instruction.getRT(), imm & rt_val);
-        }
+    case CPUMode::Recompiler:
+        scheduler.advance(runCompiledBlock());
         break;
-    case 0x0d:
-        // ORI - Bitwise OR Immediate
-        LOG_DEBUG("ORI: rs:{:#x}, rt:{:#x}, I {:#x}\n", instruction.getRS(), instruction.getRT(), instruction.getImmediate());
-        {
-            const uint32_t imm = instruction.getImmediate();
-            const uint32_t rt_val = getR(instruction.getRS());
-            setR(instruction.getRT(), imm | rt_val);
+    }
+}
+
+uint32_t CPU::step() {
+    auto current_instruction = next_instruction;
+    next_instruction_addr = pc;
+    next_instruction = load<uint32_t>(pc);
+
+    pc += 4;
+
+    decodeExecute(current_instruction);
+    return 1;
+}
+
+uint32_t CPU::traceStep() {
+    const auto current_instruction = next_instruction;
+    const uint32_t current_addr = next_instruction_addr;
+    next_instruction_addr = pc;
+    next_instruction = load<uint32_t>(pc);
+
+    pc += 4;
+
+    // Loads land in R one instruction late, and are traced as writes of
+    // the instruction they land after
+    const std::array<uint32_t, 32> before = R;
+    trace->beginOp(current_addr, current_instruction.whole);
+    trace_memory = true;
+    decodeExecute(current_instruction);
+    trace_memory = false;
+    for(uint8_t i = 1; i < R.size(); ++i) {
+        if(R[i] != before[i])
+            trace->regWrite(i, R[i]);
+    }
+    trace->endOp();
+    return 1;
+}
+
+bool CPU::startTrace(const std::string& path) {
+    trace = TraceWriter::create(path, next_instruction_addr, R);
+    if(!trace)
+        return false;
+    mapPages();
+    return true;
+}
+
+void CPU::stopTrace() {
+    trace.reset();
+    mapPages();
+}
+
+bool CPU::fetchForBlock(uint32_t addr, uint32_t& word, bool& in_ram, uint32_t& ram_offset) {
+    if(addr % 4 != 0)
+        return false;
+
+    const uint8_t region_bits = addr >> 29;
+    const uint32_t paddr = addr & REGION_MASKS[region_bits];
+
+    switch (decodeAddr(paddr)) {
+    case MemMap::Main:
+    {
+        const uint32_t offset = paddr & 0x1ffffc;
+        word = build32(memory[offset], memory[offset + 1], memory[offset + 2], memory[offset + 3]);
+        in_ram = true;
+        ram_offset = offset;
+        return true;
+    }
+    case MemMap::BIOS:
+        word = bios->load<uint32_t>(paddr & 0x7fffc);
+        in_ram = false;
+        return true;
+    default:
+        return false;
+    }
+}
+
+Block* CPU::compileBlock(uint32_t addr) {
+    auto block = std::make_unique<Block>();
+    block->addr = addr;
+
+    bool in_ram = false;
+    uint32_t ram_offset = 0;
+    bool delay_slot = false;
+    for(uint32_t i = 0; i < block_max_ops; ++i) {
+        uint32_t word;
+        bool word_in_ram;
+        uint32_t word_offset;
+        // Run checks the entry breakpoint between blocks
+        if(i && addr + 4 * i == entry_breakpoint)
+            break;
+        if(!fetchForBlock(addr + 4 * i, word, word_in_ram, word_offset))
+            break;
+        if(i == 0) {
+            in_ram = word_in_ram;
+            ram_offset = word_offset;
         }
-        break;
-    case 0x10:
-        {
-            switch(instruction.getCopOpcode()) {
-                case 0x4:
-                    // MTC0 - Move To Coprocessor 0
-                    LOG_DEBUG("MTC0: rt:{:#x}, rd:{:#x}\n", instruction.getRT(), instruction.getRD());
-                    switch(static_cast<Cop0RegAlias>(instruction.getRD())){
-                        case Cop0RegAlias::SR:
-                            Cop0R[instruction.getRD()] = getR(instruction.getRT());
-                            break;
-                        default:
-                            LOG("Unhandled write to COP0 Register {:#x}, val:{:#x}\n", instruction.getRD(), getR(instruction.getRT()));
-                    }
-                    //Cop0R[instruction.getRD()] = getR(instruction.getRT());
-                    break;
-                default:
-                    LOG("Unhandled instruction: {:#x}, opcode:{:#x}, copopcode:{:#x}\n", instruction.whole, instruction.getOpcode(), instruction.getCopOpcode());
-                    running = false;
-                    break;
-            }
+        else if(word_in_ram != in_ram) {
+            break;
         }
-        break;
-    case 0x23:
-        // LW - Load Word
-        LOG_DEBUG("LW: base:{:#x}, rt:{:#x}, offset {:#x}\n", instruction.getBase(), instruction.getRT(), instruction.getOffset());
-        {
-            if(getCop0R(Cop0RegAlias::SR) & 0x10000) {
-                LOG_DEBUG("Ignoring loads from isolated cache\n");
-                break;
-            }
-            const int32_t offset = instruction.getOffset();
-            const uint32_t rt_val = getR(instruction.getRT());
-            const uint32_t base_addr = getR(instruction.getBase());
 
-            load = {rt_val, load32(base_addr + offset)};
+        const DecodedOp op = decode(word);
+        if(delay_slot && (op.flags & DecodedOp::Branch)) {
+            // Leave a branch in a delay slot to the interpreter
+            break;
         }
-        break;
-    case 0x28:
-        // SB - Store Byte
-        LOG_DEBUG("SB: base:{:#x}, rt:{:#x}, offset {:#x}\n", instruction.getBase(), instruction.getRT(), instruction.getOffset());
-        {
-            if(getCop0R(Cop0RegAlias::SR) & 0x10000) {
-                LOG_DEBUG("Ignoring writes to isolated cache\n");
-                break;
-            }
-            const int32_t offset = instruction.getOffset();
-            const uint8_t rt_val = getR(instruction.getRT());
-            const uint32_t base_addr = getR(instruction.getBase());
-            store8(base_addr + offset, rt_val);
+        block->ops.push_back(op);
+        if(delay_slot || (op.flags & DecodedOp::Unhandled))
+            break;
+        delay_slot = op.flags & DecodedOp::Branch;
+    }
+
+    if(block->ops.empty())
+        return nullptr;
+
+    block->idle = isIdleLoop(*block, block->idle_loads);
+    return block_cache.insert(std::move(block), in_ram, ram_offset);
+}
+
+bool CPU::idleLoadsArePure(const Block& block) {
+    for(const IdleLoad& load : block.idle_loads) {
+        const uint32_t addr = R[load.base] + load.offset;
+        const uint32_t paddr = addr & REGION_MASKS[addr >> 29];
+        switch(decodeAddr(paddr)) {
+        case MemMap::Main:
+        case MemMap::BIOS:
+            break;
+        case MemMap::Scratchpad:
+            if(!inScratchpad(addr))
+                return false;
+            break;
+        case MemMap::HardwareRegs:
+            // GPUREAD moves a transfer along, other devices aren't known
+            // to be safe to read
+            if(!Dma::contains(paddr) && (paddr & ~3u) != gpu_gp1)
+                return false;
+            break;
+        default:
+            return false;
         }
-        break;
-    case 0x29:
-        // SH - Store Halfword
-        LOG_DEBUG("SH: base:{:#x}, rt:{:#x}, offset {:#x}\n", instruction.getBase(), instruction.getRT(), instruction.getOffset());
-        {
-            if(getCop0R(Cop0RegAlias::SR) & 0x10000) {
-                LOG_DEBUG("Ignoring writes to isolated cache\n");
-                break;
-            }
-            const int32_t offset = instruction.getOffset();
-            const uint16_t rt_val = getR(instruction.getRT());
-            const uint32_t base_addr = getR(instruction.getBase());
-            store16(base_addr + offset, rt_val);
+    }
+    return true;
+}
+
+Block* CPU::lookupBlock() {
+    // Blocks can only be entered when the next instruction isn't in a delay slot
+    if(next_instruction_addr + 4 != pc)
+        return nullptr;
+
+    Block* block = block_cache.find(next_instruction_addr);
+    if(!block) {
+        const auto start = std::chrono::steady_clock::now();
+        block = compileBlock(next_instruction_addr);
+        stats.compile_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        ++stats.blocks_compiled;
+    }
+    if(!block || block->ops[0].instruction.whole != next_instruction.whole)
+        return nullptr;
+    return block;
+}
+
+uint32_t CPU::runBlock() {
+    in_idle_loop = false;
+    Block* block = lookupBlock();
+    if(!block)
+        return step();
+
+    block_cache.resetInvalidated();
+
+    const auto& ops = block->ops;
+    const size_t count = ops.size();
+    for(size_t i = 0; i < count; ++i) {
+        const DecodedOp& op = ops[i];
+        const bool last = i + 1 == count;
+
+        // Everything up to the last op was fetched when compiling the block
+        if(last) {
+            next_instruction_addr = pc;
+            next_instruction = load<uint32_t>(pc);
         }
-        break;
-    case 0x2b:
-        // SW - Store Word
-        LOG_DEBUG("SW: base:{:#x}, rt:{:#x}, offset {:#x}\n", instruction.getBase(), instruction.getRT(), instruction.getOffset());
-        {
-            if(getCop0R(Cop0RegAlias::SR) & 0x10000) {
-                LOG_DEBUG("Ignoring writes to isolated cache\n");
-                break;
-            }
-            const int32_t offset = instruction.getOffset();
-            const uint32_t rt_val = getR(instruction.getRT());
-            const uint32_t base_addr = getR(instruction.getBase());
-            store32(base_addr + offset, rt_val);
+        pc += 4;
+
+        execute(op);
+
+        if(!last && (!running || block_cache.invalidated())) {
+            next_instruction_addr = block->addr + 4 * static_cast<uint32_t>(i + 1);
+            next_instruction = ops[i + 1].instruction;
+            return static_cast<uint32_t>(i + 1);
         }
-        break;
-    default:
-        LOG("Unhandled instruction: {:#x}, opcode:{:#x}\n", instruction.whole, instruction.getOpcode());
-        running = false;
-        break;
     }
+    in_idle_loop = block->idle && idle_skipping && next_instruction_addr == block->addr && idleLoadsArePure(*block);
+    return static_cast<uint32_t>(count);
 }
 
-void CPU::mainLoop() {
-    auto current_instruction = next_instruction;
-    next_instruction = load32(pc);
+uint32_t CPU::runCompiledBlock() {
+    in_idle_loop = false;
+    Block* block = lookupBlock();
+    if(!block)
+        return step();
 
-    pc += 4;
+    if(!block->code) {
+        const auto start = std::chrono::steady_clock::now();
+        const bool compiled = recompiler->compile(*block);
+        stats.compile_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        if(!compiled) {
+            LOG_DEBUG("Recompiler: Code buffer full, flushing\n");
+            block_cache.clear();
+            recompiler->reset();
+            return step();
+        }
+    }
 
-    setR(load.first, load.second);
-    load = {0,0};
+    block_cache.resetInvalidated();
 
-    decodeExecute(current_instruction);
-    std::copy(outR.begin(), outR.end(), R.begin());
+    const uint32_t executed = block->code(this);
+    if(executed < block->ops.size()) {
+        next_instruction_addr = block->addr + 4 * executed;
+        next_instruction = block->ops[executed].instruction;
+        return executed;
+    }
+    in_idle_loop = block->idle && idle_skipping && next_instruction_addr == block->addr && idleLoadsArePure(*block);
+    return executed;
 }
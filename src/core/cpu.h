@@ -6,13 +6,39 @@
 #include <memory>
 #include <string>
 #include <ostream>
+#include <type_traits>
+#include <unordered_set>
 #include <utility>
+#include <vector>
 
 #include "bios.h"
+#include "block_cache.h"
+#include "dma.h"
+#include "fastmem.h"
+#include "gpu.h"
+#include "log.h"
 #include "mips.h"
+#include "recompiler.h"
+#include "savestate.h"
+#include "scheduler.h"
+#include "trace.h"
 
 constexpr uint32_t memory_size = 2 * 1024 * 1024;
+// The data cache used as fast RAM, at 0x1f800000 in KUSEG and KSEG0
+constexpr uint32_t scratchpad_addr = 0x1f800000;
+constexpr uint32_t scratchpad_size = 1024;
 constexpr uint32_t bios_addr = 0xbfc00000;
+constexpr uint64_t cpu_clock = 33868800;
+
+// Granularity of the tracking of RAM writes, see CPU::dirtyPages
+constexpr uint32_t dirty_page_shift = 12;
+constexpr uint32_t dirty_page_size = 1 << dirty_page_shift;
+constexpr uint32_t dirty_page_count = memory_size >> dirty_page_shift;
+
+// Granularity of the memory page tables
+constexpr uint32_t mem_page_shift = 16;
+constexpr uint32_t mem_page_size = 1 << mem_page_shift;
+constexpr uint32_t mem_page_count = 1 << (32 - mem_page_shift);
 
 enum class MemMap {
     Main,
@@ -24,86 +50,35 @@ enum class MemMap {
     Unmapped
 };
 
-enum class RegAlias : uint8_t {
-    R0 = 0,
-    R1 = 1,
-    R2 = 2,
-    R3 = 3,
-    R4 = 4,
-    R5 = 5,
-    R6 = 6,
-    R7 = 7,
-    R8 = 8,
-    R9 = 9,
-    R10 = 10,
-    R11 = 11,
-    R12 = 12,
-    R13 = 13,
-    R14 = 14,
-    R15 = 15,
-    R16 = 16,
-    R17 = 17,
-    R18 = 18,
-    R19 = 19,
-    R20 = 20,
-    R21 = 21,
-    R22 = 22,
-    R23 = 23,
-    R24 = 24,
-    R25 = 25,
-    R26 = 26,
-    R27 = 27,
-    R28 = 28,
-    R29 = 29,
-    R30 = 30,
-    R31 = 31,
-    zero = 0,
-    at = 1,
-    v0 = 2,
-    v1 = 3,
-    a0 = 4,
-    a1 = 5,
-    a2 = 6,
-    a3 = 7,
-    t0 = 8,
-    t1 = 9,
-    t2 = 10,
-    t3 = 11,
-    t4 = 12,
-    t5 = 13,
-    t6 = 14,
-    t7 = 15,
-    s0 = 16,
-    s1 = 17,
-    s2 = 18,
-    s3 = 19,
-    s4 = 20,
-    s5 = 21,
-    s6 = 22,
-    s7 = 23,
-    t8 = 24,
-    t9 = 25,
-    k0 = 26,
-    k1 = 27,
-    gp = 28,
-    sp = 29,
-    fp = 30,
-    s8 = 30,
-    ra = 31,
+enum class CPUMode {
+    Interpreter,       // Decode and execute one instruction at a time
+    CachedInterpreter, // Execute pre-decoded blocks from the block cache
+    Recompiler,        // Execute blocks translated to native code
+};
+
+// Why CPU::run returned
+enum class StopReason {
+    BudgetExhausted,
+    Halted,      // running was cleared, e.g. by an invalid memory access
+    Breakpoint,  // The next instruction to execute is on a breakpoint
+    UnhandledOp,
 };
 
-enum class Cop0RegAlias : uint8_t {
-    BPC = 3,
-    BDA = 5,
-    JUMPDEST = 6,
-    DCIC = 7,
-    BadVaddr = 8,
-    BDAM = 9,
-    BPCM = 11,
-    SR = 12,
-    CAUSE = 13,
-    EPC = 14,
-    PRID = 15,
+// Counters for profiling, they only ever go up
+struct CPUStats {
+    uint64_t instructions = 0;
+    uint64_t blocks_compiled = 0;
+    // Host time spent decoding blocks and generating native code
+    uint64_t compile_ns = 0;
+    // Cycles skipped instead of running idle loops
+    uint64_t idle_cycles = 0;
+};
+
+struct RunResult {
+    StopReason reason;
+    // Cycles actually executed. Blocks run to completion, so this
+    // can go past the budget by the length of one block.
+    uint64_t cycles;
 };
 
 inline std::ostream &operator<<(std::ostream& os, MemMap map) {
@@ -135,14 +110,118 @@ inline std::ostream &operator<<(std::ostream& os, MemMap map) {
 }
 
 class CPU {
+    friend class Recompiler;
+    friend struct BenchAccess;
+
 public:
     CPU(std::string bios_path);
+    ~CPU();
 
     CPU(const CPU&) = delete;
     CPU& operator=(const CPU&) = delete;
 
     bool running = true;
 
+    void setMode(CPUMode new_mode);
+    CPUMode getMode() const {
+        return mode;
+    }
+
+    // Executes until cycle_budget cycles ran or the cpu stops, running
+    // the scheduled events as their cycle comes up. For now every
+    // instruction takes one cycle.
+    RunResult run(uint64_t cycle_budget);
+
+    // Guest time, components schedule their events here
+    Scheduler& getScheduler() {
+        return scheduler;
+    }
+    Dma& getDma() {
+        return dma;
+    }
+    Gpu& getGpu() {
+        return gpu;
+    }
+    uint64_t getCycle() const {
+        return scheduler.now();
+    }
+
+    // Whether the block based modes skip ahead once they're stuck in an
+    // idle loop, see idle_loop.h. On by default, the interpreter never does.
+    void setIdleSkipping(bool enabled) {
+        idle_skipping = enabled;
+    }
+
+    // Maps guest memory into a host address range for the recompiler to
+    // access directly. Returns false if it isn't supported on this host.
+    bool enableFastmem();
+
+    // Records every executed instruction into a binary trace at path, see
+    // trace.h. While tracing the CPU single steps in the interpreter and
+    // all memory accesses take the slow path, whatever the mode.
+    bool startTrace(const std::string& path);
+    void stopTrace();
+
+    const CPUStats& getStats() const {
+        return stats;
+    }
+
+    // Guest state, for tests and tools
+    uint32_t getPC() const {
+        return pc;
+    }
+    const std::array<uint32_t, 32>& getRegisters() const {
+        return R;
+    }
+    // The memory_size bytes of main RAM
+    const uint8_t* getRAM() const {
+        return memory;
+    }
+
+    // For loaders putting programs straight into the machine. Writing RAM
+    // drops the code compiled from it, addr is any address mapping to it.
+    void writeRAM(uint32_t addr, const uint8_t* data, size_t size);
+
+    // One byte per dirty_page_size page of main RAM, non-zero if it was
+    // written since the last clearDirtyPages, by the guest, a loader or
+    // loading a state. Meant for a single user, like the rewind buffer.
+    const uint8_t* dirtyPages() const {
+        return dirty_pages.data();
+    }
+    void clearDirtyPages() {
+        dirty_pages.fill(0);
+    }
+    void setRegister(RegAlias reg, uint32_t val);
+    // Continues execution at addr, as if a jump there just retired
+    void jumpTo(uint32_t addr);
+
+    void addBreakpoint(uint32_t addr);
+    void removeBreakpoint(uint32_t addr);
+    // Stops run with StopReason::Breakpoint when execution gets to addr, by
+    // a jump, a branch or falling through, in every mode. Unlike
+    // addBreakpoint it doesn't force single stepping: blocks end right
+    // before addr instead, so setting it drops the blocks compiled so far.
+    void setEntryBreakpoint(uint32_t addr);
+    void clearEntryBreakpoint() {
+        entry_breakpoint = no_entry_breakpoint;
+    }
+
+    const Bios& getBios() const {
+        return *bios;
+    }
+
+    // Everything the guest can see of the machine, in the format of
+    // savestate.h, to resume from later on a CPU with the same BIOS.
+    // Without RAM and VRAM for users keeping track of them themselves.
+    void saveState(SavestateWriter& writer, bool with_ram = true) const;
+    std::vector<uint8_t> saveState() const;
+    bool saveState(const std::string& path) const;
+    // Return false and leave the CPU untouched if it isn't a state this
+    // version can load
+    bool loadState(const SavestateReader& reader, bool with_ram = true);
+    bool loadState(const uint8_t* state, size_t size);
+    bool loadState(const std::string& path);
+
 private:
     // Registers
 
@@ -150,46 +229,211 @@ private:
 
     std::array<uint32_t, 32> R;
 
-    // Duplicate registers to emulate the load delay slot
-    // TODO: possibly emulate the delay slot by separating
-    // the decoding and executing step, with the decoding step
-    // returning a struct with the necessary arguments and 
-    // the decoded function, and then the execute step would
-    // execute pending loads and call the decoded function.
-    std::array<uint32_t, 32> outR;
+    // Load delay slot: a load queued by an instruction only lands in R
+    // after the next instruction executed, and is dropped if that
+    // instruction writes the same register. When nothing is queued,
+    // instructions write R directly with no extra bookkeeping.
+    std::pair<uint8_t, uint32_t> pending_load{0,0};
+    // The load landing after the instruction being executed
+    std::pair<uint8_t, uint32_t> retiring_load{0,0};
 
-    std::pair<uint8_t, uint32_t> load{0,0};
-
-    uint32_t hi;
-    uint32_t lo;
+    uint32_t hi = 0;
+    uint32_t lo = 0;
 
     // Cop0 Registers
     std::array<uint32_t, 16> Cop0R{0};
 
-    uint8_t memory[memory_size]{0};
+    // Layout of the savestate section holding the registers
+    static constexpr uint32_t state_version = 2;
+    static constexpr size_t state_size = 3 * 4 + 32 * 4 + 2 * 4 + 1 + 4 + 16 * 4 + scratchpad_size;
+
+    // Main RAM, owned by the CPU unless fastmem is enabled
+    std::unique_ptr<uint8_t[]> owned_memory;
+    uint8_t* memory = nullptr;
+
+    std::array<uint8_t, dirty_page_count> dirty_pages{};
 
-    std::unique_ptr<Bios> bios;
+    std::array<uint8_t, scratchpad_size> owned_scratchpad{};
+    // Moves into the fastmem arena along with RAM
+    uint8_t* scratchpad = owned_scratchpad.data();
+    // Cleared while tracing, which records accesses on the slow path
+    bool scratchpad_mapped = true;
+
+    std::shared_ptr<const Bios> bios;
+    std::unique_ptr<Fastmem> fastmem;
+    Scheduler scheduler;
+    Dma dma;
+    Gpu gpu;
+
+    // Host pointers for each page of the virtual address space that is
+    // entirely backed by RAM (with its mirrors) or the BIOS. The rest is
+    // null and goes through decodeAddr.
+    std::array<const uint8_t*, mem_page_count> read_pages{};
+    std::array<uint8_t*, mem_page_count> write_pages{};
 
     Instruction next_instruction{0}; // Due to branch delay slots
+    // Address next_instruction was fetched from. It's only pc - 4 when
+    // next_instruction isn't sitting in a branch delay slot.
+    uint32_t next_instruction_addr = 0;
+
+    CPUMode mode = CPUMode::Interpreter;
+    StopReason halt_reason = StopReason::Halted;
+    std::unordered_set<uint32_t> breakpoints;
+    // Unaligned, so it never matches an instruction
+    static constexpr uint32_t no_entry_breakpoint = 1;
+    uint32_t entry_breakpoint = no_entry_breakpoint;
+    BlockCache block_cache;
+    std::unique_ptr<Recompiler> recompiler;
+    std::unique_ptr<TraceWriter> trace;
+    CPUStats stats;
+    bool idle_skipping = true;
+    // Set when the last block run is an idle loop that branched back to itself
+    bool in_idle_loop = false;
+    // Set while the instruction being traced executes, so the fetch of the
+    // next one isn't recorded as an access
+    bool trace_memory = false;
 public:
     void decodeExecute(Instruction instruction);
     void mainLoop();
 
 private:
+    struct OpTables;
+    DecodedOp decode(Instruction instruction) const;
+    // Each returns how many instructions it executed
+    uint32_t step();
+    uint32_t traceStep();
+    // Executes an op, then lands the load queued by the previous one
+    void execute(const DecodedOp& op) {
+        if(!pending_load.first) {
+            (this->*op.handler)(op);
+            return;
+        }
+        retiring_load = pending_load;
+        pending_load = {0,0};
+        (this->*op.handler)(op);
+        if(retiring_load.first)
+            R[retiring_load.first] = retiring_load.second;
+        retiring_load = {0,0};
+    }
+    Block* lookupBlock();
+    // Whether the loads of an idle loop read memory without side effects
+    bool idleLoadsArePure(const Block& block);
+    uint32_t runBlock();
+    uint32_t runCompiledBlock();
+    void skipIdleLoop(uint64_t end);
+    RunResult runStepped(uint64_t cycle_budget);
+    Block* compileBlock(uint32_t addr);
+    bool fetchForBlock(uint32_t addr, uint32_t& word, bool& in_ram, uint32_t& ram_offset);
+
+    // Instruction handlers
+    void opSLL(const DecodedOp& op);
+    void opJR(const DecodedOp& op);
+    void opOR(const DecodedOp& op);
+    void opADDU(const DecodedOp& op);
+    void opSLTU(const DecodedOp& op);
+    void opJ(const DecodedOp& op);
+    void opJAL(const DecodedOp& op);
+    void opBNE(const DecodedOp& op);
+    void opADDI(const DecodedOp& op);
+    void opADDIU(const DecodedOp& op);
+    void opLUI(const DecodedOp& op);
+    void opANDI(const DecodedOp& op);
+    void opORI(const DecodedOp& op);
+    void opMTC0(const DecodedOp& op);
+    void opLB(const DecodedOp& op);
+    void opLH(const DecodedOp& op);
+    void opLWL(const DecodedOp& op);
+    void opLW(const DecodedOp& op);
+    void opLBU(const DecodedOp& op);
+    void opLHU(const DecodedOp& op);
+    void opLWR(const DecodedOp& op);
+    void opSB(const DecodedOp& op);
+    void opSH(const DecodedOp& op);
+    void opSWL(const DecodedOp& op);
+    void opSW(const DecodedOp& op);
+    void opSWR(const DecodedOp& op);
+    void opUnhandled(const DecodedOp& op);
+    void opUnhandledSpecial(const DecodedOp& op);
+    void opUnhandledCop(const DecodedOp& op);
+
+    void mapPages();
     MemMap decodeAddr(uint32_t addr);
-    uint32_t load32(uint32_t addr);
-    void store8(uint32_t addr, uint8_t val);
-    void store16(uint32_t addr, uint16_t val);
-    void store32(uint32_t addr, uint32_t val);
+    // The scratchpad is too small for the page tables, it has a lookup of
+    // its own next to them. Only KUSEG and KSEG0 see it.
+    static bool inScratchpad(uint32_t addr) {
+        return (addr & 0x7ffffc00) == scratchpad_addr;
+    }
+    // Guest memory accesses of 8, 16 or 32 bits. Signed types sign extend.
+    // Aligned accesses to pages in the page tables are a single host
+    // access, everything else goes through decodeAddr.
+    template<typename T>
+    T load(uint32_t addr) {
+        const uint8_t* page = read_pages[addr >> mem_page_shift];
+        if(page && addr % sizeof(T) == 0) {
+            LOG_DEBUG("CPU: Reading from {:#x}\n", addr);
+            return readLE<T>(page + (addr & (mem_page_size - 1)));
+        }
+        if(scratchpad_mapped && inScratchpad(addr) && addr % sizeof(T) == 0)
+            return readLE<T>(scratchpad + (addr & (scratchpad_size - 1)));
+        return static_cast<T>(loadSlow<std::make_unsigned_t<T>>(addr));
+    }
+    template<typename T>
+    T loadSlow(uint32_t addr);
+    template<typename T>
+    void store(uint32_t addr, T val) {
+        uint8_t* page = write_pages[addr >> mem_page_shift];
+        if(page && addr % sizeof(T) == 0) {
+            LOG_DEBUG("CPU: Storing {:#x} to {:#x}\n", val, addr);
+            const uint32_t offset = static_cast<uint32_t>(page - memory) + (addr & (mem_page_size - 1));
+            block_cache.invalidate(offset);
+            dirty_pages[offset >> dirty_page_shift] = 1;
+            writeLE<T>(memory + offset, val);
+            return;
+        }
+        if(scratchpad_mapped && inScratchpad(addr) && addr % sizeof(T) == 0) {
+            writeLE<T>(scratchpad + (addr & (scratchpad_size - 1)), val);
+            return;
+        }
+        storeSlow<T>(addr, val);
+    }
+    template<typename T>
+    void storeSlow(uint32_t addr, T val);
+    // Whether addr is in RAM or the scratchpad, where SWL and SWR can merge
+    // their bytes into the word around them
+    bool isMemory(uint32_t addr);
+    // The count low bytes of val to addr, for SWL and SWR elsewhere. Reading
+    // the word around them back could have side effects, and writing it
+    // back would store bytes the guest didn't.
+    void storePartial(uint32_t addr, uint32_t val, uint32_t count);
+    // Devices behind MemMap::HardwareRegs, word accesses
+    uint32_t readHardware(uint32_t paddr);
+    void writeHardware(uint32_t paddr, uint32_t val);
+    // Drops the code compiled from a range of RAM that was written
+    // outside of the store path and marks it dirty
+    void ramWritten(uint32_t offset, uint32_t size);
+    // Loads and stores are ignored while the cache is isolated
+    bool cacheIsolated() const {
+        return getCop0R(Cop0RegAlias::SR) & 0x10000;
+    }
     constexpr void setR(uint8_t i, uint32_t val) {
-        if(i)
-            outR[i] = val;
+        if(i) {
+            R[i] = val;
+            // The instruction in the load delay slot wins
+            if(i == retiring_load.first)
+                retiring_load.first = 0;
+        }
     }
     constexpr uint32_t getR(uint8_t i) const {
         if(i)
             return R[i];
         return 0;
     }
+    // Includes a load still in its delay slot, which LWL and LWR merge with
+    constexpr uint32_t getLoadingR(uint8_t i) const {
+        if(i && i == retiring_load.first)
+            return retiring_load.second;
+        return getR(i);
+    }
     // RegAlias overloads
     constexpr void setR(RegAlias i, uint32_t val) {
         setR(static_cast<uint8_t>(i), val);
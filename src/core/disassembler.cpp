@@ -0,0 +1,133 @@
+#include <fmt/core.h>
+
+#include "disassembler.h"
+
+namespace {
+    constexpr const char* reg_names[32] = {
+        "zero", "at", "v0", "v1", "a0", "a1", "a2", "a3",
+        "t0", "t1", "t2", "t3", "t4", "t5", "t6", "t7",
+        "s0", "s1", "s2", "s3", "s4", "s5", "s6", "s7",
+        "t8", "t9", "k0", "k1", "gp", "sp", "fp", "ra",
+    };
+
+    std::string disassembleSpecial(Instruction in) {
+        const char* rs = regName(in.getRS());
+        const char* rt = regName(in.getRT());
+        const char* rd = regName(in.getRD());
+        switch(in.getFunct()) {
+        case 0x00:
+            if(in.whole == 0)
+                return "nop";
+            return fmt::format("sll ${}, ${}, {}", rd, rt, in.getShamt());
+        case 0x02: return fmt::format("srl ${}, ${}, {}", rd, rt, in.getShamt());
+        case 0x03: return fmt::format("sra ${}, ${}, {}", rd, rt, in.getShamt());
+        case 0x04: return fmt::format("sllv ${}, ${}, ${}", rd, rt, rs);
+        case 0x06: return fmt::format("srlv ${}, ${}, ${}", rd, rt, rs);
+        case 0x07: return fmt::format("srav ${}, ${}, ${}", rd, rt, rs);
+        case 0x08: return fmt::format("jr ${}", rs);
+        case 0x09: return fmt::format("jalr ${}, ${}", rd, rs);
+        case 0x0c: return "syscall";
+        case 0x0d: return "break";
+        case 0x10: return fmt::format("mfhi ${}", rd);
+        case 0x11: return fmt::format("mthi ${}", rs);
+        case 0x12: return fmt::format("mflo ${}", rd);
+        case 0x13: return fmt::format("mtlo ${}", rs);
+        case 0x18: return fmt::format("mult ${}, ${}", rs, rt);
+        case 0x19: return fmt::format("multu ${}, ${}", rs, rt);
+        case 0x1a: return fmt::format("div ${}, ${}", rs, rt);
+        case 0x1b: return fmt::format("divu ${}, ${}", rs, rt);
+        case 0x20: return fmt::format("add ${}, ${}, ${}", rd, rs, rt);
+        case 0x21: return fmt::format("addu ${}, ${}, ${}", rd, rs, rt);
+        case 0x22: return fmt::format("sub ${}, ${}, ${}", rd, rs, rt);
+        case 0x23: return fmt::format("subu ${}, ${}, ${}", rd, rs, rt);
+        case 0x24: return fmt::format("and ${}, ${}, ${}", rd, rs, rt);
+        case 0x25: return fmt::format("or ${}, ${}, ${}", rd, rs, rt);
+        case 0x26: return fmt::format("xor ${}, ${}, ${}", rd, rs, rt);
+        case 0x27: return fmt::format("nor ${}, ${}, ${}", rd, rs, rt);
+        case 0x2a: return fmt::format("slt ${}, ${}, ${}", rd, rs, rt);
+        case 0x2b: return fmt::format("sltu ${}, ${}, ${}", rd, rs, rt);
+        default:
+            return fmt::format("illegal {:#010x}", in.whole);
+        }
+    }
+
+    std::string disassembleCop(Instruction in) {
+        const uint8_t cop = in.getOpcode() & 3;
+        const char* rt = regName(in.getRT());
+        switch(in.getCopOpcode()) {
+        case 0x00: return fmt::format("mfc{} ${}, ${}", cop, rt, in.getRD());
+        case 0x02: return fmt::format("cfc{} ${}, ${}", cop, rt, in.getRD());
+        case 0x04: return fmt::format("mtc{} ${}, ${}", cop, rt, in.getRD());
+        case 0x06: return fmt::format("ctc{} ${}, ${}", cop, rt, in.getRD());
+        default:
+            if(cop == 0 && in.getCopOpcode() == 0x10 && in.getFunct() == 0x10)
+                return "rfe";
+            if(in.getCopOpcode() & 0x10)
+                return fmt::format("cop{} {:#x}", cop, in.whole & 0x1ffffff);
+            return fmt::format("illegal {:#010x}", in.whole);
+        }
+    }
+} // Anonymous namespace
+
+const char* regName(uint8_t reg) {
+    return reg_names[reg & 31];
+}
+
+std::string disassemble(Instruction in, uint32_t pc) {
+    const char* rs = regName(in.getRS());
+    const char* rt = regName(in.getRT());
+    const int16_t simm = in.getImmediateS();
+    const uint16_t imm = in.getImmediate();
+    const uint32_t branch_target = pc + 4 + (static_cast<uint32_t>(static_cast<int32_t>(simm)) << 2);
+    const uint32_t jump_target = ((pc + 4) & 0xf0000000) | (in.getAddress() << 2);
+
+    switch(in.getOpcode()) {
+    case 0x00: return disassembleSpecial(in);
+    case 0x01:
+    {
+        const bool link = (in.getRT() & 0x1e) == 0x10;
+        const bool bgez = in.getRT() & 1;
+        return fmt::format("b{}{} ${}, {:#010x}", bgez ? "gez" : "ltz", link ? "al" : "", rs, branch_target);
+    }
+    case 0x02: return fmt::format("j {:#010x}", jump_target);
+    case 0x03: return fmt::format("jal {:#010x}", jump_target);
+    case 0x04: return fmt::format("beq ${}, ${}, {:#010x}", rs, rt, branch_target);
+    case 0x05: return fmt::format("bne ${}, ${}, {:#010x}", rs, rt, branch_target);
+    case 0x06: return fmt::format("blez ${}, {:#010x}", rs, branch_target);
+    case 0x07: return fmt::format("bgtz ${}, {:#010x}", rs, branch_target);
+    case 0x08: return fmt::format("addi ${}, ${}, {}", rt, rs, simm);
+    case 0x09: return fmt::format("addiu ${}, ${}, {}", rt, rs, simm);
+    case 0x0a: return fmt::format("slti ${}, ${}, {}", rt, rs, simm);
+    case 0x0b: return fmt::format("sltiu ${}, ${}, {}", rt, rs, simm);
+    case 0x0c: return fmt::format("andi ${}, ${}, {:#x}", rt, rs, imm);
+    case 0x0d: return fmt::format("ori ${}, ${}, {:#x}", rt, rs, imm);
+    case 0x0e: return fmt::format("xori ${}, ${}, {:#x}", rt, rs, imm);
+    case 0x0f: return fmt::format("lui ${}, {:#x}", rt, imm);
+    case 0x10:
+    case 0x11:
+    case 0x12:
+    case 0x13: return disassembleCop(in);
+    case 0x20: return fmt::format("lb ${}, {}(${})", rt, simm, rs);
+    case 0x21: return fmt::format("lh ${}, {}(${})", rt, simm, rs);
+    case 0x22: return fmt::format("lwl ${}, {}(${})", rt, simm, rs);
+    case 0x23: return fmt::format("lw ${}, {}(${})", rt, simm, rs);
+    case 0x24: return fmt::format("lbu ${}, {}(${})", rt, simm, rs);
+    case 0x25: return fmt::format("lhu ${}, {}(${})", rt, simm, rs);
+    case 0x26: return fmt::format("lwr ${}, {}(${})", rt, simm, rs);
+    case 0x28: return fmt::format("sb ${}, {}(${})", rt, simm, rs);
+    case 0x29: return fmt::format("sh ${}, {}(${})", rt, simm, rs);
+    case 0x2a: return fmt::format("swl ${}, {}(${})", rt, simm, rs);
+    case 0x2b: return fmt::format("sw ${}, {}(${})", rt, simm, rs);
+    case 0x2e: return fmt::format("swr ${}, {}(${})", rt, simm, rs);
+    case 0x30:
+    case 0x31:
+    case 0x32:
+    case 0x33: return fmt::format("lwc{} ${}, {}(${})", in.getOpcode() & 3, in.getRT(), simm, rs);
+    case 0x38:
+    case 0x39:
+    case 0x3a:
+    case 0x3b: return fmt::format("swc{} ${}, {}(${})", in.getOpcode() & 3, in.getRT(), simm, rs);
+    default:
+        return fmt::format("illegal {:#010x}", in.whole);
+    }
+}
@@ -0,0 +1,16 @@
+#ifndef DISASSEMBLER_H
+#define DISASSEMBLER_H
+
+#include <cstdint>
+#include <string>
+
+#include "mips.h"
+
+// Register names as used by the assembler, $zero to $ra
+const char* regName(uint8_t reg);
+
+// Renders an instruction as assembly. pc is the address it was fetched
+// from and is needed for branch and jump targets.
+std::string disassemble(Instruction instruction, uint32_t pc);
+
+#endif // DISASSEMBLER_H
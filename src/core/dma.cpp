@@ -0,0 +1,330 @@
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <vector>
+
+#include <fmt/core.h>
+
+#include "cpu.h"
+#include "dma.h"
+#include "log.h"
+#include "savestate.h"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define DMA_SSE2
+#include <emmintrin.h>
+#endif
+
+namespace {
+    constexpr uint32_t ram_mask = memory_size - 1;
+    constexpr uint32_t ot_end = 0x00ffffff;
+    // Linked lists are only followed this far, in case the guest made a loop
+    constexpr uint32_t max_list_nodes = memory_size / 4;
+
+    constexpr uint32_t dma_section = sectionTag("DMA ");
+    constexpr uint32_t dma_state_version = 1;
+    constexpr size_t dma_state_size = 2 * 4 + dma_channel_count * (3 * 4 + 8);
+} // Anonymous namespace
+
+Dma::Dma(Scheduler& scheduler, RamWritten ram_written) : scheduler(scheduler), ram_written(std::move(ram_written)) {
+    for(size_t i = 0; i < dma_channel_count; ++i) {
+        done_events[i] = scheduler.addEvent(fmt::format("DMA{}", i), [this, i](uint64_t) { finish(i); });
+    }
+}
+
+uint32_t Dma::read(uint32_t paddr) const {
+    if(paddr == dma_dpcr)
+        return dpcr;
+    if(paddr == dma_dicr)
+        return dicr;
+
+    const uint32_t offset = paddr - dma_base;
+    const size_t index = offset >> 4;
+    if(index >= dma_channel_count)
+        return 0;
+    switch(offset & 0xf) {
+    case 0x0:
+        return channels[index].madr;
+    case 0x4:
+        return channels[index].bcr;
+    case 0x8:
+        return channels[index].chcr;
+    default:
+        return 0;
+    }
+}
+
+void Dma::write(uint32_t paddr, uint32_t val) {
+    if(paddr == dma_dpcr) {
+        dpcr = val;
+        for(size_t i = 0; i < dma_channel_count; ++i) {
+            startIfReady(i);
+        }
+        return;
+    }
+    if(paddr == dma_dicr) {
+        // Flags are acknowledged by writing 1 to them
+        const uint32_t flags = dicr & 0x7f000000 & ~val;
+        dicr = flags | (val & 0x00ff803f);
+        updateMasterFlag();
+        return;
+    }
+
+    const uint32_t offset = paddr - dma_base;
+    const size_t index = offset >> 4;
+    if(index >= dma_channel_count)
+        return;
+    Channel& channel = channels[index];
+    switch(offset & 0xf) {
+    case 0x0:
+        channel.madr = val & 0x00ffffff;
+        break;
+    case 0x4:
+        channel.bcr = val;
+        break;
+    case 0x8:
+        // The OTC channel always goes backward into RAM
+        if(index == static_cast<size_t>(DmaChannel::OTC))
+            channel.chcr = (val & (busy | trigger | 0x40000000)) | backward;
+        else
+            channel.chcr = val & 0x71770703;
+        startIfReady(index);
+        break;
+    default:
+        break;
+    }
+}
+
+void Dma::startIfReady(size_t index) {
+    Channel& channel = channels[index];
+    const bool enabled = dpcr & (8u << (4 * index));
+    const uint32_t mode = syncMode(channel.chcr);
+    if(!enabled || !(channel.chcr & busy) || (mode == 0 && !(channel.chcr & trigger)))
+        return;
+    if(scheduler.isScheduled(done_events[index]))
+        return;
+
+    channel.chcr &= ~trigger;
+    const DmaDevice* device = devices[index];
+    const uint64_t device_before = device ? device->hostNs() : 0;
+    const auto start = std::chrono::steady_clock::now();
+    uint32_t cycles;
+    if(mode == 2)
+        cycles = transferLinkedList(index);
+    else
+        cycles = transferBlock(index);
+    const auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+    const int64_t device_ns = device ? static_cast<int64_t>(device->hostNs() - device_before) : 0;
+    stats.transfer_ns += static_cast<uint64_t>(std::max<int64_t>(elapsed.count() - device_ns, 0));
+    LOG_DEBUG("DMA: Channel {} mode {} done in {} cycles\n", index, mode, cycles);
+    scheduler.scheduleIn(done_events[index], std::max<uint32_t>(cycles, 1));
+}
+
+uint32_t Dma::transferBlock(size_t index) {
+    Channel& channel = channels[index];
+    const uint32_t block_size = channel.bcr & 0xffff;
+    uint32_t words;
+    if(syncMode(channel.chcr) == 0)
+        words = block_size ? block_size : 0x10000;
+    else
+        words = block_size * (channel.bcr >> 16);
+
+    const uint32_t addr = channel.madr & ram_mask & ~3u;
+    if(index == static_cast<size_t>(DmaChannel::OTC))
+        return clearOrderingTable(addr, words);
+
+    DmaDevice* device = devices[index];
+    const bool to_device = channel.chcr & from_ram;
+    const uint32_t step = channel.chcr & backward ? static_cast<uint32_t>(-4) : 4;
+    if(!(channel.chcr & backward) && addr + 4ull * words <= memory_size) {
+        // One block copy straight between RAM and the device
+        uint8_t* data = ram + addr;
+        if(to_device) {
+            if(device)
+                device->dmaWrite(data, words);
+        }
+        else {
+            if(device)
+                device->dmaRead(data, words);
+            else
+                std::memset(data, 0, 4ull * words);
+            ram_written(addr, 4 * words);
+        }
+    }
+    else {
+        // Wrapping around RAM or going backward, gathered word by word
+        std::vector<uint8_t> buffer(4ull * words, 0);
+        if(to_device) {
+            for(uint32_t i = 0; i < words; ++i) {
+                std::memcpy(buffer.data() + 4 * i, ram + ((addr + i * step) & ram_mask), 4);
+            }
+            if(device)
+                device->dmaWrite(buffer.data(), words);
+        }
+        else {
+            if(device)
+                device->dmaRead(buffer.data(), words);
+            for(uint32_t i = 0; i < words; ++i) {
+                const uint32_t word_addr = (addr + i * step) & ram_mask;
+                std::memcpy(ram + word_addr, buffer.data() + 4 * i, 4);
+                ram_written(word_addr, 4);
+            }
+        }
+    }
+
+    // Request mode leaves MADR past the data and no blocks to go
+    if(syncMode(channel.chcr) == 1) {
+        channel.madr = (addr + words * step) & 0x00ffffff;
+        channel.bcr &= 0xffff;
+    }
+    return words;
+}
+
+uint32_t Dma::transferLinkedList(size_t index) {
+    Channel& channel = channels[index];
+    DmaDevice* device = devices[index];
+    if(!(channel.chcr & from_ram)) {
+        LOG("DMA: Linked list transfer to RAM on channel {}\n", index);
+        return 1;
+    }
+
+    std::vector<uint8_t> buffer;
+    uint32_t addr = channel.madr & ram_mask & ~3u;
+    uint32_t cycles = 0;
+    for(uint32_t node = 0; node < max_list_nodes; ++node) {
+        const uint32_t header = readLE<uint32_t>(ram + addr);
+        const uint32_t words = header >> 24;
+        if(words && device) {
+            const uint32_t data = (addr + 4) & ram_mask;
+            if(data + 4 * words <= memory_size) {
+                device->dmaWrite(ram + data, words);
+            }
+            else {
+                buffer.resize(4 * words);
+                for(uint32_t i = 0; i < words; ++i) {
+                    std::memcpy(buffer.data() + 4 * i, ram + ((data + 4 * i) & ram_mask), 4);
+                }
+                device->dmaWrite(buffer.data(), words);
+            }
+        }
+        cycles += words + 1;
+        if(header & 0x00800000)
+            break;
+        addr = header & ram_mask & ~3u;
+    }
+    channel.madr = ot_end;
+    return cycles;
+}
+
+// Links count entries into an empty ordering table ending at addr: each
+// points to the one before it, the first one is the end marker
+uint32_t Dma::clearOrderingTable(uint32_t addr, uint32_t count) {
+    if(!count)
+        return 0;
+    const uint32_t span = 4 * (count - 1);
+    if(addr < span) {
+        for(uint32_t i = 0; i < count; ++i) {
+            const uint32_t entry = (addr - 4 * i) & ram_mask;
+            writeLE<uint32_t>(ram + entry, i + 1 == count ? ot_end : (entry - 4) & ram_mask);
+            ram_written(entry, 4);
+        }
+        return count;
+    }
+
+    // Seen from the lowest entry up, it's an ascending run of addresses
+    const uint32_t low = addr - span;
+    uint8_t* table = ram + low;
+    uint32_t i = 0;
+#ifdef DMA_SSE2
+    __m128i entries = _mm_setr_epi32(low - 4, low, low + 4, low + 8);
+    const __m128i advance = _mm_set1_epi32(16);
+    for(; i + 4 <= count; i += 4) {
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(table + 4 * i), entries);
+        entries = _mm_add_epi32(entries, advance);
+    }
+#endif
+    for(; i < count; ++i) {
+        writeLE<uint32_t>(table + 4 * i, low + 4 * i - 4);
+    }
+    writeLE<uint32_t>(table, ot_end);
+    ram_written(low, 4 * count);
+    return count;
+}
+
+void Dma::finish(size_t index) {
+    channels[index].chcr &= ~busy;
+    if(dicr & (1u << (16 + index)))
+        dicr |= 1u << (24 + index);
+    updateMasterFlag();
+}
+
+void Dma::updateMasterFlag() {
+    const bool force = dicr & (1u << 15);
+    const bool master = dicr & (1u << 23);
+    const uint32_t enabled = (dicr >> 16) & 0x7f;
+    const uint32_t flags = (dicr >> 24) & 0x7f;
+    if(force || (master && (enabled & flags)))
+        dicr |= 0x80000000;
+    else
+        dicr &= ~0x80000000;
+}
+
+void Dma::reset() {
+    channels.fill({});
+    for(const Scheduler::EventId event : done_events) {
+        scheduler.cancel(event);
+    }
+    dpcr = 0x07654321;
+    dicr = 0;
+}
+
+void Dma::saveState(SavestateWriter& writer) const {
+    writer.beginSection(dma_section, dma_state_version);
+    writer.put(dpcr);
+    writer.put(dicr);
+    for(size_t i = 0; i < dma_channel_count; ++i) {
+        writer.put(channels[i].madr);
+        writer.put(channels[i].bcr);
+        writer.put(channels[i].chcr);
+        writer.put(scheduler.dueAt(done_events[i]));
+    }
+}
+
+bool Dma::checkState(const SavestateReader& reader) {
+    const SavestateSection* state = reader.find(dma_section, dma_state_version);
+    if(state && state->size != dma_state_size) {
+        LOG("DMA: Not a state this version can load\n");
+        return false;
+    }
+    return true;
+}
+
+bool Dma::loadState(const SavestateReader& reader) {
+    if(!checkState(reader))
+        return false;
+    const SavestateSection* state = reader.find(dma_section, dma_state_version);
+    if(!state) {
+        reset();
+        return true;
+    }
+
+    const uint8_t* pos = state->data;
+    const auto get = [&](auto& val) {
+        val = readLE<std::remove_reference_t<decltype(val)>>(pos);
+        pos += sizeof(val);
+    };
+    get(dpcr);
+    get(dicr);
+    for(size_t i = 0; i < dma_channel_count; ++i) {
+        get(channels[i].madr);
+        get(channels[i].bcr);
+        get(channels[i].chcr);
+        uint64_t due;
+        get(due);
+        if(due == Scheduler::never)
+            scheduler.cancel(done_events[i]);
+        else
+            scheduler.schedule(done_events[i], due);
+    }
+    return true;
+}
@@ -0,0 +1,139 @@
+#ifndef DMA_H
+#define DMA_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+#include "scheduler.h"
+
+class SavestateReader;
+class SavestateWriter;
+
+// The registers, 0x10 bytes per channel then the control registers
+constexpr uint32_t dma_base = 0x1f801080;
+constexpr uint32_t dma_end = 0x1f801100;
+constexpr uint32_t dma_dpcr = 0x1f8010f0;
+constexpr uint32_t dma_dicr = 0x1f8010f4;
+
+enum class DmaChannel : uint8_t {
+    MdecIn,
+    MdecOut,
+    GPU,
+    CDROM,
+    SPU,
+    PIO,
+    OTC,
+};
+constexpr size_t dma_channel_count = 7;
+
+// A device on the other end of a channel. Words are little endian in
+// host memory, usually straight in guest RAM.
+class DmaDevice {
+public:
+    virtual ~DmaDevice() = default;
+
+    // From RAM to the device
+    virtual void dmaWrite(const uint8_t* words, size_t count) = 0;
+    // From the device to RAM
+    virtual void dmaRead(uint8_t* words, size_t count) = 0;
+
+    // Host time the device spent on the thread driving it, which DMA
+    // leaves out of its own time
+    virtual uint64_t hostNs() const {
+        return 0;
+    }
+};
+
+// Counters for profiling, they only ever go up
+struct DmaStats {
+    // Host time spent moving data, not counting the devices
+    uint64_t transfer_ns = 0;
+};
+
+// The DMA controller. A transfer moves all of its data as soon as it
+// starts, as one block copy between RAM and the device when the addresses
+// are contiguous, and reports completion once the time it would have
+// taken passed, through a scheduler event per channel. Chopping and
+// request pacing aren't modelled.
+class Dma {
+public:
+    // Called with the RAM offset and size of everything written to RAM
+    using RamWritten = std::function<void(uint32_t offset, uint32_t size)>;
+
+    Dma(Scheduler& scheduler, RamWritten ram_written);
+
+    Dma(const Dma&) = delete;
+    Dma& operator=(const Dma&) = delete;
+
+    // Main RAM, memory_size bytes
+    void setRAM(uint8_t* memory) {
+        ram = memory;
+    }
+    // Channels without a device read zeros and drop what they write
+    void connect(DmaChannel channel, DmaDevice* device) {
+        devices[static_cast<size_t>(channel)] = device;
+    }
+
+    static bool contains(uint32_t paddr) {
+        return paddr >= dma_base && paddr < dma_end;
+    }
+    // Word accesses, paddr is word aligned
+    uint32_t read(uint32_t paddr) const;
+    void write(uint32_t paddr, uint32_t val);
+
+    // Whether DICR requests an interrupt. There's no interrupt controller
+    // to pass it on to yet.
+    bool irqPending() const {
+        return dicr & 0x80000000;
+    }
+
+    const DmaStats& getStats() const {
+        return stats;
+    }
+
+    void reset();
+    void saveState(SavestateWriter& writer) const;
+    // Whether the state holds a controller this version can load, or none
+    static bool checkState(const SavestateReader& reader);
+    // Resets the controller if the state has no DMA section, returns
+    // false if it has one this version can't load
+    bool loadState(const SavestateReader& reader);
+
+private:
+    struct Channel {
+        uint32_t madr = 0;
+        uint32_t bcr = 0;
+        uint32_t chcr = 0;
+    };
+
+    // CHCR bits
+    static constexpr uint32_t from_ram = 1 << 0;
+    static constexpr uint32_t backward = 1 << 1;
+    static constexpr uint32_t busy = 1 << 24;
+    static constexpr uint32_t trigger = 1 << 28;
+    static uint32_t syncMode(uint32_t chcr) {
+        return (chcr >> 9) & 3;
+    }
+
+    void startIfReady(size_t index);
+    // Each returns the cycles the transfer takes
+    uint32_t transferBlock(size_t index);
+    uint32_t transferLinkedList(size_t index);
+    uint32_t clearOrderingTable(uint32_t addr, uint32_t count);
+    void finish(size_t index);
+    void updateMasterFlag();
+
+    Scheduler& scheduler;
+    RamWritten ram_written;
+    uint8_t* ram = nullptr;
+    std::array<Channel, dma_channel_count> channels;
+    std::array<DmaDevice*, dma_channel_count> devices{};
+    std::array<Scheduler::EventId, dma_channel_count> done_events;
+    uint32_t dpcr = 0x07654321;
+    uint32_t dicr = 0;
+    DmaStats stats;
+};
+
+#endif // DMA_H
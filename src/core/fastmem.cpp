@@ -0,0 +1,213 @@
+#include "fastmem.h"
+#include "bios.h"
+#include "log.h"
+
+#if defined(__linux__) && defined(__x86_64__)
+#define FASTMEM_SUPPORTED
+#endif
+
+#ifdef FASTMEM_SUPPORTED
+#include <atomic>
+#include <csignal>
+#include <mutex>
+#include <sys/mman.h>
+#include <ucontext.h>
+#include <unistd.h>
+#endif
+
+#ifdef FASTMEM_SUPPORTED
+namespace {
+    constexpr uint64_t arena_size = 1ull << 32;
+    // KUSEG, KSEG0 and KSEG1 all see the same physical memory
+    constexpr uint32_t segments[] = {0x00000000, 0x80000000, 0xa0000000};
+    // RAM is mirrored across the first 8 MiB
+    constexpr uint32_t ram_window = 0x00800000;
+    constexpr uint32_t bios_base = 0x1fc00000;
+    constexpr uint32_t scratchpad_base = 0x1f800000;
+
+    // The signal handler can't take locks or free memory, so handlers live
+    // in a list that only grows. Removed entries are reused by later adds.
+    struct HandlerEntry {
+        std::atomic<uintptr_t> begin{0};
+        std::atomic<uintptr_t> end{0};
+        std::atomic<Fastmem::FaultHandler> handler{nullptr};
+        // Written last, null while the entry is free
+        std::atomic<void*> context{nullptr};
+        HandlerEntry* next = nullptr;
+    };
+
+    std::atomic<HandlerEntry*> fault_handlers{nullptr};
+    std::mutex fault_handlers_mutex;
+
+    struct sigaction previous_action;
+    std::mutex install_mutex;
+
+    void segvHandler(int sig, siginfo_t* info, void* raw_context) {
+        auto* context = static_cast<ucontext_t*>(raw_context);
+        const auto host_pc = static_cast<uintptr_t>(context->uc_mcontext.gregs[REG_RIP]);
+
+        for(HandlerEntry* entry = fault_handlers.load(std::memory_order_acquire); entry; entry = entry->next) {
+            void* handler_context = entry->context.load(std::memory_order_acquire);
+            if(!handler_context || host_pc < entry->begin.load(std::memory_order_relaxed) ||
+               host_pc >= entry->end.load(std::memory_order_relaxed))
+                continue;
+            const auto handler = entry->handler.load(std::memory_order_relaxed);
+            if(const uintptr_t resume = handler(handler_context, host_pc)) {
+                context->uc_mcontext.gregs[REG_RIP] = static_cast<greg_t>(resume);
+                return;
+            }
+            break;
+        }
+
+        // Not ours, let whoever was installed before deal with it
+        if(previous_action.sa_flags & SA_SIGINFO) {
+            previous_action.sa_sigaction(sig, info, raw_context);
+        }
+        else if(previous_action.sa_handler == SIG_DFL || previous_action.sa_handler == SIG_IGN) {
+            // Returning retries the access, which now gets the default action
+            signal(sig, SIG_DFL);
+        }
+        else {
+            previous_action.sa_handler(sig);
+        }
+    }
+
+    // Checked on every create, since whoever installed a handler after us
+    // (test frameworks do, around each test) may have restored an older one
+    void installHandler() {
+        std::lock_guard<std::mutex> lock(install_mutex);
+        struct sigaction current{};
+        sigaction(SIGSEGV, nullptr, &current);
+        if((current.sa_flags & SA_SIGINFO) && current.sa_sigaction == segvHandler)
+            return;
+
+        struct sigaction action{};
+        action.sa_sigaction = segvHandler;
+        action.sa_flags = SA_SIGINFO | SA_NODEFER;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGSEGV, &action, &previous_action);
+    }
+} // Anonymous namespace
+#endif
+
+Fastmem::~Fastmem() {
+#ifdef FASTMEM_SUPPORTED
+    if(arena)
+        munmap(arena, arena_size);
+    if(ram_view)
+        munmap(ram_view, ram_size);
+    if(scratchpad_view)
+        munmap(scratchpad_view, scratchpad_page_size);
+    if(fd >= 0)
+        close(fd);
+#endif
+}
+
+std::unique_ptr<Fastmem> Fastmem::create(size_t ram_size, size_t scratchpad_size, const Bios& bios) {
+#ifdef FASTMEM_SUPPORTED
+    std::unique_ptr<Fastmem> fastmem(new Fastmem());
+    fastmem->ram_size = ram_size;
+    const auto host_page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    fastmem->scratchpad_page_size = (scratchpad_size + host_page_size - 1) & ~(host_page_size - 1);
+    const size_t scratchpad_offset = ram_size;
+    const size_t bios_offset = scratchpad_offset + fastmem->scratchpad_page_size;
+
+    // RAM first, then the scratchpad. The BIOS is mapped from its own file,
+    // only images not backed by one are copied in after them.
+    const bool copy_bios = bios.fd() < 0;
+    fastmem->fd = memfd_create("prosur-fastmem", MFD_CLOEXEC);
+    if(fastmem->fd < 0 || ftruncate(fastmem->fd, bios_offset + (copy_bios ? bios_size : 0)) != 0) {
+        LOG("Fastmem: Failed to create the backing memory\n");
+        return nullptr;
+    }
+    if(copy_bios && pwrite(fastmem->fd, bios.data(), bios_size, bios_offset) != static_cast<ssize_t>(bios_size)) {
+        LOG("Fastmem: Failed to copy the BIOS\n");
+        return nullptr;
+    }
+    const int bios_fd = copy_bios ? fastmem->fd : bios.fd();
+    const auto bios_file_offset = static_cast<off_t>(copy_bios ? bios_offset : 0);
+
+    void* arena = mmap(nullptr, arena_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    void* ram_view = mmap(nullptr, ram_size, PROT_READ | PROT_WRITE, MAP_SHARED, fastmem->fd, 0);
+    void* scratchpad_view = mmap(nullptr, fastmem->scratchpad_page_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                                 fastmem->fd, static_cast<off_t>(scratchpad_offset));
+    if(arena != MAP_FAILED)
+        fastmem->arena = static_cast<uint8_t*>(arena);
+    if(ram_view != MAP_FAILED)
+        fastmem->ram_view = static_cast<uint8_t*>(ram_view);
+    if(scratchpad_view != MAP_FAILED)
+        fastmem->scratchpad_view = static_cast<uint8_t*>(scratchpad_view);
+    if(!fastmem->arena || !fastmem->ram_view || !fastmem->scratchpad_view) {
+        LOG("Fastmem: Failed to reserve the address space\n");
+        return nullptr;
+    }
+
+    for(const uint32_t segment : segments) {
+        for(uint32_t offset = 0; offset < ram_window; offset += static_cast<uint32_t>(ram_size)) {
+            if(mmap(fastmem->arena + segment + offset, ram_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_FIXED, fastmem->fd, 0) == MAP_FAILED) {
+                LOG("Fastmem: Failed to map RAM at {:#x}\n", segment + offset);
+                return nullptr;
+            }
+        }
+        if(mmap(fastmem->arena + segment + bios_base, bios_size, PROT_READ,
+                MAP_SHARED | MAP_FIXED, bios_fd, bios_file_offset) == MAP_FAILED) {
+            LOG("Fastmem: Failed to map the BIOS at {:#x}\n", segment + bios_base);
+            return nullptr;
+        }
+        // KSEG1 doesn't see the scratchpad
+        if(segment != 0xa0000000 &&
+           mmap(fastmem->arena + segment + scratchpad_base, fastmem->scratchpad_page_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_FIXED, fastmem->fd, static_cast<off_t>(scratchpad_offset)) == MAP_FAILED) {
+            LOG("Fastmem: Failed to map the scratchpad at {:#x}\n", segment + scratchpad_base);
+            return nullptr;
+        }
+    }
+
+    installHandler();
+
+    LOG("Fastmem: Guest address space mapped at {}\n", static_cast<void*>(fastmem->arena));
+    return fastmem;
+#else
+    (void)ram_size;
+    (void)scratchpad_size;
+    (void)bios;
+    return nullptr;
+#endif
+}
+
+void Fastmem::addFaultHandler(const void* code, size_t code_size, void* context, FaultHandler handler) {
+#ifdef FASTMEM_SUPPORTED
+    std::lock_guard<std::mutex> lock(fault_handlers_mutex);
+    HandlerEntry* entry = fault_handlers.load(std::memory_order_relaxed);
+    while(entry && entry->context.load(std::memory_order_relaxed)) {
+        entry = entry->next;
+    }
+    if(!entry) {
+        entry = new HandlerEntry();
+        entry->next = fault_handlers.load(std::memory_order_relaxed);
+        fault_handlers.store(entry, std::memory_order_release);
+    }
+    entry->begin.store(reinterpret_cast<uintptr_t>(code), std::memory_order_relaxed);
+    entry->end.store(reinterpret_cast<uintptr_t>(code) + code_size, std::memory_order_relaxed);
+    entry->handler.store(handler, std::memory_order_relaxed);
+    entry->context.store(context, std::memory_order_release);
+#else
+    (void)code;
+    (void)code_size;
+    (void)context;
+    (void)handler;
+#endif
+}
+
+void Fastmem::removeFaultHandler(void* context) {
+#ifdef FASTMEM_SUPPORTED
+    std::lock_guard<std::mutex> lock(fault_handlers_mutex);
+    for(HandlerEntry* entry = fault_handlers.load(std::memory_order_relaxed); entry; entry = entry->next) {
+        if(entry->context.load(std::memory_order_relaxed) == context)
+            entry->context.store(nullptr, std::memory_order_release);
+    }
+#else
+    (void)context;
+#endif
+}
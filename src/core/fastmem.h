@@ -0,0 +1,60 @@
+#ifndef FASTMEM_H
+#define FASTMEM_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+class Bios;
+
+// Host mapping of the whole 4 GiB guest address space, so guest RAM and
+// BIOS accesses become a single host access relative to base().
+// Main RAM comes from a memfd and is mapped with its mirrors into KUSEG,
+// KSEG0 and KSEG1, the BIOS is mapped read only from its file, sharing its
+// pages with every other mapping of that file. The scratchpad takes a
+// whole host page in KUSEG and KSEG0, so the rest of that page doesn't
+// fault like it should on the slow path. Everything else is left
+// unmapped: accessing it faults, and registered fault handlers redirect
+// execution to a slow path. Only available on Linux.
+class Fastmem {
+public:
+    ~Fastmem();
+
+    Fastmem(const Fastmem&) = delete;
+    Fastmem& operator=(const Fastmem&) = delete;
+
+    // Returns null if fastmem isn't available on this host
+    static std::unique_ptr<Fastmem> create(size_t ram_size, size_t scratchpad_size, const Bios& bios);
+
+    uint8_t* base() const {
+        return arena;
+    }
+    // A view of main RAM outside of the arena, shared with every mirror
+    uint8_t* ram() const {
+        return ram_view;
+    }
+    uint8_t* scratchpad() const {
+        return scratchpad_view;
+    }
+
+    // Called from the SIGSEGV handler with the faulting host pc. Returns
+    // the host address to resume execution at, or 0 if the fault isn't
+    // from a site the handler knows about.
+    using FaultHandler = uintptr_t (*)(void* context, uintptr_t host_pc);
+    // Faults with a host pc within the code_size bytes at code go to
+    // handler. The ranges of the handlers must not overlap.
+    static void addFaultHandler(const void* code, size_t code_size, void* context, FaultHandler handler);
+    static void removeFaultHandler(void* context);
+
+private:
+    Fastmem() = default;
+
+    int fd = -1;
+    uint8_t* arena = nullptr;
+    uint8_t* ram_view = nullptr;
+    uint8_t* scratchpad_view = nullptr;
+    size_t ram_size = 0;
+    size_t scratchpad_page_size = 0;
+};
+
+#endif // FASTMEM_H
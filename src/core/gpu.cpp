@@ -0,0 +1,312 @@
+#include <array>
+#include <chrono>
+#include <type_traits>
+
+#include "gpu.h"
+#include "log.h"
+#include "mips.h"
+#include "savestate.h"
+
+namespace {
+    constexpr uint32_t gpu_section = sectionTag("GPU ");
+    constexpr uint32_t gpu_state_version = 1;
+    constexpr size_t gpu_state_size = 1 + 5 * 4 + 4 + 1 + 8 + 8;
+
+    // Scanlines per frame and CPU cycles per scanline of each video mode
+    constexpr uint32_t ntsc_lines = 263;
+    constexpr uint32_t ntsc_line_cycles = 2172;
+    constexpr uint32_t pal_lines = 314;
+    constexpr uint32_t pal_line_cycles = 2167;
+
+    using Clock = std::chrono::steady_clock;
+    uint64_t nanosSince(Clock::time_point start) {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+    }
+} // Anonymous namespace
+
+Gpu::Gpu(Scheduler& scheduler) : scheduler(scheduler) {
+    vblank_event = scheduler.addEvent("VBlank", [this](uint64_t due) { vblank(due); });
+    scheduler.scheduleIn(vblank_event, frameCycles());
+}
+
+Gpu::~Gpu() {
+    setThreaded(false);
+}
+
+void Gpu::setThreaded(bool threaded) {
+    if(threaded == isThreaded())
+        return;
+    if(threaded) {
+        worker = std::thread(&Gpu::workerLoop, this);
+        return;
+    }
+    sync();
+    {
+        std::lock_guard<std::mutex> lock(worker_mutex);
+        worker_stopping = true;
+    }
+    worker_wake.notify_one();
+    worker.join();
+    worker_stopping = false;
+}
+
+void Gpu::gp0(uint32_t word) {
+    if(!isThreaded()) {
+        const auto start = Clock::now();
+        renderer.gp0(word);
+        render_ns.fetch_add(nanosSince(start), std::memory_order_relaxed);
+        return;
+    }
+    // A full FIFO means the renderer is busy, it makes room soon enough
+    if(!fifo.push(word)) {
+        const auto start = Clock::now();
+        while(!fifo.push(word)) {
+            std::this_thread::yield();
+        }
+        fifo_wait_ns += nanosSince(start);
+    }
+    ++words_sent;
+    // Pairs with the fence of the render thread going to sleep, so either
+    // it sees the word or this side sees it sleeping
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(worker_sleeping.load(std::memory_order_relaxed)) {
+        std::lock_guard<std::mutex> lock(worker_mutex);
+        worker_wake.notify_one();
+    }
+}
+
+void Gpu::sync() const {
+    if(!isThreaded() || words_done.load(std::memory_order_acquire) == words_sent)
+        return;
+    const auto start = Clock::now();
+    while(words_done.load(std::memory_order_acquire) != words_sent) {
+        std::this_thread::yield();
+    }
+    fifo_wait_ns += nanosSince(start);
+}
+
+void Gpu::workerLoop() {
+    std::array<uint32_t, 256> batch;
+    while(true) {
+        const size_t count = fifo.pop(batch.data(), batch.size());
+        if(count) {
+            const auto start = Clock::now();
+            for(size_t i = 0; i < count; ++i) {
+                renderer.gp0(batch[i]);
+            }
+            render_ns.fetch_add(nanosSince(start), std::memory_order_relaxed);
+            words_done.fetch_add(count, std::memory_order_release);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(worker_mutex);
+        worker_sleeping.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        worker_wake.wait(lock, [&] { return worker_stopping || !fifo.empty(); });
+        worker_sleeping.store(false, std::memory_order_relaxed);
+        if(worker_stopping)
+            break;
+    }
+}
+
+uint32_t Gpu::read(uint32_t paddr) {
+    if(paddr == gpu_gp1)
+        return status();
+    sync();
+    if(renderer.readPending())
+        read_latch = renderer.readWord();
+    return read_latch;
+}
+
+void Gpu::write(uint32_t paddr, uint32_t val) {
+    if(paddr == gpu_gp0)
+        gp0(val);
+    else
+        gp1(val);
+}
+
+void Gpu::dmaWrite(const uint8_t* words, size_t count) {
+    if(!isThreaded()) {
+        const auto start = Clock::now();
+        renderer.gp0(words, count);
+        render_ns.fetch_add(nanosSince(start), std::memory_order_relaxed);
+        return;
+    }
+    for(size_t i = 0; i < count; ++i) {
+        gp0(readLE<uint32_t>(words + 4 * i));
+    }
+}
+
+void Gpu::dmaRead(uint8_t* words, size_t count) {
+    for(size_t i = 0; i < count; ++i) {
+        writeLE<uint32_t>(words + 4 * i, read(gpu_gp0));
+    }
+}
+
+uint64_t Gpu::hostNs() const {
+    // Drawing on the render thread runs alongside the CPU thread
+    return fifo_wait_ns + (isThreaded() ? 0 : render_ns.load(std::memory_order_relaxed));
+}
+
+GpuStats Gpu::getStats() const {
+    return {render_ns.load(std::memory_order_relaxed), fifo_wait_ns};
+}
+
+uint32_t Gpu::status() const {
+    sync();
+    // Commands and DMA blocks are always welcome, nothing is queued
+    constexpr uint32_t ready_for_command = 1 << 26;
+    constexpr uint32_t ready_for_dma = 1 << 28;
+    const uint32_t ready_to_send = renderer.readPending() ? 1 << 27 : 0;
+
+    uint32_t stat = renderer.statusBits() | ready_for_command | ready_for_dma | ready_to_send;
+    stat |= (!interlaced() || odd_field) ? 1 << 13 : 0;
+    stat |= ((display_mode >> 7) & 1) << 14;
+    stat |= ((display_mode >> 6) & 1) << 16;
+    stat |= (display_mode & 0x3f) << 17;
+    stat |= display_disabled ? 1 << 23 : 0;
+    stat |= renderer.irqRequested() ? 1 << 24 : 0;
+    stat |= dma_direction << 29;
+    stat |= (interlaced() && odd_field) ? 1u << 31 : 0;
+    // The DMA request follows the direction
+    switch(dma_direction) {
+    case 1:
+        stat |= 1 << 25;
+        break;
+    case 2:
+        stat |= (stat & ready_for_dma) >> 3;
+        break;
+    case 3:
+        stat |= (stat & ready_to_send) >> 2;
+        break;
+    default:
+        break;
+    }
+    return stat;
+}
+
+void Gpu::gp1(uint32_t val) {
+    const uint32_t op = (val >> 24) & 0x3f;
+    // All but the display settings reach into the drawing state
+    if(op < 0x03 || op > 0x08)
+        sync();
+    switch(op) {
+    case 0x00:
+        reset();
+        break;
+    case 0x01:
+        renderer.resetCommandBuffer();
+        break;
+    case 0x02:
+        renderer.acknowledgeIrq();
+        break;
+    case 0x03:
+        display_disabled = val & 1;
+        break;
+    case 0x04:
+        dma_direction = val & 3;
+        break;
+    case 0x05:
+        display_start = val & 0x7ffff;
+        break;
+    case 0x06:
+        horizontal_range = val & 0xffffff;
+        break;
+    case 0x07:
+        vertical_range = val & 0xfffff;
+        break;
+    case 0x08:
+        display_mode = val & 0xff;
+        break;
+    case 0x09:
+        renderer.setTextureDisableAllowed(val & 1);
+        break;
+    default:
+        if(op >= 0x10) {
+            uint32_t info;
+            if(renderer.drawInfo(val, info))
+                read_latch = info;
+        }
+        else {
+            LOG_DEBUG("GPU: Ignoring GP1({:#04x})\n", op);
+        }
+        break;
+    }
+}
+
+uint32_t Gpu::frameCycles() const {
+    return display_mode & 0x08 ? pal_lines * pal_line_cycles : ntsc_lines * ntsc_line_cycles;
+}
+
+void Gpu::vblank(uint64_t due) {
+    ++frames;
+    if(interlaced())
+        odd_field = !odd_field;
+    // Relative to when it was due, blocks running past it don't add drift
+    scheduler.schedule(vblank_event, due + frameCycles());
+}
+
+void Gpu::reset() {
+    sync();
+    renderer.reset();
+    display_disabled = true;
+    dma_direction = 0;
+    display_start = 0;
+    horizontal_range = 0;
+    vertical_range = 0;
+    display_mode = 0;
+    odd_field = false;
+}
+
+void Gpu::saveState(SavestateWriter& writer, bool with_vram) const {
+    sync();
+    writer.beginSection(gpu_section, gpu_state_version);
+    writer.put<uint8_t>(display_disabled);
+    for(const uint32_t reg : {dma_direction, display_start, horizontal_range, vertical_range, display_mode}) {
+        writer.put(reg);
+    }
+    writer.put(read_latch);
+    writer.put<uint8_t>(odd_field);
+    writer.put(frames);
+    writer.put(scheduler.dueAt(vblank_event));
+    renderer.saveState(writer, with_vram);
+}
+
+bool Gpu::checkState(const SavestateReader& reader, bool with_vram) {
+    const SavestateSection* state = reader.find(gpu_section, gpu_state_version);
+    if(state && state->size != gpu_state_size) {
+        LOG("GPU: Not a state this version can load\n");
+        return false;
+    }
+    return Renderer::checkState(reader, with_vram);
+}
+
+void Gpu::loadState(const SavestateReader& reader, bool with_vram) {
+    sync();
+    renderer.loadState(reader, with_vram);
+    const SavestateSection* state = reader.find(gpu_section, gpu_state_version);
+    if(!state) {
+        reset();
+        scheduler.scheduleIn(vblank_event, frameCycles());
+        return;
+    }
+
+    const uint8_t* pos = state->data;
+    const auto get = [&](auto& val) {
+        val = readLE<std::remove_reference_t<decltype(val)>>(pos);
+        pos += sizeof(val);
+    };
+    uint8_t flag;
+    get(flag);
+    display_disabled = flag;
+    for(uint32_t* reg : {&dma_direction, &display_start, &horizontal_range, &vertical_range, &display_mode}) {
+        get(*reg);
+    }
+    get(read_latch);
+    get(flag);
+    odd_field = flag;
+    get(frames);
+    uint64_t due;
+    get(due);
+    scheduler.schedule(vblank_event, due);
+}
@@ -0,0 +1,184 @@
+#ifndef GPU_H
+#define GPU_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+#include "command_fifo.h"
+#include "dma.h"
+#include "renderer.h"
+#include "scheduler.h"
+
+class SavestateReader;
+class SavestateWriter;
+
+// Counters for profiling, they only ever go up
+struct GpuStats {
+    // Host time in the renderer, on the render thread if there is one
+    uint64_t render_ns = 0;
+    // Host time the CPU thread spent waiting on the render thread
+    uint64_t fifo_wait_ns = 0;
+};
+
+// GP0 and GPUREAD share the first word, GP1 and GPUSTAT the second
+constexpr uint32_t gpu_base = 0x1f801810;
+constexpr uint32_t gpu_end = 0x1f801818;
+constexpr uint32_t gpu_gp0 = 0x1f801810;
+constexpr uint32_t gpu_gp1 = 0x1f801814;
+
+// The GPU as the CPU and DMA channel 2 see it. GP0 goes to the renderer,
+// GP1 and the display side live here. Nothing is scanned out, the display
+// only matters for GPUSTAT and the VBlank event, which fires once per
+// frame at the rate of the video mode.
+//
+// The renderer can run on a thread of its own, taking GP0 words from a
+// CommandFifo as the CPU keeps going. Anything that reads or changes the
+// renderer from this side first waits for it to catch up, so the guest
+// sees exactly what it would with the renderer called inline: GPUREAD,
+// GPUSTAT, the GP1 commands reaching into the drawing state, VRAM access
+// and savestates are the sync points.
+class Gpu : public DmaDevice {
+public:
+    explicit Gpu(Scheduler& scheduler);
+    ~Gpu() override;
+
+    Gpu(const Gpu&) = delete;
+    Gpu& operator=(const Gpu&) = delete;
+
+    static bool contains(uint32_t paddr) {
+        return paddr >= gpu_base && paddr < gpu_end;
+    }
+    // Word accesses, paddr is word aligned. Reading GPUREAD moves a VRAM
+    // transfer along.
+    uint32_t read(uint32_t paddr);
+    void write(uint32_t paddr, uint32_t val);
+
+    void dmaWrite(const uint8_t* words, size_t count) override;
+    void dmaRead(uint8_t* words, size_t count) override;
+    uint64_t hostNs() const override;
+
+    GpuStats getStats() const;
+
+    // Starts or stops the render thread, off by default
+    void setThreaded(bool threaded);
+    bool isThreaded() const {
+        return worker.joinable();
+    }
+
+    // Level of the span kernels, see raster.h
+    void setSimdLevel(SimdLevel level) {
+        sync();
+        renderer.setSimdLevel(level);
+    }
+    SimdLevel getSimdLevel() const {
+        return renderer.getSimdLevel();
+    }
+    // Threads sharing out the drawing of each batch of primitives, see
+    // Renderer. Works the same with or without the render thread.
+    void setRasterThreads(uint32_t count) {
+        sync();
+        renderer.setRasterThreads(count);
+    }
+    uint32_t getRasterThreads() const {
+        return renderer.getRasterThreads();
+    }
+    // See Renderer::setTextureCaching
+    void setTextureCaching(bool enabled) {
+        sync();
+        renderer.setTextureCaching(enabled);
+    }
+
+    // vram_pixels pixels, row after row
+    const uint16_t* getVRAM() const {
+        sync();
+        return renderer.getVRAM();
+    }
+    // For loaders, offset and size in bytes
+    void writeVRAM(uint32_t offset, const uint8_t* data, size_t size) {
+        sync();
+        renderer.writeVRAM(offset, data, size);
+    }
+    // One byte per vram_page_size page of VRAM, non-zero if it was written
+    // since the last clearDirtyVramPages, like CPU::dirtyPages
+    const uint8_t* dirtyVramPages() const {
+        sync();
+        return renderer.dirtyPages();
+    }
+    void clearDirtyVramPages() {
+        sync();
+        renderer.clearDirtyPages();
+    }
+
+    // VBlanks since power on
+    uint64_t frameCount() const {
+        return frames;
+    }
+    // Whether GP0(1F) requests an interrupt. There's no interrupt
+    // controller to pass it on to yet.
+    bool irqPending() const {
+        sync();
+        return renderer.irqRequested();
+    }
+
+    // GP1(00), VRAM is left alone
+    void reset();
+    void saveState(SavestateWriter& writer, bool with_vram) const;
+    // Whether the state holds a GPU this version can load, or none
+    static bool checkState(const SavestateReader& reader, bool with_vram);
+    // Resets the GPU if the state has none, it must pass checkState
+    void loadState(const SavestateReader& reader, bool with_vram);
+
+private:
+    void gp0(uint32_t word);
+    // Waits until the render thread went through every word sent to it
+    void sync() const;
+    void workerLoop();
+
+    uint32_t status() const;
+    void gp1(uint32_t val);
+    bool interlaced() const {
+        return display_mode & 0x20;
+    }
+    // CPU cycles from one VBlank to the next
+    uint32_t frameCycles() const;
+    void vblank(uint64_t due);
+
+    Scheduler& scheduler;
+    Scheduler::EventId vblank_event;
+    Renderer renderer;
+
+    // Only used while threaded
+    CommandFifo fifo;
+    std::thread worker;
+    // Words pushed by this side and drawn by the render thread
+    uint64_t words_sent = 0;
+    std::atomic<uint64_t> words_done{0};
+    // The render thread sleeps on worker_wake once the FIFO runs dry
+    std::mutex worker_mutex;
+    std::condition_variable worker_wake;
+    std::atomic<bool> worker_sleeping{false};
+    bool worker_stopping = false;
+
+    std::atomic<uint64_t> render_ns{0};
+    mutable uint64_t fifo_wait_ns = 0;
+
+    // GP1(03) to GP1(08) as written
+    bool display_disabled = true;
+    uint32_t dma_direction = 0;
+    uint32_t display_start = 0;
+    uint32_t horizontal_range = 0;
+    uint32_t vertical_range = 0;
+    uint32_t display_mode = 0;
+
+    // GPUREAD keeps the last word it was given
+    uint32_t read_latch = 0;
+    // Interlaced field being displayed, odd when set
+    bool odd_field = false;
+    uint64_t frames = 0;
+};
+
+#endif // GPU_H
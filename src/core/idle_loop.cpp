@@ -0,0 +1,156 @@
+#include <array>
+#include <vector>
+
+#include "idle_loop.h"
+
+namespace {
+    constexpr uint32_t bit(uint8_t reg) {
+        return 1u << reg;
+    }
+
+    // Registers an instruction reads and writes, as masks
+    struct RegUse {
+        uint32_t reads = 0;
+        uint32_t writes = 0;
+        bool load = false; // The write lands after the next instruction
+    };
+
+    // Returns false for instructions with side effects and anything the
+    // analysis doesn't know about
+    bool getRegUse(Instruction instruction, RegUse& use) {
+        const uint8_t rs = instruction.getRS();
+        const uint8_t rt = instruction.getRT();
+        const uint8_t rd = instruction.getRD();
+        switch(instruction.getOpcode()) {
+        case 0x00:
+            switch(instruction.getFunct()) {
+            case 0x00: // SLL
+                use = {bit(rt), bit(rd)};
+                return true;
+            case 0x21: // ADDU
+            case 0x25: // OR
+            case 0x2b: // SLTU
+                use = {bit(rs) | bit(rt), bit(rd)};
+                return true;
+            default:
+                return false;
+            }
+        case 0x02: // J
+            use = {};
+            return true;
+        case 0x05: // BNE
+            use = {bit(rs) | bit(rt), 0};
+            return true;
+        case 0x08: // ADDI
+        case 0x09: // ADDIU
+        case 0x0c: // ANDI
+        case 0x0d: // ORI
+            use = {bit(rs), bit(rt)};
+            return true;
+        case 0x0f: // LUI
+            use = {0, bit(rt)};
+            return true;
+        case 0x20: // LB
+        case 0x21: // LH
+        case 0x23: // LW
+        case 0x24: // LBU
+        case 0x25: // LHU
+            use = {bit(rs), bit(rt), true};
+            return true;
+        case 0x22: // LWL
+        case 0x26: // LWR
+            // Merge with the old value of rt
+            use = {bit(rs) | bit(rt), bit(rt), true};
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    // Where the branch at index i of block goes when taken
+    bool getBranchTarget(const Block& block, size_t i, uint32_t& target) {
+        const DecodedOp& op = block.ops[i];
+        const uint32_t delay_slot = block.addr + 4 * static_cast<uint32_t>(i + 1);
+        switch(op.instruction.getOpcode()) {
+        case 0x02: // J
+            target = (delay_slot & 0xf0000000) | (op.instruction.getAddress() << 2);
+            return true;
+        case 0x05: // BNE
+            target = delay_slot + (op.simm << 2);
+            return true;
+        default:
+            return false;
+        }
+    }
+} // Anonymous namespace
+
+bool isIdleLoop(const Block& block, std::vector<IdleLoad>& loads) {
+    const auto& ops = block.ops;
+    if(ops.size() < 2 || !(ops[ops.size() - 2].flags & DecodedOp::Branch))
+        return false;
+
+    uint32_t target;
+    if(!getBranchTarget(block, ops.size() - 2, target) || target != block.addr)
+        return false;
+
+    std::vector<RegUse> uses(ops.size());
+    uint32_t written = 0;
+    for(size_t i = 0; i < ops.size(); ++i) {
+        if(!getRegUse(ops[i].instruction, uses[i]))
+            return false;
+        written |= uses[i].writes;
+    }
+    written &= ~bit(0);
+
+    // A load in the delay slot would land in the next iteration
+    if(uses.back().load)
+        return false;
+
+    // Load addresses come from registers the loop doesn't write, or from
+    // constants it builds with LUI, ORI and ADDIU
+    std::array<uint32_t, 32> constants{};
+    uint32_t known = bit(0);
+    loads.clear();
+    for(size_t i = 0; i < ops.size(); ++i) {
+        const DecodedOp& op = ops[i];
+        if(uses[i].load) {
+            if(!(written & bit(op.rs)))
+                loads.push_back({op.rs, static_cast<uint32_t>(op.simm)});
+            else if(known & bit(op.rs))
+                loads.push_back({0, constants[op.rs] + static_cast<uint32_t>(op.simm)});
+            else
+                return false;
+        }
+
+        const uint8_t opcode = op.instruction.getOpcode();
+        const uint32_t writes = uses[i].writes & ~bit(0);
+        if(opcode == 0x0f) { // LUI
+            constants[op.rt] = op.imm << 16;
+            known |= writes;
+        }
+        else if((opcode == 0x09 || opcode == 0x0d) && (known & bit(op.rs))) { // ADDIU, ORI
+            constants[op.rt] = opcode == 0x09 ? constants[op.rs] + static_cast<uint32_t>(op.simm)
+                                              : constants[op.rs] | op.imm;
+            known |= writes;
+        }
+        else {
+            known &= ~writes;
+        }
+    }
+
+    // Reading a register the loop writes before it's written this iteration
+    // means it carries state, like a timeout counter
+    uint32_t defined = 0;
+    uint32_t landing = 0;
+    for(const RegUse& use : uses) {
+        if(use.reads & written & ~defined)
+            return false;
+        defined |= landing;
+        landing = 0;
+        if(use.load)
+            landing = use.writes;
+        else
+            defined |= use.writes;
+    }
+    return true;
+}
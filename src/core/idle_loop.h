@@ -0,0 +1,20 @@
+#ifndef IDLE_LOOP_H
+#define IDLE_LOOP_H
+
+#include "block_cache.h"
+
+// Whether block is a loop that waits for something else to change memory,
+// like polling a hardware register or a counter bumped by an interrupt.
+//
+// That's a block ending on a branch back to its own start which stores
+// nothing and whose registers carry nothing from one iteration to the
+// next: every register it writes is written before it's read. Once such a
+// loop branched back to itself, running it again computes the exact same
+// thing until memory changes, so the time until then can be skipped.
+//
+// That only holds if its loads have no side effects, which depends on
+// where they go. Each load's address has to be loop invariant, and is
+// returned in loads for the caller to check before skipping.
+bool isIdleLoop(const Block& block, std::vector<IdleLoad>& loads);
+
+#endif // IDLE_LOOP_H
@@ -1,7 +1,208 @@
 
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
 #include <fmt/core.h>
 #include <fmt/os.h>
 
 #include "log.h"
 
-fmt::ostream out = fmt::output_file("log.txt");
+namespace {
+    // How long the backend sleeps when there's nothing to write
+    constexpr auto idle_interval = std::chrono::milliseconds(5);
+
+    // Single producer, single consumer ring of one thread's records
+    struct Ring {
+        std::array<logging::Record, logging::ring_capacity> records;
+        std::atomic<uint64_t> head{0};    // Written by the owning thread
+        std::atomic<uint64_t> tail{0};    // Written by the backend
+        std::atomic<uint64_t> dropped{0}; // Written by the owning thread
+        uint64_t reported_dropped = 0;    // Backend only
+        std::atomic<bool> retired{false}; // Set when the owning thread exits
+    };
+
+    class Backend {
+    public:
+        Backend() : out(fmt::output_file("log.txt")) {
+            thread = std::thread(&Backend::run, this);
+        }
+        ~Backend() {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            wake.notify_one();
+            thread.join();
+        }
+
+        Ring* addRing() {
+            std::lock_guard<std::mutex> lock(mutex);
+            rings.push_back(std::make_unique<Ring>());
+            return rings.back().get();
+        }
+
+        void flush() {
+            std::unique_lock<std::mutex> lock(mutex);
+            const uint64_t ticket = ++flush_requested;
+            wake.notify_one();
+            drained.wait(lock, [&] { return flush_done >= ticket; });
+        }
+
+        uint64_t dropped() {
+            std::lock_guard<std::mutex> lock(mutex);
+            uint64_t total = retired_dropped;
+            for(const auto& ring : rings) {
+                total += ring->dropped.load(std::memory_order_relaxed);
+            }
+            return total;
+        }
+
+    private:
+        void run() {
+            while(true) {
+                uint64_t requested;
+                bool stop;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    wake.wait_for(lock, idle_interval, [&] { return stopping || flush_requested != flush_done; });
+                    requested = flush_requested;
+                    stop = stopping;
+                }
+
+                drainAll();
+
+                if(requested != flush_done || stop) {
+                    out.flush();
+                    std::fflush(stdout);
+                    std::lock_guard<std::mutex> lock(mutex);
+                    flush_done = requested;
+                    drained.notify_all();
+                }
+                if(stop)
+                    break;
+            }
+        }
+
+        void drainAll() {
+            std::vector<Ring*> snapshot;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                snapshot.reserve(rings.size());
+                for(const auto& ring : rings) {
+                    snapshot.push_back(ring.get());
+                }
+            }
+
+            buf.clear();
+            for(Ring* ring : snapshot) {
+                drain(*ring);
+            }
+            if(buf.size()) {
+                out.print("{}", fmt::string_view(buf.data(), buf.size()));
+                fmt::print("{}", fmt::string_view(buf.data(), buf.size()));
+            }
+
+            // Rings of exited threads go away once they're empty
+            std::lock_guard<std::mutex> lock(mutex);
+            for(auto it = rings.begin(); it != rings.end();) {
+                Ring& ring = **it;
+                if(ring.retired.load(std::memory_order_acquire) &&
+                   ring.head.load(std::memory_order_acquire) == ring.tail.load(std::memory_order_relaxed)) {
+                    retired_dropped += ring.dropped.load(std::memory_order_relaxed);
+                    it = rings.erase(it);
+                }
+                else {
+                    ++it;
+                }
+            }
+        }
+
+        void drain(Ring& ring) {
+            const uint64_t head = ring.head.load(std::memory_order_acquire);
+            uint64_t tail = ring.tail.load(std::memory_order_relaxed);
+            for(; tail != head; ++tail) {
+                logging::Record& record = ring.records[tail % logging::ring_capacity];
+                try {
+                    record.format(buf, record.format_string, record.args);
+                }
+                catch(const fmt::format_error&) {
+                    buf.append(fmt::string_view(record.format_string));
+                }
+            }
+            ring.tail.store(tail, std::memory_order_release);
+
+            const uint64_t dropped = ring.dropped.load(std::memory_order_relaxed);
+            if(dropped != ring.reported_dropped) {
+                fmt::format_to(std::back_inserter(buf), "Log: Dropped {} messages\n", dropped - ring.reported_dropped);
+                ring.reported_dropped = dropped;
+            }
+        }
+
+        fmt::ostream out;
+        fmt::memory_buffer buf;
+        std::thread thread;
+
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::condition_variable drained;
+        std::vector<std::unique_ptr<Ring>> rings;
+        uint64_t retired_dropped = 0;
+        uint64_t flush_requested = 0;
+        uint64_t flush_done = 0;
+        bool stopping = false;
+    };
+
+    Backend& backend() {
+        static Backend instance;
+        return instance;
+    }
+
+    struct ThreadRing {
+        Ring* ring = nullptr;
+        ~ThreadRing() {
+            if(ring)
+                ring->retired.store(true, std::memory_order_release);
+        }
+    };
+    thread_local ThreadRing thread_ring;
+} // Anonymous namespace
+
+namespace logging {
+    Record* reserve() {
+        Ring* ring = thread_ring.ring;
+        if(!ring)
+            ring = thread_ring.ring = backend().addRing();
+
+        const uint64_t head = ring->head.load(std::memory_order_relaxed);
+        if(head - ring->tail.load(std::memory_order_acquire) == ring_capacity) {
+            ring->dropped.store(ring->dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        return &ring->records[head % ring_capacity];
+    }
+
+    void commit() {
+        Ring* ring = thread_ring.ring;
+        ring->head.store(ring->head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    void flush() {
+        backend().flush();
+    }
+
+    uint64_t dropped() {
+        return backend().dropped();
+    }
+
+    void formatText(fmt::memory_buffer& buf, const char*, void* args) {
+        std::unique_ptr<std::string> text(*static_cast<std::string**>(args));
+        buf.append(fmt::string_view(*text));
+    }
+} // namespace logging
@@ -1,30 +1,98 @@
 #ifndef LOG_H
 #define LOG_H
 
+#include<cstddef>
+#include<cstdint>
+#include<iterator>
+#include<new>
 #include<string>
-#include<stdarg.h>
+#include<tuple>
+#include<type_traits>
 
 #include<fmt/core.h>
-#include<fmt/os.h>
+#include<fmt/format.h>
 
 enum class LogLevel {
     Debug,
     Normal
 };
 
-extern fmt::ostream out;
+// Asynchronous logging. Call sites push a record holding the format string
+// and the raw arguments into a lock-free ring owned by their thread, and a
+// background thread formats them and writes them to log.txt and stdout.
+// Records are dropped and counted when a ring is full, so a thread logging
+// in a hot loop never waits on I/O.
+namespace logging {
+    constexpr size_t ring_capacity = 1024;
+    constexpr size_t record_payload = 112;
+
+    using FormatFn = void (*)(fmt::memory_buffer& buf, const char* format, void* args);
+
+    struct Record {
+        FormatFn format;
+        const char* format_string;
+        alignas(std::max_align_t) unsigned char args[record_payload];
+    };
+
+    // Claims the next free record of the calling thread's ring, or returns
+    // null if it's full. Must be followed by commit() on the same thread.
+    Record* reserve();
+    void commit();
+
+    // Blocks until every record pushed so far has been written out
+    void flush();
+    // Records dropped because a ring was full
+    uint64_t dropped();
+
+    // Arguments are kept raw when they can be formatted later on another
+    // thread, which only holds for plain values. C strings, string views
+    // and anything else that may point at storage gone by then are
+    // formatted on the calling thread.
+    template<typename T, typename D = std::decay_t<T>>
+    constexpr bool is_deferrable = std::is_arithmetic_v<D> || std::is_enum_v<D> ||
+        std::is_same_v<D, const void*> || std::is_same_v<D, void*> || std::is_same_v<D, std::nullptr_t>;
+
+    template<typename... T>
+    void formatArgs(fmt::memory_buffer& buf, const char* format, void* args) {
+        std::apply([&](const auto&... arg) {
+            fmt::vformat_to(std::back_inserter(buf), format, fmt::make_format_args(arg...));
+        }, *static_cast<std::tuple<T...>*>(args));
+    }
+
+    // Anything else is formatted up front and the text is passed along
+    void formatText(fmt::memory_buffer& buf, const char* format, void* args);
+
+    template<typename... T>
+    void push(const char* format, T&&... args) {
+        Record* record = reserve();
+        if(!record)
+            return;
+
+        using Args = std::tuple<std::decay_t<T>...>;
+        if constexpr((is_deferrable<T> && ...) && sizeof(Args) <= record_payload &&
+                     alignof(Args) <= alignof(std::max_align_t)) {
+            new (record->args) Args(std::forward<T>(args)...);
+            record->format = &formatArgs<std::decay_t<T>...>;
+        }
+        else {
+            auto* text = new std::string(fmt::vformat(format, fmt::make_format_args(args...)));
+            new (record->args) std::string*(text);
+            record->format = &formatText;
+        }
+        record->format_string = format;
+        commit();
+    }
+} // namespace logging
 
 template<typename... T>
 inline void log(LogLevel level, const char* s, T&&... args) {
     if(level == LogLevel::Debug) {
 #ifdef _DEBUG
-        out.print(s, args...);
-        fmt::print(s, args...);
+        logging::push(s, std::forward<T>(args)...);
 #endif
     }
     else {
-        out.print(s, args...);
-        fmt::print(s, args...);
+        logging::push(s, std::forward<T>(args)...);
     }
 }
 
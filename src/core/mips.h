@@ -2,6 +2,11 @@
 #define MIPS_H
 
 #include <cstdint>
+#include <cstring>
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#error "Guest memory is accessed with host loads, which must be little endian"
+#endif
 
 constexpr uint32_t build32(uint8_t a, uint8_t b, uint8_t c, uint8_t d) {
     return (static_cast<uint32_t>(d) << 24) | (static_cast<uint32_t>(c) << 16) | (static_cast<uint32_t>(b) << 8) | a;
@@ -20,6 +25,18 @@ constexpr uint8_t getFourthByte(uint32_t whole) {
     return (whole >> 24) & 0xff;
 }
 
+// Single host access to little endian guest memory of any width
+template<typename T>
+T readLE(const uint8_t* ptr) {
+    T val;
+    std::memcpy(&val, ptr, sizeof(T));
+    return val;
+}
+template<typename T>
+void writeLE(uint8_t* ptr, T val) {
+    std::memcpy(ptr, &val, sizeof(T));
+}
+
 constexpr uint8_t getFirstByte(uint16_t whole) {
     return whole & 0xff;
 }
@@ -31,6 +48,88 @@ constexpr uint8_t getFirstByte(uint8_t whole) {
     return whole;
 }
 
+enum class RegAlias : uint8_t {
+    R0 = 0,
+    R1 = 1,
+    R2 = 2,
+    R3 = 3,
+    R4 = 4,
+    R5 = 5,
+    R6 = 6,
+    R7 = 7,
+    R8 = 8,
+    R9 = 9,
+    R10 = 10,
+    R11 = 11,
+    R12 = 12,
+    R13 = 13,
+    R14 = 14,
+    R15 = 15,
+    R16 = 16,
+    R17 = 17,
+    R18 = 18,
+    R19 = 19,
+    R20 = 20,
+    R21 = 21,
+    R22 = 22,
+    R23 = 23,
+    R24 = 24,
+    R25 = 25,
+    R26 = 26,
+    R27 = 27,
+    R28 = 28,
+    R29 = 29,
+    R30 = 30,
+    R31 = 31,
+    zero = 0,
+    at = 1,
+    v0 = 2,
+    v1 = 3,
+    a0 = 4,
+    a1 = 5,
+    a2 = 6,
+    a3 = 7,
+    t0 = 8,
+    t1 = 9,
+    t2 = 10,
+    t3 = 11,
+    t4 = 12,
+    t5 = 13,
+    t6 = 14,
+    t7 = 15,
+    s0 = 16,
+    s1 = 17,
+    s2 = 18,
+    s3 = 19,
+    s4 = 20,
+    s5 = 21,
+    s6 = 22,
+    s7 = 23,
+    t8 = 24,
+    t9 = 25,
+    k0 = 26,
+    k1 = 27,
+    gp = 28,
+    sp = 29,
+    fp = 30,
+    s8 = 30,
+    ra = 31,
+};
+
+enum class Cop0RegAlias : uint8_t {
+    BPC = 3,
+    BDA = 5,
+    JUMPDEST = 6,
+    DCIC = 7,
+    BadVaddr = 8,
+    BDAM = 9,
+    BPCM = 11,
+    SR = 12,
+    CAUSE = 13,
+    EPC = 14,
+    PRID = 15,
+};
+
 struct Instruction {
     uint32_t whole{0};
 
@@ -0,0 +1,75 @@
+#include <cstring>
+#include <fstream>
+
+#include "cpu.h"
+#include "log.h"
+#include "psexe.h"
+
+namespace {
+    // Whether size bytes from addr are all in one copy of main RAM
+    bool inRAM(uint32_t addr, uint32_t size) {
+        // KUSEG, KSEG0 and KSEG1 see the 2 MiB of RAM mirrored across their first 8 MiB
+        const uint32_t segment = addr >> 29;
+        const uint32_t physical = addr & 0x1fffffff;
+        if((segment != 0 && segment != 4 && segment != 5) || physical >= 0x00800000)
+            return false;
+        return physical % memory_size + static_cast<uint64_t>(size) <= memory_size;
+    }
+} // Anonymous namespace
+
+bool parsePsExe(const uint8_t* data, size_t size, PsExe& exe) {
+    if(size < psexe_header_size || std::memcmp(data, psexe_magic, sizeof(psexe_magic)) != 0) {
+        LOG("PS-X EXE: Bad header\n");
+        return false;
+    }
+
+    exe.pc0 = readLE<uint32_t>(data + 0x10);
+    exe.gp0 = readLE<uint32_t>(data + 0x14);
+    exe.text_addr = readLE<uint32_t>(data + 0x18);
+    const uint32_t text_size = readLE<uint32_t>(data + 0x1c);
+    exe.bss_addr = readLE<uint32_t>(data + 0x28);
+    exe.bss_size = readLE<uint32_t>(data + 0x2c);
+    exe.stack_addr = readLE<uint32_t>(data + 0x30);
+    exe.stack_size = readLE<uint32_t>(data + 0x34);
+
+    if(size - psexe_header_size < text_size) {
+        LOG("PS-X EXE: Text of {:#x} bytes, but only {:#x} in the file\n", text_size, size - psexe_header_size);
+        return false;
+    }
+    if(!inRAM(exe.text_addr, text_size) || (exe.bss_size && !inRAM(exe.bss_addr, exe.bss_size))) {
+        LOG("PS-X EXE: Text at {:#x} or BSS at {:#x} isn't in RAM\n", exe.text_addr, exe.bss_addr);
+        return false;
+    }
+    exe.text.assign(data + psexe_header_size, data + psexe_header_size + text_size);
+    return true;
+}
+
+bool readPsExe(const std::string& path, PsExe& exe) {
+    std::ifstream file(path, std::ios::in | std::ios::binary | std::ios::ate);
+    if(!file) {
+        LOG("PS-X EXE: Can't open {}\n", path);
+        return false;
+    }
+    std::vector<uint8_t> data(static_cast<size_t>(file.tellg()));
+    file.seekg(0);
+    if(!file.read(reinterpret_cast<char*>(data.data()), data.size())) {
+        LOG("PS-X EXE: Failed to read {}\n", path);
+        return false;
+    }
+    return parsePsExe(data.data(), data.size(), exe);
+}
+
+void sideloadPsExe(CPU& cpu, const PsExe& exe) {
+    cpu.writeRAM(exe.text_addr, exe.text.data(), exe.text.size());
+    if(exe.bss_size) {
+        const std::vector<uint8_t> zeros(exe.bss_size, 0);
+        cpu.writeRAM(exe.bss_addr, zeros.data(), zeros.size());
+    }
+
+    const uint32_t stack = exe.stack_addr ? exe.stack_addr + exe.stack_size : psexe_default_stack;
+    cpu.setRegister(RegAlias::gp, exe.gp0);
+    cpu.setRegister(RegAlias::sp, stack);
+    cpu.setRegister(RegAlias::fp, stack);
+    cpu.jumpTo(exe.pc0);
+    LOG("PS-X EXE: Loaded {:#x} bytes at {:#x}, starting at {:#x}\n", exe.text.size(), exe.text_addr, exe.pc0);
+}
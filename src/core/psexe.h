@@ -0,0 +1,46 @@
+#ifndef PSEXE_H
+#define PSEXE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+class CPU;
+
+// PS-X EXE, the executable format of the BIOS and of homebrew. A 0x800
+// byte header, then the text segment loaded at t_addr:
+//
+//   0x00  "PS-X EXE" magic
+//   0x10  pc0, the entry point
+//   0x14  gp0
+//   0x18  t_addr, 0x1c t_size
+//   0x28  b_addr, 0x2c b_size, zeroed before starting
+//   0x30  s_addr, 0x34 s_size, the stack, if s_addr isn't 0
+//
+// Numbers are little endian.
+constexpr char psexe_magic[8] = {'P', 'S', '-', 'X', ' ', 'E', 'X', 'E'};
+constexpr uint32_t psexe_header_size = 0x800;
+// Where the BIOS puts the stack when the executable doesn't say
+constexpr uint32_t psexe_default_stack = 0x801fff00;
+
+struct PsExe {
+    uint32_t pc0 = 0;
+    uint32_t gp0 = 0;
+    uint32_t text_addr = 0;
+    std::vector<uint8_t> text;
+    uint32_t bss_addr = 0;
+    uint32_t bss_size = 0;
+    uint32_t stack_addr = 0;
+    uint32_t stack_size = 0;
+};
+
+// Both log and return false if it isn't an executable that fits in RAM
+bool parsePsExe(const uint8_t* data, size_t size, PsExe& exe);
+bool readPsExe(const std::string& path, PsExe& exe);
+
+// Puts exe in RAM and starts it the way the BIOS would, without running
+// any of the BIOS. Call it on a fresh CPU, or after runBoot to have the
+// kernel initialized first.
+void sideloadPsExe(CPU& cpu, const PsExe& exe);
+
+#endif // PSEXE_H
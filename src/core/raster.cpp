@@ -0,0 +1,515 @@
+#include <algorithm>
+
+#include "raster.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define RASTER_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// The vector kernels are compiled for their instruction set whatever the
+// flags of the rest of the build, and only called once the host is known
+// to support it. MSVC takes the intrinsics without being told.
+#if defined(__GNUC__) || defined(__clang__)
+#define RASTER_TARGET(isa) __attribute__((target(isa)))
+#else
+#define RASTER_TARGET(isa)
+#endif
+
+namespace {
+    // Added to the 8 bit colors before they're cut down to 5 bits
+    constexpr int8_t dither_table[4][4] = {
+        {-4, 0, -3, 1},
+        {2, -2, 3, -1},
+        {-3, 1, -4, 0},
+        {3, -1, 2, -2},
+    };
+
+    // An attribute i pixels into a span, wrapping like the 32 bit lanes
+    // of the vector kernels do
+    int32_t attribAt(int32_t start, int32_t step, uint32_t i) {
+        return static_cast<int32_t>(static_cast<uint32_t>(start) + i * static_cast<uint32_t>(step));
+    }
+
+    int32_t clamp8(int32_t c) {
+        return std::clamp(c, 0, 255);
+    }
+
+    // u and v are 8 bit coordinates in the texture page
+    uint16_t fetchTexel(const TextureSource& tex, uint32_t u, uint32_t v) {
+        u = (u & tex.and_u) | tex.or_u;
+        v = (v & tex.and_v) | tex.or_v;
+        if(tex.decoded)
+            return tex.decoded[v << 8 | u];
+        const uint16_t* row = tex.vram + ((tex.page_y + v) & (vram_height - 1)) * vram_width;
+        uint32_t index;
+        switch(tex.depth) {
+        case TextureDepth::Bits4:
+            index = (row[(tex.page_x + u / 4) & (vram_width - 1)] >> (4 * (u & 3))) & 0xf;
+            break;
+        case TextureDepth::Bits8:
+            index = (row[(tex.page_x + u / 2) & (vram_width - 1)] >> (8 * (u & 1))) & 0xff;
+            break;
+        default:
+            return row[(tex.page_x + u) & (vram_width - 1)];
+        }
+        return tex.vram[tex.clut_y * vram_width + ((tex.clut_x + index) & (vram_width - 1))];
+    }
+
+    // r, g and b are the interpolated colors as integers, dither is 0
+    // unless the primitive is dithered
+    void shadePixel(const SpanSetup& setup, uint16_t& pixel, uint16_t texel, int32_t r, int32_t g, int32_t b,
+                    int32_t dither) {
+        if(setup.check_mask && (pixel & 0x8000))
+            return;
+        bool blend = setup.semi_transparent;
+        uint16_t mask = setup.set_mask;
+        if(setup.textured) {
+            // Fully transparent
+            if(!texel)
+                return;
+            blend = blend && (texel & 0x8000);
+            mask |= texel & 0x8000;
+        }
+
+        const int32_t shade[3] = {r, g, b};
+        uint32_t color[3];
+        for(int c = 0; c < 3; ++c) {
+            const uint32_t tex = (texel >> (5 * c)) & 31;
+            if(setup.textured && setup.raw_texture) {
+                color[c] = tex;
+                continue;
+            }
+            int32_t m = clamp8(shade[c]);
+            if(setup.textured)
+                m = std::min<int32_t>((tex * m) >> 4, 255);
+            color[c] = static_cast<uint32_t>(clamp8(m + dither)) >> 3;
+        }
+        if(blend) {
+            for(int c = 0; c < 3; ++c) {
+                const uint32_t back = (pixel >> (5 * c)) & 31;
+                switch(setup.blend_mode) {
+                case 0:
+                    color[c] = (back + color[c]) >> 1;
+                    break;
+                case 1:
+                    color[c] = std::min(back + color[c], 31u);
+                    break;
+                case 2:
+                    color[c] = back > color[c] ? back - color[c] : 0;
+                    break;
+                default:
+                    color[c] = std::min(back + color[c] / 4, 31u);
+                    break;
+                }
+            }
+        }
+        pixel = static_cast<uint16_t>(color[0] | color[1] << 5 | color[2] << 10 | mask);
+    }
+
+    // Pixel i of a span, the reference the vector kernels follow and
+    // finish their spans with
+    void drawPixel(const SpanSetup& setup, uint16_t* dst, int32_t x, int32_t y, uint32_t i,
+                   const SpanAttribs& start, const SpanAttribs& step) {
+        uint16_t texel = 0;
+        if(setup.textured) {
+            const uint32_t u = (attribAt(start.u, step.u, i) >> raster_frac) & 0xff;
+            const uint32_t v = (attribAt(start.v, step.v, i) >> raster_frac) & 0xff;
+            texel = fetchTexel(setup.texture, u, v);
+        }
+        const int32_t dither = setup.dither ? dither_table[y & 3][(x + i) & 3] : 0;
+        shadePixel(setup, dst[i], texel, attribAt(start.r, step.r, i) >> raster_frac,
+                   attribAt(start.g, step.g, i) >> raster_frac, attribAt(start.b, step.b, i) >> raster_frac, dither);
+    }
+
+    // Spans of a single color are a plain fill in every kernel
+    bool fillSpan(const SpanSetup& setup, uint16_t* dst, uint32_t count, const SpanAttribs& start,
+                  const SpanAttribs& step) {
+        const bool flat = !step.r && !step.g && !step.b;
+        if(!flat || setup.textured || setup.semi_transparent || setup.check_mask || setup.dither)
+            return false;
+        uint16_t pixel = 0;
+        shadePixel(setup, pixel, 0, start.r >> raster_frac, start.g >> raster_frac, start.b >> raster_frac, 0);
+        std::fill_n(dst, count, pixel);
+        return true;
+    }
+
+    void drawSpanScalar(const SpanSetup& setup, uint16_t* dst, int32_t x, int32_t y, uint32_t count,
+                        const SpanAttribs& start, const SpanAttribs& step) {
+        if(fillSpan(setup, dst, count, start, step))
+            return;
+        for(uint32_t i = 0; i < count; ++i) {
+            drawPixel(setup, dst, x, y, i, start, step);
+        }
+    }
+
+#ifdef RASTER_X86
+    // Whether columns [x, x + count) overlap [first, first + width), which
+    // can wrap around the right edge of VRAM
+    bool columnsOverlap(int32_t x, uint32_t count, uint32_t first, uint32_t width) {
+        const int32_t end = x + static_cast<int32_t>(count);
+        for(const int32_t base : {static_cast<int32_t>(first), static_cast<int32_t>(first - vram_width)}) {
+            if(x < base + static_cast<int32_t>(width) && base < end)
+                return true;
+        }
+        return false;
+    }
+
+    // A span drawn over its own texture page or CLUT reads texels it wrote
+    // itself. The vector kernels draw those pixel by pixel, so they see the
+    // same texels as the scalar kernel whatever the width of their steps.
+    bool readsOwnPixels(const SpanSetup& setup, int32_t x, int32_t y, uint32_t count) {
+        if(!setup.textured)
+            return false;
+        const TextureSource& tex = setup.texture;
+        const uint32_t row = static_cast<uint32_t>(y);
+        uint32_t page_width;
+        switch(tex.depth) {
+        case TextureDepth::Bits4:
+            page_width = 64;
+            break;
+        case TextureDepth::Bits8:
+            page_width = 128;
+            break;
+        default:
+            page_width = 256;
+            break;
+        }
+        if(row >= tex.page_y && row < tex.page_y + 256 && columnsOverlap(x, count, tex.page_x, page_width))
+            return true;
+        return tex.depth != TextureDepth::Bits15 && row == tex.clut_y &&
+               columnsOverlap(x, count, tex.clut_x, tex.depth == TextureDepth::Bits4 ? 16 : 256);
+    }
+
+    // SSE4.1, 8 pixels at a time in 16 bit lanes
+
+    // start + (i + lane) * step for 4 lanes
+    RASTER_TARGET("sse4.1") inline __m128i lanes4(int32_t start, int32_t step, uint32_t i) {
+        const __m128i index = _mm_add_epi32(_mm_set1_epi32(static_cast<int32_t>(i)), _mm_setr_epi32(0, 1, 2, 3));
+        return _mm_add_epi32(_mm_set1_epi32(start), _mm_mullo_epi32(index, _mm_set1_epi32(step)));
+    }
+
+    // Integer part of 8 pixels of an attribute, clamped to [0, 65535]
+    RASTER_TARGET("sse4.1") inline __m128i attrib8(int32_t start, int32_t step, uint32_t i) {
+        return _mm_packus_epi32(_mm_srai_epi32(lanes4(start, step, i), raster_frac),
+                                _mm_srai_epi32(lanes4(start, step, i + 4), raster_frac));
+    }
+
+    RASTER_TARGET("sse4.1") inline __m128i shadeChannel8(const SpanSetup& setup, __m128i shade, __m128i tex,
+                                                          __m128i dither) {
+        if(setup.textured && setup.raw_texture)
+            return tex;
+        const __m128i max = _mm_set1_epi16(255);
+        __m128i m = _mm_min_epu16(shade, max);
+        if(setup.textured)
+            m = _mm_min_epu16(_mm_srli_epi16(_mm_mullo_epi16(tex, m), 4), max);
+        m = _mm_min_epi16(_mm_max_epi16(_mm_add_epi16(m, dither), _mm_setzero_si128()), max);
+        return _mm_srli_epi16(m, 3);
+    }
+
+    RASTER_TARGET("sse4.1") inline __m128i blendChannel8(uint8_t mode, __m128i back, __m128i front) {
+        const __m128i max = _mm_set1_epi16(31);
+        switch(mode) {
+        case 0:
+            return _mm_srli_epi16(_mm_add_epi16(back, front), 1);
+        case 1:
+            return _mm_min_epi16(_mm_add_epi16(back, front), max);
+        case 2:
+            return _mm_subs_epu16(back, front);
+        default:
+            return _mm_min_epi16(_mm_add_epi16(back, _mm_srli_epi16(front, 2)), max);
+        }
+    }
+
+    RASTER_TARGET("sse4.1") void drawSpanSse41(const SpanSetup& setup, uint16_t* dst, int32_t x, int32_t y,
+                                               uint32_t count, const SpanAttribs& start, const SpanAttribs& step) {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i ones = _mm_set1_epi16(-1);
+        const __m128i low5 = _mm_set1_epi16(31);
+        const __m128i mask_bit = _mm_set1_epi16(static_cast<int16_t>(0x8000));
+        // Each step starts a multiple of 4 pixels into the span, so they all
+        // get the same pattern
+        const int8_t* d = dither_table[y & 3];
+        const __m128i dither = setup.dither
+            ? _mm_setr_epi16(d[x & 3], d[(x + 1) & 3], d[(x + 2) & 3], d[(x + 3) & 3],
+                             d[x & 3], d[(x + 1) & 3], d[(x + 2) & 3], d[(x + 3) & 3])
+            : zero;
+
+        if(fillSpan(setup, dst, count, start, step))
+            return;
+        if(readsOwnPixels(setup, x, y, count)) {
+            drawSpanScalar(setup, dst, x, y, count, start, step);
+            return;
+        }
+        uint32_t i = 0;
+        for(; i + 8 <= count; i += 8) {
+            __m128i* out = reinterpret_cast<__m128i*>(dst + i);
+            const __m128i back = _mm_loadu_si128(out);
+            __m128i write = ones;
+            if(setup.check_mask)
+                write = _mm_andnot_si128(_mm_srai_epi16(back, 15), write);
+
+            // No gathers before AVX2, the texels are looked up one by one
+            __m128i texel = zero;
+            __m128i blend = setup.semi_transparent ? ones : zero;
+            __m128i mask = _mm_set1_epi16(static_cast<int16_t>(setup.set_mask));
+            if(setup.textured) {
+                alignas(16) uint16_t texels[8];
+                for(uint32_t k = 0; k < 8; ++k) {
+                    texels[k] = fetchTexel(setup.texture, (attribAt(start.u, step.u, i + k) >> raster_frac) & 0xff,
+                                           (attribAt(start.v, step.v, i + k) >> raster_frac) & 0xff);
+                }
+                texel = _mm_load_si128(reinterpret_cast<const __m128i*>(texels));
+                write = _mm_andnot_si128(_mm_cmpeq_epi16(texel, zero), write);
+                blend = _mm_and_si128(blend, _mm_srai_epi16(texel, 15));
+                mask = _mm_or_si128(mask, _mm_and_si128(texel, mask_bit));
+            }
+
+            __m128i r = shadeChannel8(setup, attrib8(start.r, step.r, i), _mm_and_si128(texel, low5), dither);
+            __m128i g = shadeChannel8(setup, attrib8(start.g, step.g, i),
+                                      _mm_and_si128(_mm_srli_epi16(texel, 5), low5), dither);
+            __m128i b = shadeChannel8(setup, attrib8(start.b, step.b, i),
+                                      _mm_and_si128(_mm_srli_epi16(texel, 10), low5), dither);
+            if(setup.semi_transparent) {
+                const __m128i back_r = _mm_and_si128(back, low5);
+                const __m128i back_g = _mm_and_si128(_mm_srli_epi16(back, 5), low5);
+                const __m128i back_b = _mm_and_si128(_mm_srli_epi16(back, 10), low5);
+                r = _mm_blendv_epi8(r, blendChannel8(setup.blend_mode, back_r, r), blend);
+                g = _mm_blendv_epi8(g, blendChannel8(setup.blend_mode, back_g, g), blend);
+                b = _mm_blendv_epi8(b, blendChannel8(setup.blend_mode, back_b, b), blend);
+            }
+
+            const __m128i pixel = _mm_or_si128(_mm_or_si128(r, _mm_slli_epi16(g, 5)),
+                                               _mm_or_si128(_mm_slli_epi16(b, 10), mask));
+            _mm_storeu_si128(out, _mm_blendv_epi8(back, pixel, write));
+        }
+        for(; i < count; ++i) {
+            drawPixel(setup, dst, x, y, i, start, step);
+        }
+    }
+
+    // AVX2, 16 pixels at a time in 16 bit lanes
+
+    RASTER_TARGET("avx2") inline __m256i lanes8(int32_t start, int32_t step, uint32_t i) {
+        const __m256i index = _mm256_add_epi32(_mm256_set1_epi32(static_cast<int32_t>(i)),
+                                               _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+        return _mm256_add_epi32(_mm256_set1_epi32(start), _mm256_mullo_epi32(index, _mm256_set1_epi32(step)));
+    }
+
+    // Two vectors of 32 bit lanes to one of 16 bit lanes in the same
+    // order, clamped to [0, 65535]. The pack works within 128 bit halves.
+    RASTER_TARGET("avx2") inline __m256i pack16(__m256i low, __m256i high) {
+        return _mm256_permute4x64_epi64(_mm256_packus_epi32(low, high), 0xd8);
+    }
+
+    RASTER_TARGET("avx2") inline __m256i attrib16(int32_t start, int32_t step, uint32_t i) {
+        return pack16(_mm256_srai_epi32(lanes8(start, step, i), raster_frac),
+                      _mm256_srai_epi32(lanes8(start, step, i + 8), raster_frac));
+    }
+
+    // Integer part of 8 pixels of a texture coordinate
+    RASTER_TARGET("avx2") inline __m256i coord8(int32_t start, int32_t step, uint32_t i) {
+        return _mm256_srai_epi32(lanes8(start, step, i), raster_frac);
+    }
+
+    // Texels of 8 pixels, given the integer parts of their coordinates
+    RASTER_TARGET("avx2") inline __m256i fetchTexels8(const TextureSource& tex, __m256i u, __m256i v) {
+        const __m256i low8 = _mm256_set1_epi32(0xff);
+        const __m256i low16 = _mm256_set1_epi32(0xffff);
+        const __m256i columns = _mm256_set1_epi32(vram_width - 1);
+        const int* base = reinterpret_cast<const int*>(tex.vram);
+        u = _mm256_or_si256(_mm256_and_si256(u, _mm256_set1_epi32(tex.and_u & 0xff)), _mm256_set1_epi32(tex.or_u));
+        v = _mm256_or_si256(_mm256_and_si256(v, _mm256_set1_epi32(tex.and_v & 0xff)), _mm256_set1_epi32(tex.or_v));
+        u = _mm256_and_si256(u, low8);
+        v = _mm256_and_si256(v, low8);
+        if(tex.decoded) {
+            const __m256i texel = _mm256_or_si256(_mm256_slli_epi32(v, 8), u);
+            return _mm256_and_si256(_mm256_i32gather_epi32(reinterpret_cast<const int*>(tex.decoded), texel, 2), low16);
+        }
+        const __m256i row = _mm256_slli_epi32(
+            _mm256_and_si256(_mm256_add_epi32(v, _mm256_set1_epi32(tex.page_y)), _mm256_set1_epi32(vram_height - 1)),
+            10);
+        const __m256i page_x = _mm256_set1_epi32(tex.page_x);
+
+        __m256i index;
+        switch(tex.depth) {
+        case TextureDepth::Bits4: {
+            const __m256i column = _mm256_and_si256(_mm256_add_epi32(_mm256_srli_epi32(u, 2), page_x), columns);
+            const __m256i word = _mm256_i32gather_epi32(base, _mm256_add_epi32(row, column), 2);
+            const __m256i shift = _mm256_slli_epi32(_mm256_and_si256(u, _mm256_set1_epi32(3)), 2);
+            index = _mm256_and_si256(_mm256_srlv_epi32(word, shift), _mm256_set1_epi32(0xf));
+            break;
+        }
+        case TextureDepth::Bits8: {
+            const __m256i column = _mm256_and_si256(_mm256_add_epi32(_mm256_srli_epi32(u, 1), page_x), columns);
+            const __m256i word = _mm256_i32gather_epi32(base, _mm256_add_epi32(row, column), 2);
+            const __m256i shift = _mm256_slli_epi32(_mm256_and_si256(u, _mm256_set1_epi32(1)), 3);
+            index = _mm256_and_si256(_mm256_srlv_epi32(word, shift), low8);
+            break;
+        }
+        default: {
+            const __m256i column = _mm256_and_si256(_mm256_add_epi32(u, page_x), columns);
+            return _mm256_and_si256(_mm256_i32gather_epi32(base, _mm256_add_epi32(row, column), 2), low16);
+        }
+        }
+        const __m256i clut = _mm256_add_epi32(
+            _mm256_set1_epi32(tex.clut_y * vram_width),
+            _mm256_and_si256(_mm256_add_epi32(index, _mm256_set1_epi32(tex.clut_x)), columns));
+        return _mm256_and_si256(_mm256_i32gather_epi32(base, clut, 2), low16);
+    }
+
+    RASTER_TARGET("avx2") inline __m256i shadeChannel16(const SpanSetup& setup, __m256i shade, __m256i tex,
+                                                         __m256i dither) {
+        if(setup.textured && setup.raw_texture)
+            return tex;
+        const __m256i max = _mm256_set1_epi16(255);
+        __m256i m = _mm256_min_epu16(shade, max);
+        if(setup.textured)
+            m = _mm256_min_epu16(_mm256_srli_epi16(_mm256_mullo_epi16(tex, m), 4), max);
+        m = _mm256_min_epi16(_mm256_max_epi16(_mm256_add_epi16(m, dither), _mm256_setzero_si256()), max);
+        return _mm256_srli_epi16(m, 3);
+    }
+
+    RASTER_TARGET("avx2") inline __m256i blendChannel16(uint8_t mode, __m256i back, __m256i front) {
+        const __m256i max = _mm256_set1_epi16(31);
+        switch(mode) {
+        case 0:
+            return _mm256_srli_epi16(_mm256_add_epi16(back, front), 1);
+        case 1:
+            return _mm256_min_epi16(_mm256_add_epi16(back, front), max);
+        case 2:
+            return _mm256_subs_epu16(back, front);
+        default:
+            return _mm256_min_epi16(_mm256_add_epi16(back, _mm256_srli_epi16(front, 2)), max);
+        }
+    }
+
+    RASTER_TARGET("avx2") void drawSpanAvx2(const SpanSetup& setup, uint16_t* dst, int32_t x, int32_t y,
+                                            uint32_t count, const SpanAttribs& start, const SpanAttribs& step) {
+        const __m256i zero = _mm256_setzero_si256();
+        const __m256i ones = _mm256_set1_epi16(-1);
+        const __m256i low5 = _mm256_set1_epi16(31);
+        const __m256i mask_bit = _mm256_set1_epi16(static_cast<int16_t>(0x8000));
+        const int8_t* d = dither_table[y & 3];
+        const int16_t d0 = d[x & 3], d1 = d[(x + 1) & 3], d2 = d[(x + 2) & 3], d3 = d[(x + 3) & 3];
+        const __m256i dither = setup.dither
+            ? _mm256_setr_epi16(d0, d1, d2, d3, d0, d1, d2, d3, d0, d1, d2, d3, d0, d1, d2, d3)
+            : zero;
+
+        if(fillSpan(setup, dst, count, start, step))
+            return;
+        if(readsOwnPixels(setup, x, y, count)) {
+            drawSpanScalar(setup, dst, x, y, count, start, step);
+            return;
+        }
+        uint32_t i = 0;
+        for(; i + 16 <= count; i += 16) {
+            __m256i* out = reinterpret_cast<__m256i*>(dst + i);
+            const __m256i back = _mm256_loadu_si256(out);
+            __m256i write = ones;
+            if(setup.check_mask)
+                write = _mm256_andnot_si256(_mm256_srai_epi16(back, 15), write);
+
+            __m256i texel = zero;
+            __m256i blend = setup.semi_transparent ? ones : zero;
+            __m256i mask = _mm256_set1_epi16(static_cast<int16_t>(setup.set_mask));
+            if(setup.textured) {
+                texel = pack16(fetchTexels8(setup.texture, coord8(start.u, step.u, i), coord8(start.v, step.v, i)),
+                               fetchTexels8(setup.texture, coord8(start.u, step.u, i + 8),
+                                            coord8(start.v, step.v, i + 8)));
+                write = _mm256_andnot_si256(_mm256_cmpeq_epi16(texel, zero), write);
+                blend = _mm256_and_si256(blend, _mm256_srai_epi16(texel, 15));
+                mask = _mm256_or_si256(mask, _mm256_and_si256(texel, mask_bit));
+            }
+
+            __m256i r = shadeChannel16(setup, attrib16(start.r, step.r, i), _mm256_and_si256(texel, low5), dither);
+            __m256i g = shadeChannel16(setup, attrib16(start.g, step.g, i),
+                                       _mm256_and_si256(_mm256_srli_epi16(texel, 5), low5), dither);
+            __m256i b = shadeChannel16(setup, attrib16(start.b, step.b, i),
+                                       _mm256_and_si256(_mm256_srli_epi16(texel, 10), low5), dither);
+            if(setup.semi_transparent) {
+                const __m256i back_r = _mm256_and_si256(back, low5);
+                const __m256i back_g = _mm256_and_si256(_mm256_srli_epi16(back, 5), low5);
+                const __m256i back_b = _mm256_and_si256(_mm256_srli_epi16(back, 10), low5);
+                r = _mm256_blendv_epi8(r, blendChannel16(setup.blend_mode, back_r, r), blend);
+                g = _mm256_blendv_epi8(g, blendChannel16(setup.blend_mode, back_g, g), blend);
+                b = _mm256_blendv_epi8(b, blendChannel16(setup.blend_mode, back_b, b), blend);
+            }
+
+            const __m256i pixel = _mm256_or_si256(_mm256_or_si256(r, _mm256_slli_epi16(g, 5)),
+                                                  _mm256_or_si256(_mm256_slli_epi16(b, 10), mask));
+            _mm256_storeu_si256(out, _mm256_blendv_epi8(back, pixel, write));
+        }
+        // The tail goes through SSE code, which pays for every instruction
+        // while the upper halves are dirty, here and after returning
+        _mm256_zeroupper();
+        for(; i < count; ++i) {
+            drawPixel(setup, dst, x, y, i, start, step);
+        }
+    }
+#endif // RASTER_X86
+
+    SimdLevel detectSimdLevel() {
+#ifdef RASTER_X86
+#if defined(__GNUC__) || defined(__clang__)
+        __builtin_cpu_init();
+        if(__builtin_cpu_supports("avx2"))
+            return SimdLevel::AVX2;
+        if(__builtin_cpu_supports("sse4.1"))
+            return SimdLevel::SSE41;
+#elif defined(_MSC_VER)
+        int info[4];
+        __cpuid(info, 0);
+        const int max_leaf = info[0];
+        __cpuid(info, 1);
+        const bool sse41 = info[2] & (1 << 19);
+        // AVX state has to be saved by the OS too
+        const bool avx = (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (_xgetbv(0) & 6) == 6;
+        if(avx && max_leaf >= 7) {
+            __cpuidex(info, 7, 0);
+            if(info[1] & (1 << 5))
+                return SimdLevel::AVX2;
+        }
+        if(sse41)
+            return SimdLevel::SSE41;
+#endif
+#endif
+        return SimdLevel::Scalar;
+    }
+} // Anonymous namespace
+
+SimdLevel hostSimdLevel() {
+    static const SimdLevel level = detectSimdLevel();
+    return level;
+}
+
+SimdLevel supportedSimdLevel(SimdLevel level) {
+    return std::min(level, hostSimdLevel());
+}
+
+SpanKernel spanKernel(SimdLevel level) {
+    switch(supportedSimdLevel(level)) {
+#ifdef RASTER_X86
+    case SimdLevel::AVX2:
+        return &drawSpanAvx2;
+    case SimdLevel::SSE41:
+        return &drawSpanSse41;
+#endif
+    default:
+        return &drawSpanScalar;
+    }
+}
+
+const char* simdLevelName(SimdLevel level) {
+    switch(level) {
+    case SimdLevel::AVX2:
+        return "avx2";
+    case SimdLevel::SSE41:
+        return "sse4.1";
+    default:
+        return "scalar";
+    }
+}
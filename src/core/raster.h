@@ -0,0 +1,88 @@
+#ifndef RASTER_H
+#define RASTER_H
+
+#include <cstddef>
+#include <cstdint>
+
+// VRAM is 1024x512 pixels of 16 bits, 1 MiB
+constexpr uint32_t vram_width = 1024;
+constexpr uint32_t vram_height = 512;
+constexpr uint32_t vram_pixels = vram_width * vram_height;
+// Allocated past the last pixel, so the gathers reading 32 bits at a
+// time can load the last one
+constexpr uint32_t vram_padding = 2;
+
+// Fractional bits of the colors and texture coordinates interpolated
+// along spans
+constexpr int raster_frac = 12;
+
+// Instruction sets the span kernels are written for
+enum class SimdLevel {
+    Scalar,
+    SSE41,
+    AVX2,
+};
+
+enum class TextureDepth : uint8_t {
+    Bits4,
+    Bits8,
+    Bits15,
+};
+
+// Where the texels of a primitive come from, in halfword coordinates
+struct TextureSource {
+    const uint16_t* vram = nullptr;
+    uint32_t page_x = 0;
+    uint32_t page_y = 0;
+    uint32_t clut_x = 0;
+    uint32_t clut_y = 0;
+    TextureDepth depth = TextureDepth::Bits4;
+    // 4 and 8 bit pages already through their CLUT, texel (u, v) at
+    // v * 256 + u, see TextureCache. Null to decode from VRAM.
+    const uint16_t* decoded = nullptr;
+    // The texture window, applied as (u & and_u) | or_u
+    uint8_t and_u = 0xff;
+    uint8_t or_u = 0;
+    uint8_t and_v = 0xff;
+    uint8_t or_v = 0;
+};
+
+// What a primitive does to each pixel, the same for all of its spans
+struct SpanSetup {
+    bool textured = false;
+    // Texels aren't modulated by the color
+    bool raw_texture = false;
+    bool semi_transparent = false;
+    bool dither = false;
+    // Pixels with the mask bit set are left alone
+    bool check_mask = false;
+    // 0: B/2+F/2, 1: B+F, 2: B-F, 3: B+F/4
+    uint8_t blend_mode = 0;
+    // Or'ed into every pixel drawn
+    uint16_t set_mask = 0;
+    TextureSource texture;
+};
+
+// Color and texture coordinates with raster_frac fractional bits, either
+// at the first pixel of a span or as the step from one pixel to the next
+struct SpanAttribs {
+    int32_t r = 0;
+    int32_t g = 0;
+    int32_t b = 0;
+    int32_t u = 0;
+    int32_t v = 0;
+};
+
+// Draws count pixels to the right of dst, which is pixel x of row y.
+// Every kernel gives the same pixels as the scalar one.
+using SpanKernel = void (*)(const SpanSetup& setup, uint16_t* dst, int32_t x, int32_t y, uint32_t count,
+                            const SpanAttribs& start, const SpanAttribs& step);
+
+// The best level this host supports
+SimdLevel hostSimdLevel();
+// Falls back to the best supported level below the one asked for
+SpanKernel spanKernel(SimdLevel level);
+SimdLevel supportedSimdLevel(SimdLevel level);
+const char* simdLevelName(SimdLevel level);
+
+#endif // RASTER_H
@@ -0,0 +1,407 @@
+#include <algorithm>
+#include <vector>
+
+#include "recompiler.h"
+#include "cpu.h"
+#include "log.h"
+#include "x64_emitter.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define RECOMPILER_X64
+#endif
+
+#ifdef RECOMPILER_X64
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+#endif
+
+namespace {
+#ifdef _WIN32
+    constexpr x64::Reg arg0 = x64::RCX;
+    constexpr x64::Reg arg1 = x64::RDX;
+#else
+    constexpr x64::Reg arg0 = x64::RDI;
+    constexpr x64::Reg arg1 = x64::RSI;
+#endif
+
+    uint8_t* allocateCode(size_t size) {
+#if !defined(RECOMPILER_X64)
+        return nullptr;
+#elif defined(_WIN32)
+        return static_cast<uint8_t*>(VirtualAlloc(nullptr, size, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE));
+#else
+        void* ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        return ptr == MAP_FAILED ? nullptr : static_cast<uint8_t*>(ptr);
+#endif
+    }
+
+    void freeCode(uint8_t* ptr, size_t size) {
+        if(!ptr)
+            return;
+#if defined(RECOMPILER_X64) && defined(_WIN32)
+        VirtualFree(ptr, 0, MEM_RELEASE);
+#elif defined(RECOMPILER_X64)
+        munmap(ptr, size);
+#endif
+    }
+
+    int32_t fieldOffset(const CPU& cpu, const void* field) {
+        return static_cast<int32_t>(static_cast<const uint8_t*>(field) - reinterpret_cast<const uint8_t*>(&cpu));
+    }
+} // Anonymous namespace
+
+Recompiler::Recompiler(CPU& cpu) : cpu(cpu) {
+    code_buffer = allocateCode(recompiler_code_size);
+    if(!code_buffer) {
+        LOG("Recompiler: Failed to allocate the code buffer\n");
+    }
+
+    r_offset = fieldOffset(cpu, cpu.R.data());
+    pc_offset = fieldOffset(cpu, &cpu.pc);
+    load_reg_offset = fieldOffset(cpu, &cpu.pending_load.first);
+    load_val_offset = fieldOffset(cpu, &cpu.pending_load.second);
+    sr_offset = fieldOffset(cpu, &cpu.Cop0R[static_cast<size_t>(Cop0RegAlias::SR)]);
+    code_pages_offset = fieldOffset(cpu, cpu.block_cache.codePages());
+    dirty_pages_offset = fieldOffset(cpu, cpu.dirty_pages.data());
+}
+
+Recompiler::~Recompiler() {
+    if(fault_handler_added)
+        Fastmem::removeFaultHandler(this);
+    freeCode(code_buffer, recompiler_code_size);
+}
+
+bool Recompiler::supported() {
+#ifdef RECOMPILER_X64
+    return true;
+#else
+    return false;
+#endif
+}
+
+void Recompiler::reset() {
+    code_used = 0;
+    fault_sites.clear();
+}
+
+bool Recompiler::interpretOp(CPU* cpu, const DecodedOp* op) {
+    cpu->execute(*op);
+    return cpu->running && !cpu->block_cache.invalidated();
+}
+
+void Recompiler::fetchNext(CPU* cpu) {
+    cpu->next_instruction_addr = cpu->pc;
+    cpu->next_instruction = cpu->load<uint32_t>(cpu->pc);
+}
+
+uintptr_t Recompiler::handleFault(void* context, uintptr_t host_pc) {
+    auto* self = static_cast<Recompiler*>(context);
+    const auto it = self->fault_sites.find(host_pc);
+    if(it == self->fault_sites.end())
+        return 0;
+    // Whatever the site hit isn't RAM or BIOS, most likely MMIO it will hit
+    // again, so it jumps straight to the slow path from now on
+    x64::Emitter::patchJmp(reinterpret_cast<uint8_t*>(host_pc), reinterpret_cast<const uint8_t*>(it->second));
+    return it->second;
+}
+
+bool Recompiler::compile(Block& block) {
+    using namespace x64;
+
+    if(!code_buffer)
+        return false;
+
+    Emitter e(code_buffer + code_used, recompiler_code_size - code_used);
+
+    const auto readReg = [&](Reg dst, uint8_t r) {
+        if(r)
+            e.mov(dst, RBX, r_offset + 4 * r);
+        else
+            e.alu(Alu::XOR, dst, dst);
+    };
+    const auto writeReg = [&](uint8_t r, Reg src) {
+        if(r)
+            e.mov(RBX, r_offset + 4 * r, src);
+    };
+    // Lands the load queued by the previous instruction, only emitted when
+    // one can be queued. Must come after the instruction read its operands
+    // and before it writes its result, which wins over the load. Clobbers
+    // ecx and edx.
+    bool load_pending = true;
+    const auto applyLoad = [&]() {
+        if(!load_pending)
+            return;
+        e.movzxByte(RCX, RBX, load_reg_offset);
+        e.test(RCX, RCX);
+        const Label no_load = e.jcc(Cond::E);
+        e.mov(RDX, RBX, load_val_offset);
+        e.movIndexed(RBX, RCX, r_offset, RDX);
+        e.movByteImm(RBX, load_reg_offset, 0);
+        e.movImm(RBX, load_val_offset, 0);
+        e.bind(no_load);
+    };
+    const auto callThunk = [&](const void* fn, const DecodedOp* op) {
+        e.mov64(arg0, RBX);
+        if(op)
+            e.mov64(arg1, reinterpret_cast<uint64_t>(op));
+        e.mov64(RAX, reinterpret_cast<uint64_t>(fn));
+        e.call(RAX);
+    };
+
+    std::vector<Label> exits;
+    // Runs the op through its interpreter handler, leaving the block if
+    // it stopped the CPU or invalidated code
+    const auto emitFallback = [&](const DecodedOp& op, size_t i, bool last) {
+        callThunk(reinterpret_cast<const void*>(&Recompiler::interpretOp), &op);
+        if(!last) {
+            e.testByte(RAX, RAX);
+            const Label keep_going = e.jcc(Cond::NE);
+            e.mov(RAX, static_cast<uint32_t>(i + 1));
+            exits.push_back(e.jmp());
+            e.bind(keep_going);
+        }
+    };
+
+    // Fastmem accesses, rbp holds the base of the guest address space.
+    // Anything that isn't a plain aligned access takes the fallback, as
+    // does any access that faults. The access is padded to fit a jmp,
+    // which replaces it once it faulted.
+    struct MemoryOp {
+        DecodedOp::Handler handler;
+        uint8_t size;
+        bool is_signed;
+        bool is_store;
+    };
+    static const MemoryOp memory_ops[] = {
+        {&CPU::opLB, 1, true, false},
+        {&CPU::opLBU, 1, false, false},
+        {&CPU::opLH, 2, true, false},
+        {&CPU::opLHU, 2, false, false},
+        {&CPU::opLW, 4, false, false},
+        {&CPU::opSB, 1, false, true},
+        {&CPU::opSH, 2, false, true},
+        {&CPU::opSW, 4, false, true},
+    };
+    const auto findMemoryOp = [&](const DecodedOp& op) -> const MemoryOp* {
+        for(const MemoryOp& mem : memory_ops) {
+            if(mem.handler == op.handler)
+                return &mem;
+        }
+        return nullptr;
+    };
+
+    // Only code using fastmem can fault, so only then is the handler needed
+    const bool use_fastmem = cpu.fastmem != nullptr;
+    if(use_fastmem && !fault_handler_added) {
+        Fastmem::addFaultHandler(code_buffer, recompiler_code_size, this, &Recompiler::handleFault);
+        fault_handler_added = true;
+    }
+    std::vector<std::pair<size_t, size_t>> new_fault_sites;
+    const auto padSite = [&](size_t site) {
+        for(size_t size = e.size() - site; size < Emitter::jmp_size; ++size) {
+            e.nop();
+        }
+    };
+    const auto emitMemory = [&](const DecodedOp& op, const MemoryOp& mem, size_t i, bool last) {
+        readReg(RAX, op.rs);
+        e.alu(Alu::ADD, RAX, static_cast<uint32_t>(op.simm));
+        e.testImm(RBX, sr_offset, 0x10000);
+        const Label isolated = e.jcc(Cond::NE);
+        std::vector<Label> slow;
+        if(mem.size > 1) {
+            e.testImm(RAX, mem.size - 1u);
+            slow.push_back(e.jcc(Cond::NE));
+        }
+
+        size_t site;
+        if(!mem.is_store) {
+            site = e.size();
+            if(mem.size == 1 && mem.is_signed)
+                e.movsxByteIndexed(RAX, RBP, RAX);
+            else if(mem.size == 1)
+                e.movzxByteIndexed(RAX, RBP, RAX);
+            else if(mem.size == 2 && mem.is_signed)
+                e.movsxWordIndexed(RAX, RBP, RAX);
+            else if(mem.size == 2)
+                e.movzxWordIndexed(RAX, RBP, RAX);
+            else
+                e.movLoadIndexed(RAX, RBP, RAX);
+            padSite(site);
+            applyLoad();
+            if(op.rt) {
+                e.movByteImm(RBX, load_reg_offset, op.rt);
+                e.mov(RBX, load_val_offset, RAX);
+            }
+        }
+        else {
+            // Stores to pages with compiled code need to invalidate it
+            static_assert(dirty_page_shift == block_page_shift, "Dirty and code pages share the index");
+            e.mov(RCX, RAX);
+            e.alu(Alu::AND, RCX, memory_size - 1u);
+            e.shr(RCX, block_page_shift);
+            e.cmpByteIndexed(RBX, RCX, code_pages_offset, 0);
+            slow.push_back(e.jcc(Cond::NE));
+            // Marked even if the store faults to the slow path, which is harmless
+            e.movByteImmIndexed(RBX, RCX, dirty_pages_offset, 1);
+            readReg(RDX, op.rt);
+            site = e.size();
+            if(mem.size == 1)
+                e.movByteStoreIndexed(RBP, RAX, RDX);
+            else if(mem.size == 2)
+                e.movWordStoreIndexed(RBP, RAX, RDX);
+            else
+                e.movStoreIndexed(RBP, RAX, RDX);
+            padSite(site);
+            applyLoad();
+        }
+        const Label done = e.jmp();
+
+        e.bind(isolated);
+        applyLoad();
+        const Label isolated_done = e.jmp();
+
+        for(const Label& label : slow) {
+            e.bind(label);
+        }
+        new_fault_sites.emplace_back(site, e.size());
+        emitFallback(op, i, last);
+        e.bind(done);
+        e.bind(isolated_done);
+    };
+
+    // Returns false if the op has to go through its interpreter handler
+    const auto emitNative = [&](const DecodedOp& op, uint32_t op_pc) {
+        const auto handler = op.handler;
+        if(handler == &CPU::opSLL) {
+            readReg(RAX, op.rt);
+            if(op.shamt)
+                e.shl(RAX, op.shamt);
+            applyLoad();
+            writeReg(op.rd, RAX);
+        }
+        else if(handler == &CPU::opOR || handler == &CPU::opADDU) {
+            readReg(RAX, op.rs);
+            if(op.rt)
+                e.alu(handler == &CPU::opOR ? Alu::OR : Alu::ADD, RAX, RBX, r_offset + 4 * op.rt);
+            applyLoad();
+            writeReg(op.rd, RAX);
+        }
+        else if(handler == &CPU::opSLTU) {
+            readReg(RAX, op.rs);
+            if(op.rt)
+                e.alu(Alu::CMP, RAX, RBX, r_offset + 4 * op.rt);
+            else
+                e.alu(Alu::CMP, RAX, 0u);
+            e.setcc(Cond::B, RAX);
+            e.movzxByte(RAX, RAX);
+            applyLoad();
+            writeReg(op.rd, RAX);
+        }
+        else if(handler == &CPU::opADDIU || handler == &CPU::opANDI || handler == &CPU::opORI) {
+            readReg(RAX, op.rs);
+            if(handler == &CPU::opADDIU)
+                e.alu(Alu::ADD, RAX, static_cast<uint32_t>(op.simm));
+            else
+                e.alu(handler == &CPU::opANDI ? Alu::AND : Alu::OR, RAX, op.imm);
+            applyLoad();
+            writeReg(op.rt, RAX);
+        }
+        else if(handler == &CPU::opLUI) {
+            applyLoad();
+            e.mov(RAX, op.imm << 16);
+            writeReg(op.rt, RAX);
+        }
+        else if(handler == &CPU::opJ || handler == &CPU::opJAL) {
+            // pc already points past the delay slot when the jump executes
+            const uint32_t next_pc = op_pc + 8;
+            const uint32_t target = (next_pc & 0xf0000000) | (op.instruction.getAddress() << 2);
+            applyLoad();
+            if(handler == &CPU::opJAL) {
+                e.mov(RAX, next_pc);
+                writeReg(static_cast<uint8_t>(RegAlias::ra), RAX);
+            }
+            e.movImm(RBX, pc_offset, target);
+        }
+        else if(handler == &CPU::opJR) {
+            readReg(RAX, op.rs);
+            applyLoad();
+            e.mov(RBX, pc_offset, RAX);
+        }
+        else if(handler == &CPU::opBNE) {
+            const uint32_t target = op_pc + 4 + (static_cast<uint32_t>(op.simm) << 2);
+            readReg(RAX, op.rs);
+            if(op.rt)
+                e.alu(Alu::CMP, RAX, RBX, r_offset + 4 * op.rt);
+            else
+                e.alu(Alu::CMP, RAX, 0u);
+            e.setcc(Cond::NE, RAX);
+            applyLoad();
+            e.testByte(RAX, RAX);
+            const Label not_taken = e.jcc(Cond::E);
+            e.movImm(RBX, pc_offset, target);
+            e.bind(not_taken);
+        }
+        else {
+            return false;
+        }
+        return true;
+    };
+
+    // uint32_t block(CPU* cpu), returns how many ops were executed
+    e.push(RBX);
+    e.push(RBP);
+    // Shadow space for win64 calls, also keeps the stack 16 byte aligned
+    e.subRsp(40);
+    e.mov64(RBX, arg0);
+    if(use_fastmem)
+        e.mov64(RBP, reinterpret_cast<uint64_t>(cpu.fastmem->base()));
+
+    const auto& ops = block.ops;
+    for(size_t i = 0; i < ops.size(); ++i) {
+        const DecodedOp& op = ops[i];
+        const bool last = i + 1 == ops.size();
+        const uint32_t op_pc = block.addr + 4 * static_cast<uint32_t>(i);
+
+        // Everything up to the last op was fetched when compiling the block
+        if(last)
+            callThunk(reinterpret_cast<const void*>(&Recompiler::fetchNext), nullptr);
+        e.aluMemImm8(Alu::ADD, RBX, pc_offset, 4);
+
+        if(emitNative(op, op_pc)) {
+            load_pending = false;
+            continue;
+        }
+
+        const MemoryOp* mem = use_fastmem ? findMemoryOp(op) : nullptr;
+        if(mem)
+            emitMemory(op, *mem, i, last);
+        else
+            emitFallback(op, i, last);
+        load_pending = true;
+    }
+
+    e.mov(RAX, static_cast<uint32_t>(ops.size()));
+    for(const Label& exit : exits) {
+        e.bind(exit);
+    }
+    e.addRsp(40);
+    e.pop(RBP);
+    e.pop(RBX);
+    e.ret();
+
+    if(e.overflowed())
+        return false;
+
+    const auto code_start = reinterpret_cast<uintptr_t>(e.begin());
+    for(const auto& [site, resume] : new_fault_sites) {
+        fault_sites[code_start + site] = code_start + resume;
+    }
+
+    block.code = reinterpret_cast<Block::CompiledCode>(e.begin());
+    // Keep blocks 16 byte aligned
+    code_used = std::min((code_used + e.size() + 15) & ~static_cast<size_t>(15), recompiler_code_size);
+    return true;
+}
@@ -0,0 +1,61 @@
+#ifndef RECOMPILER_H
+#define RECOMPILER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+
+#include "block_cache.h"
+
+class CPU;
+
+constexpr size_t recompiler_code_size = 16 * 1024 * 1024;
+
+// Translates blocks from the block cache into x86-64 code.
+// Simple ALU and branch instructions are emitted natively, everything
+// else calls back into the interpreter handler of the op, so the
+// interpreter stays the reference for their semantics.
+// With fastmem enabled aligned loads and stores access the host mapping
+// of the guest directly. An access that faults resumes on the interpreter
+// path and is patched to take it directly from then on.
+class Recompiler {
+public:
+    explicit Recompiler(CPU& cpu);
+    ~Recompiler();
+
+    Recompiler(const Recompiler&) = delete;
+    Recompiler& operator=(const Recompiler&) = delete;
+
+    // Whether native code can be generated and run on this host
+    static bool supported();
+
+    // Fills block.code. Returns false when the code buffer is full,
+    // in which case all blocks must be dropped and the buffer reset.
+    bool compile(Block& block);
+    void reset();
+
+private:
+    static bool interpretOp(CPU* cpu, const DecodedOp* op);
+    static void fetchNext(CPU* cpu);
+    static uintptr_t handleFault(void* context, uintptr_t host_pc);
+
+    CPU& cpu;
+    uint8_t* code_buffer = nullptr;
+    size_t code_used = 0;
+
+    // Host address of each fastmem access mapped to its slow path, the
+    // access is patched into a jump there when it faults
+    std::unordered_map<uintptr_t, uintptr_t> fault_sites;
+    bool fault_handler_added = false;
+
+    // Offsets of the CPU state from the CPU pointer the code receives
+    int32_t r_offset;
+    int32_t pc_offset;
+    int32_t load_reg_offset;
+    int32_t load_val_offset;
+    int32_t sr_offset;
+    int32_t code_pages_offset;
+    int32_t dirty_pages_offset;
+};
+
+#endif // RECOMPILER_H
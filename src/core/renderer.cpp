@@ -0,0 +1,835 @@
+#include <cstdlib>
+#include <cstring>
+#include <type_traits>
+
+#include "log.h"
+#include "mips.h"
+#include "renderer.h"
+#include "savestate.h"
+
+namespace {
+    constexpr uint32_t renderer_section = sectionTag("GP0 ");
+    constexpr uint32_t vram_section = sectionTag("VRAM");
+    constexpr uint32_t renderer_state_version = 1;
+    constexpr size_t renderer_state_size = 6 * 4 + 3 + 2 * 4 + 16 * 4 + 1 + 6 * 2;
+    constexpr size_t vram_bytes = 2 * vram_pixels;
+
+    int32_t signExtend11(uint32_t val) {
+        return static_cast<int32_t>(val << 21) >> 21;
+    }
+
+    // Both round towards the infinity of their name, d is positive
+    int64_t floorDiv(int64_t n, int64_t d) {
+        return n >= 0 ? n / d : -((-n + d - 1) / d);
+    }
+    int64_t ceilDiv(int64_t n, int64_t d) {
+        return n >= 0 ? (n + d - 1) / d : -(-n / d);
+    }
+
+    // Words making up the command starting with op, its own included.
+    // Polylines are the length of their first segment.
+    uint32_t commandLength(uint32_t op) {
+        switch(op >> 5) {
+        case 1: {
+            const uint32_t vertices = op & 0x08 ? 4 : 3;
+            const uint32_t textured = op & 0x04 ? 1 : 0;
+            return op & 0x10 ? vertices * (2 + textured) : 1 + vertices * (1 + textured);
+        }
+        case 2:
+            return op & 0x10 ? 4 : 3;
+        case 3:
+            return 2 + (op & 0x04 ? 1 : 0) + ((op & 0x18) == 0 ? 1 : 0);
+        case 4:
+            return 4;
+        case 5:
+        case 6:
+            return 3;
+        default:
+            return op == 0x02 ? 3 : 1;
+        }
+    }
+
+    // Rows in each band handed to a raster thread, small enough that most
+    // primitives are shared between threads
+    constexpr int32_t band_rows = 8;
+
+    // Calls draw for each row from top to bottom, exclusive, in the bands
+    // numbered index modulo count
+    template<typename Draw>
+    void forEachRow(int32_t top, int32_t bottom, uint32_t index, uint32_t count, Draw&& draw) {
+        for(int32_t band = top / band_rows; band * band_rows < bottom; ++band) {
+            if(static_cast<uint32_t>(band) % count != index)
+                continue;
+            const int32_t end = std::min(bottom, (band + 1) * band_rows);
+            for(int32_t y = std::max(top, band * band_rows); y < end; ++y) {
+                draw(y);
+            }
+        }
+    }
+} // Anonymous namespace
+
+Renderer::Renderer() : vram(std::make_unique<uint16_t[]>(vram_pixels + vram_padding)) {
+    setSimdLevel(hostSimdLevel());
+}
+
+void Renderer::setSimdLevel(SimdLevel level) {
+    flush();
+    simd_level = supportedSimdLevel(level);
+    draw_span = spanKernel(simd_level);
+}
+
+void Renderer::setRasterThreads(uint32_t count) {
+    if(count == getRasterThreads())
+        return;
+    flush();
+    workers = count > 1 ? std::make_unique<WorkerPool>(count) : nullptr;
+}
+
+void Renderer::setTextureCaching(bool enabled) {
+    flush();
+    texture_caching = enabled;
+    texture_cache.clear();
+}
+
+void Renderer::gp0(uint32_t word) {
+    if(transfer.kind == TransferKind::ToVram) {
+        receivePixel(static_cast<uint16_t>(word));
+        if(transfer.kind == TransferKind::ToVram)
+            receivePixel(static_cast<uint16_t>(word >> 16));
+        return;
+    }
+    if(polyline && (word & 0xf000f000) == 0x50005000) {
+        polyline = false;
+        command_size = 0;
+        return;
+    }
+
+    if(command_size == 0)
+        command_length = commandLength(word >> 24);
+    command[command_size++] = word;
+    if(command_size == command_length)
+        execute();
+}
+
+void Renderer::gp0(const uint8_t* words, size_t count) {
+    for(size_t i = 0; i < count; ++i) {
+        gp0(readLE<uint32_t>(words + 4 * i));
+    }
+}
+
+void Renderer::resetCommandBuffer() {
+    command_size = 0;
+    polyline = false;
+    transfer = {};
+}
+
+void Renderer::reset() {
+    resetCommandBuffer();
+    draw_mode = 0;
+    texture_window = 0;
+    area_top_left = 0;
+    area_bottom_right = 0;
+    draw_offset = 0;
+    mask_setting = 0;
+    irq = false;
+}
+
+void Renderer::execute() {
+    const uint32_t op = command[0] >> 24;
+    command_size = 0;
+    switch(op >> 5) {
+    case 0:
+        if(op == 0x02)
+            fillRectangle();
+        else if(op == 0x1f)
+            irq = true;
+        else if(op != 0x00 && op != 0x01)
+            LOG_DEBUG("GPU: Ignoring GP0({:#04x})\n", op);
+        break;
+    case 1:
+        drawPolygon();
+        break;
+    case 2:
+        drawLineCommand();
+        break;
+    case 3:
+        drawRectangle();
+        break;
+    case 4:
+        copyRectangle();
+        break;
+    case 5:
+        startTransfer(TransferKind::ToVram);
+        break;
+    case 6:
+        startTransfer(TransferKind::FromVram);
+        break;
+    default:
+        switch(op) {
+        case 0xe1:
+            draw_mode = command[0] & 0x3fff;
+            break;
+        case 0xe2:
+            texture_window = command[0] & 0xfffff;
+            break;
+        case 0xe3:
+            area_top_left = command[0] & 0xfffff;
+            break;
+        case 0xe4:
+            area_bottom_right = command[0] & 0xfffff;
+            break;
+        case 0xe5:
+            draw_offset = command[0] & 0x3fffff;
+            break;
+        case 0xe6:
+            mask_setting = command[0] & 3;
+            break;
+        default:
+            LOG_DEBUG("GPU: Ignoring GP0({:#04x})\n", op);
+            break;
+        }
+        break;
+    }
+}
+
+Renderer::Vertex Renderer::vertex(uint32_t xy, uint32_t color, uint32_t uv) const {
+    Vertex v;
+    v.x = signExtend11(xy) + signExtend11(draw_offset);
+    v.y = signExtend11(xy >> 16) + signExtend11(draw_offset >> 11);
+    v.r = static_cast<uint8_t>(color);
+    v.g = static_cast<uint8_t>(color >> 8);
+    v.b = static_cast<uint8_t>(color >> 16);
+    v.u = static_cast<uint8_t>(uv);
+    v.v = static_cast<uint8_t>(uv >> 8);
+    return v;
+}
+
+SpanSetup Renderer::primitiveSetup(bool textured, bool raw, bool semi_transparent, uint16_t clut) const {
+    SpanSetup setup;
+    setup.textured = textured && !(texture_disable_allowed && (draw_mode & 0x800));
+    setup.raw_texture = raw;
+    setup.semi_transparent = semi_transparent;
+    setup.blend_mode = static_cast<uint8_t>((draw_mode >> 5) & 3);
+    setup.check_mask = mask_setting & 2;
+    setup.set_mask = mask_setting & 1 ? 0x8000 : 0;
+    if(!setup.textured)
+        return setup;
+
+    TextureSource& tex = setup.texture;
+    tex.vram = vram.get();
+    tex.page_x = (draw_mode & 0xf) * 64;
+    tex.page_y = draw_mode & 0x10 ? 256 : 0;
+    switch((draw_mode >> 7) & 3) {
+    case 0:
+        tex.depth = TextureDepth::Bits4;
+        break;
+    case 1:
+        tex.depth = TextureDepth::Bits8;
+        break;
+    default:
+        tex.depth = TextureDepth::Bits15;
+        break;
+    }
+    tex.clut_x = (clut & 0x3f) * 16;
+    tex.clut_y = (clut >> 6) & 0x1ff;
+    // Masked coordinate bits are replaced by the offset, in steps of 8 texels
+    const uint32_t mask_u = texture_window & 0x1f;
+    const uint32_t mask_v = (texture_window >> 5) & 0x1f;
+    const uint32_t offset_u = (texture_window >> 10) & 0x1f;
+    const uint32_t offset_v = (texture_window >> 15) & 0x1f;
+    tex.and_u = static_cast<uint8_t>(~(mask_u * 8));
+    tex.or_u = static_cast<uint8_t>((offset_u & mask_u) * 8);
+    tex.and_v = static_cast<uint8_t>(~(mask_v * 8));
+    tex.or_v = static_cast<uint8_t>((offset_v & mask_v) * 8);
+    return setup;
+}
+
+void Renderer::drawPolygon() {
+    const uint32_t op = command[0] >> 24;
+    const bool gouraud = op & 0x10;
+    const bool textured = op & 0x04;
+    const bool raw = op & 0x01;
+    const size_t count = op & 0x08 ? 4 : 3;
+
+    Vertex vertices[4];
+    uint16_t clut = 0;
+    size_t pos = 1;
+    for(size_t i = 0; i < count; ++i) {
+        const uint32_t color = gouraud && i > 0 ? command[pos++] : command[0];
+        const uint32_t xy = command[pos++];
+        const uint32_t uv = textured ? command[pos++] : 0;
+        if(textured && i == 0)
+            clut = static_cast<uint16_t>(uv >> 16);
+        // Textured polygons bring their own texture page
+        if(textured && i == 1)
+            draw_mode = (draw_mode & ~0x9ffu) | ((uv >> 16) & 0x9ff);
+        vertices[i] = vertex(xy, color, uv);
+    }
+
+    SpanSetup setup = primitiveSetup(textured, raw, op & 0x02, clut);
+    setup.dither = (draw_mode & 0x200) && (gouraud || (setup.textured && !raw));
+    drawTriangle(vertices[0], vertices[1], vertices[2], setup);
+    if(count == 4)
+        drawTriangle(vertices[1], vertices[2], vertices[3], setup);
+}
+
+void Renderer::drawTriangle(const Vertex& v0, const Vertex& v1, const Vertex& v2, const SpanSetup& setup) {
+    const Vertex* v[3] = {&v0, &v1, &v2};
+    // The GPU skips polygons this large
+    for(int i = 0; i < 3; ++i) {
+        const Vertex& a = *v[i];
+        const Vertex& b = *v[(i + 1) % 3];
+        if(std::abs(a.x - b.x) >= 1024 || std::abs(a.y - b.y) >= 512)
+            return;
+    }
+    std::sort(std::begin(v), std::end(v), [](const Vertex* a, const Vertex* b) { return a->y < b->y; });
+    const Vertex& top = *v[0];
+    const Vertex& mid = *v[1];
+    const Vertex& bottom = *v[2];
+    const int64_t area = static_cast<int64_t>(mid.x - top.x) * (bottom.y - top.y) -
+                         static_cast<int64_t>(bottom.x - top.x) * (mid.y - top.y);
+    if(!area)
+        return;
+
+    Primitive prim;
+    prim.kind = PrimitiveKind::Triangle;
+    prim.setup = setup;
+    prim.vertices[0] = top;
+    prim.vertices[1] = mid;
+    prim.vertices[2] = bottom;
+    // Each attribute is a plane, stepping by step_x and step_y per pixel
+    const auto plane = [&](uint8_t Vertex::*attrib, int32_t& dx, int32_t& dy) {
+        const int64_t d1 = mid.*attrib - top.*attrib;
+        const int64_t d2 = bottom.*attrib - top.*attrib;
+        dx = static_cast<int32_t>((d1 * (bottom.y - top.y) - d2 * (mid.y - top.y)) * (1 << raster_frac) / area);
+        dy = static_cast<int32_t>((d2 * (mid.x - top.x) - d1 * (bottom.x - top.x)) * (1 << raster_frac) / area);
+    };
+    plane(&Vertex::r, prim.step_x.r, prim.step_y.r);
+    plane(&Vertex::g, prim.step_x.g, prim.step_y.g);
+    plane(&Vertex::b, prim.step_x.b, prim.step_y.b);
+    plane(&Vertex::u, prim.step_x.u, prim.step_y.u);
+    plane(&Vertex::v, prim.step_x.v, prim.step_y.v);
+
+    prim.left = areaLeft();
+    prim.top = std::max<int32_t>(top.y, areaTop());
+    prim.right = areaRight() + 1;
+    prim.bottom = std::min<int32_t>(bottom.y, areaBottom() + 1);
+    const int32_t left = std::max(std::min({top.x, mid.x, bottom.x}), prim.left);
+    const int32_t right = std::min(std::max({top.x, mid.x, bottom.x}), prim.right);
+    if(prim.top >= prim.bottom || left >= right)
+        return;
+    submit(prim, left, prim.top, right, prim.bottom);
+}
+
+void Renderer::rasterTriangle(const Primitive& prim, Bands bands) const {
+    const Vertex& top = prim.vertices[0];
+    const Vertex& mid = prim.vertices[1];
+    const Vertex& bottom = prim.vertices[2];
+    // Rows and columns are drawn from the first one an edge touches up to
+    // the last one before the opposite edge, so polygons sharing an edge
+    // never both draw a pixel
+    const auto edgeX = [](const Vertex& a, const Vertex& b, int32_t y) {
+        const int64_t dy = b.y - a.y;
+        return static_cast<int32_t>(ceilDiv(static_cast<int64_t>(a.x) * dy + static_cast<int64_t>(y - a.y) * (b.x - a.x), dy));
+    };
+
+    forEachRow(prim.top, prim.bottom, bands.index, bands.count, [&](int32_t y) {
+        const int32_t long_x = edgeX(top, bottom, y);
+        const int32_t short_x = y < mid.y ? edgeX(top, mid, y) : edgeX(mid, bottom, y);
+        const int32_t x_start = std::max(std::min(long_x, short_x), prim.left);
+        const int32_t x_end = std::min(std::max(long_x, short_x), prim.right);
+        if(x_start >= x_end)
+            return;
+
+        const int64_t rel_x = x_start - top.x;
+        const int64_t rel_y = y - top.y;
+        const auto at = [&](uint8_t val, int32_t dx, int32_t dy) {
+            return static_cast<int32_t>((static_cast<int64_t>(val) << raster_frac) + (1 << (raster_frac - 1)) +
+                                        dx * rel_x + dy * rel_y);
+        };
+        SpanAttribs start;
+        start.r = at(top.r, prim.step_x.r, prim.step_y.r);
+        start.g = at(top.g, prim.step_x.g, prim.step_y.g);
+        start.b = at(top.b, prim.step_x.b, prim.step_y.b);
+        start.u = at(top.u, prim.step_x.u, prim.step_y.u);
+        start.v = at(top.v, prim.step_x.v, prim.step_y.v);
+        draw_span(prim.setup, &vram[y * vram_width + x_start], x_start, y, x_end - x_start, start, prim.step_x);
+    });
+}
+
+void Renderer::drawRectangle() {
+    const uint32_t op = command[0] >> 24;
+    const bool textured = op & 0x04;
+    size_t pos = 1;
+    const uint32_t xy = command[pos++];
+    const uint32_t uv = textured ? command[pos++] : 0;
+    uint32_t width;
+    uint32_t height;
+    switch((op >> 3) & 3) {
+    case 0:
+        width = command[pos] & 0x3ff;
+        height = (command[pos] >> 16) & 0x1ff;
+        break;
+    case 1:
+        width = height = 1;
+        break;
+    case 2:
+        width = height = 8;
+        break;
+    default:
+        width = height = 16;
+        break;
+    }
+
+    Primitive prim;
+    prim.kind = PrimitiveKind::Rectangle;
+    const Vertex& corner = prim.vertices[0] = vertex(xy, command[0], uv);
+    prim.setup = primitiveSetup(textured, op & 0x01, op & 0x02, static_cast<uint16_t>(uv >> 16));
+    prim.left = std::max<int32_t>(corner.x, areaLeft());
+    prim.right = std::min<int32_t>(corner.x + width, areaRight() + 1);
+    prim.top = std::max<int32_t>(corner.y, areaTop());
+    prim.bottom = std::min<int32_t>(corner.y + height, areaBottom() + 1);
+    if(prim.left >= prim.right || prim.top >= prim.bottom)
+        return;
+
+    // Texels follow pixels one for one, flipping isn't supported
+    prim.start.r = corner.r << raster_frac;
+    prim.start.g = corner.g << raster_frac;
+    prim.start.b = corner.b << raster_frac;
+    prim.start.u = (corner.u + prim.left - corner.x) << raster_frac;
+    prim.step_x.u = 1 << raster_frac;
+    submit(prim, prim.left, prim.top, prim.right, prim.bottom);
+}
+
+void Renderer::rasterRectangle(const Primitive& prim, Bands bands) const {
+    const Vertex& corner = prim.vertices[0];
+    SpanAttribs start = prim.start;
+    forEachRow(prim.top, prim.bottom, bands.index, bands.count, [&](int32_t y) {
+        start.v = (corner.v + y - corner.y) << raster_frac;
+        draw_span(prim.setup, &vram[y * vram_width + prim.left], prim.left, y, prim.right - prim.left, start, prim.step_x);
+    });
+}
+
+void Renderer::drawLineCommand() {
+    const uint32_t op = command[0] >> 24;
+    const bool gouraud = op & 0x10;
+    SpanSetup setup = primitiveSetup(false, false, op & 0x02, 0);
+    setup.dither = gouraud && (draw_mode & 0x200);
+    const Vertex from = vertex(command[1], command[0], 0);
+    const Vertex to = gouraud ? vertex(command[3], command[2], 0) : vertex(command[2], command[0], 0);
+    drawLine(from, to, setup);
+
+    if(op & 0x08) {
+        // The end of this segment starts the next one
+        polyline = true;
+        if(gouraud) {
+            command[0] = (command[0] & 0xff000000) | (command[2] & 0xffffff);
+            command[1] = command[3];
+        }
+        else {
+            command[1] = command[2];
+        }
+        command_size = 2;
+    }
+}
+
+void Renderer::drawLine(const Vertex& v0, const Vertex& v1, const SpanSetup& setup) {
+    if(std::abs(v1.x - v0.x) >= 1024 || std::abs(v1.y - v0.y) >= 512)
+        return;
+
+    Primitive prim;
+    prim.kind = PrimitiveKind::Line;
+    prim.setup = setup;
+    prim.vertices[0] = v0;
+    prim.vertices[1] = v1;
+    prim.left = areaLeft();
+    prim.top = areaTop();
+    prim.right = areaRight() + 1;
+    prim.bottom = areaBottom() + 1;
+    const int32_t left = std::max(std::min(v0.x, v1.x), prim.left);
+    const int32_t top = std::max(std::min(v0.y, v1.y), prim.top);
+    const int32_t right = std::min(std::max(v0.x, v1.x) + 1, prim.right);
+    const int32_t bottom = std::min(std::max(v0.y, v1.y) + 1, prim.bottom);
+    if(left >= right || top >= bottom)
+        return;
+    submit(prim, left, top, right, bottom);
+}
+
+void Renderer::rasterLine(const Primitive& prim, Bands bands) const {
+    const Vertex& v0 = prim.vertices[0];
+    const Vertex& v1 = prim.vertices[1];
+    const int32_t dx = v1.x - v0.x;
+    const int32_t dy = v1.y - v0.y;
+
+    // Both ends are drawn, one pixel per step along the major axis
+    const int32_t steps = std::max(std::abs(dx), std::abs(dy));
+    const auto lerp = [&](int32_t from, int32_t to, int32_t i) {
+        return steps ? static_cast<int32_t>(floorDiv(2 * static_cast<int64_t>(to - from) * i + steps, 2 * steps)) : 0;
+    };
+    const auto shade = [&](uint8_t from, uint8_t to, int32_t i) {
+        const int32_t delta = steps ? (to - from) * (1 << raster_frac) * i / steps : 0;
+        return (from << raster_frac) + (1 << (raster_frac - 1)) + delta;
+    };
+    const SpanAttribs no_step;
+    for(int32_t i = 0; i <= steps; ++i) {
+        const int32_t x = v0.x + lerp(0, dx, i);
+        const int32_t y = v0.y + lerp(0, dy, i);
+        if(x < prim.left || x >= prim.right || y < prim.top || y >= prim.bottom ||
+           static_cast<uint32_t>(y / band_rows) % bands.count != bands.index)
+            continue;
+        SpanAttribs color;
+        color.r = shade(v0.r, v1.r, i);
+        color.g = shade(v0.g, v1.g, i);
+        color.b = shade(v0.b, v1.b, i);
+        draw_span(prim.setup, &vram[y * vram_width + x], x, y, 1, color, no_step);
+    }
+}
+
+void Renderer::submit(Primitive prim, int32_t left, int32_t top, int32_t right, int32_t bottom) {
+    markRows(top, bottom - 1);
+    VramCells writes;
+    markCells(writes, left, top, right - left, bottom - top);
+    VramCells reads;
+    TextureSource& tex = prim.setup.texture;
+    if(prim.setup.textured) {
+        const uint32_t page_width = tex.depth == TextureDepth::Bits4 ? 64 : tex.depth == TextureDepth::Bits8 ? 128 : 256;
+        markCells(reads, tex.page_x, tex.page_y, page_width, 256);
+        if(tex.depth != TextureDepth::Bits15)
+            markCells(reads, tex.clut_x, tex.clut_y, tex.depth == TextureDepth::Bits4 ? 16 : 256, 1);
+    }
+    if(workers && ((reads & (batch_writes | writes)).any() || (writes & batch_reads).any()))
+        flush();
+    texture_cache.invalidate(left, top, right - left, bottom - top);
+
+    // Texels it draws over are read as the rows go, top to bottom, so
+    // those come straight from VRAM
+    const bool reads_own = (reads & writes).any();
+    if(texture_caching && prim.setup.textured && tex.depth != TextureDepth::Bits15 && !reads_own) {
+        uint32_t first;
+        uint32_t count;
+        textureRows(prim, first, count);
+        // Batched primitives may still use the page it would drop
+        if(!batch.empty() && texture_cache.wouldEvict(tex))
+            flush();
+        tex.decoded = texture_cache.lookup(vram.get(), tex, first, count);
+    }
+    if(!workers || reads_own) {
+        raster(prim, {0, 1});
+        return;
+    }
+    batch.push_back(prim);
+    batch_writes |= writes;
+    batch_reads |= reads;
+    if(batch.size() == batch_capacity)
+        flush();
+}
+
+void Renderer::flush() const {
+    if(batch.empty())
+        return;
+    workers->run([this](uint32_t index) {
+        const Bands bands{index, workers->size()};
+        for(const Primitive& prim : batch) {
+            raster(prim, bands);
+        }
+    });
+    batch.clear();
+    batch_writes.reset();
+    batch_reads.reset();
+}
+
+void Renderer::textureRows(const Primitive& prim, uint32_t& first, uint32_t& count) const {
+    const TextureSource& tex = prim.setup.texture;
+    first = 0;
+    count = 256;
+    // Windows fold rows together, and steps this steep come from slivers
+    // that could be rounded anywhere
+    const int32_t steep = 64 << raster_frac;
+    if(tex.and_v != 0xff || tex.or_v || std::abs(prim.step_x.v) > steep || std::abs(prim.step_y.v) > steep)
+        return;
+    if(prim.kind == PrimitiveKind::Rectangle) {
+        const Vertex& corner = prim.vertices[0];
+        first = (corner.v + prim.top - corner.y) & 0xff;
+        count = std::min<uint32_t>(prim.bottom - prim.top, 256);
+        return;
+    }
+    // Rounded along the rows, texels can land a row outside the vertices
+    const auto [low, high] = std::minmax({prim.vertices[0].v, prim.vertices[1].v, prim.vertices[2].v});
+    first = (low - 1) & 0xff;
+    count = std::min(high - low + 3, 256);
+}
+
+void Renderer::raster(const Primitive& prim, Bands bands) const {
+    switch(prim.kind) {
+    case PrimitiveKind::Triangle:
+        rasterTriangle(prim, bands);
+        break;
+    case PrimitiveKind::Rectangle:
+        rasterRectangle(prim, bands);
+        break;
+    case PrimitiveKind::Line:
+        rasterLine(prim, bands);
+        break;
+    }
+}
+
+void Renderer::markCells(VramCells& cells, uint32_t x, uint32_t y, uint32_t width, uint32_t height) {
+    constexpr uint32_t columns = vram_width / cell_width;
+    constexpr uint32_t rows = vram_height / cell_height;
+    const uint32_t first_column = x / cell_width;
+    const uint32_t first_row = y / cell_height;
+    const uint32_t column_count = std::min((x + width - 1) / cell_width - first_column + 1, columns);
+    const uint32_t row_count = std::min((y + height - 1) / cell_height - first_row + 1, rows);
+    for(uint32_t row = 0; row < row_count; ++row) {
+        for(uint32_t column = 0; column < column_count; ++column) {
+            cells.set((first_row + row) % rows * columns + (first_column + column) % columns);
+        }
+    }
+}
+
+void Renderer::fillRectangle() {
+    flush();
+    // Ignores the drawing area and mask settings, x and width go by 16
+    const uint32_t color = command[0];
+    const uint16_t pixel = static_cast<uint16_t>(((color >> 3) & 0x1f) | ((color >> 11) & 0x1f) << 5 |
+                                                 ((color >> 19) & 0x1f) << 10);
+    const uint32_t x = command[1] & 0x3f0;
+    const uint32_t y = (command[1] >> 16) & 0x1ff;
+    const uint32_t width = ((command[2] & 0x3ff) + 0xf) & ~0xfu;
+    const uint32_t height = (command[2] >> 16) & 0x1ff;
+    texture_cache.invalidate(x, y, width, height);
+    for(uint32_t row = 0; row < height; ++row) {
+        const uint32_t line = (y + row) & (vram_height - 1);
+        uint16_t* dst = &vram[line * vram_width];
+        const uint32_t before_wrap = std::min(width, vram_width - x);
+        std::fill_n(dst + x, before_wrap, pixel);
+        std::fill_n(dst, width - before_wrap, pixel);
+        markRows(line, line);
+    }
+}
+
+void Renderer::copyRectangle() {
+    flush();
+    const uint32_t src_x = command[1] & 0x3ff;
+    const uint32_t src_y = (command[1] >> 16) & 0x1ff;
+    const uint32_t dst_x = command[2] & 0x3ff;
+    const uint32_t dst_y = (command[2] >> 16) & 0x1ff;
+    const uint32_t width = ((command[3] - 1) & 0x3ff) + 1;
+    const uint32_t height = (((command[3] >> 16) - 1) & 0x1ff) + 1;
+    texture_cache.invalidate(dst_x, dst_y, width, height);
+
+    // A row at a time through a copy, the rectangles can overlap
+    std::array<uint16_t, vram_width> line;
+    for(uint32_t row = 0; row < height; ++row) {
+        const uint16_t* src = &vram[((src_y + row) & (vram_height - 1)) * vram_width];
+        for(uint32_t column = 0; column < width; ++column) {
+            line[column] = src[(src_x + column) & (vram_width - 1)];
+        }
+        const uint32_t y = (dst_y + row) & (vram_height - 1);
+        for(uint32_t column = 0; column < width; ++column) {
+            storePixel(dst_x + column, y, line[column]);
+        }
+        markRows(y, y);
+    }
+}
+
+void Renderer::startTransfer(TransferKind kind) {
+    flush();
+    transfer.kind = kind;
+    transfer.x = command[1] & 0x3ff;
+    transfer.y = (command[1] >> 16) & 0x1ff;
+    transfer.width = static_cast<uint16_t>(((command[2] - 1) & 0x3ff) + 1);
+    transfer.height = static_cast<uint16_t>((((command[2] >> 16) - 1) & 0x1ff) + 1);
+    transfer.column = 0;
+    transfer.row = 0;
+    if(kind == TransferKind::ToVram)
+        texture_cache.invalidate(transfer.x, transfer.y, transfer.width, transfer.height);
+}
+
+void Renderer::receivePixel(uint16_t pixel) {
+    const uint32_t y = (transfer.y + transfer.row) & (vram_height - 1);
+    if(transfer.column == 0)
+        markRows(y, y);
+    storePixel(transfer.x + transfer.column, y, pixel);
+    if(++transfer.column == transfer.width) {
+        transfer.column = 0;
+        if(++transfer.row == transfer.height)
+            transfer.kind = TransferKind::None;
+    }
+}
+
+uint16_t Renderer::sendPixel() {
+    const uint32_t y = (transfer.y + transfer.row) & (vram_height - 1);
+    const uint16_t pixel = vram[y * vram_width + ((transfer.x + transfer.column) & (vram_width - 1))];
+    if(++transfer.column == transfer.width) {
+        transfer.column = 0;
+        if(++transfer.row == transfer.height)
+            transfer.kind = TransferKind::None;
+    }
+    return pixel;
+}
+
+uint32_t Renderer::readWord() {
+    if(!readPending())
+        return 0;
+    // Primitives can be sent while a transfer waits to be read
+    flush();
+    const uint32_t low = sendPixel();
+    const uint32_t high = readPending() ? sendPixel() : 0;
+    return low | high << 16;
+}
+
+uint32_t Renderer::statusBits() const {
+    uint32_t bits = draw_mode & 0x7ff;
+    bits |= (mask_setting & 3) << 11;
+    if(texture_disable_allowed && (draw_mode & 0x800))
+        bits |= 1 << 15;
+    return bits;
+}
+
+bool Renderer::drawInfo(uint32_t index, uint32_t& info) const {
+    switch(index & 7) {
+    case 2:
+        info = texture_window;
+        return true;
+    case 3:
+        info = area_top_left;
+        return true;
+    case 4:
+        info = area_bottom_right;
+        return true;
+    case 5:
+        info = draw_offset;
+        return true;
+    case 7:
+        // GPU version
+        info = 2;
+        return true;
+    default:
+        return false;
+    }
+}
+
+void Renderer::writeVRAM(uint32_t offset, const uint8_t* data, size_t size) {
+    if(!size)
+        return;
+    flush();
+    std::memcpy(reinterpret_cast<uint8_t*>(vram.get()) + offset, data, size);
+    const uint32_t top = offset / (2 * vram_width);
+    const uint32_t bottom = static_cast<uint32_t>((offset + size - 1) / (2 * vram_width));
+    markRows(top, bottom);
+    texture_cache.invalidate(0, top, vram_width, bottom - top + 1);
+}
+
+void Renderer::clearVRAM() {
+    flush();
+    std::fill_n(vram.get(), vram_pixels, 0);
+    texture_cache.clear();
+    dirty_pages.fill(1);
+}
+
+void Renderer::saveState(SavestateWriter& writer, bool with_vram) const {
+    flush();
+    writer.beginSection(renderer_section, renderer_state_version);
+    for(const uint32_t reg : {draw_mode, texture_window, area_top_left, area_bottom_right, draw_offset, mask_setting}) {
+        writer.put(reg);
+    }
+    writer.put<uint8_t>(texture_disable_allowed);
+    writer.put<uint8_t>(irq);
+    writer.put<uint8_t>(polyline);
+    writer.put(command_size);
+    writer.put(command_length);
+    for(const uint32_t word : command) {
+        writer.put(word);
+    }
+    writer.put(static_cast<uint8_t>(transfer.kind));
+    for(const uint16_t val : {transfer.x, transfer.y, transfer.width, transfer.height, transfer.column, transfer.row}) {
+        writer.put(val);
+    }
+
+    if(with_vram) {
+        // Host order, little endian like the rest of the state
+        writer.beginSection(vram_section, 1);
+        writer.putBytes(reinterpret_cast<const uint8_t*>(vram.get()), vram_bytes);
+    }
+}
+
+bool Renderer::checkState(const SavestateReader& reader, bool with_vram) {
+    const SavestateSection* state = reader.find(renderer_section, renderer_state_version);
+    if(!state)
+        return true;
+    const SavestateSection* vram_state = reader.find(vram_section, 1);
+    if(state->size != renderer_state_size || (with_vram && (!vram_state || vram_state->size != vram_bytes))) {
+        LOG("GPU: Not a state this version can load\n");
+        return false;
+    }
+
+    // Past the registers and flags, anything out of range here would have
+    // GP0 run off the command buffer or VRAM
+    const uint8_t* command_state = state->data + 6 * 4 + 3;
+    const uint32_t command_size = readLE<uint32_t>(command_state);
+    const uint32_t op = readLE<uint32_t>(command_state + 8) >> 24;
+    const uint8_t* transfer_state = command_state + 8 + 16 * 4;
+    const auto kind = static_cast<TransferKind>(transfer_state[0]);
+    const uint16_t width = readLE<uint16_t>(transfer_state + 5);
+    const uint16_t height = readLE<uint16_t>(transfer_state + 7);
+    const uint16_t column = readLE<uint16_t>(transfer_state + 9);
+    const uint16_t row = readLE<uint16_t>(transfer_state + 11);
+
+    const bool command_valid = command_size == 0 || command_size < commandLength(op);
+    bool transfer_valid = kind == TransferKind::None;
+    if(kind == TransferKind::ToVram || kind == TransferKind::FromVram) {
+        transfer_valid = width >= 1 && width <= vram_width && height >= 1 && height <= vram_height &&
+                         column < width && row < height;
+    }
+    if(!command_valid || !transfer_valid) {
+        LOG("GPU: The state is damaged\n");
+        return false;
+    }
+    return true;
+}
+
+void Renderer::loadState(const SavestateReader& reader, bool with_vram) {
+    flush();
+    const SavestateSection* state = reader.find(renderer_section, renderer_state_version);
+    if(!state) {
+        reset();
+        if(with_vram)
+            clearVRAM();
+        return;
+    }
+
+    const uint8_t* pos = state->data;
+    const auto get = [&](auto& val) {
+        val = readLE<std::remove_reference_t<decltype(val)>>(pos);
+        pos += sizeof(val);
+    };
+    for(uint32_t* reg : {&draw_mode, &texture_window, &area_top_left, &area_bottom_right, &draw_offset, &mask_setting}) {
+        get(*reg);
+    }
+    for(bool* flag : {&texture_disable_allowed, &irq, &polyline}) {
+        uint8_t val;
+        get(val);
+        *flag = val;
+    }
+    get(command_size);
+    get(command_length);
+    for(uint32_t& word : command) {
+        get(word);
+    }
+    uint8_t kind;
+    get(kind);
+    transfer.kind = static_cast<TransferKind>(kind);
+    for(uint16_t* val : {&transfer.x, &transfer.y, &transfer.width, &transfer.height, &transfer.column, &transfer.row}) {
+        get(*val);
+    }
+    // The length isn't trusted, it follows from the command like in gp0
+    if(command_size > 0)
+        command_length = commandLength(command[0] >> 24);
+
+    if(with_vram) {
+        std::memcpy(vram.get(), reader.find(vram_section, 1)->data, vram_bytes);
+        texture_cache.clear();
+        dirty_pages.fill(1);
+    }
+}
@@ -0,0 +1,269 @@
+#ifndef RENDERER_H
+#define RENDERER_H
+
+#include <algorithm>
+#include <array>
+#include <bitset>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "raster.h"
+#include "texture_cache.h"
+#include "worker_pool.h"
+
+class SavestateReader;
+class SavestateWriter;
+
+// Granularity of the tracking of VRAM writes, two rows of pixels
+constexpr uint32_t vram_page_size = 4096;
+constexpr uint32_t vram_page_rows = vram_page_size / (2 * vram_width);
+constexpr uint32_t vram_page_count = vram_height / vram_page_rows;
+
+// Everything behind GP0: the drawing state, commands being put together
+// from their words, VRAM and the transfers in and out of it. Primitives
+// are drawn by the span kernels of raster.h as soon as their last word
+// arrives. Their 4 and 8 bit textures come decoded from a TextureCache,
+// unless they draw over their own texture page or CLUT.
+//
+// With more than one raster thread, primitives are batched instead and
+// each thread draws the whole batch over its own bands of rows, so every
+// pixel still sees the primitives in order. A primitive reading texels
+// that the batch writes, or writing texels the batch reads, draws the
+// batch first. So do fills, copies, transfers and anything looking at
+// VRAM from outside.
+class Renderer {
+public:
+    Renderer();
+
+    Renderer(const Renderer&) = delete;
+    Renderer& operator=(const Renderer&) = delete;
+
+    // Kernels are picked at the best level of the host by default
+    void setSimdLevel(SimdLevel level);
+    SimdLevel getSimdLevel() const {
+        return simd_level;
+    }
+    // Threads drawing each batch, 1 by default draws on the calling thread
+    // alone without batching
+    void setRasterThreads(uint32_t count);
+    uint32_t getRasterThreads() const {
+        return workers ? workers->size() : 1;
+    }
+    // Decoding 4 and 8 bit textures through the cache, on by default.
+    // Without it every texel goes through its CLUT in VRAM.
+    void setTextureCaching(bool enabled);
+    bool isTextureCaching() const {
+        return texture_caching;
+    }
+
+    void gp0(uint32_t word);
+    // Little endian words, as DMA hands them over
+    void gp0(const uint8_t* words, size_t count);
+    // GP1(01), drops a command half received and any transfer
+    void resetCommandBuffer();
+    // The drawing state part of GP1(00), VRAM is left alone
+    void reset();
+    // GP1(09)
+    void setTextureDisableAllowed(bool allowed) {
+        texture_disable_allowed = allowed;
+    }
+
+    // A VRAM to CPU transfer is waiting to be read through GPUREAD
+    bool readPending() const {
+        return transfer.kind == TransferKind::FromVram;
+    }
+    // Next two pixels of the transfer
+    uint32_t readWord();
+
+    // GPUSTAT bits 0 to 12 and 15, from the draw mode and mask settings
+    uint32_t statusBits() const;
+    // GP1(10) answers, false for indices that don't change GPUREAD
+    bool drawInfo(uint32_t index, uint32_t& info) const;
+    // Requested by GP0(1F) until acknowledged by GP1(02)
+    bool irqRequested() const {
+        return irq;
+    }
+    void acknowledgeIrq() {
+        irq = false;
+    }
+
+    const uint16_t* getVRAM() const {
+        flush();
+        return vram.get();
+    }
+    // For loaders, offset and size in bytes
+    void writeVRAM(uint32_t offset, const uint8_t* data, size_t size);
+    void clearVRAM();
+
+    // One byte per vram_page_size page of VRAM, non-zero if it was
+    // written since the last clearDirtyPages
+    const uint8_t* dirtyPages() const {
+        return dirty_pages.data();
+    }
+    void clearDirtyPages() {
+        dirty_pages.fill(0);
+    }
+
+    void saveState(SavestateWriter& writer, bool with_vram) const;
+    // Whether the state holds a renderer this version can load, or none
+    static bool checkState(const SavestateReader& reader, bool with_vram);
+    // Resets the drawing state if the state has none
+    void loadState(const SavestateReader& reader, bool with_vram);
+
+private:
+    struct Vertex {
+        int32_t x;
+        int32_t y;
+        uint8_t r;
+        uint8_t g;
+        uint8_t b;
+        uint8_t u;
+        uint8_t v;
+    };
+
+    enum class PrimitiveKind : uint8_t {
+        Triangle,
+        Rectangle,
+        Line,
+    };
+    // Everything needed to draw a primitive later on, with the drawing
+    // area it was sent under
+    struct Primitive {
+        PrimitiveKind kind;
+        SpanSetup setup;
+        // Sorted top to bottom for triangles, the corner of rectangles and
+        // both ends of lines
+        Vertex vertices[3];
+        // Attributes at the top left of rectangles and the steps of
+        // triangles and rectangles
+        SpanAttribs start;
+        SpanAttribs step_x;
+        SpanAttribs step_y;
+        // Clipped to, right and bottom exclusive
+        int32_t left;
+        int32_t top;
+        int32_t right;
+        int32_t bottom;
+    };
+    // Rows whose band of rows is index modulo count
+    struct Bands {
+        uint32_t index;
+        uint32_t count;
+    };
+    // VRAM split in 64x16 pixel cells, to tell which primitives of a batch
+    // depend on each other
+    static constexpr uint32_t cell_width = 64;
+    static constexpr uint32_t cell_height = 16;
+    using VramCells = std::bitset<(vram_width / cell_width) * (vram_height / cell_height)>;
+    static constexpr size_t batch_capacity = 256;
+
+    enum class TransferKind : uint8_t {
+        None,
+        ToVram,
+        FromVram,
+    };
+    // A rectangle of VRAM going to or from the CPU, row by row
+    struct Transfer {
+        TransferKind kind = TransferKind::None;
+        uint16_t x = 0;
+        uint16_t y = 0;
+        uint16_t width = 0;
+        uint16_t height = 0;
+        // Position of the next pixel in the rectangle
+        uint16_t column = 0;
+        uint16_t row = 0;
+    };
+
+    void execute();
+    void drawPolygon();
+    void drawRectangle();
+    void drawLineCommand();
+    void fillRectangle();
+    void copyRectangle();
+    void startTransfer(TransferKind kind);
+    void receivePixel(uint16_t pixel);
+    uint16_t sendPixel();
+
+    void drawTriangle(const Vertex& v0, const Vertex& v1, const Vertex& v2, const SpanSetup& setup);
+    void drawLine(const Vertex& v0, const Vertex& v1, const SpanSetup& setup);
+    // Draws or batches prim, which writes pixels within the box left to
+    // right and top to bottom, exclusive
+    void submit(Primitive prim, int32_t left, int32_t top, int32_t right, int32_t bottom);
+    // Rows of its texture page a textured primitive can read, from first
+    // on and wrapping
+    void textureRows(const Primitive& prim, uint32_t& first, uint32_t& count) const;
+    // Draws the batch
+    void flush() const;
+    static void markCells(VramCells& cells, uint32_t x, uint32_t y, uint32_t width, uint32_t height);
+    void raster(const Primitive& prim, Bands bands) const;
+    void rasterTriangle(const Primitive& prim, Bands bands) const;
+    void rasterRectangle(const Primitive& prim, Bands bands) const;
+    void rasterLine(const Primitive& prim, Bands bands) const;
+    SpanSetup primitiveSetup(bool textured, bool raw, bool semi_transparent, uint16_t clut) const;
+    Vertex vertex(uint32_t xy, uint32_t color, uint32_t uv) const;
+
+    // Inclusive, top <= bottom
+    void markRows(uint32_t top, uint32_t bottom) {
+        std::fill(dirty_pages.begin() + top / vram_page_rows, dirty_pages.begin() + bottom / vram_page_rows + 1, 1);
+    }
+    // Writes one pixel the way transfers do, honoring the mask settings
+    void storePixel(uint32_t x, uint32_t y, uint16_t pixel) {
+        uint16_t& dst = vram[(y & (vram_height - 1)) * vram_width + (x & (vram_width - 1))];
+        if((mask_setting & 2) && (dst & 0x8000))
+            return;
+        dst = pixel | (mask_setting & 1 ? 0x8000 : 0);
+    }
+
+    // The drawing area, inclusive
+    uint32_t areaLeft() const {
+        return area_top_left & 0x3ff;
+    }
+    uint32_t areaTop() const {
+        return (area_top_left >> 10) & 0x1ff;
+    }
+    uint32_t areaRight() const {
+        return area_bottom_right & 0x3ff;
+    }
+    uint32_t areaBottom() const {
+        return (area_bottom_right >> 10) & 0x1ff;
+    }
+
+    std::unique_ptr<uint16_t[]> vram;
+    SimdLevel simd_level;
+    SpanKernel draw_span;
+
+    // The command being received, command_length words in all
+    std::array<uint32_t, 16> command{};
+    uint32_t command_size = 0;
+    uint32_t command_length = 0;
+    // Set once the first segment of a polyline is drawn, the rest come
+    // one vertex at a time until the terminator
+    bool polyline = false;
+    Transfer transfer;
+
+    // GP0(E1) to GP0(E6) as written
+    uint32_t draw_mode = 0;
+    uint32_t texture_window = 0;
+    uint32_t area_top_left = 0;
+    uint32_t area_bottom_right = 0;
+    uint32_t draw_offset = 0;
+    uint32_t mask_setting = 0;
+    bool texture_disable_allowed = false;
+    bool irq = false;
+
+    std::array<uint8_t, vram_page_count> dirty_pages{};
+    TextureCache texture_cache;
+    bool texture_caching = true;
+
+    // Only used with more than one raster thread. Drawing the batch
+    // changes nothing the guest can tell apart, so it happens whenever
+    // VRAM is looked at, const or not.
+    std::unique_ptr<WorkerPool> workers;
+    mutable std::vector<Primitive> batch;
+    mutable VramCells batch_writes;
+    mutable VramCells batch_reads;
+};
+
+#endif // RENDERER_H
@@ -0,0 +1,190 @@
+#include <algorithm>
+#include <cstring>
+
+#include "log.h"
+#include "rewind.h"
+#include "savestate.h"
+
+static_assert(vram_page_size == dirty_page_size, "VRAM pages go through the same deltas as RAM pages");
+
+namespace {
+    constexpr uint32_t page_words = dirty_page_size / 4;
+
+    // Packs before ^ after as a u16 count of zero words, a u16 count of
+    // literal words and the literals, repeated over the page. Returns an
+    // empty delta if the page didn't change.
+    std::vector<uint8_t> encodePage(const uint8_t* before, const uint8_t* after) {
+        std::vector<uint8_t> delta;
+        uint32_t word = 0;
+        bool changed = false;
+        while(word < page_words) {
+            const uint32_t zeros_start = word;
+            while(word < page_words && readLE<uint32_t>(before + 4 * word) == readLE<uint32_t>(after + 4 * word)) {
+                ++word;
+            }
+            const uint32_t literals_start = word;
+            while(word < page_words && readLE<uint32_t>(before + 4 * word) != readLE<uint32_t>(after + 4 * word)) {
+                ++word;
+            }
+            if(literals_start == word)
+                break;
+
+            changed = true;
+            const size_t pos = delta.size();
+            delta.resize(pos + 4 + 4 * (word - literals_start));
+            writeLE<uint16_t>(delta.data() + pos, static_cast<uint16_t>(literals_start - zeros_start));
+            writeLE<uint16_t>(delta.data() + pos + 2, static_cast<uint16_t>(word - literals_start));
+            for(uint32_t i = literals_start; i < word; ++i) {
+                const uint32_t diff = readLE<uint32_t>(before + 4 * i) ^ readLE<uint32_t>(after + 4 * i);
+                writeLE<uint32_t>(delta.data() + pos + 4 + 4 * (i - literals_start), diff);
+            }
+        }
+        if(!changed)
+            delta.clear();
+        return delta;
+    }
+
+    // Turns the page a delta was encoded against back into the one before
+    void applyDelta(const std::vector<uint8_t>& delta, uint8_t* page) {
+        uint32_t word = 0;
+        for(size_t pos = 0; pos < delta.size();) {
+            word += readLE<uint16_t>(delta.data() + pos);
+            const uint16_t literals = readLE<uint16_t>(delta.data() + pos + 2);
+            pos += 4;
+            for(uint16_t i = 0; i < literals; ++i, ++word, pos += 4) {
+                writeLE<uint32_t>(page + 4 * word, readLE<uint32_t>(page + 4 * word) ^ readLE<uint32_t>(delta.data() + pos));
+            }
+        }
+    }
+} // Anonymous namespace
+
+RewindBuffer::RewindBuffer(CPU& cpu, size_t capacity) : cpu(cpu), capacity(capacity) {
+    for(const Area area : {Area::RAM, Area::VRAM}) {
+        Shadow& shadow = shadows[static_cast<size_t>(area)];
+        shadow.data.resize(pageCount(area) * dirty_page_size);
+        shadow.stale.resize(pageCount(area));
+    }
+}
+
+const uint8_t* RewindBuffer::contents(Area area) const {
+    if(area == Area::RAM)
+        return cpu.getRAM();
+    return reinterpret_cast<const uint8_t*>(cpu.getGpu().getVRAM());
+}
+
+uint32_t RewindBuffer::pageCount(Area area) const {
+    return area == Area::RAM ? dirty_page_count : vram_page_count;
+}
+
+const uint8_t* RewindBuffer::dirtyPages(Area area) const {
+    return area == Area::RAM ? cpu.dirtyPages() : cpu.getGpu().dirtyVramPages();
+}
+
+void RewindBuffer::clearDirtyPages(Area area) {
+    if(area == Area::RAM)
+        cpu.clearDirtyPages();
+    else
+        cpu.getGpu().clearDirtyVramPages();
+}
+
+void RewindBuffer::restorePage(Area area, uint32_t index, const uint8_t* data) {
+    if(area == Area::RAM)
+        cpu.writeRAM(index * dirty_page_size, data, dirty_page_size);
+    else
+        cpu.getGpu().writeVRAM(index * dirty_page_size, data, dirty_page_size);
+}
+
+std::vector<uint8_t> RewindBuffer::changedPages(Area area) const {
+    const Shadow& shadow = shadows[static_cast<size_t>(area)];
+    std::vector<uint8_t> changed(pageCount(area));
+    const uint8_t* dirty = dirtyPages(area);
+    for(uint32_t page = 0; page < changed.size(); ++page) {
+        changed[page] = dirty[page] | shadow.stale[page];
+    }
+    return changed;
+}
+
+void RewindBuffer::capture(Area area) {
+    Shadow& shadow = shadows[static_cast<size_t>(area)];
+    const uint8_t* current = contents(area);
+    if(snapshots.empty()) {
+        std::memcpy(shadow.data.data(), current, shadow.data.size());
+    }
+    else {
+        const std::vector<uint8_t> changed = changedPages(area);
+        std::vector<Page>& pages = snapshots.back().pages;
+        for(uint32_t page = 0; page < changed.size(); ++page) {
+            if(!changed[page])
+                continue;
+            uint8_t* before = shadow.data.data() + page * dirty_page_size;
+            const uint8_t* after = current + page * dirty_page_size;
+            std::vector<uint8_t> delta = encodePage(before, after);
+            if(delta.empty())
+                continue;
+            pages.push_back({area, page, std::move(delta)});
+            std::memcpy(before, after, dirty_page_size);
+        }
+    }
+    clearDirtyPages(area);
+    std::fill(shadow.stale.begin(), shadow.stale.end(), 0);
+}
+
+void RewindBuffer::capture() {
+    capture(Area::RAM);
+    capture(Area::VRAM);
+
+    SavestateWriter writer;
+    cpu.saveState(writer, false);
+    snapshots.push_back({writer.finish(), {}});
+    if(snapshots.size() > capacity)
+        snapshots.pop_front();
+}
+
+void RewindBuffer::restore(Area area) {
+    Shadow& shadow = shadows[static_cast<size_t>(area)];
+    const std::vector<uint8_t> changed = changedPages(area);
+    for(uint32_t page = 0; page < changed.size(); ++page) {
+        if(changed[page])
+            restorePage(area, page, shadow.data.data() + page * dirty_page_size);
+    }
+    clearDirtyPages(area);
+    std::fill(shadow.stale.begin(), shadow.stale.end(), 0);
+}
+
+bool RewindBuffer::rewind() {
+    if(snapshots.empty())
+        return false;
+
+    restore(Area::RAM);
+    restore(Area::VRAM);
+
+    SavestateReader reader;
+    const std::vector<uint8_t>& state = snapshots.back().state;
+    if(!reader.parse(state.data(), state.size()) || !cpu.loadState(reader, false)) {
+        LOG("Rewind: Failed to load the snapshot\n");
+        return false;
+    }
+    snapshots.pop_back();
+
+    // The shadow copies move back to the capture before
+    if(!snapshots.empty()) {
+        for(const Page& page : snapshots.back().pages) {
+            Shadow& shadow = shadows[static_cast<size_t>(page.area)];
+            applyDelta(page.delta, shadow.data.data() + page.index * dirty_page_size);
+            shadow.stale[page.index] = 1;
+        }
+        snapshots.back().pages.clear();
+    }
+    return true;
+}
+
+size_t RewindBuffer::memoryUsage() const {
+    size_t bytes = 0;
+    for(const Snapshot& snapshot : snapshots) {
+        bytes += snapshot.state.size();
+        for(const Page& page : snapshot.pages) {
+            bytes += page.delta.size();
+        }
+    }
+    return bytes;
+}
@@ -0,0 +1,81 @@
+#ifndef REWIND_H
+#define REWIND_H
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+#include "cpu.h"
+
+// A ring of recent snapshots to step the machine back through, meant to
+// be captured once a frame.
+//
+// Only RAM and VRAM pages written since the previous capture are stored,
+// as their contents before the writes, xored with the contents after and
+// packed as runs of zero and literal words. A page the guest touched a few
+// words of shrinks to a few bytes. The newest capture is kept in full in
+// shadow copies of RAM and VRAM, and the rest of the machine is a small
+// savestate without either for every capture.
+//
+// The buffer relies on the dirty pages of the CPU and the GPU, which it
+// clears, so nothing else can use them at the same time.
+class RewindBuffer {
+public:
+    RewindBuffer(CPU& cpu, size_t capacity);
+
+    void capture();
+    // Puts the machine back to the newest capture and drops it, so the
+    // next call goes one further back. Returns false if there's none.
+    bool rewind();
+
+    size_t size() const {
+        return snapshots.size();
+    }
+    // Bytes held by the snapshots, without the shadow copies
+    size_t memoryUsage() const;
+
+private:
+    enum class Area : uint8_t {
+        RAM,
+        VRAM,
+    };
+    static constexpr size_t area_count = 2;
+
+    struct Page {
+        Area area;
+        uint32_t index;
+        std::vector<uint8_t> delta;
+    };
+    struct Snapshot {
+        std::vector<uint8_t> state;
+        // The pages that changed until the next capture, empty for the newest
+        std::vector<Page> pages;
+    };
+
+    struct Shadow {
+        std::vector<uint8_t> data;
+        // Pages the shadow copy was moved back on by a rewind, they differ
+        // from the area without its owner knowing
+        std::vector<uint8_t> stale;
+    };
+
+    // Each area is made of dirty_page_size pages, with its own dirty flags
+    const uint8_t* contents(Area area) const;
+    uint32_t pageCount(Area area) const;
+    const uint8_t* dirtyPages(Area area) const;
+    void clearDirtyPages(Area area);
+    void restorePage(Area area, uint32_t index, const uint8_t* data);
+
+    // Pages where the area may differ from its shadow copy
+    std::vector<uint8_t> changedPages(Area area) const;
+    void capture(Area area);
+    void restore(Area area);
+
+    CPU& cpu;
+    size_t capacity;
+    std::deque<Snapshot> snapshots;
+    std::array<Shadow, area_count> shadows;
+};
+
+#endif // REWIND_H
@@ -0,0 +1,183 @@
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <thread>
+
+#include "log.h"
+#include "savestate.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define SAVESTATE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+    constexpr size_t header_size = sizeof(savestate_magic) + 4 + 4 + 8;
+    constexpr size_t entry_size = 4 + 4 + 8 + 8;
+
+    size_t alignUp(size_t size) {
+        return (size + savestate_alignment - 1) & ~(savestate_alignment - 1);
+    }
+} // Anonymous namespace
+
+SavestateWriter::SavestateWriter() : data(header_size, 0) {
+    std::memcpy(data.data(), savestate_magic, sizeof(savestate_magic));
+}
+
+void SavestateWriter::beginSection(uint32_t tag, uint32_t version) {
+    endSection();
+    data.resize(alignUp(data.size()), 0);
+    sections.push_back({tag, version, data.size(), 0});
+}
+
+void SavestateWriter::endSection() {
+    if(!sections.empty() && !sections.back().size)
+        sections.back().size = data.size() - sections.back().offset;
+}
+
+std::vector<uint8_t> SavestateWriter::finish() {
+    endSection();
+    const size_t table_offset = alignUp(data.size());
+    data.resize(table_offset, 0);
+    for(const Entry& entry : sections) {
+        put(entry.tag);
+        put(entry.version);
+        put(entry.offset);
+        put(entry.size);
+    }
+    writeLE<uint32_t>(data.data() + 8, savestate_version);
+    writeLE<uint32_t>(data.data() + 12, static_cast<uint32_t>(sections.size()));
+    writeLE<uint64_t>(data.data() + 16, table_offset);
+    sections.clear();
+    return std::move(data);
+}
+
+bool SavestateWriter::finishToFile(const std::string& path) {
+    const std::vector<uint8_t> state = finish();
+
+    std::error_code error;
+    const auto parent = std::filesystem::path(path).parent_path();
+    if(!parent.empty())
+        std::filesystem::create_directories(parent, error);
+
+    // Unique per process and thread, the rename publishes it atomically
+    const std::string temp_path = fmt::format("{}.{:x}.{:x}.tmp", path,
+        std::chrono::steady_clock::now().time_since_epoch().count(),
+        std::hash<std::thread::id>{}(std::this_thread::get_id()));
+    {
+        std::ofstream file(temp_path, std::ios::out | std::ios::binary);
+        file.write(reinterpret_cast<const char*>(state.data()), state.size());
+        if(!file) {
+            LOG("Savestate: Failed to write {}\n", temp_path);
+            file.close();
+            std::remove(temp_path.c_str());
+            return false;
+        }
+    }
+    std::filesystem::rename(temp_path, path, error);
+    if(error) {
+        LOG("Savestate: Failed to create {}\n", path);
+        std::remove(temp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+SavestateReader::~SavestateReader() {
+    unmap();
+}
+
+void SavestateReader::unmap() {
+#ifdef SAVESTATE_MMAP
+    if(mapping)
+        munmap(mapping, mapping_size);
+#endif
+    mapping = nullptr;
+    mapping_size = 0;
+}
+
+bool SavestateReader::open(const std::string& path) {
+    unmap();
+    owned.clear();
+#ifdef SAVESTATE_MMAP
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+        return false;
+    struct stat info;
+    if(fstat(fd, &info) != 0 || info.st_size < static_cast<off_t>(header_size)) {
+        LOG("Savestate: {} is too short\n", path);
+        close(fd);
+        return false;
+    }
+    int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+    // Every page gets copied right away, fault them in with one call
+    flags |= MAP_POPULATE;
+#endif
+    void* view = mmap(nullptr, info.st_size, PROT_READ, flags, fd, 0);
+    close(fd);
+    if(view == MAP_FAILED) {
+        LOG("Savestate: Failed to map {}\n", path);
+        return false;
+    }
+    mapping = view;
+    mapping_size = info.st_size;
+    return parse(static_cast<const uint8_t*>(view), mapping_size);
+#else
+    std::ifstream file(path, std::ios::in | std::ios::binary | std::ios::ate);
+    if(!file)
+        return false;
+    owned.resize(static_cast<size_t>(file.tellg()));
+    file.seekg(0);
+    if(!file.read(reinterpret_cast<char*>(owned.data()), owned.size())) {
+        LOG("Savestate: Failed to read {}\n", path);
+        return false;
+    }
+    return parse(owned.data(), owned.size());
+#endif
+}
+
+bool SavestateReader::parse(const uint8_t* state, size_t size) {
+    sections.clear();
+    if(size < header_size || std::memcmp(state, savestate_magic, sizeof(savestate_magic)) != 0) {
+        LOG("Savestate: Bad header\n");
+        return false;
+    }
+    const uint32_t version = readLE<uint32_t>(state + 8);
+    if(version != savestate_version) {
+        LOG("Savestate: Format version {}, expected {}\n", version, savestate_version);
+        return false;
+    }
+    const uint32_t count = readLE<uint32_t>(state + 12);
+    const uint64_t table_offset = readLE<uint64_t>(state + 16);
+    if(table_offset > size || (size - table_offset) / entry_size < count) {
+        LOG("Savestate: Truncated section table\n");
+        return false;
+    }
+
+    for(uint32_t i = 0; i < count; ++i) {
+        const uint8_t* entry = state + table_offset + i * entry_size;
+        const uint64_t offset = readLE<uint64_t>(entry + 8);
+        const uint64_t section_size = readLE<uint64_t>(entry + 16);
+        if(offset > table_offset || section_size > table_offset - offset) {
+            LOG("Savestate: Section {} is out of bounds\n", i);
+            sections.clear();
+            return false;
+        }
+        sections.push_back({readLE<uint32_t>(entry), {readLE<uint32_t>(entry + 4), state + offset, section_size}});
+    }
+    return true;
+}
+
+const SavestateSection* SavestateReader::find(uint32_t tag, uint32_t version) const {
+    for(const Entry& entry : sections) {
+        if(entry.tag == tag && entry.section.version == version)
+            return &entry.section;
+    }
+    return nullptr;
+}
@@ -0,0 +1,105 @@
+#ifndef SAVESTATE_H
+#define SAVESTATE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "mips.h"
+
+// Machine state as a list of sections, one or more per component, so
+// components can be added and change their layout independently.
+//
+// A file starts with a header:
+//
+//   0x00  "PSXSTATE" magic
+//   0x08  u32 format version
+//   0x0c  u32 number of sections
+//   0x10  u64 offset of the section table
+//
+// then the section data, each aligned to savestate_alignment, and the
+// table at the end with for each section its u32 tag, u32 version, u64
+// offset and u64 size. Numbers are little endian. Loading maps the file
+// and copies every section straight out of the mapping.
+constexpr char savestate_magic[8] = {'P', 'S', 'X', 'S', 'T', 'A', 'T', 'E'};
+constexpr uint32_t savestate_version = 1;
+constexpr size_t savestate_alignment = 64;
+
+// Four characters identifying a section, e.g. sectionTag("RAM ")
+constexpr uint32_t sectionTag(const char (&name)[5]) {
+    return static_cast<uint8_t>(name[0]) | static_cast<uint8_t>(name[1]) << 8 |
+           static_cast<uint8_t>(name[2]) << 16 | static_cast<uint32_t>(static_cast<uint8_t>(name[3])) << 24;
+}
+
+class SavestateWriter {
+public:
+    SavestateWriter();
+
+    // Everything put until the next beginSection goes into this one
+    void beginSection(uint32_t tag, uint32_t version);
+    template<typename T>
+    void put(T val) {
+        data.resize(data.size() + sizeof(T));
+        writeLE<T>(data.data() + data.size() - sizeof(T), val);
+    }
+    void putBytes(const uint8_t* bytes, size_t size) {
+        data.insert(data.end(), bytes, bytes + size);
+    }
+
+    // Adds the section table, the writer can't be used after
+    std::vector<uint8_t> finish();
+    // Writes to a temporary file renamed to path once complete, so
+    // readers never see a partial state
+    bool finishToFile(const std::string& path);
+
+private:
+    struct Entry {
+        uint32_t tag;
+        uint32_t version;
+        uint64_t offset;
+        uint64_t size;
+    };
+    void endSection();
+
+    std::vector<uint8_t> data;
+    std::vector<Entry> sections;
+};
+
+struct SavestateSection {
+    uint32_t version;
+    const uint8_t* data;
+    size_t size;
+};
+
+// A parsed state, either mapped from a file or viewing memory owned by
+// the caller
+class SavestateReader {
+public:
+    SavestateReader() = default;
+    ~SavestateReader();
+
+    SavestateReader(const SavestateReader&) = delete;
+    SavestateReader& operator=(const SavestateReader&) = delete;
+
+    // Both return false if it isn't a valid state. Only a missing file
+    // isn't logged.
+    bool open(const std::string& path);
+    bool parse(const uint8_t* state, size_t size);
+
+    // Returns null if there's no section tag of that version
+    const SavestateSection* find(uint32_t tag, uint32_t version) const;
+
+private:
+    struct Entry {
+        uint32_t tag;
+        SavestateSection section;
+    };
+    void unmap();
+
+    std::vector<Entry> sections;
+    void* mapping = nullptr;
+    size_t mapping_size = 0;
+    std::vector<uint8_t> owned;
+};
+
+#endif // SAVESTATE_H
@@ -0,0 +1,52 @@
+#include <algorithm>
+
+#include "scheduler.h"
+#include "log.h"
+
+Scheduler::EventId Scheduler::addEvent(std::string name, Callback callback) {
+    events.push_back({std::move(name), std::move(callback)});
+    return static_cast<EventId>(events.size() - 1);
+}
+
+void Scheduler::schedule(EventId id, uint64_t cycle) {
+    Event& event = events[id];
+    ++event.generation;
+    event.due = cycle;
+    heap.push_back({cycle, sequence++, id, event.generation});
+    std::push_heap(heap.begin(), heap.end(), later);
+    updateNext();
+}
+
+void Scheduler::cancel(EventId id) {
+    Event& event = events[id];
+    if(event.due == never)
+        return;
+    ++event.generation;
+    event.due = never;
+    updateNext();
+}
+
+void Scheduler::runDue() {
+    while(!heap.empty() && heap.front().due <= current) {
+        const Entry entry = heap.front();
+        std::pop_heap(heap.begin(), heap.end(), later);
+        heap.pop_back();
+        if(isStale(entry))
+            continue;
+
+        Event& event = events[entry.id];
+        event.due = never;
+        LOG_DEBUG("Scheduler: {} due at {}, now {}\n", event.name, entry.due, current);
+        // The callback may schedule this or any other event again
+        event.callback(entry.due);
+    }
+    updateNext();
+}
+
+void Scheduler::updateNext() {
+    while(!heap.empty() && isStale(heap.front())) {
+        std::pop_heap(heap.begin(), heap.end(), later);
+        heap.pop_back();
+    }
+    next = heap.empty() ? never : heap.front().due;
+}
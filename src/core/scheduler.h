@@ -0,0 +1,100 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <string>
+#include <vector>
+
+// Guest time and the hardware events due at some point of it.
+//
+// Components register their kinds of events once, then schedule them at
+// a cycle. The CPU advances time after every block or instruction and
+// only has to compare against the earliest pending event, the callbacks
+// run once it's reached. Each kind of event is pending at most once,
+// scheduling it again moves it.
+class Scheduler {
+public:
+    using EventId = uint32_t;
+    // Gets the cycle the event was due at, which can be a little earlier
+    // than now() since blocks run to completion
+    using Callback = std::function<void(uint64_t due)>;
+
+    static constexpr uint64_t never = std::numeric_limits<uint64_t>::max();
+
+    Scheduler() = default;
+
+    Scheduler(const Scheduler&) = delete;
+    Scheduler& operator=(const Scheduler&) = delete;
+
+    EventId addEvent(std::string name, Callback callback);
+
+    void schedule(EventId id, uint64_t cycle);
+    void scheduleIn(EventId id, uint64_t delay) {
+        schedule(id, current + delay);
+    }
+    void cancel(EventId id);
+    bool isScheduled(EventId id) const {
+        return events[id].due != never;
+    }
+    // never if it isn't scheduled
+    uint64_t dueAt(EventId id) const {
+        return events[id].due;
+    }
+
+    // Cycles since power on, as of the last block boundary
+    uint64_t now() const {
+        return current;
+    }
+    // Cycle of the earliest pending event, never if there's none
+    uint64_t nextEvent() const {
+        return next;
+    }
+
+    // Moves time without running anything, for loading saved states.
+    // Pending events keep their cycle.
+    void setNow(uint64_t cycle) {
+        current = cycle;
+    }
+
+    void advance(uint64_t cycles) {
+        current += cycles;
+        if(current >= next)
+            runDue();
+    }
+
+private:
+    struct Event {
+        std::string name;
+        Callback callback;
+        uint64_t due = never;
+        // Bumped whenever the event moves, so older heap entries are ignored
+        uint32_t generation = 0;
+    };
+    struct Entry {
+        uint64_t due;
+        uint64_t sequence; // Keeps events due on the same cycle in order
+        EventId id;
+        uint32_t generation;
+    };
+    static bool later(const Entry& a, const Entry& b) {
+        return a.due != b.due ? a.due > b.due : a.sequence > b.sequence;
+    }
+
+    void runDue();
+    bool isStale(const Entry& entry) const {
+        return events[entry.id].generation != entry.generation;
+    }
+    // Drops stale entries from the top of the heap and updates next
+    void updateNext();
+
+    std::vector<Event> events;
+    // Min-heap on the due cycle, may hold stale entries
+    std::vector<Entry> heap;
+    uint64_t sequence = 0;
+    uint64_t current = 0;
+    uint64_t next = never;
+};
+
+#endif // SCHEDULER_H
@@ -0,0 +1,112 @@
+#include <algorithm>
+
+#include "texture_cache.h"
+
+namespace {
+    constexpr uint32_t page_size = 256;
+
+    // Whether [a, a + a_size) and [b, b + b_size) overlap, both wrapping
+    // at size, a power of two
+    bool overlaps(uint32_t a, uint32_t a_size, uint32_t b, uint32_t b_size, uint32_t size) {
+        if(!a_size || !b_size)
+            return false;
+        return ((b - a) & (size - 1)) < a_size || ((a - b) & (size - 1)) < b_size;
+    }
+
+    // Halfwords of VRAM taken by a row of the page and by the CLUT
+    uint32_t pageWidth(const TextureSource& tex) {
+        return tex.depth == TextureDepth::Bits4 ? 64 : 128;
+    }
+    uint32_t clutWidth(const TextureSource& tex) {
+        return tex.depth == TextureDepth::Bits4 ? 16 : 256;
+    }
+} // Anonymous namespace
+
+uint32_t TextureCache::keyOf(const TextureSource& tex) {
+    return 1u << 31 | static_cast<uint32_t>(tex.depth) << 24 | (tex.page_x / 64) << 20 | (tex.page_y / 256) << 19 |
+           (tex.clut_x / 16) << 9 | tex.clut_y;
+}
+
+const uint16_t* TextureCache::lookup(const uint16_t* vram, const TextureSource& tex, uint32_t first,
+                                     uint32_t count) {
+    const uint32_t key = keyOf(tex);
+    Entry* entry = nullptr;
+    for(Entry& candidate : entries) {
+        if(candidate.key == key) {
+            entry = &candidate;
+            break;
+        }
+    }
+    if(!entry) {
+        // Free entries were last used at 0
+        entry = &*std::min_element(entries.begin(), entries.end(),
+                                   [](const Entry& a, const Entry& b) { return a.last_used < b.last_used; });
+        entry->key = key;
+        entry->source = tex;
+        entry->rows.reset();
+        if(!entry->texels)
+            entry->texels = std::make_unique<uint16_t[]>(page_size * page_size + vram_padding);
+    }
+    entry->last_used = ++clock;
+
+    for(uint32_t i = 0; i < std::min(count, page_size); ++i) {
+        const uint32_t v = (first + i) & (page_size - 1);
+        if(!entry->rows[v])
+            decodeRow(vram, *entry, v);
+    }
+    return entry->texels.get();
+}
+
+bool TextureCache::wouldEvict(const TextureSource& tex) const {
+    const uint32_t key = keyOf(tex);
+    return std::none_of(entries.begin(), entries.end(),
+                        [&](const Entry& entry) { return entry.key == key || entry.key == 0; });
+}
+
+void TextureCache::decodeRow(const uint16_t* vram, Entry& entry, uint32_t v) {
+    const TextureSource& tex = entry.source;
+    const uint16_t* row = vram + ((tex.page_y + v) & (vram_height - 1)) * vram_width;
+    const uint16_t* clut = vram + tex.clut_y * vram_width;
+    uint16_t* out = &entry.texels[v * page_size];
+    if(tex.depth == TextureDepth::Bits4) {
+        for(uint32_t u = 0; u < page_size; ++u) {
+            const uint32_t index = (row[(tex.page_x + u / 4) & (vram_width - 1)] >> (4 * (u & 3))) & 0xf;
+            out[u] = clut[(tex.clut_x + index) & (vram_width - 1)];
+        }
+    }
+    else {
+        for(uint32_t u = 0; u < page_size; ++u) {
+            const uint32_t index = (row[(tex.page_x + u / 2) & (vram_width - 1)] >> (8 * (u & 1))) & 0xff;
+            out[u] = clut[(tex.clut_x + index) & (vram_width - 1)];
+        }
+    }
+    entry.rows.set(v);
+}
+
+void TextureCache::invalidate(uint32_t x, uint32_t y, uint32_t width, uint32_t height) {
+    for(Entry& entry : entries) {
+        if(!entry.key || entry.rows.none())
+            continue;
+        const TextureSource& tex = entry.source;
+        if(overlaps(x, width, tex.clut_x, clutWidth(tex), vram_width) &&
+           overlaps(y, height, tex.clut_y, 1, vram_height)) {
+            entry.rows.reset();
+            continue;
+        }
+        if(!overlaps(x, width, tex.page_x, pageWidth(tex), vram_width) ||
+           !overlaps(y, height, tex.page_y, page_size, vram_height))
+            continue;
+        for(uint32_t v = 0; v < page_size; ++v) {
+            if(((tex.page_y + v - y) & (vram_height - 1)) < height)
+                entry.rows.reset(v);
+        }
+    }
+}
+
+void TextureCache::clear() {
+    for(Entry& entry : entries) {
+        entry.key = 0;
+        entry.last_used = 0;
+        entry.rows.reset();
+    }
+}
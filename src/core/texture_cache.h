@@ -0,0 +1,51 @@
+#ifndef TEXTURE_CACHE_H
+#define TEXTURE_CACHE_H
+
+#include <array>
+#include <bitset>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "raster.h"
+
+// Texture pages of 4 and 8 bit texels already looked up in their CLUT,
+// 256x256 halfwords each, so drawing them is a plain fetch per texel like
+// 15 bit textures. A page is decoded a row at a time as primitives need
+// its rows. A VRAM write drops the rows of the pages it overlaps, or the
+// whole page if it overlaps the CLUT.
+class TextureCache {
+public:
+    static constexpr size_t entry_count = 32;
+
+    // The decoded texels of tex, a 4 or 8 bit texture, with row v starting
+    // at v * 256. The count rows from first on, wrapping after 255, are
+    // decoded from vram. The texels stay valid until the next call that
+    // wouldEvict them, invalidate or clear.
+    const uint16_t* lookup(const uint16_t* vram, const TextureSource& tex, uint32_t first, uint32_t count);
+    // Whether looking tex up would drop another page to make room
+    bool wouldEvict(const TextureSource& tex) const;
+
+    // VRAM within the rectangle changed, it wraps around the edges
+    void invalidate(uint32_t x, uint32_t y, uint32_t width, uint32_t height);
+    void clear();
+
+private:
+    struct Entry {
+        // Depth, texture page and CLUT, 0 while the entry is free
+        uint32_t key = 0;
+        TextureSource source;
+        uint64_t last_used = 0;
+        std::bitset<256> rows;
+        // Padded like VRAM for the gathers
+        std::unique_ptr<uint16_t[]> texels;
+    };
+
+    static uint32_t keyOf(const TextureSource& tex);
+    void decodeRow(const uint16_t* vram, Entry& entry, uint32_t v);
+
+    std::array<Entry, entry_count> entries;
+    uint64_t clock = 0;
+};
+
+#endif // TEXTURE_CACHE_H
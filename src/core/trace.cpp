@@ -0,0 +1,236 @@
+#include <cstring>
+
+#include "trace.h"
+#include "log.h"
+
+namespace {
+    constexpr uint32_t zigzag(uint32_t delta) {
+        return (delta << 1) ^ static_cast<uint32_t>(static_cast<int32_t>(delta) >> 31);
+    }
+    constexpr uint32_t unzigzag(uint32_t val) {
+        return (val >> 1) ^ (0u - (val & 1));
+    }
+
+    size_t cacheIndex(uint32_t pc) {
+        return (pc >> 2) % trace_instruction_cache_size;
+    }
+
+    uint8_t log2Size(uint8_t size) {
+        return size == 4 ? 2 : size == 2 ? 1 : 0;
+    }
+} // Anonymous namespace
+
+TraceWriter::~TraceWriter() {
+    if(file) {
+        flush();
+        std::fclose(file);
+    }
+}
+
+std::unique_ptr<TraceWriter> TraceWriter::create(const std::string& path, uint32_t pc, const std::array<uint32_t, 32>& regs) {
+    std::FILE* file = std::fopen(path.c_str(), "wb");
+    if(!file) {
+        LOG("Trace: Failed to create {}\n", path);
+        return nullptr;
+    }
+    // Writes go through our own buffer
+    std::setvbuf(file, nullptr, _IONBF, 0);
+
+    std::unique_ptr<TraceWriter> writer(new TraceWriter());
+    writer->file = file;
+    writer->buffer.resize(buffer_size);
+    writer->regs = regs;
+    writer->prev_pc = pc - 4;
+
+    std::memcpy(writer->buffer.data(), trace_magic, sizeof(trace_magic));
+    writer->pos = sizeof(trace_magic);
+    const auto put32 = [&](uint32_t val) {
+        for(int i = 0; i < 4; ++i) {
+            writer->putByte(static_cast<uint8_t>(val >> (8 * i)));
+        }
+    };
+    put32(trace_version);
+    put32(pc);
+    for(const uint32_t reg : regs) {
+        put32(reg);
+    }
+    return writer;
+}
+
+void TraceWriter::beginOp(uint32_t pc, uint32_t instruction) {
+    op_pc = pc;
+    op_instruction = instruction;
+    reg_count = 0;
+    mem_count = 0;
+}
+
+void TraceWriter::regWrite(uint8_t reg, uint32_t val) {
+    if(reg_count < trace_max_regs)
+        op_regs[reg_count++] = {reg, val};
+}
+
+void TraceWriter::memAccess(bool store, uint8_t size, uint32_t addr, uint32_t val) {
+    if(mem_count < trace_max_mems)
+        op_mems[mem_count++] = {store, size, addr, val};
+}
+
+void TraceWriter::endOp() {
+    if(pos > buffer_size - max_record_size)
+        flush();
+
+    auto& cached = instruction_cache[cacheIndex(op_pc)];
+    const bool jump = op_pc != prev_pc + 4;
+    const bool new_instruction = cached.first != op_pc || cached.second != op_instruction;
+
+    putByte((jump ? trace_pc_jump : 0) | (new_instruction ? trace_new_instruction : 0) |
+            (reg_count << trace_reg_shift) | (mem_count << trace_mem_shift));
+    if(jump)
+        putDelta(op_pc, prev_pc + 4);
+    if(new_instruction) {
+        for(int i = 0; i < 4; ++i) {
+            putByte(static_cast<uint8_t>(op_instruction >> (8 * i)));
+        }
+        cached = {op_pc, op_instruction};
+    }
+    for(uint8_t i = 0; i < reg_count; ++i) {
+        const auto [reg, val] = op_regs[i];
+        putByte(reg);
+        putDelta(val, regs[reg]);
+        regs[reg] = val;
+    }
+    for(uint8_t i = 0; i < mem_count; ++i) {
+        const TraceMemoryAccess& access = op_mems[i];
+        putByte((access.store ? 1 : 0) | (log2Size(access.size) << 1));
+        putDelta(access.addr, prev_mem_addr);
+        putVarint(access.val);
+        prev_mem_addr = access.addr;
+    }
+    prev_pc = op_pc;
+}
+
+void TraceWriter::flush() {
+    if(pos && std::fwrite(buffer.data(), 1, pos, file) != pos)
+        LOG("Trace: Write failed, the trace is incomplete\n");
+    pos = 0;
+}
+
+void TraceWriter::putVarint(uint32_t val) {
+    while(val >= 0x80) {
+        putByte(static_cast<uint8_t>(val) | 0x80);
+        val >>= 7;
+    }
+    putByte(static_cast<uint8_t>(val));
+}
+
+void TraceWriter::putDelta(uint32_t val, uint32_t prev) {
+    putVarint(zigzag(val - prev));
+}
+
+TraceReader::~TraceReader() {
+    if(file)
+        std::fclose(file);
+}
+
+bool TraceReader::open(const std::string& path) {
+    file = std::fopen(path.c_str(), "rb");
+    if(!file)
+        return false;
+
+    char magic[sizeof(trace_magic)];
+    if(std::fread(magic, 1, sizeof(magic), file) != sizeof(magic) || std::memcmp(magic, trace_magic, sizeof(magic)) != 0)
+        return false;
+
+    const auto get32 = [&](uint32_t& val) {
+        uint8_t bytes[4];
+        if(std::fread(bytes, 1, 4, file) != 4)
+            return false;
+        val = bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | (static_cast<uint32_t>(bytes[3]) << 24);
+        return true;
+    };
+    uint32_t version;
+    uint32_t pc;
+    if(!get32(version) || version != trace_version || !get32(pc))
+        return false;
+    for(uint32_t& reg : regs) {
+        if(!get32(reg))
+            return false;
+    }
+    prev_pc = pc - 4;
+    return true;
+}
+
+bool TraceReader::next(TraceRecord& record) {
+    uint8_t flags;
+    if(!getByte(flags))
+        return false;
+
+    record.pc = prev_pc + 4;
+    if(flags & trace_pc_jump && !getDelta(record.pc, prev_pc + 4))
+        return false;
+
+    auto& cached = instruction_cache[cacheIndex(record.pc)];
+    if(flags & trace_new_instruction) {
+        uint8_t bytes[4];
+        if(std::fread(bytes, 1, 4, file) != 4)
+            return false;
+        record.instruction = bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | (static_cast<uint32_t>(bytes[3]) << 24);
+        cached = {record.pc, record.instruction};
+    }
+    else {
+        record.instruction = cached.second;
+    }
+
+    record.reg_writes.clear();
+    const uint8_t reg_count = (flags >> trace_reg_shift) & trace_max_regs;
+    for(uint8_t i = 0; i < reg_count; ++i) {
+        uint8_t reg;
+        if(!getByte(reg) || reg >= regs.size() || !getDelta(regs[reg], regs[reg]))
+            return false;
+        record.reg_writes.emplace_back(reg, regs[reg]);
+    }
+
+    record.mem_accesses.clear();
+    const uint8_t mem_count = (flags >> trace_mem_shift) & trace_max_mems;
+    for(uint8_t i = 0; i < mem_count; ++i) {
+        uint8_t kind;
+        TraceMemoryAccess access;
+        if(!getByte(kind) || !getDelta(access.addr, prev_mem_addr) || !getVarint(access.val))
+            return false;
+        access.store = kind & 1;
+        access.size = 1 << ((kind >> 1) & 3);
+        prev_mem_addr = access.addr;
+        record.mem_accesses.push_back(access);
+    }
+
+    prev_pc = record.pc;
+    return true;
+}
+
+bool TraceReader::getByte(uint8_t& val) {
+    const int c = std::fgetc(file);
+    if(c == EOF)
+        return false;
+    val = static_cast<uint8_t>(c);
+    return true;
+}
+
+bool TraceReader::getVarint(uint32_t& val) {
+    val = 0;
+    for(int shift = 0; shift < 35; shift += 7) {
+        uint8_t byte;
+        if(!getByte(byte))
+            return false;
+        val |= static_cast<uint32_t>(byte & 0x7f) << shift;
+        if(!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+bool TraceReader::getDelta(uint32_t& val, uint32_t prev) {
+    uint32_t delta;
+    if(!getVarint(delta))
+        return false;
+    val = prev + unzigzag(delta);
+    return true;
+}
@@ -0,0 +1,128 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Binary execution trace, one record per executed instruction.
+//
+// The file starts with a header: the 8 byte magic, a u32 version, the pc
+// of the first instruction and the 32 registers at the start of the trace.
+// Each record is a flags byte followed by:
+//  - the pc as a zigzag varint delta from the previous pc + 4, only if
+//    the trace_pc_jump flag is set
+//  - the raw instruction, only if the trace_new_instruction flag is set.
+//    Otherwise it's the same word that was last traced at this pc, both
+//    sides keep a small direct mapped cache of them.
+//  - the register writes: register number, then the new value as a zigzag
+//    varint delta from the previous value of the register
+//  - the memory accesses: kind byte (bit 0 set for stores, bits 1-2 the
+//    log2 of the size), the address as a zigzag varint delta from the
+//    previous access and the value as a varint
+// Numbers in the header are little endian.
+constexpr char trace_magic[8] = {'P', 'S', 'X', 'T', 'R', 'A', 'C', 'E'};
+constexpr uint32_t trace_version = 1;
+
+constexpr uint8_t trace_pc_jump = 0x01;
+constexpr uint8_t trace_new_instruction = 0x02;
+constexpr uint8_t trace_reg_shift = 2;
+constexpr uint8_t trace_mem_shift = 5;
+constexpr uint8_t trace_max_regs = 7;
+constexpr uint8_t trace_max_mems = 7;
+
+constexpr size_t trace_instruction_cache_size = 4096;
+
+struct TraceMemoryAccess {
+    bool store;
+    uint8_t size;
+    uint32_t addr;
+    uint32_t val;
+};
+
+struct TraceRecord {
+    uint32_t pc;
+    uint32_t instruction;
+    std::vector<std::pair<uint8_t, uint32_t>> reg_writes;
+    std::vector<TraceMemoryAccess> mem_accesses;
+};
+
+class TraceWriter {
+public:
+    ~TraceWriter();
+
+    TraceWriter(const TraceWriter&) = delete;
+    TraceWriter& operator=(const TraceWriter&) = delete;
+
+    // Returns null if the file can't be created
+    static std::unique_ptr<TraceWriter> create(const std::string& path, uint32_t pc, const std::array<uint32_t, 32>& regs);
+
+    void beginOp(uint32_t pc, uint32_t instruction);
+    // Extra writes or accesses beyond the limits of a record are dropped
+    void regWrite(uint8_t reg, uint32_t val);
+    void memAccess(bool store, uint8_t size, uint32_t addr, uint32_t val);
+    void endOp();
+
+    // Writes out everything recorded so far
+    void flush();
+
+private:
+    TraceWriter() = default;
+
+    void putByte(uint8_t val) {
+        buffer[pos++] = val;
+    }
+    void putVarint(uint32_t val);
+    void putDelta(uint32_t val, uint32_t prev);
+
+    // Worst case size of a record
+    static constexpr size_t max_record_size = 1 + 5 + 4 + trace_max_regs * 6 + trace_max_mems * 11;
+    static constexpr size_t buffer_size = 4 * 1024 * 1024;
+
+    std::FILE* file = nullptr;
+    std::vector<uint8_t> buffer;
+    size_t pos = 0;
+
+    uint32_t prev_pc = 0;
+    uint32_t prev_mem_addr = 0;
+    std::array<uint32_t, 32> regs{};
+    std::array<std::pair<uint32_t, uint32_t>, trace_instruction_cache_size> instruction_cache{};
+
+    // The record being built, encoded in endOp
+    uint8_t reg_count = 0;
+    uint8_t mem_count = 0;
+    uint32_t op_pc = 0;
+    uint32_t op_instruction = 0;
+    std::array<std::pair<uint8_t, uint32_t>, trace_max_regs> op_regs{};
+    std::array<TraceMemoryAccess, trace_max_mems> op_mems{};
+};
+
+class TraceReader {
+public:
+    ~TraceReader();
+
+    // Returns false if the file isn't a trace this version can read
+    bool open(const std::string& path);
+    // Returns false at the end of the trace
+    bool next(TraceRecord& record);
+
+    const std::array<uint32_t, 32>& registers() const {
+        return regs;
+    }
+
+private:
+    bool getByte(uint8_t& val);
+    bool getVarint(uint32_t& val);
+    bool getDelta(uint32_t& val, uint32_t prev);
+
+    std::FILE* file = nullptr;
+    uint32_t prev_pc = 0;
+    uint32_t prev_mem_addr = 0;
+    std::array<uint32_t, 32> regs{};
+    std::array<std::pair<uint32_t, uint32_t>, trace_instruction_cache_size> instruction_cache{};
+};
+
+#endif // TRACE_H
@@ -0,0 +1,54 @@
+#include "worker_pool.h"
+
+WorkerPool::WorkerPool(uint32_t size) {
+    for(uint32_t index = 1; index < size; ++index) {
+        threads.emplace_back(&WorkerPool::workerLoop, this, index);
+    }
+}
+
+WorkerPool::~WorkerPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    job_ready.notify_all();
+    for(std::thread& thread : threads) {
+        thread.join();
+    }
+}
+
+void WorkerPool::run(const Job& job) {
+    if(threads.empty()) {
+        job(0);
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        this->job = &job;
+        remaining = static_cast<uint32_t>(threads.size());
+        ++generation;
+    }
+    job_ready.notify_all();
+    job(0);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    job_done.wait(lock, [&] { return remaining == 0; });
+    this->job = nullptr;
+}
+
+void WorkerPool::workerLoop(uint32_t index) {
+    uint64_t seen = 0;
+    std::unique_lock<std::mutex> lock(mutex);
+    while(true) {
+        job_ready.wait(lock, [&] { return stopping || generation != seen; });
+        if(stopping)
+            return;
+        seen = generation;
+        const Job& current = *job;
+        lock.unlock();
+        current(index);
+        lock.lock();
+        if(--remaining == 0)
+            job_done.notify_one();
+    }
+}
@@ -0,0 +1,45 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of threads going through one job at a time, each given the
+// index of its share of the work. The thread calling run does share 0, so
+// a pool of size n starts n - 1 threads.
+class WorkerPool {
+public:
+    using Job = std::function<void(uint32_t index)>;
+
+    explicit WorkerPool(uint32_t size);
+    ~WorkerPool();
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    uint32_t size() const {
+        return static_cast<uint32_t>(threads.size()) + 1;
+    }
+    // Calls job once for every index below size() and returns once all
+    // calls did. Only one thread may run jobs at a time.
+    void run(const Job& job);
+
+private:
+    void workerLoop(uint32_t index);
+
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable job_ready;
+    std::condition_variable job_done;
+    const Job* job = nullptr;
+    // Bumped for every job, workers take each one once
+    uint64_t generation = 0;
+    uint32_t remaining = 0;
+    bool stopping = false;
+};
+
+#endif // WORKER_POOL_H
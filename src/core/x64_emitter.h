@@ -0,0 +1,320 @@
+#ifndef X64_EMITTER_H
+#define X64_EMITTER_H
+
+#include <cstdint>
+#include <cstring>
+
+// Minimal x86-64 machine code emitter with just what the recompiler needs.
+// Only the eight legacy registers are supported, memory operands are
+// [base + disp32], [base + index*4 + disp32] or [base + index].
+namespace x64 {
+
+enum Reg : uint8_t {
+    RAX = 0,
+    RCX = 1,
+    RDX = 2,
+    RBX = 3,
+    RSP = 4,
+    RBP = 5,
+    RSI = 6,
+    RDI = 7,
+};
+
+enum class Cond : uint8_t {
+    B = 0x2,  // below (unsigned)
+    E = 0x4,  // equal / zero
+    NE = 0x5, // not equal / not zero
+};
+
+// Group 1 ALU operations, the value is the /digit of the 0x81 encoding
+enum class Alu : uint8_t {
+    ADD = 0,
+    OR = 1,
+    AND = 4,
+    SUB = 5,
+    XOR = 6,
+    CMP = 7,
+};
+
+// Position of a rel32 field waiting for its target
+struct Label {
+    size_t pos;
+};
+
+class Emitter {
+public:
+    Emitter(uint8_t* buffer, size_t capacity) : code(buffer), capacity(capacity) {}
+
+    uint8_t* begin() const {
+        return code;
+    }
+    size_t size() const {
+        return pos;
+    }
+    // Set if the emitter ran out of space, the code must be discarded
+    bool overflowed() const {
+        return overflow;
+    }
+
+    void push(Reg r) {
+        emit8(0x50 + r);
+    }
+    void pop(Reg r) {
+        emit8(0x58 + r);
+    }
+    void ret() {
+        emit8(0xc3);
+    }
+    void nop() {
+        emit8(0x90);
+    }
+
+    // 64 bit register moves and immediates
+    void mov64(Reg dst, Reg src) {
+        emit8(0x48);
+        emit8(0x89);
+        emit8(0xc0 | (src << 3) | dst);
+    }
+    void mov64(Reg dst, uint64_t imm) {
+        emit8(0x48);
+        emit8(0xb8 + dst);
+        emit64(imm);
+    }
+    void addRsp(int8_t imm) {
+        emit8(0x48);
+        emit8(0x83);
+        emit8(0xc4);
+        emit8(static_cast<uint8_t>(imm));
+    }
+    void subRsp(int8_t imm) {
+        emit8(0x48);
+        emit8(0x83);
+        emit8(0xec);
+        emit8(static_cast<uint8_t>(imm));
+    }
+    void call(Reg r) {
+        emit8(0xff);
+        emit8(0xd0 | r);
+    }
+
+    // 32 bit operations
+    void mov(Reg dst, uint32_t imm) {
+        emit8(0xb8 + dst);
+        emit32(imm);
+    }
+    void mov(Reg dst, Reg base, int32_t disp) {
+        emit8(0x8b);
+        modrmDisp(dst, base, disp);
+    }
+    void mov(Reg base, int32_t disp, Reg src) {
+        emit8(0x89);
+        modrmDisp(src, base, disp);
+    }
+    void movImm(Reg base, int32_t disp, uint32_t imm) {
+        emit8(0xc7);
+        modrmDisp(0, base, disp);
+        emit32(imm);
+    }
+    // mov [base + index*4 + disp], src
+    void movIndexed(Reg base, Reg index, int32_t disp, Reg src) {
+        emit8(0x89);
+        emit8(0x84 | (src << 3));
+        emit8(0x80 | (index << 3) | base);
+        emit32(static_cast<uint32_t>(disp));
+    }
+    // mov dst, [base + index]
+    void movLoadIndexed(Reg dst, Reg base, Reg index) {
+        emit8(0x8b);
+        modrmSib(dst, base, index);
+    }
+    // mov [base + index], src
+    void movStoreIndexed(Reg base, Reg index, Reg src) {
+        emit8(0x89);
+        modrmSib(src, base, index);
+    }
+    // Zero or sign extending byte and word loads from [base + index]
+    void movzxByteIndexed(Reg dst, Reg base, Reg index) {
+        emit8(0x0f);
+        emit8(0xb6);
+        modrmSib(dst, base, index);
+    }
+    void movsxByteIndexed(Reg dst, Reg base, Reg index) {
+        emit8(0x0f);
+        emit8(0xbe);
+        modrmSib(dst, base, index);
+    }
+    void movzxWordIndexed(Reg dst, Reg base, Reg index) {
+        emit8(0x0f);
+        emit8(0xb7);
+        modrmSib(dst, base, index);
+    }
+    void movsxWordIndexed(Reg dst, Reg base, Reg index) {
+        emit8(0x0f);
+        emit8(0xbf);
+        modrmSib(dst, base, index);
+    }
+    // Byte store, src has to be one of al, cl, dl or bl
+    void movByteStoreIndexed(Reg base, Reg index, Reg src) {
+        emit8(0x88);
+        modrmSib(src, base, index);
+    }
+    void movWordStoreIndexed(Reg base, Reg index, Reg src) {
+        emit8(0x66);
+        emit8(0x89);
+        modrmSib(src, base, index);
+    }
+    void mov(Reg dst, Reg src) {
+        emit8(0x89);
+        emit8(0xc0 | (src << 3) | dst);
+    }
+    void movzxByte(Reg dst, Reg base, int32_t disp) {
+        emit8(0x0f);
+        emit8(0xb6);
+        modrmDisp(dst, base, disp);
+    }
+    void movByteImm(Reg base, int32_t disp, uint8_t imm) {
+        emit8(0xc6);
+        modrmDisp(0, base, disp);
+        emit8(imm);
+    }
+    void alu(Alu op, Reg dst, uint32_t imm) {
+        emit8(0x81);
+        emit8(0xc0 | (static_cast<uint8_t>(op) << 3) | dst);
+        emit32(imm);
+    }
+    void alu(Alu op, Reg dst, Reg base, int32_t disp) {
+        // The reg, r/m form of each group 1 op is 8 * /digit + 3
+        emit8(static_cast<uint8_t>(op) * 8 + 3);
+        modrmDisp(dst, base, disp);
+    }
+    void alu(Alu op, Reg dst, Reg src) {
+        emit8(static_cast<uint8_t>(op) * 8 + 3);
+        emit8(0xc0 | (dst << 3) | src);
+    }
+    void aluMemImm8(Alu op, Reg base, int32_t disp, int8_t imm) {
+        emit8(0x83);
+        modrmDisp(static_cast<uint8_t>(op), base, disp);
+        emit8(static_cast<uint8_t>(imm));
+    }
+    // cmp byte [base + index + disp], imm
+    void cmpByteIndexed(Reg base, Reg index, int32_t disp, uint8_t imm) {
+        emit8(0x80);
+        emit8(0x84 | (static_cast<uint8_t>(Alu::CMP) << 3));
+        emit8((index << 3) | base);
+        emit32(static_cast<uint32_t>(disp));
+        emit8(imm);
+    }
+    // mov byte [base + index + disp], imm
+    void movByteImmIndexed(Reg base, Reg index, int32_t disp, uint8_t imm) {
+        emit8(0xc6);
+        emit8(0x84);
+        emit8((index << 3) | base);
+        emit32(static_cast<uint32_t>(disp));
+        emit8(imm);
+    }
+    void shl(Reg dst, uint8_t amount) {
+        emit8(0xc1);
+        emit8(0xe0 | dst);
+        emit8(amount);
+    }
+    void shr(Reg dst, uint8_t amount) {
+        emit8(0xc1);
+        emit8(0xe8 | dst);
+        emit8(amount);
+    }
+    void testImm(Reg dst, uint32_t imm) {
+        emit8(0xf7);
+        emit8(0xc0 | dst);
+        emit32(imm);
+    }
+    void testImm(Reg base, int32_t disp, uint32_t imm) {
+        emit8(0xf7);
+        modrmDisp(0, base, disp);
+        emit32(imm);
+    }
+    void test(Reg a, Reg b) {
+        emit8(0x85);
+        emit8(0xc0 | (b << 3) | a);
+    }
+    void testByte(Reg a, Reg b) {
+        emit8(0x84);
+        emit8(0xc0 | (b << 3) | a);
+    }
+    void setcc(Cond cond, Reg dst) {
+        emit8(0x0f);
+        emit8(0x90 | static_cast<uint8_t>(cond));
+        emit8(0xc0 | dst);
+    }
+    void movzxByte(Reg dst, Reg src) {
+        emit8(0x0f);
+        emit8(0xb6);
+        emit8(0xc0 | (dst << 3) | src);
+    }
+
+    // Jumps, always with rel32 displacements
+    Label jcc(Cond cond) {
+        emit8(0x0f);
+        emit8(0x80 | static_cast<uint8_t>(cond));
+        emit32(0);
+        return Label{pos};
+    }
+    Label jmp() {
+        emit8(0xe9);
+        emit32(0);
+        return Label{pos};
+    }
+    void bind(Label label) {
+        if(overflow)
+            return;
+        const int32_t rel = static_cast<int32_t>(pos - label.pos);
+        std::memcpy(code + label.pos - 4, &rel, 4);
+    }
+    static constexpr size_t jmp_size = 5;
+    // Overwrites the jmp_size bytes at site with a jump to target
+    static void patchJmp(uint8_t* site, const uint8_t* target) {
+        const int32_t rel = static_cast<int32_t>(target - (site + jmp_size));
+        site[0] = 0xe9;
+        std::memcpy(site + 1, &rel, 4);
+    }
+
+private:
+    // [base + index] with a zero disp8, which also works for rbp as base
+    void modrmSib(uint8_t reg, Reg base, Reg index) {
+        emit8(0x44 | (reg << 3));
+        emit8((index << 3) | base);
+        emit8(0);
+    }
+    void modrmDisp(uint8_t reg, Reg base, int32_t disp) {
+        emit8(0x80 | (reg << 3) | base);
+        if(base == RSP)
+            emit8(0x24);
+        emit32(static_cast<uint32_t>(disp));
+    }
+
+    void emit8(uint8_t val) {
+        if(pos >= capacity) {
+            overflow = true;
+            return;
+        }
+        code[pos++] = val;
+    }
+    void emit32(uint32_t val) {
+        for(int i = 0; i < 4; ++i) {
+            emit8(static_cast<uint8_t>(val >> (8 * i)));
+        }
+    }
+    void emit64(uint64_t val) {
+        for(int i = 0; i < 8; ++i) {
+            emit8(static_cast<uint8_t>(val >> (8 * i)));
+        }
+    }
+
+    uint8_t* code;
+    size_t capacity;
+    size_t pos = 0;
+    bool overflow = false;
+};
+
+} // namespace x64
+
+#endif // X64_EMITTER_H
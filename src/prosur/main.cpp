@@ -12,9 +12,15 @@
 #include <fmt/core.h>
 #include <fmt/os.h>
 
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
 #include <memory>
+#include <vector>
 
+#include "core/boot_cache.h"
 #include "core/cpu.h"
+#include "core/psexe.h"
 
 #ifdef _WIN32
 std::string UTF16ToUTF8(const std::wstring& input) {
@@ -35,9 +41,104 @@ std::string UTF16ToUTF8(const std::wstring& input) {
 }
 #endif
 
+// Run a video frame worth of cycles at a time, other components
+// get to sync in between
+constexpr uint64_t frame_cycles = cpu_clock / 60;
+// The BIOS takes a few seconds, give up on caching its boot after this
+constexpr uint64_t max_boot_cycles = 30 * cpu_clock;
+
+static void printStopReason(StopReason reason) {
+    if (reason == StopReason::Breakpoint)
+        fmt::print("Breakpoint hit\n");
+    else if (reason == StopReason::UnhandledOp)
+        fmt::print("Stopped on an unhandled instruction\n");
+}
+
+// Runs a fixed number of guest cycles as fast as possible and reports how
+// long it took on the host
+static int runBenchmark(CPU& cpu, uint64_t total_cycles) {
+    using clock = std::chrono::steady_clock;
+    const auto seconds = [](clock::duration d) { return std::chrono::duration<double>(d).count(); };
+
+    clock::duration cpu_time{};
+    uint64_t cycles = 0;
+    StopReason reason = StopReason::BudgetExhausted;
+    const auto start = clock::now();
+    while (cycles < total_cycles) {
+        const auto run_start = clock::now();
+        const RunResult result = cpu.run(std::min(frame_cycles, total_cycles - cycles));
+        cpu_time += clock::now() - run_start;
+        cycles += result.cycles;
+        if (result.reason != StopReason::BudgetExhausted) {
+            reason = result.reason;
+            break;
+        }
+    }
+    const double host = seconds(clock::now() - start);
+    logging::flush();
+
+    const CPUStats& stats = cpu.getStats();
+    const GpuStats gpu_stats = cpu.getGpu().getStats();
+    const bool gpu_threaded = cpu.getGpu().isThreaded();
+    const double compile = stats.compile_ns / 1e9;
+    const double dma = cpu.getDma().getStats().transfer_ns / 1e9;
+    const double render = gpu_stats.render_ns / 1e9;
+    const double fifo_wait = gpu_stats.fifo_wait_ns / 1e9;
+    // Everything but the render thread is part of the time in cpu.run
+    const double execute = seconds(cpu_time) - compile - dma - fifo_wait - (gpu_threaded ? 0 : render);
+    const double other = host - seconds(cpu_time);
+    const auto row = [&](const char* name, double time) {
+        fmt::print("  {:<14} {:9.3f} s {:6.1f}%\n", name, time, host > 0 ? 100 * time / host : 0);
+    };
+
+    printStopReason(reason);
+    fmt::print("Guest cycles:    {} ({:.1f} frames, {:.3f} s of guest time)\n", cycles,
+               static_cast<double>(cycles) / frame_cycles, static_cast<double>(cycles) / cpu_clock);
+    fmt::print("Instructions:    {}\n", stats.instructions);
+    fmt::print("Host time:       {:.3f} s ({:.1f}x real time)\n", host,
+               host > 0 ? static_cast<double>(cycles) / cpu_clock / host : 0);
+    fmt::print("MIPS:            {:.2f}\n", host > 0 ? stats.instructions / host / 1e6 : 0);
+    fmt::print("Blocks compiled: {}\n", stats.blocks_compiled);
+    fmt::print("Idle cycles:     {} ({:.1f}%)\n", stats.idle_cycles,
+               cycles > 0 ? 100.0 * stats.idle_cycles / cycles : 0);
+    fmt::print("Breakdown:\n");
+    row("cpu execute", execute);
+    row("cpu compile", compile);
+    row("dma", dma);
+    if(gpu_threaded)
+        row("gpu fifo wait", fifo_wait);
+    else
+        row("gpu render", render);
+    row("other", other);
+    if(gpu_threaded) {
+        fmt::print("Render thread, alongside the above:\n");
+        row("gpu render", render);
+    }
+    return reason == StopReason::BudgetExhausted ? 0 : 1;
+}
+
 static void printHelp(const char* argv0) {
     fmt::print("Usage: {} [options] <filename>\n"
-               "-h, --help            Display this help text and exit\n",
+               "-h, --help            Display this help text and exit\n"
+               "-c, --cpu <mode>      CPU backend: interpreter (default), cached or recompiler\n"
+               "-b, --break <addr>    Stop when the instruction at addr is about to execute\n"
+               "    --no-fastmem      Don't map guest memory into the host for the recompiler\n"
+               "    --no-idle-skip    Keep running idle loops instead of skipping ahead\n"
+               "    --no-gpu-thread   Draw on the CPU thread instead of a render thread of its own\n"
+               "    --raster-threads <n> Threads sharing the drawing of each batch of primitives,\n"
+               "                      1 by default\n"
+               "-t, --trace <file>    Record every executed instruction to file, see tracedump\n"
+               "    --boot-cache <dir> Restore the machine as the BIOS finished booting from a\n"
+               "                      snapshot in dir, or boot and save one there\n"
+               "-e, --exe <file>      Load a PS-X EXE straight into RAM and start it without\n"
+               "                      running the BIOS\n"
+               "    --exe-after-boot  Let the BIOS initialize the kernel before loading the\n"
+               "                      --exe, implied by --boot-cache\n"
+               "    --headless        Run without a window. There is no window yet, so this does\n"
+               "                      nothing\n"
+               "    --bench           Run a fixed amount of guest time and report the host time\n"
+               "    --cycles <n>      Guest cycles to run with --bench\n"
+               "    --frames <n>      Guest frames to run with --bench, 600 by default\n",
                argv0);
 }
 
@@ -56,19 +157,112 @@ int main(int argc, char* args[]) {
 #endif
 
     std::string filename = "./../../../../SCPH1001.BIN";
+    CPUMode cpu_mode = CPUMode::Interpreter;
+    std::vector<uint32_t> breakpoints;
+    bool use_fastmem = true;
+    bool idle_skipping = true;
+    bool gpu_thread = true;
+    uint32_t raster_threads = 1;
+    std::string trace_path;
+    std::string boot_cache_dir;
+    std::string exe_path;
+    bool exe_after_boot = false;
+    bool bench = false;
+    uint64_t bench_cycles = 600 * frame_cycles;
 
     static struct option long_options[] = {
         {"help", no_argument, 0, 'h'},
+        {"cpu", required_argument, 0, 'c'},
+        {"break", required_argument, 0, 'b'},
+        {"no-fastmem", no_argument, 0, 'F'},
+        {"no-idle-skip", no_argument, 0, 'I'},
+        {"no-gpu-thread", no_argument, 0, 'G'},
+        {"raster-threads", required_argument, 0, 'T'},
+        {"trace", required_argument, 0, 't'},
+        {"boot-cache", required_argument, 0, 'K'},
+        {"exe", required_argument, 0, 'e'},
+        {"exe-after-boot", no_argument, 0, 'A'},
+        {"headless", no_argument, 0, 'H'},
+        {"bench", no_argument, 0, 'B'},
+        {"cycles", required_argument, 0, 'C'},
+        {"frames", required_argument, 0, 'R'},
         {0, 0, 0, 0},
     };
 
     while (optind < argc) {
-        int arg = getopt_long(argc, args, "h", long_options, &option_index);
+        int arg = getopt_long(argc, args, "hc:b:t:e:", long_options, &option_index);
         if (arg != -1) {
             switch (static_cast<char>(arg)) {
             case 'h':
                 printHelp(args[0]);
                 return 0;
+            case 'c':
+            {
+                const std::string mode_name = optarg;
+                if (mode_name == "interpreter") {
+                    cpu_mode = CPUMode::Interpreter;
+                } else if (mode_name == "cached") {
+                    cpu_mode = CPUMode::CachedInterpreter;
+                } else if (mode_name == "recompiler") {
+                    cpu_mode = CPUMode::Recompiler;
+                } else {
+                    fmt::print("Unknown cpu mode {}\n", mode_name);
+                    printHelp(args[0]);
+                    return -1;
+                }
+                break;
+            }
+            case 'b':
+                breakpoints.push_back(static_cast<uint32_t>(std::strtoul(optarg, &endarg, 0)));
+                if (*endarg != '\0') {
+                    fmt::print("Invalid breakpoint address {}\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'F':
+                use_fastmem = false;
+                break;
+            case 'I':
+                idle_skipping = false;
+                break;
+            case 'G':
+                gpu_thread = false;
+                break;
+            case 'T':
+                raster_threads = static_cast<uint32_t>(std::strtoul(optarg, &endarg, 0));
+                if (*endarg != '\0' || raster_threads == 0 || raster_threads > 64) {
+                    fmt::print("Invalid raster thread count {}\n", optarg);
+                    return -1;
+                }
+                break;
+            case 't':
+                trace_path = optarg;
+                break;
+            case 'K':
+                boot_cache_dir = optarg;
+                break;
+            case 'e':
+                exe_path = optarg;
+                break;
+            case 'A':
+                exe_after_boot = true;
+                break;
+            case 'H':
+                // There's no window to leave out yet
+                break;
+            case 'B':
+                bench = true;
+                break;
+            case 'C':
+            case 'R':
+                bench_cycles = std::strtoull(optarg, &endarg, 0);
+                if (*endarg != '\0' || bench_cycles == 0) {
+                    fmt::print("Invalid {} count {}\n", arg == 'C' ? "cycle" : "frame", optarg);
+                    return -1;
+                }
+                if (arg == 'R')
+                    bench_cycles *= frame_cycles;
+                break;
             }
         } else {
 #ifdef _WIN32
@@ -90,10 +284,57 @@ int main(int argc, char* args[]) {
 
     fmt::print("Provided filename is {}\n", filename);
 
+    PsExe exe;
+    if (!exe_path.empty() && !readPsExe(exe_path, exe)) {
+        fmt::print("Failed to load the executable {}\n", exe_path);
+        return -1;
+    }
+
     std::unique_ptr<CPU> cpu = std::make_unique<CPU>(filename);
+    if (cpu_mode == CPUMode::Recompiler && use_fastmem)
+        cpu->enableFastmem();
+    cpu->setMode(cpu_mode);
+    cpu->setIdleSkipping(idle_skipping);
+    cpu->getGpu().setThreaded(gpu_thread);
+    cpu->getGpu().setRasterThreads(raster_threads);
+
+    if (!boot_cache_dir.empty()) {
+        const BootCache boot_cache(boot_cache_dir);
+        if (!boot_cache.restore(*cpu)) {
+            if (runBoot(*cpu, max_boot_cycles))
+                boot_cache.save(*cpu);
+            else
+                fmt::print("The BIOS didn't finish booting, not caching it\n");
+        }
+    }
+    if (!exe_path.empty()) {
+        if (exe_after_boot && boot_cache_dir.empty() && !runBoot(*cpu, max_boot_cycles)) {
+            fmt::print("The BIOS didn't finish booting\n");
+            return -1;
+        }
+        sideloadPsExe(*cpu, exe);
+    }
+
+    for (const uint32_t addr : breakpoints) {
+        cpu->addBreakpoint(addr);
+    }
+    if (!trace_path.empty() && !cpu->startTrace(trace_path)) {
+        fmt::print("Failed to create the trace {}\n", trace_path);
+        return -1;
+    }
+
+    if (bench)
+        return runBenchmark(*cpu, bench_cycles);
+
+    while (true) {
+        const RunResult result = cpu->run(frame_cycles);
+        if (result.reason == StopReason::BudgetExhausted)
+            continue;
 
-    while(cpu->running){
-        cpu->mainLoop();
+        // Let the log catch up so the reason is printed after it
+        logging::flush();
+        printStopReason(result.reason);
+        break;
     }
 
     return 0;
@@ -0,0 +1,55 @@
+
+#include <catch2/catch_test_macros.hpp>
+
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <vector>
+
+#include "core/bios.h"
+
+namespace {
+    std::string writeImage(const std::string& name, size_t size, uint8_t fill) {
+        const auto path = (std::filesystem::temp_directory_path() / name).string();
+        const std::vector<char> image(size, static_cast<char>(fill));
+        std::ofstream file(path, std::ios::out | std::ios::binary);
+        file.write(image.data(), image.size());
+        return path;
+    }
+} // Anonymous namespace
+
+TEST_CASE("BIOS images of the same file should be shared") {
+    const std::string path = writeImage("prosur_bios_test.bin", bios_size, 0x5a);
+    const std::string other_path = writeImage("prosur_bios_test_other.bin", bios_size, 0xa5);
+
+    const auto bios = Bios::open(path);
+    REQUIRE(bios->valid());
+    REQUIRE(bios->load<uint32_t>(0x100) == 0x5a5a5a5a);
+
+    // Through another path to the same file as well
+    const auto again = Bios::open((std::filesystem::path(path).parent_path() / "." / "prosur_bios_test.bin").string());
+    REQUIRE(again == bios);
+
+    const auto other = Bios::open(other_path);
+    REQUIRE(other != bios);
+    REQUIRE(other->hash() != bios->hash());
+
+    // And through a copy of the file
+    const std::string copy_path = writeImage("prosur_bios_test_copy.bin", bios_size, 0x5a);
+    REQUIRE(Bios::open(copy_path) == bios);
+
+    std::remove(path.c_str());
+    std::remove(other_path.c_str());
+    std::remove(copy_path.c_str());
+}
+
+TEST_CASE("Invalid BIOS files should give an empty image") {
+    const std::string path = writeImage("prosur_bios_test_short.bin", bios_size / 2, 0x5a);
+    const auto bios = Bios::open(path);
+    REQUIRE(!bios->valid());
+    REQUIRE(bios->load<uint32_t>(0) == 0);
+    REQUIRE(bios->load<uint32_t>(bios_size - 4) == 0);
+    std::remove(path.c_str());
+
+    REQUIRE(!Bios::open("prosur_missing_bios.bin")->valid());
+}
@@ -0,0 +1,167 @@
+#include <catch2/catch_test_macros.hpp>
+
+#include <cstdio>
+#include <filesystem>
+#include <vector>
+
+#include "core/boot_cache.h"
+#include "core/cpu.h"
+#include "machine_state.h"
+#include "workloads/workloads.h"
+
+namespace {
+    using Reg = RegAlias;
+
+    // Stands in for a BIOS: fills some RAM, installs a little shell at
+    // boot_done_pc and jumps to it. The shell depends on what the boot
+    // left in registers and memory, then stops the CPU.
+    void buildBoot(Assembler& as) {
+        Assembler shell(boot_done_pc);
+        shell.lw(Reg::t0, 0, Reg::s1);
+        shell.nop();
+        shell.addu(Reg::t1, Reg::t0, Reg::s2);
+        shell.sw(Reg::t1, 4, Reg::s1);
+        shell.nop();
+        shell.word(0xffffffff);
+
+        as.li(Reg::s1, workload_src);
+        as.li(Reg::s2, 0);
+        as.li(Reg::s0, 1000);
+        const auto fill = as.bindNew();
+        as.addu(Reg::s2, Reg::s2, Reg::s0);
+        as.sw(Reg::s2, 0, Reg::s1);
+        as.addiu(Reg::s0, Reg::s0, -1);
+        as.bne(Reg::s0, Reg::zero, fill);
+        as.nop();
+
+        as.li(Reg::s3, boot_done_pc);
+        int16_t offset = 0;
+        for(const uint32_t word : shell.finish()) {
+            as.li(Reg::t0, word);
+            as.sw(Reg::t0, offset, Reg::s3);
+            offset += 4;
+        }
+        as.jr(Reg::s3);
+        as.nop();
+    }
+
+    const Workload boot_workload = {"boot", "Stand in BIOS", buildBoot};
+} // Anonymous namespace
+
+TEST_CASE("The entry breakpoint should stop the CPU once the BIOS booted") {
+    const std::string path = writeBiosImage(buildWorkloadBios(boot_workload), "prosur_boot_test.bin");
+    REQUIRE(!path.empty());
+
+    CPU cpu(path);
+    REQUIRE(runBoot(cpu, 1'000'000));
+    const MachineState booted(cpu);
+
+    // Nothing of the shell ran yet
+    REQUIRE(booted.reg(Reg::t1) != 500500);
+
+    // The breakpoint is gone, so the shell runs to its end
+    REQUIRE(cpu.run(1'000'000).reason == StopReason::UnhandledOp);
+    REQUIRE(cpu.getRegisters()[static_cast<size_t>(Reg::t1)] == 500500 * 2);
+    REQUIRE(!runBoot(cpu, 1'000'000));
+
+    std::remove(path.c_str());
+}
+
+TEST_CASE("The entry breakpoint should stop the CPU when it falls through to it") {
+    Assembler as(bios_addr);
+    const auto loop = as.bindNew();
+    as.addiu(Reg::t0, Reg::t0, 1);
+    as.addiu(Reg::t1, Reg::t1, 1);
+    as.addiu(Reg::t2, Reg::t2, 1);
+    const auto entry = as.bindNew();
+    as.addiu(Reg::t3, Reg::t3, 1);
+    as.j(loop);
+    as.nop();
+    const std::vector<uint32_t> code = as.finish();
+    const std::string path = writeBiosImage(buildBiosImage(code), "prosur_boot_test.bin");
+    REQUIRE(!path.empty());
+
+    for(const CPUMode mode : {CPUMode::Interpreter, CPUMode::CachedInterpreter, CPUMode::Recompiler}) {
+        INFO("Mode: " << static_cast<int>(mode));
+        CPU cpu(path);
+        cpu.setMode(mode);
+        for(const Reg reg : {Reg::t0, Reg::t1, Reg::t2, Reg::t3}) {
+            cpu.setRegister(reg, 0);
+        }
+        // Blocks compiled before the breakpoint was set run past it too
+        REQUIRE(cpu.run(100).reason == StopReason::BudgetExhausted);
+        cpu.setEntryBreakpoint(as.address(entry));
+        REQUIRE(cpu.run(1000).reason == StopReason::Breakpoint);
+        const uint32_t passes = cpu.getRegisters()[static_cast<size_t>(Reg::t2)];
+        REQUIRE(cpu.getRegisters()[static_cast<size_t>(Reg::t3)] == passes - 1);
+        REQUIRE(cpu.run(1000).reason == StopReason::Breakpoint);
+        REQUIRE(cpu.getRegisters()[static_cast<size_t>(Reg::t3)] == passes);
+        REQUIRE(cpu.getRegisters()[static_cast<size_t>(Reg::t2)] == passes + 1);
+    }
+    std::remove(path.c_str());
+}
+
+TEST_CASE("Loading a saved state should give the same machine") {
+    const std::string path = writeBiosImage(buildWorkloadBios(boot_workload), "prosur_boot_test.bin");
+    REQUIRE(!path.empty());
+
+    for(const CPUMode mode : {CPUMode::CachedInterpreter, CPUMode::Recompiler}) {
+        CPU cpu(path);
+        cpu.setMode(mode);
+        REQUIRE(runBoot(cpu, 1'000'000));
+        const std::vector<uint8_t> state = cpu.saveState();
+        const MachineState booted(cpu);
+        REQUIRE(cpu.run(1'000'000).reason == StopReason::UnhandledOp);
+        const MachineState finished(cpu);
+
+        CPU other(path);
+        other.setMode(mode);
+        REQUIRE(other.loadState(state.data(), state.size()));
+        REQUIRE(MachineState(other) == booted);
+        REQUIRE(other.run(1'000'000).reason == StopReason::UnhandledOp);
+        REQUIRE(MachineState(other) == finished);
+
+        // Truncated or damaged states leave the machine alone
+        REQUIRE(!other.loadState(state.data(), state.size() - 1));
+        std::vector<uint8_t> damaged = state;
+        damaged[0] ^= 0xff;
+        REQUIRE(!other.loadState(damaged.data(), damaged.size()));
+        REQUIRE(MachineState(other) == finished);
+    }
+
+    std::remove(path.c_str());
+}
+
+TEST_CASE("The boot cache should restore the machine it saved") {
+    const std::string path = writeBiosImage(buildWorkloadBios(boot_workload), "prosur_boot_test.bin");
+    REQUIRE(!path.empty());
+    const auto directory = std::filesystem::temp_directory_path() / "prosur_boot_cache_test";
+    std::filesystem::remove_all(directory);
+    const BootCache cache(directory.string());
+
+    CPU cpu(path);
+    REQUIRE(!cache.restore(cpu));
+    REQUIRE(runBoot(cpu, 1'000'000));
+    REQUIRE(cache.save(cpu));
+    REQUIRE(std::filesystem::exists(cache.pathFor(cpu.getBios().hash())));
+    const MachineState booted(cpu);
+
+    CPU restored(path);
+    REQUIRE(cache.restore(restored));
+    REQUIRE(MachineState(restored) == booted);
+    REQUIRE(restored.run(1'000'000).reason == StopReason::UnhandledOp);
+    REQUIRE(cpu.run(1'000'000).reason == StopReason::UnhandledOp);
+    REQUIRE(MachineState(restored) == MachineState(cpu));
+
+    // Snapshots of another BIOS aren't used
+    std::vector<uint8_t> image = buildWorkloadBios(boot_workload);
+    image[bios_size - 1] ^= 0xff;
+    const std::string other_path = writeBiosImage(image, "prosur_boot_test_other.bin");
+    CPU other(other_path);
+    std::filesystem::copy_file(cache.pathFor(cpu.getBios().hash()), cache.pathFor(other.getBios().hash()));
+    REQUIRE(!cache.restore(other));
+
+    std::filesystem::remove_all(directory);
+    std::remove(path.c_str());
+    std::remove(other_path.c_str());
+}
@@ -0,0 +1,238 @@
+#include <catch2/catch_test_macros.hpp>
+
+#include <cstdio>
+#include <vector>
+
+#include "core/cpu.h"
+#include "core/dma.h"
+#include "core/savestate.h"
+#include "workloads/workloads.h"
+
+namespace {
+    using Reg = RegAlias;
+
+    constexpr uint32_t chcr_to_device = 0x00000001;
+    constexpr uint32_t chcr_backward = 0x00000002;
+    constexpr uint32_t chcr_request = 0x00000200;
+    constexpr uint32_t chcr_linked_list = 0x00000400;
+    constexpr uint32_t chcr_start = 0x01000000;
+    constexpr uint32_t chcr_trigger = 0x10000000;
+
+    uint32_t channelReg(DmaChannel channel, uint32_t reg) {
+        return dma_base + 0x10 * static_cast<uint32_t>(channel) + reg;
+    }
+
+    struct FakeDevice : DmaDevice {
+        std::vector<uint32_t> received;
+        uint32_t next = 0x1000;
+
+        void dmaWrite(const uint8_t* words, size_t count) override {
+            for(size_t i = 0; i < count; ++i) {
+                received.push_back(readLE<uint32_t>(words + 4 * i));
+            }
+        }
+        void dmaRead(uint8_t* words, size_t count) override {
+            for(size_t i = 0; i < count; ++i) {
+                writeLE<uint32_t>(words + 4 * i, next++);
+            }
+        }
+    };
+
+    struct Machine {
+        Scheduler scheduler;
+        std::vector<uint8_t> ram;
+        std::vector<std::pair<uint32_t, uint32_t>> written;
+        Dma dma;
+        FakeDevice device;
+
+        Machine() : ram(memory_size, 0), dma(scheduler, [this](uint32_t offset, uint32_t size) {
+            written.emplace_back(offset, size);
+        }) {
+            dma.setRAM(ram.data());
+            dma.connect(DmaChannel::GPU, &device);
+            // Every channel enabled
+            dma.write(dma_dpcr, 0x0fffffff);
+        }
+
+        uint32_t word(uint32_t addr) const {
+            return readLE<uint32_t>(ram.data() + (addr & (memory_size - 1)));
+        }
+        void setWord(uint32_t addr, uint32_t val) {
+            writeLE<uint32_t>(ram.data() + (addr & (memory_size - 1)), val);
+        }
+    };
+} // Anonymous namespace
+
+TEST_CASE("DMA block transfers should move the data and finish later") {
+    Machine m;
+    for(uint32_t i = 0; i < 16; ++i) {
+        m.setWord(0x1000 + 4 * i, 0xa000 + i);
+    }
+
+    // Manual mode, from RAM
+    m.dma.write(channelReg(DmaChannel::GPU, 0), 0x1000);
+    m.dma.write(channelReg(DmaChannel::GPU, 4), 16);
+    m.dma.write(channelReg(DmaChannel::GPU, 8), chcr_start | chcr_trigger | chcr_to_device);
+    REQUIRE(m.device.received.size() == 16);
+    REQUIRE(m.device.received[15] == 0xa00f);
+    REQUIRE(m.dma.read(channelReg(DmaChannel::GPU, 8)) & chcr_start);
+    m.scheduler.advance(15);
+    REQUIRE(m.dma.read(channelReg(DmaChannel::GPU, 8)) & chcr_start);
+    m.scheduler.advance(1);
+    REQUIRE(!(m.dma.read(channelReg(DmaChannel::GPU, 8)) & chcr_start));
+
+    // Request mode, 2 blocks of 3 words into RAM
+    m.dma.write(channelReg(DmaChannel::GPU, 0), 0x2000);
+    m.dma.write(channelReg(DmaChannel::GPU, 4), 0x00020003);
+    m.dma.write(channelReg(DmaChannel::GPU, 8), chcr_start | chcr_request);
+    for(uint32_t i = 0; i < 6; ++i) {
+        REQUIRE(m.word(0x2000 + 4 * i) == 0x1000 + i);
+    }
+    REQUIRE(m.written.back() == std::make_pair(0x2000u, 24u));
+    REQUIRE(m.dma.read(channelReg(DmaChannel::GPU, 0)) == 0x2018);
+
+    // Backward, wrapping under address 0
+    m.written.clear();
+    m.dma.write(channelReg(DmaChannel::GPU, 0), 0x4);
+    m.dma.write(channelReg(DmaChannel::GPU, 4), 3);
+    m.scheduler.advance(100);
+    m.dma.write(channelReg(DmaChannel::GPU, 8), chcr_start | chcr_trigger | chcr_backward);
+    REQUIRE(m.word(0x4) == 0x1006);
+    REQUIRE(m.word(0x0) == 0x1007);
+    REQUIRE(m.word(memory_size - 4) == 0x1008);
+    REQUIRE(m.written.size() == 3);
+}
+
+TEST_CASE("DMA should follow linked lists and clear ordering tables") {
+    Machine m;
+
+    // An ordering table of 8 entries ending at 0x3000, then one that wraps
+    m.dma.write(channelReg(DmaChannel::OTC, 0), 0x3000);
+    m.dma.write(channelReg(DmaChannel::OTC, 4), 8);
+    m.dma.write(channelReg(DmaChannel::OTC, 8), chcr_start | chcr_trigger);
+    for(uint32_t i = 0; i < 7; ++i) {
+        REQUIRE(m.word(0x3000 - 4 * i) == 0x3000 - 4 * (i + 1));
+    }
+    REQUIRE(m.word(0x3000 - 4 * 7) == 0x00ffffff);
+    REQUIRE(m.written.back() == std::make_pair(0x3000u - 28, 32u));
+
+    m.scheduler.advance(8);
+    m.dma.write(channelReg(DmaChannel::OTC, 0), 0x4);
+    m.dma.write(channelReg(DmaChannel::OTC, 4), 3);
+    m.dma.write(channelReg(DmaChannel::OTC, 8), chcr_start | chcr_trigger);
+    REQUIRE(m.word(0x4) == 0x0);
+    REQUIRE(m.word(0x0) == memory_size - 4);
+    REQUIRE(m.word(memory_size - 4) == 0x00ffffff);
+
+    // Sent from the last entry of the first table, through two packets
+    m.setWord(0x3000, 0x02002000);
+    m.setWord(0x3004, 0x11);
+    m.setWord(0x3008, 0x22);
+    m.setWord(0x2000, 0x01000000 | (0x3000 - 4 * 6));
+    m.setWord(0x2004, 0x33);
+    m.scheduler.advance(3);
+    m.dma.write(channelReg(DmaChannel::GPU, 0), 0x3000);
+    m.dma.write(channelReg(DmaChannel::GPU, 8), chcr_start | chcr_linked_list | chcr_to_device);
+    REQUIRE(m.device.received == std::vector<uint32_t>{0x11, 0x22, 0x33});
+    REQUIRE(m.dma.read(channelReg(DmaChannel::GPU, 0)) == 0x00ffffff);
+}
+
+TEST_CASE("DMA interrupts should be flagged in DICR") {
+    Machine m;
+    m.dma.write(dma_dicr, 0x00840000);
+    m.dma.write(channelReg(DmaChannel::GPU, 4), 4);
+    m.dma.write(channelReg(DmaChannel::GPU, 8), chcr_start | chcr_trigger | chcr_to_device);
+    REQUIRE(!m.dma.irqPending());
+    m.scheduler.advance(4);
+    REQUIRE(m.dma.irqPending());
+    REQUIRE(m.dma.read(dma_dicr) == 0x84840000);
+
+    // Acknowledged by writing the flag back
+    m.dma.write(dma_dicr, 0x04840000);
+    REQUIRE(!m.dma.irqPending());
+    REQUIRE(m.dma.read(dma_dicr) == 0x00840000);
+
+    // Disabled channels don't start
+    m.dma.write(dma_dpcr, 0);
+    m.dma.write(channelReg(DmaChannel::GPU, 8), chcr_start | chcr_trigger | chcr_to_device);
+    REQUIRE(m.device.received.size() == 4);
+    m.dma.write(dma_dpcr, 0x00000800);
+    REQUIRE(m.device.received.size() == 8);
+}
+
+TEST_CASE("Transfers in flight should survive a savestate") {
+    Machine m;
+    m.dma.write(channelReg(DmaChannel::GPU, 4), 100);
+    m.dma.write(channelReg(DmaChannel::GPU, 8), chcr_start | chcr_trigger | chcr_to_device);
+    m.scheduler.advance(40);
+    SavestateWriter writer;
+    m.dma.saveState(writer);
+    const std::vector<uint8_t> state = writer.finish();
+
+    Machine other;
+    other.scheduler.setNow(40);
+    SavestateReader reader;
+    REQUIRE(reader.parse(state.data(), state.size()));
+    REQUIRE(other.dma.loadState(reader));
+    REQUIRE(other.dma.read(channelReg(DmaChannel::GPU, 8)) & chcr_start);
+    other.scheduler.advance(60);
+    REQUIRE(!(other.dma.read(channelReg(DmaChannel::GPU, 8)) & chcr_start));
+}
+
+TEST_CASE("The guest should clear ordering tables through DMA") {
+    constexpr uint32_t table_end = workload_src + 0x3fc;
+    Assembler as(bios_addr);
+    as.li(Reg::s0, dma_base);
+    as.li(Reg::t0, 0x08000000);
+    as.sw(Reg::t0, dma_dpcr - dma_base, Reg::s0);
+    as.li(Reg::t0, table_end);
+    as.sw(Reg::t0, 0x60, Reg::s0);
+    as.li(Reg::t0, 256);
+    as.sw(Reg::t0, 0x64, Reg::s0);
+    as.li(Reg::t0, chcr_start | chcr_trigger | chcr_backward);
+    as.sw(Reg::t0, 0x68, Reg::s0);
+    // Polls CHCR until the busy bit clears
+    as.li(Reg::s1, chcr_start);
+    as.li(Reg::s2, 0);
+    const auto poll = as.bindNew();
+    const auto done = as.newLabel();
+    as.lw(Reg::t0, 0x68, Reg::s0);
+    as.addiu(Reg::s2, Reg::s2, 1);
+    as.sltu(Reg::t1, Reg::t0, Reg::s1);
+    as.bne(Reg::t1, Reg::zero, done);
+    as.nop();
+    as.j(poll);
+    as.nop();
+    as.bind(done);
+    as.word(0xffffffff);
+    const std::string path = writeBiosImage(buildBiosImage(as.finish()), "prosur_dma_test.bin");
+    REQUIRE(!path.empty());
+
+    struct Backend {
+        CPUMode mode;
+        bool fastmem;
+    };
+    const Backend backends[] = {
+        {CPUMode::Interpreter, false},
+        {CPUMode::CachedInterpreter, false},
+        {CPUMode::Recompiler, false},
+        {CPUMode::Recompiler, true},
+    };
+    for(const Backend& backend : backends) {
+        INFO("Mode: " << static_cast<int>(backend.mode) << " fastmem: " << backend.fastmem);
+        CPU cpu(path);
+        if(backend.fastmem && !cpu.enableFastmem())
+            continue;
+        cpu.setMode(backend.mode);
+        REQUIRE(cpu.run(100'000).reason == StopReason::UnhandledOp);
+
+        const uint8_t* ram = cpu.getRAM();
+        const uint32_t end_offset = table_end & (memory_size - 1);
+        REQUIRE(readLE<uint32_t>(ram + end_offset) == end_offset - 4);
+        REQUIRE(readLE<uint32_t>(ram + end_offset - 0x200) == end_offset - 0x204);
+        REQUIRE(readLE<uint32_t>(ram + end_offset - 0x3fc) == 0x00ffffff);
+        // It polled while the transfer was in flight
+        REQUIRE(cpu.getRegisters()[static_cast<size_t>(Reg::s2)] > 1);
+    }
+    std::remove(path.c_str());
+}
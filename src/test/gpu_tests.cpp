@@ -0,0 +1,627 @@
+#include <catch2/catch_test_macros.hpp>
+
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <initializer_list>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "core/command_fifo.h"
+#include "core/cpu.h"
+#include "core/gpu.h"
+#include "core/rewind.h"
+#include "core/savestate.h"
+#include "workloads/workloads.h"
+
+namespace {
+    using Reg = RegAlias;
+
+    constexpr uint32_t ntsc_frame = 263 * 2172;
+    constexpr uint32_t pal_frame = 314 * 2167;
+
+    struct Machine {
+        Scheduler scheduler;
+        Gpu gpu;
+
+        Machine() : gpu(scheduler) {
+            // Drawing to the whole of VRAM
+            gp0({0xe3000000, 0xe4000000 | 1023 | 511 << 10});
+        }
+
+        void gp0(std::initializer_list<uint32_t> words) {
+            for(const uint32_t word : words) {
+                gpu.write(gpu_gp0, word);
+            }
+        }
+        uint16_t pixel(uint32_t x, uint32_t y) const {
+            return gpu.getVRAM()[y * vram_width + x];
+        }
+    };
+
+    size_t countMismatches(const uint16_t* a, const uint16_t* b) {
+        size_t mismatches = 0;
+        for(uint32_t i = 0; i < vram_pixels; ++i) {
+            mismatches += a[i] != b[i];
+        }
+        return mismatches;
+    }
+
+    // Primitives of every kind over random VRAM, textured from all depths
+    // with random windows and mask settings
+    std::vector<uint32_t> randomScene(std::mt19937& rng) {
+        const auto random = [&](uint32_t n) { return static_cast<uint32_t>(rng() % n); };
+        const auto position = [&]() { return random(400) | random(300) << 16; };
+        std::vector<uint32_t> words;
+        for(int i = 0; i < 300; ++i) {
+            if(random(8) == 0) {
+                words.push_back(0xe1000000 | random(0x1000));
+                words.push_back(0xe2000000 | random(0x100000));
+                words.push_back(0xe6000000 | random(4));
+            }
+            const uint32_t kind = random(3);
+            if(kind == 0) {
+                const uint32_t op = 0x20 | random(0x20);
+                const size_t vertices = op & 0x08 ? 4 : 3;
+                words.push_back(op << 24 | random(0x1000000));
+                for(size_t v = 0; v < vertices; ++v) {
+                    if(op & 0x10 && v > 0)
+                        words.push_back(random(0x1000000));
+                    words.push_back(position());
+                    if(op & 0x04) {
+                        // The CLUT with the first vertex, the texture page with the second
+                        const uint32_t extra = v == 0 ? random(0x8000) : v == 1 ? random(0x200) : 0;
+                        words.push_back(extra << 16 | random(0x10000));
+                    }
+                }
+            }
+            else if(kind == 1) {
+                const uint32_t op = 0x60 | random(0x20);
+                words.push_back(op << 24 | random(0x1000000));
+                words.push_back(position());
+                if(op & 0x04)
+                    words.push_back(random(0x8000) << 16 | random(0x10000));
+                if((op & 0x18) == 0)
+                    words.push_back(random(200) | random(200) << 16);
+            }
+            else {
+                const uint32_t op = 0x40 | (random(2) << 4) | (random(2) << 1);
+                words.push_back(op << 24 | random(0x1000000));
+                words.push_back(position());
+                if(op & 0x10)
+                    words.push_back(random(0x1000000));
+                words.push_back(position());
+            }
+        }
+        return words;
+    }
+} // Anonymous namespace
+
+TEST_CASE("GP0 should fill, transfer and copy VRAM") {
+    Machine m;
+    // Fills go by 16 pixels horizontally
+    m.gp0({0x020000ff, 0x00040014, 0x0002000a});
+    REQUIRE(m.pixel(16, 4) == 0x001f);
+    REQUIRE(m.pixel(31, 5) == 0x001f);
+    REQUIRE(m.pixel(15, 4) == 0);
+    REQUIRE(m.pixel(32, 4) == 0);
+    REQUIRE(m.pixel(16, 6) == 0);
+
+    // The high half of the last word is dropped
+    m.gp0({0xa0000000, 0x00c80064, 0x00010003, 0x22221111, 0x44443333});
+    REQUIRE(m.pixel(100, 200) == 0x1111);
+    REQUIRE(m.pixel(102, 200) == 0x3333);
+    REQUIRE(m.pixel(103, 200) == 0);
+
+    m.gp0({0xc0000000, 0x00c80064, 0x00010003});
+    REQUIRE(m.gpu.read(gpu_gp1) & (1 << 27));
+    REQUIRE(m.gpu.read(gpu_gp0) == 0x22221111);
+    REQUIRE(m.gpu.read(gpu_gp0) == 0x00003333);
+    REQUIRE(!(m.gpu.read(gpu_gp1) & (1 << 27)));
+    // GPUREAD keeps its last word
+    REQUIRE(m.gpu.read(gpu_gp0) == 0x00003333);
+
+    m.gp0({0x80000000, 0x00c80064, 0x00000000, 0x00010003});
+    REQUIRE(m.pixel(0, 0) == 0x1111);
+    REQUIRE(m.pixel(2, 0) == 0x3333);
+
+    // Set the mask bit, then leave masked pixels alone
+    m.gp0({0xe6000003, 0xa0000000, 0x000001f4, 0x00010001, 0x00000001});
+    REQUIRE(m.pixel(500, 0) == 0x8001);
+    m.gp0({0xa0000000, 0x000001f4, 0x00010001, 0x00000002});
+    REQUIRE(m.pixel(500, 0) == 0x8001);
+}
+
+TEST_CASE("Polygons sharing an edge should never both draw a pixel") {
+    Machine m;
+    // Additive, so a pixel drawn twice shows
+    m.gp0({0xe1000020});
+    m.gp0({0x2a080808, 0x000a000a, 0x000a0014, 0x0014000a, 0x00140014});
+    for(uint32_t y = 0; y < 30; ++y) {
+        for(uint32_t x = 0; x < 30; ++x) {
+            INFO("x: " << x << " y: " << y);
+            const bool inside = x >= 10 && x < 20 && y >= 10 && y < 20;
+            REQUIRE(m.pixel(x, y) == (inside ? 0x0421 : 0));
+        }
+    }
+
+    // The drawing offset moves primitives, the area clips them
+    m.gp0({0xe5000000 | 100 | 50 << 11, 0xe3000000 | 105, 0x60ffffff, 0x00000000, 0x000a000a});
+    REQUIRE(m.pixel(104, 50) == 0);
+    REQUIRE(m.pixel(105, 50) == 0x7fff);
+    REQUIRE(m.pixel(109, 59) == 0x7fff);
+    REQUIRE(m.pixel(110, 59) == 0);
+}
+
+TEST_CASE("Every span kernel should draw the same pixels") {
+    std::mt19937 rng(0x5eed);
+    std::vector<uint8_t> initial(2 * vram_pixels);
+    for(uint8_t& byte : initial) {
+        byte = static_cast<uint8_t>(rng());
+    }
+    const std::vector<uint32_t> scene = randomScene(rng);
+
+    const auto render = [&](Machine& m, SimdLevel level) {
+        m.gpu.setSimdLevel(level);
+        m.gpu.writeVRAM(0, initial.data(), initial.size());
+        for(const uint32_t word : scene) {
+            m.gpu.write(gpu_gp0, word);
+        }
+    };
+    Machine reference;
+    render(reference, SimdLevel::Scalar);
+    REQUIRE(countMismatches(reference.gpu.getVRAM(), reinterpret_cast<const uint16_t*>(initial.data())) > 10000);
+
+    for(const SimdLevel level : {SimdLevel::SSE41, SimdLevel::AVX2}) {
+        if(supportedSimdLevel(level) != level)
+            continue;
+        INFO("Level: " << simdLevelName(level));
+        Machine m;
+        render(m, level);
+        REQUIRE(m.gpu.getSimdLevel() == level);
+        REQUIRE(countMismatches(reference.gpu.getVRAM(), m.gpu.getVRAM()) == 0);
+    }
+}
+
+TEST_CASE("The command FIFO should hand words over in order") {
+    constexpr uint32_t count = 1 << 20;
+    CommandFifo fifo;
+    std::thread producer([&] {
+        for(uint32_t word = 0; word < count; ++word) {
+            while(!fifo.push(word)) {
+                std::this_thread::yield();
+            }
+        }
+    });
+    uint32_t expected = 0;
+    bool in_order = true;
+    std::array<uint32_t, 100> batch;
+    while(expected < count) {
+        const size_t popped = fifo.pop(batch.data(), batch.size());
+        for(size_t i = 0; i < popped; ++i) {
+            in_order = in_order && batch[i] == expected++;
+        }
+    }
+    producer.join();
+    REQUIRE(in_order);
+    REQUIRE(fifo.empty());
+}
+
+TEST_CASE("A threaded GPU should look the same to the guest as an inline one") {
+    std::mt19937 rng(0x7ead);
+    const std::vector<uint32_t> scene = randomScene(rng);
+
+    // The scene in pieces, each followed by a status read and a readback
+    const auto run = [&](Machine& m) {
+        std::vector<uint32_t> reads;
+        for(size_t pos = 0; pos < scene.size(); pos += 97) {
+            for(size_t i = pos; i < std::min(pos + 97, scene.size()); ++i) {
+                m.gpu.write(gpu_gp0, scene[i]);
+            }
+            reads.push_back(m.gpu.read(gpu_gp1));
+            m.gp0({0xc0000000, static_cast<uint32_t>(pos % 300) << 16, 0x00010040});
+            for(int i = 0; i < 32; ++i) {
+                reads.push_back(m.gpu.read(gpu_gp0));
+            }
+        }
+        return reads;
+    };
+    Machine inline_gpu;
+    const std::vector<uint32_t> expected = run(inline_gpu);
+    Machine threaded;
+    threaded.gpu.setThreaded(true);
+    REQUIRE(threaded.gpu.isThreaded());
+    REQUIRE(run(threaded) == expected);
+    REQUIRE(countMismatches(inline_gpu.gpu.getVRAM(), threaded.gpu.getVRAM()) == 0);
+
+    // Words still queued are drawn before the thread stops
+    threaded.gp0({0x02ffffff, 0x00000000, 0x00100010});
+    threaded.gpu.setThreaded(false);
+    REQUIRE(threaded.pixel(15, 15) == 0x7fff);
+}
+
+TEST_CASE("Raster threads should draw the same pixels as one") {
+    std::mt19937 rng(0xba2d);
+    std::vector<uint8_t> initial(2 * vram_pixels);
+    for(uint8_t& byte : initial) {
+        byte = static_cast<uint8_t>(rng());
+    }
+    const std::vector<uint32_t> scene = randomScene(rng);
+
+    // Copies and readbacks between pieces of the scene draw what was batched
+    const auto run = [&](Machine& m) {
+        m.gpu.writeVRAM(0, initial.data(), initial.size());
+        std::vector<uint32_t> reads;
+        for(size_t pos = 0; pos < scene.size(); pos += 89) {
+            m.gp0({0xc0000000, static_cast<uint32_t>(pos % 300) << 16, 0x00010040});
+            for(size_t i = pos; i < std::min(pos + 89, scene.size()); ++i) {
+                m.gpu.write(gpu_gp0, scene[i]);
+            }
+            for(int i = 0; i < 32; ++i) {
+                reads.push_back(m.gpu.read(gpu_gp0));
+            }
+            m.gp0({0x80000000, static_cast<uint32_t>(pos % 256), 0x01000000 | static_cast<uint32_t>(pos % 500), 0x00100020});
+        }
+        return reads;
+    };
+    Machine reference;
+    const std::vector<uint32_t> expected = run(reference);
+
+    for(const uint32_t threads : {2u, 3u, 4u}) {
+        for(const bool threaded : {false, true}) {
+            INFO("Threads: " << threads << ", render thread: " << threaded);
+            Machine m;
+            m.gpu.setThreaded(threaded);
+            m.gpu.setRasterThreads(threads);
+            REQUIRE(m.gpu.getRasterThreads() == threads);
+            REQUIRE(run(m) == expected);
+            REQUIRE(countMismatches(reference.gpu.getVRAM(), m.gpu.getVRAM()) == 0);
+        }
+    }
+}
+
+TEST_CASE("Cached textures should follow every VRAM write under them") {
+    Machine m;
+    REQUIRE(m.gpu.getVRAM() != nullptr);
+    // A 16x16 sprite of texel 1 in a 4 bit page at x 512, its CLUT at y 480
+    m.gp0({0xe1000008, 0xa0000000, 0x00000200, 0x00100004});
+    for(int i = 0; i < 32; ++i) {
+        m.gp0({0x11111111});
+    }
+    m.gp0({0xa0000000, 0x01e00000, 0x00010004, 0x001f0000, 0x00007c00});
+    const auto draw = [&] { m.gp0({0x65000000, 0x00000000, 0x78000000, 0x00100010}); };
+    draw();
+    REQUIRE(m.pixel(0, 0) == 0x001f);
+    REQUIRE(m.pixel(15, 15) == 0x001f);
+
+    // A CLUT entry changes every row
+    m.gp0({0xa0000000, 0x01e00001, 0x00010001, 0x000003e0});
+    draw();
+    REQUIRE(m.pixel(0, 0) == 0x03e0);
+    REQUIRE(m.pixel(15, 15) == 0x03e0);
+
+    // Texels change the rows they're on, through transfers, fills, copies
+    // and loaders alike
+    m.gp0({0xa0000000, 0x00050200, 0x00010004, 0x22222222, 0x22222222});
+    draw();
+    REQUIRE(m.pixel(3, 5) == 0x7c00);
+    REQUIRE(m.pixel(3, 4) == 0x03e0);
+    REQUIRE(m.pixel(3, 6) == 0x03e0);
+    // 0x2222 once cut down to 15 bits
+    m.gp0({0x02408810, 0x00070200, 0x00010010});
+    draw();
+    REQUIRE(m.pixel(3, 7) == 0x7c00);
+    m.gp0({0x80000000, 0x00050200, 0x00090200, 0x00010004});
+    draw();
+    REQUIRE(m.pixel(3, 9) == 0x7c00);
+    const uint8_t texels[] = {0x22, 0x22};
+    m.gpu.writeVRAM(2 * (11 * vram_width + 512), texels, sizeof(texels));
+    draw();
+    REQUIRE(m.pixel(3, 11) == 0x7c00);
+    REQUIRE(m.pixel(4, 11) == 0x03e0);
+
+    // Polygons drawing into the page
+    m.gp0({0x68408810, 0x000c0200});
+    draw();
+    REQUIRE(m.pixel(0, 12) == 0x7c00);
+    REQUIRE(m.pixel(3, 12) == 0x7c00);
+    REQUIRE(m.pixel(4, 12) == 0x03e0);
+}
+
+TEST_CASE("Cached textures should draw the same pixels as VRAM") {
+    std::mt19937 rng(0xc10d);
+    std::vector<uint8_t> initial(2 * vram_pixels);
+    for(uint8_t& byte : initial) {
+        byte = static_cast<uint8_t>(rng());
+    }
+    const std::vector<uint32_t> scene = randomScene(rng);
+
+    // The scene drawn twice, with copies and loads over textures and CLUTs
+    // between its pieces
+    const auto run = [&](Machine& m) {
+        m.gpu.writeVRAM(0, initial.data(), initial.size());
+        for(int pass = 0; pass < 2; ++pass) {
+            for(size_t pos = 0; pos < scene.size(); pos += 61) {
+                for(size_t i = pos; i < std::min(pos + 61, scene.size()); ++i) {
+                    m.gpu.write(gpu_gp0, scene[i]);
+                }
+                const uint32_t x = static_cast<uint32_t>(pos * 7 % 1000);
+                const uint32_t y = static_cast<uint32_t>(pos * 13 % 500);
+                m.gp0({0x80000000, y << 16 | x, (511 - y) << 16 | (1023 - x), 0x00040008});
+                m.gpu.writeVRAM(2 * (y * vram_width + x), &initial[pos], 16);
+            }
+        }
+    };
+    Machine reference;
+    reference.gpu.setTextureCaching(false);
+    reference.gpu.setSimdLevel(SimdLevel::Scalar);
+    run(reference);
+
+    for(const SimdLevel level : {SimdLevel::Scalar, SimdLevel::SSE41, SimdLevel::AVX2}) {
+        if(supportedSimdLevel(level) != level)
+            continue;
+        for(const uint32_t threads : {1u, 3u}) {
+            INFO("Level: " << simdLevelName(level) << ", threads: " << threads);
+            Machine m;
+            m.gpu.setSimdLevel(level);
+            m.gpu.setRasterThreads(threads);
+            run(m);
+            REQUIRE(countMismatches(reference.gpu.getVRAM(), m.gpu.getVRAM()) == 0);
+        }
+    }
+}
+
+TEST_CASE("GPUSTAT should follow GP0 and GP1") {
+    Machine m;
+    REQUIRE(m.gpu.read(gpu_gp1) == 0x14802000);
+
+    m.gpu.write(gpu_gp1, 0x03000000);
+    REQUIRE(!(m.gpu.read(gpu_gp1) & (1 << 23)));
+    m.gpu.write(gpu_gp1, 0x08000029);
+    REQUIRE(((m.gpu.read(gpu_gp1) >> 17) & 0x3f) == 0x29);
+    m.gpu.write(gpu_gp1, 0x04000002);
+    REQUIRE(((m.gpu.read(gpu_gp1) >> 29) & 3) == 2);
+    REQUIRE(m.gpu.read(gpu_gp1) & (1 << 25));
+
+    m.gp0({0xe1000123, 0xe6000003});
+    REQUIRE((m.gpu.read(gpu_gp1) & 0x1fff) == (0x123 | 3 << 11));
+    m.gp0({0x1f000000});
+    REQUIRE(m.gpu.irqPending());
+    REQUIRE(m.gpu.read(gpu_gp1) & (1 << 24));
+    m.gpu.write(gpu_gp1, 0x02000000);
+    REQUIRE(!(m.gpu.read(gpu_gp1) & (1 << 24)));
+
+    // Drawing state through GPUREAD
+    m.gpu.write(gpu_gp1, 0x10000003);
+    REQUIRE(m.gpu.read(gpu_gp0) == 0);
+    m.gpu.write(gpu_gp1, 0x10000004);
+    REQUIRE(m.gpu.read(gpu_gp0) == (1023 | 511 << 10));
+    m.gpu.write(gpu_gp1, 0x10000007);
+    REQUIRE(m.gpu.read(gpu_gp0) == 2);
+
+    m.gpu.write(gpu_gp1, 0x00000000);
+    REQUIRE(m.gpu.read(gpu_gp1) == 0x14802000);
+}
+
+TEST_CASE("VBlank should come once a frame at the rate of the video mode") {
+    Machine m;
+    m.scheduler.advance(ntsc_frame - 1);
+    REQUIRE(m.gpu.frameCount() == 0);
+    m.scheduler.advance(1);
+    REQUIRE(m.gpu.frameCount() == 1);
+
+    // PAL and interlaced from the next frame on, the field flips every VBlank
+    m.gpu.write(gpu_gp1, 0x08000028);
+    const bool odd = m.gpu.read(gpu_gp1) >> 31;
+    m.scheduler.advance(ntsc_frame);
+    REQUIRE(m.gpu.frameCount() == 2);
+    REQUIRE((m.gpu.read(gpu_gp1) >> 31) != odd);
+    m.scheduler.advance(pal_frame - 1);
+    REQUIRE(m.gpu.frameCount() == 2);
+    m.scheduler.advance(1);
+    REQUIRE(m.gpu.frameCount() == 3);
+    REQUIRE((m.gpu.read(gpu_gp1) >> 31) == odd);
+}
+
+TEST_CASE("The GPU should take command lists and give VRAM through DMA") {
+    Machine m;
+    std::vector<uint8_t> ram(memory_size, 0);
+    Dma dma(m.scheduler, [](uint32_t, uint32_t) {});
+    dma.setRAM(ram.data());
+    dma.connect(DmaChannel::GPU, &m.gpu);
+    dma.write(dma_dpcr, 0x00000800);
+
+    // A single packet holding a fill
+    writeLE<uint32_t>(ram.data() + 0x100, 0x03ffffff);
+    writeLE<uint32_t>(ram.data() + 0x104, 0x02f80000);
+    writeLE<uint32_t>(ram.data() + 0x108, 0x00000000);
+    writeLE<uint32_t>(ram.data() + 0x10c, 0x00010010);
+    dma.write(dma_base + 0x20, 0x100);
+    dma.write(dma_base + 0x28, 0x01000401);
+    REQUIRE(m.pixel(0, 0) == 0x7c00);
+    REQUIRE(m.pixel(15, 0) == 0x7c00);
+    m.scheduler.advance(100);
+
+    m.gp0({0xc0000000, 0x00000000, 0x00010004});
+    dma.write(dma_base + 0x20, 0x200);
+    dma.write(dma_base + 0x24, 2);
+    dma.write(dma_base + 0x28, 0x11000000);
+    REQUIRE(readLE<uint32_t>(ram.data() + 0x200) == 0x7c007c00);
+    REQUIRE(readLE<uint32_t>(ram.data() + 0x204) == 0x7c007c00);
+    REQUIRE(!(m.gpu.read(gpu_gp1) & (1 << 27)));
+}
+
+TEST_CASE("GPU savestates should keep VRAM, transfers and the next VBlank") {
+    Machine m;
+    m.gp0({0x0200f800, 0x00100000, 0x00010010, 0xe1000234});
+    // Halfway through an upload, and through the second frame
+    m.gp0({0xa0000000, 0x00200000, 0x00010004, 0x22221111});
+    m.scheduler.advance(ntsc_frame + 1000);
+    SavestateWriter writer;
+    m.gpu.saveState(writer, true);
+    const std::vector<uint8_t> state = writer.finish();
+
+    Machine other;
+    other.scheduler.setNow(ntsc_frame + 1000);
+    SavestateReader reader;
+    REQUIRE(reader.parse(state.data(), state.size()));
+    REQUIRE(Gpu::checkState(reader, true));
+    other.gpu.loadState(reader, true);
+    for(Machine* machine : {&m, &other}) {
+        machine->gp0({0x44443333});
+    }
+    REQUIRE(countMismatches(m.gpu.getVRAM(), other.gpu.getVRAM()) == 0);
+    REQUIRE(other.pixel(0, 16) == 0x03e0);
+    REQUIRE(other.pixel(3, 32) == 0x4444);
+    REQUIRE(other.gpu.read(gpu_gp1) == m.gpu.read(gpu_gp1));
+    REQUIRE(other.gpu.frameCount() == 1);
+    other.scheduler.advance(ntsc_frame - 1001);
+    REQUIRE(other.gpu.frameCount() == 1);
+    other.scheduler.advance(1);
+    REQUIRE(other.gpu.frameCount() == 2);
+
+    // VRAM is required when asked for
+    SavestateWriter without_vram;
+    m.gpu.saveState(without_vram, false);
+    const std::vector<uint8_t> small = without_vram.finish();
+    REQUIRE(reader.parse(small.data(), small.size()));
+    REQUIRE(Gpu::checkState(reader, false));
+    REQUIRE(!Gpu::checkState(reader, true));
+
+    // Damaged drawing states are rejected rather than letting GP0 run off
+    // the command buffer or the transfer rectangle
+    REQUIRE(reader.parse(state.data(), state.size()));
+    const size_t drawing_state = reader.find(sectionTag("GP0 "), 1)->data - state.data();
+    const size_t command_size = drawing_state + 6 * 4 + 3;
+    const size_t transfer_kind = command_size + 8 + 16 * 4;
+    const auto damaged = [&](size_t offset, auto val) {
+        std::vector<uint8_t> bytes = state;
+        writeLE(bytes.data() + offset, val);
+        SavestateReader damaged_reader;
+        REQUIRE(damaged_reader.parse(bytes.data(), bytes.size()));
+        return !Gpu::checkState(damaged_reader, true);
+    };
+    REQUIRE(damaged(command_size, uint32_t{16}));
+    // The upload command is still in the buffer, taking three words
+    REQUIRE(damaged(command_size, uint32_t{3}));
+    REQUIRE(!damaged(command_size, uint32_t{2}));
+    REQUIRE(damaged(transfer_kind, uint8_t{3}));
+    REQUIRE(damaged(transfer_kind + 5, uint16_t{0}));
+    REQUIRE(damaged(transfer_kind + 11, uint16_t{4}));
+    REQUIRE(!damaged(transfer_kind + 11, uint16_t{0}));
+}
+
+TEST_CASE("VRAM writes should be tracked by page") {
+    Machine m;
+    m.gpu.clearDirtyVramPages();
+    m.gp0({0x02ffffff, 0x000a0000, 0x00020010});
+    const uint8_t* dirty = m.gpu.dirtyVramPages();
+    for(uint32_t page = 0; page < vram_page_count; ++page) {
+        INFO("Page: " << page);
+        REQUIRE(!!dirty[page] == (page == 10 / vram_page_rows || page == 11 / vram_page_rows));
+    }
+
+    m.gpu.clearDirtyVramPages();
+    m.gp0({0x300000ff, 0x00000000, 0x0000ff00, 0x000000ff, 0x00ff0000, 0x00ff0000});
+    for(uint32_t page = 0; page < vram_page_count; ++page) {
+        INFO("Page: " << page);
+        REQUIRE(!!dirty[page] == (page < 255 / vram_page_rows + 1));
+    }
+}
+
+TEST_CASE("The guest should draw through GP0 and rewind with VRAM") {
+    // Fills 256 bands of 16x2 pixels in changing colors
+    Assembler as(bios_addr);
+    as.li(Reg::s0, gpu_base);
+    as.li(Reg::s1, 0x02000008);
+    as.li(Reg::s2, 0);
+    as.li(Reg::s3, 0x00020010);
+    as.li(Reg::s4, 0x02000000);
+    as.li(Reg::s5, 0x00020000);
+    const auto loop = as.bindNew();
+    as.sw(Reg::s1, 0, Reg::s0);
+    as.sw(Reg::s2, 0, Reg::s0);
+    as.sw(Reg::s3, 0, Reg::s0);
+    as.addiu(Reg::s1, Reg::s1, 8);
+    as.addu(Reg::s2, Reg::s2, Reg::s5);
+    as.sltu(Reg::t0, Reg::s2, Reg::s4);
+    as.bne(Reg::t0, Reg::zero, loop);
+    as.nop();
+    as.word(0xffffffff);
+    const std::string path = writeBiosImage(buildBiosImage(as.finish()), "prosur_gpu_test.bin");
+    REQUIRE(!path.empty());
+
+    struct Backend {
+        CPUMode mode;
+        bool fastmem;
+        bool threaded;
+    };
+    const Backend backends[] = {
+        {CPUMode::Interpreter, false, false},
+        {CPUMode::CachedInterpreter, false, false},
+        {CPUMode::Recompiler, false, false},
+        {CPUMode::Recompiler, true, false},
+        {CPUMode::Interpreter, false, true},
+        {CPUMode::Recompiler, true, true},
+    };
+    for(const Backend& backend : backends) {
+        INFO("Mode: " << static_cast<int>(backend.mode) << " fastmem: " << backend.fastmem
+                      << " threaded: " << backend.threaded);
+        CPU cpu(path);
+        if(backend.fastmem && !cpu.enableFastmem())
+            continue;
+        cpu.setMode(backend.mode);
+        cpu.getGpu().setThreaded(backend.threaded);
+
+        RewindBuffer rewind(cpu, 100);
+        std::vector<std::vector<uint8_t>> states;
+        for(int frame = 0; frame < 10; ++frame) {
+            rewind.capture();
+            states.push_back(cpu.saveState());
+            cpu.run(200);
+        }
+        REQUIRE(cpu.run(100'000).reason == StopReason::UnhandledOp);
+        const uint16_t* vram = cpu.getGpu().getVRAM();
+        REQUIRE(vram[0] == 0x0001);
+        REQUIRE(vram[2 * vram_width] == 0x0002);
+        REQUIRE(vram[510 * vram_width + 15] == 0x0020);
+        REQUIRE(vram[510 * vram_width + 16] == 0);
+
+        for(size_t i = states.size(); i-- > 0;) {
+            REQUIRE(rewind.rewind());
+            REQUIRE(cpu.saveState() == states[i]);
+        }
+    }
+    std::remove(path.c_str());
+}
+
+TEST_CASE("Unaligned stores to GPU registers should only write their bytes") {
+    Assembler as(bios_addr);
+    as.li(Reg::s0, gpu_base);
+    // Four words of VRAM, read back through GPUREAD
+    for(const uint32_t word : {0xa0000000u, 0u, 0x00010008u, 0x22221111u, 0x44443333u, 0x66665555u, 0x88887777u,
+                               0xc0000000u, 0u, 0x00010008u}) {
+        as.li(Reg::t0, word);
+        as.sw(Reg::t0, 0, Reg::s0);
+    }
+    // Halfword NOPs to GP0, which mustn't read GPUREAD on the way
+    as.swr(Reg::zero, 2, Reg::s0);
+    as.lw(Reg::s1, 0, Reg::s0);
+    as.swl(Reg::zero, 1, Reg::s0);
+    as.lw(Reg::s2, 0, Reg::s0);
+    as.nop();
+    as.word(0xffffffff);
+    const std::string path = writeBiosImage(buildBiosImage(as.finish()), "prosur_gpu_test.bin");
+    REQUIRE(!path.empty());
+
+    for(const CPUMode mode : {CPUMode::Interpreter, CPUMode::CachedInterpreter, CPUMode::Recompiler}) {
+        INFO("Mode: " << static_cast<int>(mode));
+        CPU cpu(path);
+        cpu.setMode(mode);
+        REQUIRE(cpu.run(100'000).reason == StopReason::UnhandledOp);
+        REQUIRE(cpu.getRegisters()[static_cast<size_t>(Reg::s1)] == 0x22221111);
+        REQUIRE(cpu.getRegisters()[static_cast<size_t>(Reg::s2)] == 0x44443333);
+    }
+    std::remove(path.c_str());
+}
@@ -0,0 +1,40 @@
+#include <catch2/catch_test_macros.hpp>
+
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <string_view>
+
+#include "core/log.h"
+
+namespace {
+    enum class Color { Red };
+} // Anonymous namespace
+
+TEST_CASE("Only plain values should be formatted on the logger thread") {
+    STATIC_REQUIRE(logging::is_deferrable<int>);
+    STATIC_REQUIRE(logging::is_deferrable<const uint64_t&>);
+    STATIC_REQUIRE(logging::is_deferrable<Color>);
+    STATIC_REQUIRE(logging::is_deferrable<const void*>);
+    STATIC_REQUIRE(!logging::is_deferrable<const char*>);
+    STATIC_REQUIRE(!logging::is_deferrable<const char (&)[6]>);
+    STATIC_REQUIRE(!logging::is_deferrable<std::string_view>);
+    STATIC_REQUIRE(!logging::is_deferrable<fmt::string_view>);
+    STATIC_REQUIRE(!logging::is_deferrable<std::string>);
+}
+
+TEST_CASE("Logging a view of a temporary should print what it saw") {
+    {
+        std::string text = "log test temporary ";
+        text += std::to_string(0x5eed);
+        LOG("{}\n", std::string_view(text));
+        // The view would now read the overwritten buffer
+        text.assign(text.size(), 'x');
+    }
+    logging::flush();
+
+    std::ifstream file("log.txt");
+    std::stringstream contents;
+    contents << file.rdbuf();
+    REQUIRE(contents.str().find("log test temporary 24301\n") != std::string::npos);
+}
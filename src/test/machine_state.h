@@ -0,0 +1,43 @@
+#ifndef MACHINE_STATE_H
+#define MACHINE_STATE_H
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+#include "core/cpu.h"
+
+// What the tests compare machines by: pc, registers, RAM and guest time
+struct MachineState {
+    uint32_t pc;
+    std::array<uint32_t, 32> regs;
+    std::vector<uint8_t> ram;
+    uint64_t cycle;
+
+    explicit MachineState(const CPU& cpu)
+        : pc(cpu.getPC()), regs(cpu.getRegisters()), ram(cpu.getRAM(), cpu.getRAM() + memory_size),
+          cycle(cpu.getCycle()) {}
+
+    uint32_t reg(RegAlias r) const {
+        return regs[static_cast<size_t>(r)];
+    }
+    const uint8_t* ramAt(uint32_t addr) const {
+        return ram.data() + (addr & (memory_size - 1));
+    }
+
+    bool operator==(const MachineState& other) const {
+        return pc == other.pc && regs == other.regs && ram == other.ram && cycle == other.cycle;
+    }
+};
+
+// Runs cpu until it stops, or for budget cycles, and takes the machine as
+// it was left
+struct EndState {
+    StopReason reason;
+    MachineState machine;
+
+    explicit EndState(CPU& cpu, uint64_t budget = 100'000'000)
+        : reason(cpu.run(budget).reason), machine(cpu) {}
+};
+
+#endif // MACHINE_STATE_H
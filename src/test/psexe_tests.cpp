@@ -0,0 +1,95 @@
+#include <catch2/catch_test_macros.hpp>
+
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+
+#include "core/boot_cache.h"
+#include "core/cpu.h"
+#include "core/psexe.h"
+#include "machine_state.h"
+#include "workloads/workloads.h"
+
+namespace {
+    using Reg = RegAlias;
+} // Anonymous namespace
+
+TEST_CASE("PS-X EXE headers should be checked") {
+    const std::vector<uint8_t> good = buildWorkloadExe(workloadCorpus().front());
+    PsExe exe;
+    REQUIRE(parsePsExe(good.data(), good.size(), exe));
+    REQUIRE(exe.pc0 == workload_origin);
+    REQUIRE(exe.text_addr == workload_origin);
+    REQUIRE(exe.text.size() == good.size() - psexe_header_size);
+
+    std::vector<uint8_t> bad = good;
+    bad[0] = 'X';
+    REQUIRE(!parsePsExe(bad.data(), bad.size(), exe));
+    REQUIRE(!parsePsExe(good.data(), good.size() - 1, exe));
+
+    bad = good;
+    writeLE<uint32_t>(bad.data() + 0x18, 0x801ffff0);
+    REQUIRE(!parsePsExe(bad.data(), bad.size(), exe));
+    writeLE<uint32_t>(bad.data() + 0x18, 0x1f800000);
+    REQUIRE(!parsePsExe(bad.data(), bad.size(), exe));
+}
+
+TEST_CASE("Sideloaded workloads should end like the ones the BIOS loads") {
+    for(const Workload& workload : workloadCorpus()) {
+        INFO("Workload: " << workload.name);
+        const std::string path = writeBiosImage(buildWorkloadBios(workload), "prosur_psexe_test.bin");
+        REQUIRE(!path.empty());
+        const std::vector<uint8_t> image = buildWorkloadExe(workload);
+        PsExe exe;
+        REQUIRE(parsePsExe(image.data(), image.size(), exe));
+
+        for(const CPUMode mode : {CPUMode::Interpreter, CPUMode::Recompiler}) {
+            CPU booted(path);
+            booted.setMode(mode);
+            const EndState expected(booted);
+
+            CPU sideloaded(path);
+            sideloaded.setMode(mode);
+            sideloadPsExe(sideloaded, exe);
+            REQUIRE(sideloaded.getRegisters()[static_cast<size_t>(Reg::sp)] == psexe_default_stack);
+            const EndState actual(sideloaded);
+
+            REQUIRE(actual.reason == expected.reason);
+            REQUIRE(actual.machine.pc == expected.machine.pc);
+            REQUIRE(actual.machine.ram == expected.machine.ram);
+            // The BIOS loader leaves the temporaries it used behind
+            for(const Reg reg : {Reg::v0, Reg::s0, Reg::s1, Reg::s2, Reg::s3, Reg::s4, Reg::s5}) {
+                REQUIRE(actual.machine.reg(reg) == expected.machine.reg(reg));
+            }
+        }
+        std::remove(path.c_str());
+    }
+}
+
+TEST_CASE("Executables should load over a booted machine") {
+    Assembler as(bios_addr);
+    as.li(Reg::s0, 0x1234);
+    as.li(Reg::t0, boot_done_pc);
+    as.jr(Reg::t0);
+    as.nop();
+    const std::string path = writeBiosImage(buildBiosImage(as.finish()), "prosur_psexe_boot_test.bin");
+    REQUIRE(!path.empty());
+
+    const Workload* workload = findWorkload("memcpy_words");
+    REQUIRE(workload);
+    const std::vector<uint8_t> image = buildWorkloadExe(*workload);
+    PsExe exe;
+    REQUIRE(parsePsExe(image.data(), image.size(), exe));
+
+    CPU cpu(path);
+    cpu.setMode(CPUMode::CachedInterpreter);
+    REQUIRE(runBoot(cpu, 1'000));
+    sideloadPsExe(cpu, exe);
+    const EndState state(cpu);
+    REQUIRE(state.reason == StopReason::UnhandledOp);
+    REQUIRE(std::equal(state.machine.ram.begin() + workload_src % memory_size,
+                       state.machine.ram.begin() + workload_src % memory_size + workload_copy_size,
+                       state.machine.ram.begin() + workload_dst % memory_size));
+
+    std::remove(path.c_str());
+}
@@ -0,0 +1,107 @@
+#include <catch2/catch_test_macros.hpp>
+
+#include <cstdio>
+#include <vector>
+
+#include "core/cpu.h"
+#include "core/rewind.h"
+#include "workloads/workloads.h"
+
+namespace {
+    // Compared as a whole, so a failure doesn't print megabytes of RAM
+    struct Snapshot {
+        std::vector<uint8_t> state;
+
+        explicit Snapshot(const CPU& cpu) : state(cpu.saveState()) {}
+
+        bool operator==(const Snapshot& other) const {
+            return state == other.state;
+        }
+    };
+} // Anonymous namespace
+
+TEST_CASE("Rewinding should step back through the captured states") {
+    struct Backend {
+        CPUMode mode;
+        bool fastmem;
+    };
+    const Backend backends[] = {
+        {CPUMode::Interpreter, false},
+        {CPUMode::CachedInterpreter, false},
+        {CPUMode::Recompiler, false},
+        {CPUMode::Recompiler, true},
+    };
+
+    for(const char* name : {"memcpy_words", "unaligned_copy", "self_modifying"}) {
+        INFO("Workload: " << name);
+        const Workload* workload = findWorkload(name);
+        REQUIRE(workload);
+        const std::string path = writeBiosImage(buildWorkloadBios(*workload), "prosur_rewind_test.bin");
+        REQUIRE(!path.empty());
+
+        for(const Backend& backend : backends) {
+            INFO("Mode: " << static_cast<int>(backend.mode) << " fastmem: " << backend.fastmem);
+            CPU cpu(path);
+            if(backend.fastmem && !cpu.enableFastmem())
+                continue;
+            cpu.setMode(backend.mode);
+
+            RewindBuffer rewind(cpu, 100);
+            std::vector<Snapshot> states;
+            for(int frame = 0; frame < 20; ++frame) {
+                rewind.capture();
+                states.emplace_back(cpu);
+                cpu.run(3'000);
+            }
+            CPU reference(path);
+            reference.run(100'000'000);
+            const Snapshot end(reference);
+
+            // Back and forth, then all the way back
+            for(size_t i = states.size(); i-- > 0;) {
+                REQUIRE(rewind.rewind());
+                REQUIRE(Snapshot(cpu) == states[i]);
+                if(i == 10) {
+                    cpu.run(1'000);
+                    rewind.capture();
+                    const Snapshot captured(cpu);
+                    cpu.run(2'000);
+                    REQUIRE(rewind.rewind());
+                    REQUIRE(Snapshot(cpu) == captured);
+                }
+            }
+            REQUIRE(!rewind.rewind());
+            REQUIRE(rewind.size() == 0);
+
+            // And the machine still runs like it never went back
+            cpu.run(100'000'000);
+            REQUIRE(Snapshot(cpu) == end);
+        }
+        std::remove(path.c_str());
+    }
+}
+
+TEST_CASE("The rewind buffer should keep only the newest captures") {
+    const std::string path = writeBiosImage(buildWorkloadBios(*findWorkload("memcpy_words")), "prosur_rewind_test.bin");
+    REQUIRE(!path.empty());
+    CPU cpu(path);
+    cpu.setMode(CPUMode::CachedInterpreter);
+
+    RewindBuffer rewind(cpu, 4);
+    std::vector<Snapshot> states;
+    for(int frame = 0; frame < 10; ++frame) {
+        rewind.capture();
+        states.emplace_back(cpu);
+        cpu.run(5'000);
+    }
+    REQUIRE(rewind.size() == 4);
+    // A copy of 16 KiB a frame at most, far from a full RAM per capture
+    REQUIRE(rewind.memoryUsage() < memory_size / 8);
+
+    for(size_t i = states.size(); i-- > states.size() - 4;) {
+        REQUIRE(rewind.rewind());
+        REQUIRE(Snapshot(cpu) == states[i]);
+    }
+    REQUIRE(!rewind.rewind());
+    std::remove(path.c_str());
+}
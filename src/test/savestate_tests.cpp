@@ -0,0 +1,155 @@
+#include <catch2/catch_test_macros.hpp>
+
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+#include <vector>
+
+#include "core/cpu.h"
+#include "core/savestate.h"
+#include "workloads/workloads.h"
+
+TEST_CASE("Savestate sections should read back as written") {
+    SavestateWriter writer;
+    writer.beginSection(sectionTag("ONE "), 1);
+    writer.put<uint32_t>(0x12345678);
+    writer.put<uint8_t>(0xab);
+    writer.beginSection(sectionTag("NONE"), 3);
+    writer.beginSection(sectionTag("TWO "), 2);
+    const std::vector<uint8_t> bytes(1000, 0x5a);
+    writer.putBytes(bytes.data(), bytes.size());
+    const std::vector<uint8_t> state = writer.finish();
+
+    SavestateReader reader;
+    REQUIRE(reader.parse(state.data(), state.size()));
+
+    const SavestateSection* one = reader.find(sectionTag("ONE "), 1);
+    REQUIRE(one);
+    REQUIRE(one->size == 5);
+    REQUIRE(readLE<uint32_t>(one->data) == 0x12345678);
+    REQUIRE(one->data[4] == 0xab);
+
+    const SavestateSection* none = reader.find(sectionTag("NONE"), 3);
+    REQUIRE(none);
+    REQUIRE(none->size == 0);
+
+    const SavestateSection* two = reader.find(sectionTag("TWO "), 2);
+    REQUIRE(two);
+    REQUIRE((two->data - state.data()) % savestate_alignment == 0);
+    REQUIRE(std::vector<uint8_t>(two->data, two->data + two->size) == bytes);
+
+    // Other versions of a section are treated as missing
+    REQUIRE(!reader.find(sectionTag("TWO "), 1));
+    REQUIRE(!reader.find(sectionTag("SIX "), 1));
+}
+
+TEST_CASE("Damaged savestates should be rejected") {
+    SavestateWriter writer;
+    writer.beginSection(sectionTag("ONE "), 1);
+    writer.put<uint64_t>(1);
+    const std::vector<uint8_t> state = writer.finish();
+
+    SavestateReader reader;
+    REQUIRE(!reader.parse(state.data(), state.size() - 1));
+    REQUIRE(!reader.parse(state.data(), 8));
+
+    std::vector<uint8_t> damaged = state;
+    writeLE<uint32_t>(damaged.data() + 8, savestate_version + 1);
+    REQUIRE(!reader.parse(damaged.data(), damaged.size()));
+
+    // A section running into the table
+    damaged = state;
+    const size_t table = readLE<uint64_t>(state.data() + 16);
+    writeLE<uint64_t>(damaged.data() + table + 16, table);
+    REQUIRE(!reader.parse(damaged.data(), damaged.size()));
+
+    REQUIRE(!reader.open("prosur_missing.state"));
+
+    // A CPU state loading into a register past the last one
+    const Workload* workload = findWorkload("memcpy_words");
+    REQUIRE(workload);
+    const std::string bios_path = writeBiosImage(buildWorkloadBios(*workload), "prosur_savestate_test.bin");
+    REQUIRE(!bios_path.empty());
+    CPU cpu(bios_path);
+    cpu.run(50'000);
+    const std::vector<uint8_t> cpu_state = cpu.saveState();
+    REQUIRE(reader.parse(cpu_state.data(), cpu_state.size()));
+    const SavestateSection* registers = reader.find(sectionTag("CPU "), 2);
+    REQUIRE(registers);
+    const size_t pending_load = registers->data - cpu_state.data() + 3 * 4 + 32 * 4 + 2 * 4;
+
+    CPU loaded(bios_path);
+    const std::vector<uint8_t> fresh = loaded.saveState();
+    for(const uint8_t reg : {32, 255}) {
+        damaged = cpu_state;
+        damaged[pending_load] = reg;
+        REQUIRE(!loaded.loadState(damaged.data(), damaged.size()));
+        REQUIRE(loaded.saveState() == fresh);
+    }
+    damaged = cpu_state;
+    damaged[pending_load] = 31;
+    // R0 stays zero whatever the state says
+    writeLE<uint32_t>(damaged.data() + (registers->data - cpu_state.data()) + 3 * 4, 0x1234);
+    REQUIRE(loaded.loadState(damaged.data(), damaged.size()));
+    REQUIRE(loaded.getRegisters()[0] == 0);
+    std::remove(bios_path.c_str());
+}
+
+TEST_CASE("States saved to a file should load on a CPU with the same BIOS") {
+    const Workload* workload = findWorkload("memcpy_words");
+    REQUIRE(workload);
+    const std::string bios_path = writeBiosImage(buildWorkloadBios(*workload), "prosur_savestate_test.bin");
+    REQUIRE(!bios_path.empty());
+    const std::string path = (std::filesystem::temp_directory_path() / "prosur_savestate_test.state").string();
+
+    CPU cpu(bios_path);
+    cpu.setMode(CPUMode::Recompiler);
+    cpu.run(50'000);
+    REQUIRE(cpu.saveState(path));
+
+    CPU loaded(bios_path);
+    loaded.setMode(CPUMode::CachedInterpreter);
+    REQUIRE(loaded.loadState(path));
+    REQUIRE(loaded.getCycle() == cpu.getCycle());
+    REQUIRE(loaded.getPC() == cpu.getPC());
+    REQUIRE(loaded.getRegisters() == cpu.getRegisters());
+
+    cpu.run(100'000'000);
+    loaded.run(100'000'000);
+    REQUIRE(loaded.getPC() == cpu.getPC());
+    REQUIRE(loaded.getRegisters() == cpu.getRegisters());
+    REQUIRE(std::equal(cpu.getRAM(), cpu.getRAM() + memory_size, loaded.getRAM()));
+
+    // The state doesn't include the BIOS, so it can't go with another one
+    std::vector<uint8_t> image = buildWorkloadBios(*workload);
+    image[bios_size - 1] ^= 0xff;
+    const std::string other_path = writeBiosImage(image, "prosur_savestate_test_other.bin");
+    CPU other(other_path);
+    REQUIRE(!other.loadState(path));
+
+    std::remove(path.c_str());
+    std::remove(bios_path.c_str());
+    std::remove(other_path.c_str());
+}
+
+TEST_CASE("States should carry the scratchpad") {
+    const Workload* workload = findWorkload("scratchpad");
+    REQUIRE(workload);
+    const std::string bios_path = writeBiosImage(buildWorkloadBios(*workload), "prosur_savestate_test.bin");
+    REQUIRE(!bios_path.empty());
+
+    CPU cpu(bios_path);
+    cpu.run(200'000);
+    const std::vector<uint8_t> state = cpu.saveState();
+
+    CPU loaded(bios_path);
+    REQUIRE(loaded.loadState(state.data(), state.size()));
+    REQUIRE(loaded.saveState() == state);
+
+    cpu.run(100'000'000);
+    loaded.run(100'000'000);
+    REQUIRE(loaded.getRegisters() == cpu.getRegisters());
+    REQUIRE(std::equal(cpu.getRAM(), cpu.getRAM() + memory_size, loaded.getRAM()));
+
+    std::remove(bios_path.c_str());
+}
@@ -0,0 +1,71 @@
+
+#include <catch2/catch_test_macros.hpp>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "core/scheduler.h"
+
+TEST_CASE("The scheduler should run events in order once they're due") {
+    Scheduler scheduler;
+    std::vector<std::pair<std::string, uint64_t>> fired;
+    const auto record = [&](const char* name) {
+        return [&fired, name](uint64_t due) { fired.emplace_back(name, due); };
+    };
+    const auto a = scheduler.addEvent("a", record("a"));
+    const auto b = scheduler.addEvent("b", record("b"));
+    const auto c = scheduler.addEvent("c", record("c"));
+
+    REQUIRE(scheduler.nextEvent() == Scheduler::never);
+    scheduler.schedule(a, 100);
+    scheduler.schedule(b, 50);
+    scheduler.schedule(c, 100);
+    REQUIRE(scheduler.nextEvent() == 50);
+
+    scheduler.advance(49);
+    REQUIRE(fired.empty());
+
+    // Blocks can overshoot, events still run in order with their due cycle
+    scheduler.advance(60);
+    REQUIRE(fired == std::vector<std::pair<std::string, uint64_t>>{{"b", 50}, {"a", 100}, {"c", 100}});
+    REQUIRE(scheduler.now() == 109);
+    REQUIRE(scheduler.nextEvent() == Scheduler::never);
+    REQUIRE(!scheduler.isScheduled(a));
+
+    SECTION("Scheduling again moves the event") {
+        fired.clear();
+        scheduler.schedule(a, 200);
+        scheduler.schedule(a, 150);
+        REQUIRE(scheduler.dueAt(a) == 150);
+        REQUIRE(scheduler.nextEvent() == 150);
+        scheduler.advance(100);
+        REQUIRE(fired == std::vector<std::pair<std::string, uint64_t>>{{"a", 150}});
+    }
+
+    SECTION("Cancelled events don't run") {
+        fired.clear();
+        scheduler.scheduleIn(a, 10);
+        scheduler.scheduleIn(b, 20);
+        scheduler.cancel(a);
+        REQUIRE(scheduler.nextEvent() == 129);
+        scheduler.advance(100);
+        REQUIRE(fired == std::vector<std::pair<std::string, uint64_t>>{{"b", 129}});
+    }
+}
+
+TEST_CASE("Periodic events should reschedule from their due cycle") {
+    Scheduler scheduler;
+    std::vector<uint64_t> ticks;
+    Scheduler::EventId tick = 0;
+    tick = scheduler.addEvent("tick", [&](uint64_t due) {
+        ticks.push_back(due);
+        scheduler.schedule(tick, due + 10);
+    });
+    scheduler.schedule(tick, 10);
+
+    // One big step runs every period it covers without drifting
+    scheduler.advance(35);
+    REQUIRE(ticks == std::vector<uint64_t>{10, 20, 30});
+    REQUIRE(scheduler.nextEvent() == 40);
+}
@@ -0,0 +1,64 @@
+
+#include <catch2/catch_test_macros.hpp>
+
+#include <cstdio>
+#include <filesystem>
+
+#include "core/trace.h"
+
+TEST_CASE("A trace should read back what was written") {
+    const auto path = (std::filesystem::temp_directory_path() / "prosur_trace_test.bin").string();
+
+    std::array<uint32_t, 32> regs{};
+    regs[29] = 0x801ffff0;
+    {
+        auto writer = TraceWriter::create(path, 0xbfc00000, regs);
+        REQUIRE(writer);
+
+        writer->beginOp(0xbfc00000, 0x3c080013);
+        writer->regWrite(8, 0x00130000);
+        writer->endOp();
+
+        writer->beginOp(0xbfc00004, 0xad090000);
+        writer->memAccess(true, 4, 0x1f801000, 0xdeadbeef);
+        writer->endOp();
+
+        // Jump back, same instruction as before
+        writer->beginOp(0xbfc00000, 0x3c080013);
+        writer->regWrite(29, 0x801fffe8);
+        writer->memAccess(false, 1, 0x80000003, 0xff);
+        writer->endOp();
+    }
+
+    TraceReader reader;
+    REQUIRE(reader.open(path));
+    REQUIRE(reader.registers()[29] == 0x801ffff0);
+
+    TraceRecord record;
+    REQUIRE(reader.next(record));
+    REQUIRE(record.pc == 0xbfc00000);
+    REQUIRE(record.instruction == 0x3c080013);
+    REQUIRE(record.reg_writes.size() == 1);
+    REQUIRE(record.reg_writes[0] == std::make_pair<uint8_t, uint32_t>(8, 0x00130000));
+
+    REQUIRE(reader.next(record));
+    REQUIRE(record.pc == 0xbfc00004);
+    REQUIRE(record.reg_writes.empty());
+    REQUIRE(record.mem_accesses.size() == 1);
+    REQUIRE(record.mem_accesses[0].store);
+    REQUIRE(record.mem_accesses[0].size == 4);
+    REQUIRE(record.mem_accesses[0].addr == 0x1f801000);
+    REQUIRE(record.mem_accesses[0].val == 0xdeadbeef);
+
+    REQUIRE(reader.next(record));
+    REQUIRE(record.pc == 0xbfc00000);
+    REQUIRE(record.instruction == 0x3c080013);
+    REQUIRE(record.reg_writes[0].second == 0x801fffe8);
+    REQUIRE(!record.mem_accesses[0].store);
+    REQUIRE(record.mem_accesses[0].size == 1);
+    REQUIRE(record.mem_accesses[0].addr == 0x80000003);
+    REQUIRE(record.mem_accesses[0].val == 0xff);
+
+    REQUIRE(!reader.next(record));
+    std::remove(path.c_str());
+}
@@ -0,0 +1,404 @@
+
+#include <catch2/catch_test_macros.hpp>
+
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <optional>
+#include <random>
+#include <vector>
+
+#include "core/cpu.h"
+#include "machine_state.h"
+#include "workloads/workloads.h"
+
+namespace {
+    // Empty if the backend isn't available on this host
+    std::optional<EndState> runWorkload(const std::string& bios_path, CPUMode mode, bool fastmem) {
+        CPU cpu(bios_path);
+        if(fastmem && !cpu.enableFastmem())
+            return std::nullopt;
+        cpu.setMode(mode);
+        return EndState(cpu);
+    }
+
+    // Straight line code with forward branches, where loads often land on
+    // registers the next instruction reads or writes
+    struct RandomOp {
+        enum Kind : uint8_t { Addu, Addiu, Or, Sltu, Sll, Lw, Lbu, Sw, Bne, kind_count } kind;
+        uint8_t rd;
+        uint8_t rs;
+        uint8_t rt;
+        int16_t imm;
+        // Index of the op a branch goes to, the end of the program at most
+        size_t target;
+    };
+
+    constexpr uint32_t random_data_addr = 0x80010000;
+    constexpr uint32_t random_data_size = 256;
+    constexpr uint8_t random_base = static_cast<uint8_t>(RegAlias::s0);
+    // t0 to t7, the only registers the ops write
+    constexpr uint8_t random_first_reg = static_cast<uint8_t>(RegAlias::t0);
+    constexpr uint8_t random_reg_count = 8;
+
+    std::vector<RandomOp> randomProgram(std::mt19937& rng, size_t size) {
+        const auto random = [&](uint32_t n) { return static_cast<uint32_t>(rng() % n); };
+        const auto reg = [&] { return static_cast<uint8_t>(random_first_reg + random(random_reg_count)); };
+        std::vector<RandomOp> ops(size);
+        for(size_t i = 0; i < size; ++i) {
+            RandomOp& op = ops[i];
+            // No branches in delay slots
+            const bool after_branch = i && ops[i - 1].kind == RandomOp::Bne;
+            op.kind = static_cast<RandomOp::Kind>(random(after_branch ? RandomOp::Bne : RandomOp::kind_count));
+            op.rd = reg();
+            op.rs = reg();
+            op.rt = reg();
+            if(op.kind == RandomOp::Lw || op.kind == RandomOp::Sw)
+                op.imm = static_cast<int16_t>(random(random_data_size / 4) * 4);
+            else if(op.kind == RandomOp::Lbu)
+                op.imm = static_cast<int16_t>(random(random_data_size));
+            else if(op.kind == RandomOp::Sll)
+                op.imm = static_cast<int16_t>(random(32));
+            else
+                op.imm = static_cast<int16_t>(rng());
+            op.target = std::min<size_t>(i + 2 + random(static_cast<uint32_t>(size - i)), size);
+        }
+        return ops;
+    }
+
+    void assembleRandomProgram(Assembler& as, const std::vector<RandomOp>& ops,
+                               const std::array<uint32_t, random_reg_count>& initial) {
+        const auto r = [](uint8_t reg) { return static_cast<RegAlias>(reg); };
+        as.li(r(random_base), random_data_addr);
+        for(uint8_t i = 0; i < random_reg_count; ++i) {
+            as.li(r(random_first_reg + i), initial[i]);
+        }
+        std::vector<Assembler::Label> labels(ops.size() + 1);
+        for(Assembler::Label& label : labels) {
+            label = as.newLabel();
+        }
+        for(size_t i = 0; i < ops.size(); ++i) {
+            const RandomOp& op = ops[i];
+            as.bind(labels[i]);
+            switch(op.kind) {
+            case RandomOp::Addu: as.addu(r(op.rd), r(op.rs), r(op.rt)); break;
+            case RandomOp::Addiu: as.addiu(r(op.rt), r(op.rs), op.imm); break;
+            case RandomOp::Or: as.or_(r(op.rd), r(op.rs), r(op.rt)); break;
+            case RandomOp::Sltu: as.sltu(r(op.rd), r(op.rs), r(op.rt)); break;
+            case RandomOp::Sll: as.sll(r(op.rd), r(op.rt), static_cast<uint8_t>(op.imm)); break;
+            case RandomOp::Lw: as.lw(r(op.rt), op.imm, r(random_base)); break;
+            case RandomOp::Lbu: as.lbu(r(op.rt), op.imm, r(random_base)); break;
+            case RandomOp::Sw: as.sw(r(op.rt), op.imm, r(random_base)); break;
+            case RandomOp::Bne: as.bne(r(op.rs), r(op.rt), labels[op.target]); break;
+            default: break;
+            }
+        }
+        as.bind(labels.back());
+        as.nop();
+        as.nop();
+        as.word(0xffffffff);
+    }
+
+    // The load delay slot as the CPU used to emulate it, with a second
+    // register file: the load queued by an instruction is written to the
+    // output registers before the next one runs, which reads the old
+    // registers and may overwrite the load with its own result
+    struct ReferenceMachine {
+        std::array<uint32_t, 32> R{};
+        std::array<uint8_t, random_data_size> data{};
+
+        void run(const std::vector<RandomOp>& ops) {
+            std::pair<uint8_t, uint32_t> load{0, 0};
+            size_t pc = 0;
+            size_t next_pc = 1;
+            while(pc < ops.size()) {
+                const RandomOp& op = ops[pc];
+                pc = next_pc;
+                next_pc = pc + 1;
+
+                std::array<uint32_t, 32> outR = R;
+                if(load.first)
+                    outR[load.first] = load.second;
+                load = {0, 0};
+
+                const uint32_t offset = static_cast<uint16_t>(op.imm);
+                switch(op.kind) {
+                case RandomOp::Addu: outR[op.rd] = R[op.rs] + R[op.rt]; break;
+                case RandomOp::Addiu: outR[op.rt] = R[op.rs] + static_cast<uint32_t>(op.imm); break;
+                case RandomOp::Or: outR[op.rd] = R[op.rs] | R[op.rt]; break;
+                case RandomOp::Sltu: outR[op.rd] = R[op.rs] < R[op.rt]; break;
+                case RandomOp::Sll: outR[op.rd] = R[op.rt] << op.imm; break;
+                case RandomOp::Lw: load = {op.rt, readLE<uint32_t>(&data[offset])}; break;
+                case RandomOp::Lbu: load = {op.rt, data[offset]}; break;
+                case RandomOp::Sw: writeLE<uint32_t>(&data[offset], R[op.rt]); break;
+                case RandomOp::Bne:
+                    if(R[op.rs] != R[op.rt])
+                        next_pc = op.target;
+                    break;
+                default: break;
+                }
+                R = outR;
+            }
+            // Lands during the nops after the program
+            if(load.first)
+                R[load.first] = load.second;
+        }
+    };
+} // Anonymous namespace
+
+TEST_CASE("The assembler should encode instructions and resolve labels") {
+    Assembler as(0x80010000);
+    const auto back = as.bindNew();
+    const auto forward = as.newLabel();
+    as.addiu(RegAlias::t0, RegAlias::t1, -1);
+    as.bne(RegAlias::t0, RegAlias::zero, back);
+    as.lw(RegAlias::a0, 0x10, RegAlias::sp);
+    as.jal(forward);
+    as.li(RegAlias::v0, 0x1f801814);
+    as.bind(forward);
+    as.mtc0(RegAlias::t1, Cop0RegAlias::SR);
+
+    const std::vector<uint32_t> code = as.finish();
+    REQUIRE(code.size() == 7);
+    REQUIRE(code[0] == 0x2528ffff); // ADDIU t0, t1, -1
+    REQUIRE(code[1] == 0x1500fffe); // BNE t0, zero, -2
+    REQUIRE(code[2] == 0x8fa40010); // LW a0, 0x10(sp)
+    REQUIRE(code[3] == 0x0c004006); // JAL 0x80010018
+    REQUIRE(code[4] == 0x3c021f80); // LUI v0, 0x1f80
+    REQUIRE(code[5] == 0x34421814); // ORI v0, v0, 0x1814
+    REQUIRE(code[6] == 0x40896000); // MTC0 t1, SR
+    REQUIRE(as.address(forward) == 0x80010018);
+}
+
+TEST_CASE("Every backend should end the workloads in the same state") {
+    struct Backend {
+        CPUMode mode;
+        bool fastmem;
+        const char* name;
+    };
+    const Backend backends[] = {
+        {CPUMode::CachedInterpreter, false, "cached"},
+        {CPUMode::Recompiler, false, "recompiler"},
+        {CPUMode::Recompiler, true, "fastmem"},
+    };
+
+    for(const Workload& workload : workloadCorpus()) {
+        INFO("Workload: " << workload.name);
+        const std::string path = writeBiosImage(buildWorkloadBios(workload), "prosur_workload_test.bin");
+        REQUIRE(!path.empty());
+
+        const std::optional<EndState> expected = runWorkload(path, CPUMode::Interpreter, false);
+        REQUIRE(expected);
+        REQUIRE(expected->reason == StopReason::UnhandledOp);
+
+        for(const Backend& backend : backends) {
+            INFO("Backend: " << backend.name);
+            const std::optional<EndState> state = runWorkload(path, backend.mode, backend.fastmem);
+            if(!state)
+                continue;
+            // Guest time is up to each backend, what it computed isn't
+            REQUIRE(state->reason == expected->reason);
+            REQUIRE(state->machine.pc == expected->machine.pc);
+            REQUIRE(state->machine.regs == expected->machine.regs);
+            REQUIRE(state->machine.ram == expected->machine.ram);
+        }
+        std::remove(path.c_str());
+    }
+}
+
+TEST_CASE("Loads should land after their delay slot like with a second register file") {
+    std::mt19937 rng(0x10ad);
+    for(int program = 0; program < 300; ++program) {
+        INFO("Program: " << program);
+        const std::vector<RandomOp> ops = randomProgram(rng, 48);
+        std::array<uint32_t, random_reg_count> initial;
+        for(uint32_t& val : initial) {
+            // Small values too, so some branches compare equal
+            val = rng() % 2 ? rng() : rng() % 4;
+        }
+
+        ReferenceMachine expected;
+        expected.R[random_base] = random_data_addr;
+        std::copy(initial.begin(), initial.end(), expected.R.begin() + random_first_reg);
+        expected.run(ops);
+
+        Assembler as(bios_addr);
+        assembleRandomProgram(as, ops, initial);
+        const std::string path = writeBiosImage(buildBiosImage(as.finish()), "prosur_load_delay_test.bin");
+        REQUIRE(!path.empty());
+        for(const CPUMode mode : {CPUMode::Interpreter, CPUMode::CachedInterpreter, CPUMode::Recompiler}) {
+            INFO("Mode: " << static_cast<int>(mode));
+            CPU cpu(path);
+            cpu.setMode(mode);
+            const EndState state(cpu);
+            REQUIRE(state.reason == StopReason::UnhandledOp);
+            for(uint8_t i = 0; i < random_reg_count; ++i) {
+                REQUIRE(state.machine.regs[random_first_reg + i] == expected.R[random_first_reg + i]);
+            }
+            REQUIRE(std::equal(expected.data.begin(), expected.data.end(), state.machine.ramAt(random_data_addr)));
+        }
+        std::remove(path.c_str());
+    }
+}
+
+TEST_CASE("The workloads should compute what they're meant to") {
+    const auto run = [](const char* name) {
+        const Workload* workload = findWorkload(name);
+        REQUIRE(workload);
+        const std::string path = writeBiosImage(buildWorkloadBios(*workload), "prosur_workload_test.bin");
+        const std::optional<EndState> state = runWorkload(path, CPUMode::Interpreter, false);
+        REQUIRE(state);
+        std::remove(path.c_str());
+        return state->machine;
+    };
+
+    SECTION("Copies") {
+        const MachineState words = run("memcpy_words");
+        REQUIRE(readLE<uint32_t>(words.ramAt(workload_src)) == 0x12345678);
+        REQUIRE(std::memcmp(words.ramAt(workload_dst), words.ramAt(workload_src), workload_copy_size) == 0);
+
+        const MachineState bytes = run("memcpy_bytes");
+        REQUIRE(std::memcmp(bytes.ramAt(workload_dst + 3), bytes.ramAt(workload_src + 1), workload_copy_size - 4) == 0);
+
+        const MachineState unaligned = run("unaligned_copy");
+        REQUIRE(std::memcmp(unaligned.ramAt(workload_dst + 2), unaligned.ramAt(workload_src + 1),
+                            workload_copy_size - 4) == 0);
+    }
+
+    SECTION("Calls") {
+        const MachineState state = run("calls");
+        REQUIRE(state.reg(RegAlias::v1) == 40000);
+        REQUIRE(state.reg(RegAlias::sp) == 0x801ffff0);
+    }
+
+    SECTION("Self modifying code") {
+        // Every call runs the instruction patched right before it
+        uint32_t sum = 0;
+        for(uint32_t i = 2000; i > 0; --i) {
+            sum += i & 0xff;
+        }
+        const MachineState state = run("self_modifying");
+        REQUIRE(state.reg(RegAlias::v0) == sum);
+    }
+
+    SECTION("Scratchpad") {
+        uint32_t sum = 0;
+        for(uint32_t pass = 200; pass > 0; --pass) {
+            for(uint32_t i = 0; i < scratchpad_size / 4; ++i) {
+                const uint32_t word = pass + i * 0x01030507;
+                sum += (word & 0xffff) + (word >> 24);
+            }
+        }
+        const MachineState state = run("scratchpad");
+        REQUIRE(state.reg(RegAlias::v0) == sum);
+        for(uint32_t i = 0; i < scratchpad_size / 4; ++i) {
+            REQUIRE(readLE<uint32_t>(state.ramAt(workload_dst + 4 * i)) == 1 + i * 0x01030507);
+        }
+    }
+}
+
+TEST_CASE("Idle loops should be skipped to the next event") {
+    constexpr uint64_t budget = 1'000'000;
+
+    // Waits for a GPUSTAT bit that never gets set
+    Assembler as(bios_addr);
+    as.li(RegAlias::s1, 0x1f801000);
+    as.li(RegAlias::s2, 1);
+    const auto poll = as.bindNew();
+    as.lw(RegAlias::t0, 0x814, RegAlias::s1);
+    as.nop();
+    as.andi(RegAlias::t0, RegAlias::t0, 0x400);
+    as.sltu(RegAlias::t1, RegAlias::t0, RegAlias::s2);
+    as.bne(RegAlias::t1, RegAlias::zero, poll);
+    as.nop();
+    const std::string path = writeBiosImage(buildBiosImage(as.finish()), "prosur_idle_test.bin");
+
+    CPU reference(path);
+    reference.run(budget);
+    REQUIRE(reference.getStats().idle_cycles == 0);
+
+    for(const CPUMode mode : {CPUMode::CachedInterpreter, CPUMode::Recompiler}) {
+        CPU cpu(path);
+        cpu.setMode(mode);
+        const RunResult result = cpu.run(budget);
+        REQUIRE(result.reason == StopReason::BudgetExhausted);
+        REQUIRE(result.cycles == budget);
+        REQUIRE(cpu.getStats().instructions < 100);
+        REQUIRE(cpu.getStats().instructions + cpu.getStats().idle_cycles == budget);
+        REQUIRE(cpu.getRegisters() == reference.getRegisters());
+
+        // Only the loop is skipped, running again picks up from it and
+        // wakes up for events
+        uint64_t fired_at = 0;
+        Scheduler& scheduler = cpu.getScheduler();
+        const auto event = scheduler.addEvent("test", [&](uint64_t) { fired_at = scheduler.now(); });
+        scheduler.schedule(event, budget + budget / 3);
+        REQUIRE(cpu.run(budget).cycles == budget);
+        REQUIRE(fired_at == budget + budget / 3);
+        REQUIRE(cpu.getRegisters() == reference.getRegisters());
+    }
+    std::remove(path.c_str());
+
+    SECTION("Loops reading GPUREAD keep running") {
+        // Every read moves a VRAM to CPU transfer along
+        Assembler gpuread(bios_addr);
+        gpuread.li(RegAlias::s1, 0x1f801000);
+        gpuread.li(RegAlias::t0, 0xc0000000);
+        gpuread.sw(RegAlias::t0, 0x810, RegAlias::s1);
+        gpuread.sw(RegAlias::zero, 0x810, RegAlias::s1);
+        gpuread.li(RegAlias::t0, 0x00200020);
+        gpuread.sw(RegAlias::t0, 0x810, RegAlias::s1);
+        gpuread.li(RegAlias::s2, 1);
+        const auto read = gpuread.bindNew();
+        gpuread.lw(RegAlias::t0, 0x810, RegAlias::s1);
+        gpuread.nop();
+        gpuread.andi(RegAlias::t0, RegAlias::t0, 0x400);
+        gpuread.sltu(RegAlias::t1, RegAlias::t0, RegAlias::s2);
+        gpuread.bne(RegAlias::t1, RegAlias::zero, read);
+        gpuread.nop();
+        const std::string gpuread_path = writeBiosImage(buildBiosImage(gpuread.finish()), "prosur_gpuread_test.bin");
+
+        CPU expected(gpuread_path);
+        expected.run(budget);
+        for(const CPUMode mode : {CPUMode::CachedInterpreter, CPUMode::Recompiler}) {
+            CPU cpu(gpuread_path);
+            cpu.setMode(mode);
+            REQUIRE(cpu.run(budget).cycles == budget);
+            REQUIRE(cpu.getStats().idle_cycles == 0);
+            REQUIRE(cpu.saveState() == expected.saveState());
+        }
+        std::remove(gpuread_path.c_str());
+    }
+
+    SECTION("Loops building the address of GPUSTAT are skipped") {
+        Assembler gpustat(bios_addr);
+        gpustat.li(RegAlias::s2, 1);
+        const auto poll_status = gpustat.bindNew();
+        gpustat.lui(RegAlias::t2, 0x1f80);
+        gpustat.ori(RegAlias::t2, RegAlias::t2, 0x1814);
+        gpustat.lw(RegAlias::t0, 0, RegAlias::t2);
+        gpustat.nop();
+        gpustat.andi(RegAlias::t0, RegAlias::t0, 0x400);
+        gpustat.sltu(RegAlias::t1, RegAlias::t0, RegAlias::s2);
+        gpustat.bne(RegAlias::t1, RegAlias::zero, poll_status);
+        gpustat.nop();
+        const std::string gpustat_path = writeBiosImage(buildBiosImage(gpustat.finish()), "prosur_gpustat_test.bin");
+
+        CPU cpu(gpustat_path);
+        cpu.setMode(CPUMode::CachedInterpreter);
+        REQUIRE(cpu.run(budget).cycles == budget);
+        REQUIRE(cpu.getStats().instructions < 100);
+        std::remove(gpustat_path.c_str());
+    }
+
+    SECTION("Loops counting down a timeout keep running") {
+        const std::string workload_path = writeBiosImage(buildWorkloadBios(*findWorkload("mmio_poll")), "prosur_timeout_test.bin");
+        CPU cpu(workload_path);
+        cpu.setMode(CPUMode::CachedInterpreter);
+        REQUIRE(cpu.run(budget).reason == StopReason::UnhandledOp);
+        REQUIRE(cpu.getStats().idle_cycles == 0);
+        std::remove(workload_path.c_str());
+    }
+}
@@ -0,0 +1,89 @@
+
+#undef _UNICODE
+#include <getopt.h>
+#ifndef _MSC_VER
+#include <unistd.h>
+#endif
+
+#include <fmt/core.h>
+
+#include <cstdlib>
+#include <string>
+
+#include "core/disassembler.h"
+#include "core/trace.h"
+
+static void printHelp(const char* argv0) {
+    fmt::print("Usage: {} [options] <trace>\n"
+               "-h, --help            Display this help text and exit\n"
+               "-n, --count <n>       Only print the first n instructions\n",
+               argv0);
+}
+
+int main(int argc, char* args[]) {
+    int option_index = 0;
+    char* endarg = nullptr;
+
+    std::string filename;
+    uint64_t count = UINT64_MAX;
+
+    static struct option long_options[] = {
+        {"help", no_argument, 0, 'h'},
+        {"count", required_argument, 0, 'n'},
+        {0, 0, 0, 0},
+    };
+
+    while (optind < argc) {
+        int arg = getopt_long(argc, args, "hn:", long_options, &option_index);
+        if (arg != -1) {
+            switch (static_cast<char>(arg)) {
+            case 'h':
+                printHelp(args[0]);
+                return 0;
+            case 'n':
+                count = std::strtoull(optarg, &endarg, 0);
+                if (*endarg != '\0') {
+                    fmt::print("Invalid count {}\n", optarg);
+                    return -1;
+                }
+                break;
+            default:
+                printHelp(args[0]);
+                return -1;
+            }
+        } else {
+            filename = args[optind];
+            optind++;
+        }
+    }
+
+    if (filename.empty()) {
+        fmt::print("Trace not provided. Printing help.\n");
+        printHelp(args[0]);
+        return 0;
+    }
+
+    TraceReader reader;
+    if (!reader.open(filename)) {
+        fmt::print("{} isn't a trace file\n", filename);
+        return -1;
+    }
+
+    TraceRecord record;
+    std::string line;
+    for (uint64_t i = 0; i < count && reader.next(record); ++i) {
+        line = fmt::format("{:08x}: {:08x}  {:<28}", record.pc, record.instruction,
+                           disassemble(Instruction(record.instruction), record.pc));
+        for (const auto& [reg, val] : record.reg_writes) {
+            line += fmt::format(" ${}={:#x}", regName(reg), val);
+        }
+        for (const TraceMemoryAccess& access : record.mem_accesses) {
+            line += fmt::format(" [{}{} {:#010x}={:#x}]", access.store ? "st" : "ld", 8 * access.size,
+                                access.addr, access.val);
+        }
+        line.erase(line.find_last_not_of(' ') + 1);
+        fmt::print("{}\n", line);
+    }
+
+    return 0;
+}
@@ -0,0 +1,284 @@
+#include "assembler.h"
+#include "core/log.h"
+
+namespace {
+    uint32_t reg(RegAlias r) {
+        return static_cast<uint32_t>(r);
+    }
+
+    // Primary opcodes
+    constexpr uint8_t op_regimm = 0x01;
+    constexpr uint8_t op_cop0 = 0x10;
+} // Anonymous namespace
+
+Assembler::Assembler(uint32_t origin) : base(origin) {}
+
+Assembler::Label Assembler::newLabel() {
+    labels.push_back(unbound_label);
+    return {static_cast<uint32_t>(labels.size() - 1)};
+}
+
+void Assembler::bind(Label label) {
+    if(labels[label.id] != unbound_label)
+        LOG("Assembler: Label {} bound twice\n", label.id);
+    labels[label.id] = static_cast<uint32_t>(code.size());
+}
+
+uint32_t Assembler::address(Label label) const {
+    return base + 4 * labels[label.id];
+}
+
+void Assembler::emit(Instruction instruction) {
+    code.push_back(instruction.whole);
+}
+
+void Assembler::emitR(uint8_t funct, Reg rs, Reg rt, Reg rd, uint8_t shamt) {
+    word((reg(rs) << 21) | (reg(rt) << 16) | (reg(rd) << 11) | ((shamt & 0x1f) << 6) | funct);
+}
+
+void Assembler::emitI(uint8_t opcode, Reg rs, Reg rt, uint16_t imm) {
+    word((static_cast<uint32_t>(opcode) << 26) | (reg(rs) << 21) | (reg(rt) << 16) | imm);
+}
+
+void Assembler::emitRef(uint32_t word, Label label, Fixup kind) {
+    references.push_back({code.size(), label.id, kind});
+    code.push_back(word);
+}
+
+void Assembler::sll(Reg rd, Reg rt, uint8_t shamt) {
+    emitR(0x00, Reg::zero, rt, rd, shamt);
+}
+void Assembler::srl(Reg rd, Reg rt, uint8_t shamt) {
+    emitR(0x02, Reg::zero, rt, rd, shamt);
+}
+void Assembler::sra(Reg rd, Reg rt, uint8_t shamt) {
+    emitR(0x03, Reg::zero, rt, rd, shamt);
+}
+void Assembler::sllv(Reg rd, Reg rt, Reg rs) {
+    emitR(0x04, rs, rt, rd);
+}
+void Assembler::srlv(Reg rd, Reg rt, Reg rs) {
+    emitR(0x06, rs, rt, rd);
+}
+void Assembler::srav(Reg rd, Reg rt, Reg rs) {
+    emitR(0x07, rs, rt, rd);
+}
+
+void Assembler::add(Reg rd, Reg rs, Reg rt) {
+    emitR(0x20, rs, rt, rd);
+}
+void Assembler::addu(Reg rd, Reg rs, Reg rt) {
+    emitR(0x21, rs, rt, rd);
+}
+void Assembler::sub(Reg rd, Reg rs, Reg rt) {
+    emitR(0x22, rs, rt, rd);
+}
+void Assembler::subu(Reg rd, Reg rs, Reg rt) {
+    emitR(0x23, rs, rt, rd);
+}
+void Assembler::and_(Reg rd, Reg rs, Reg rt) {
+    emitR(0x24, rs, rt, rd);
+}
+void Assembler::or_(Reg rd, Reg rs, Reg rt) {
+    emitR(0x25, rs, rt, rd);
+}
+void Assembler::xor_(Reg rd, Reg rs, Reg rt) {
+    emitR(0x26, rs, rt, rd);
+}
+void Assembler::nor(Reg rd, Reg rs, Reg rt) {
+    emitR(0x27, rs, rt, rd);
+}
+void Assembler::slt(Reg rd, Reg rs, Reg rt) {
+    emitR(0x2a, rs, rt, rd);
+}
+void Assembler::sltu(Reg rd, Reg rs, Reg rt) {
+    emitR(0x2b, rs, rt, rd);
+}
+
+void Assembler::mult(Reg rs, Reg rt) {
+    emitR(0x18, rs, rt, Reg::zero);
+}
+void Assembler::multu(Reg rs, Reg rt) {
+    emitR(0x19, rs, rt, Reg::zero);
+}
+void Assembler::div(Reg rs, Reg rt) {
+    emitR(0x1a, rs, rt, Reg::zero);
+}
+void Assembler::divu(Reg rs, Reg rt) {
+    emitR(0x1b, rs, rt, Reg::zero);
+}
+void Assembler::mfhi(Reg rd) {
+    emitR(0x10, Reg::zero, Reg::zero, rd);
+}
+void Assembler::mthi(Reg rs) {
+    emitR(0x11, rs, Reg::zero, Reg::zero);
+}
+void Assembler::mflo(Reg rd) {
+    emitR(0x12, Reg::zero, Reg::zero, rd);
+}
+void Assembler::mtlo(Reg rs) {
+    emitR(0x13, rs, Reg::zero, Reg::zero);
+}
+
+void Assembler::addi(Reg rt, Reg rs, int16_t imm) {
+    emitI(0x08, rs, rt, static_cast<uint16_t>(imm));
+}
+void Assembler::addiu(Reg rt, Reg rs, int16_t imm) {
+    emitI(0x09, rs, rt, static_cast<uint16_t>(imm));
+}
+void Assembler::slti(Reg rt, Reg rs, int16_t imm) {
+    emitI(0x0a, rs, rt, static_cast<uint16_t>(imm));
+}
+void Assembler::sltiu(Reg rt, Reg rs, int16_t imm) {
+    emitI(0x0b, rs, rt, static_cast<uint16_t>(imm));
+}
+void Assembler::andi(Reg rt, Reg rs, uint16_t imm) {
+    emitI(0x0c, rs, rt, imm);
+}
+void Assembler::ori(Reg rt, Reg rs, uint16_t imm) {
+    emitI(0x0d, rs, rt, imm);
+}
+void Assembler::xori(Reg rt, Reg rs, uint16_t imm) {
+    emitI(0x0e, rs, rt, imm);
+}
+void Assembler::lui(Reg rt, uint16_t imm) {
+    emitI(0x0f, Reg::zero, rt, imm);
+}
+
+void Assembler::lb(Reg rt, int16_t offset, Reg base) {
+    emitI(0x20, base, rt, static_cast<uint16_t>(offset));
+}
+void Assembler::lh(Reg rt, int16_t offset, Reg base) {
+    emitI(0x21, base, rt, static_cast<uint16_t>(offset));
+}
+void Assembler::lwl(Reg rt, int16_t offset, Reg base) {
+    emitI(0x22, base, rt, static_cast<uint16_t>(offset));
+}
+void Assembler::lw(Reg rt, int16_t offset, Reg base) {
+    emitI(0x23, base, rt, static_cast<uint16_t>(offset));
+}
+void Assembler::lbu(Reg rt, int16_t offset, Reg base) {
+    emitI(0x24, base, rt, static_cast<uint16_t>(offset));
+}
+void Assembler::lhu(Reg rt, int16_t offset, Reg base) {
+    emitI(0x25, base, rt, static_cast<uint16_t>(offset));
+}
+void Assembler::lwr(Reg rt, int16_t offset, Reg base) {
+    emitI(0x26, base, rt, static_cast<uint16_t>(offset));
+}
+void Assembler::sb(Reg rt, int16_t offset, Reg base) {
+    emitI(0x28, base, rt, static_cast<uint16_t>(offset));
+}
+void Assembler::sh(Reg rt, int16_t offset, Reg base) {
+    emitI(0x29, base, rt, static_cast<uint16_t>(offset));
+}
+void Assembler::swl(Reg rt, int16_t offset, Reg base) {
+    emitI(0x2a, base, rt, static_cast<uint16_t>(offset));
+}
+void Assembler::sw(Reg rt, int16_t offset, Reg base) {
+    emitI(0x2b, base, rt, static_cast<uint16_t>(offset));
+}
+void Assembler::swr(Reg rt, int16_t offset, Reg base) {
+    emitI(0x2e, base, rt, static_cast<uint16_t>(offset));
+}
+
+void Assembler::j(Label target) {
+    emitRef(0x02u << 26, target, Fixup::Jump);
+}
+void Assembler::jal(Label target) {
+    emitRef(0x03u << 26, target, Fixup::Jump);
+}
+void Assembler::jr(Reg rs) {
+    emitR(0x08, rs, Reg::zero, Reg::zero);
+}
+void Assembler::jalr(Reg rd, Reg rs) {
+    emitR(0x09, rs, Reg::zero, rd);
+}
+void Assembler::beq(Reg rs, Reg rt, Label target) {
+    emitRef((0x04u << 26) | (reg(rs) << 21) | (reg(rt) << 16), target, Fixup::Branch);
+}
+void Assembler::bne(Reg rs, Reg rt, Label target) {
+    emitRef((0x05u << 26) | (reg(rs) << 21) | (reg(rt) << 16), target, Fixup::Branch);
+}
+void Assembler::blez(Reg rs, Label target) {
+    emitRef((0x06u << 26) | (reg(rs) << 21), target, Fixup::Branch);
+}
+void Assembler::bgtz(Reg rs, Label target) {
+    emitRef((0x07u << 26) | (reg(rs) << 21), target, Fixup::Branch);
+}
+void Assembler::bltz(Reg rs, Label target) {
+    emitRef((static_cast<uint32_t>(op_regimm) << 26) | (reg(rs) << 21) | (0x00 << 16), target, Fixup::Branch);
+}
+void Assembler::bgez(Reg rs, Label target) {
+    emitRef((static_cast<uint32_t>(op_regimm) << 26) | (reg(rs) << 21) | (0x01 << 16), target, Fixup::Branch);
+}
+
+void Assembler::mfc0(Reg rt, Cop0RegAlias rd) {
+    word((static_cast<uint32_t>(op_cop0) << 26) | (0x00 << 21) | (reg(rt) << 16) | (static_cast<uint32_t>(rd) << 11));
+}
+void Assembler::mtc0(Reg rt, Cop0RegAlias rd) {
+    word((static_cast<uint32_t>(op_cop0) << 26) | (0x04 << 21) | (reg(rt) << 16) | (static_cast<uint32_t>(rd) << 11));
+}
+
+void Assembler::li(Reg rt, uint32_t val) {
+    if(val <= 0xffff) {
+        ori(rt, Reg::zero, static_cast<uint16_t>(val));
+    }
+    else if(static_cast<int32_t>(val) >= -0x8000 && static_cast<int32_t>(val) < 0) {
+        addiu(rt, Reg::zero, static_cast<int16_t>(val));
+    }
+    else {
+        lui(rt, static_cast<uint16_t>(val >> 16));
+        if(val & 0xffff)
+            ori(rt, rt, static_cast<uint16_t>(val));
+    }
+}
+
+void Assembler::la(Reg rt, Label label) {
+    emitRef((0x0fu << 26) | (reg(rt) << 16), label, Fixup::Hi16);
+    emitRef((0x0du << 26) | (reg(rt) << 21) | (reg(rt) << 16), label, Fixup::Lo16);
+}
+
+std::vector<uint32_t> Assembler::finish() {
+    for(const Reference& ref : references) {
+        uint32_t& word = code[ref.index];
+        if(labels[ref.label] == unbound_label) {
+            LOG("Assembler: Label {} referenced at {:#x} is never bound\n", ref.label, base + 4 * ref.index);
+            word = 0;
+            continue;
+        }
+
+        const uint32_t target = address({ref.label});
+        const uint32_t addr = base + 4 * static_cast<uint32_t>(ref.index);
+        switch(ref.kind) {
+        case Fixup::Branch:
+        {
+            const int32_t offset = static_cast<int32_t>(target - (addr + 4)) >> 2;
+            if(offset < -0x8000 || offset > 0x7fff) {
+                LOG("Assembler: Branch at {:#x} can't reach {:#x}\n", addr, target);
+                word = 0;
+                break;
+            }
+            word |= static_cast<uint16_t>(offset);
+        }
+            break;
+        case Fixup::Jump:
+            // Jumps stay within the 256 MiB segment of their delay slot
+            if(((addr + 4) ^ target) & 0xf0000000) {
+                LOG("Assembler: Jump at {:#x} can't reach {:#x}\n", addr, target);
+                word = 0;
+                break;
+            }
+            word |= (target >> 2) & 0x03ffffff;
+            break;
+        case Fixup::Hi16:
+            word |= target >> 16;
+            break;
+        case Fixup::Lo16:
+            word |= target & 0xffff;
+            break;
+        }
+    }
+    references.clear();
+    return code;
+}
@@ -0,0 +1,166 @@
+#ifndef ASSEMBLER_H
+#define ASSEMBLER_H
+
+#include <cstdint>
+#include <vector>
+
+#include "core/mips.h"
+
+// Builds R3000A machine code from C++, for guest programs in tests and
+// benchmarks. Instructions are appended at consecutive addresses starting
+// from the origin the code will run at. Branches and jumps can target
+// labels bound before or after them, finish() patches the forward ones.
+//
+// The assembler doesn't reorder anything: delay slots are whatever gets
+// emitted right after a branch or load.
+class Assembler {
+public:
+    using Reg = RegAlias;
+
+    struct Label {
+        uint32_t id;
+    };
+
+    explicit Assembler(uint32_t origin);
+
+    uint32_t origin() const {
+        return base;
+    }
+    // Address of the next instruction
+    uint32_t here() const {
+        return base + 4 * static_cast<uint32_t>(code.size());
+    }
+
+    Label newLabel();
+    // Binds label to the next instruction
+    void bind(Label label);
+    Label bindNew() {
+        const Label label = newLabel();
+        bind(label);
+        return label;
+    }
+    // Only valid once label is bound
+    uint32_t address(Label label) const;
+
+    // Raw words, for data or invalid instructions
+    void emit(Instruction instruction);
+    void word(uint32_t val) {
+        emit(Instruction(val));
+    }
+
+    // Shifts
+    void sll(Reg rd, Reg rt, uint8_t shamt);
+    void srl(Reg rd, Reg rt, uint8_t shamt);
+    void sra(Reg rd, Reg rt, uint8_t shamt);
+    void sllv(Reg rd, Reg rt, Reg rs);
+    void srlv(Reg rd, Reg rt, Reg rs);
+    void srav(Reg rd, Reg rt, Reg rs);
+
+    // Register ALU ops
+    void add(Reg rd, Reg rs, Reg rt);
+    void addu(Reg rd, Reg rs, Reg rt);
+    void sub(Reg rd, Reg rs, Reg rt);
+    void subu(Reg rd, Reg rs, Reg rt);
+    void and_(Reg rd, Reg rs, Reg rt);
+    void or_(Reg rd, Reg rs, Reg rt);
+    void xor_(Reg rd, Reg rs, Reg rt);
+    void nor(Reg rd, Reg rs, Reg rt);
+    void slt(Reg rd, Reg rs, Reg rt);
+    void sltu(Reg rd, Reg rs, Reg rt);
+
+    // Multiply and divide
+    void mult(Reg rs, Reg rt);
+    void multu(Reg rs, Reg rt);
+    void div(Reg rs, Reg rt);
+    void divu(Reg rs, Reg rt);
+    void mfhi(Reg rd);
+    void mthi(Reg rs);
+    void mflo(Reg rd);
+    void mtlo(Reg rs);
+
+    // Immediate ALU ops
+    void addi(Reg rt, Reg rs, int16_t imm);
+    void addiu(Reg rt, Reg rs, int16_t imm);
+    void slti(Reg rt, Reg rs, int16_t imm);
+    void sltiu(Reg rt, Reg rs, int16_t imm);
+    void andi(Reg rt, Reg rs, uint16_t imm);
+    void ori(Reg rt, Reg rs, uint16_t imm);
+    void xori(Reg rt, Reg rs, uint16_t imm);
+    void lui(Reg rt, uint16_t imm);
+
+    // Loads and stores, rt <-> offset(base)
+    void lb(Reg rt, int16_t offset, Reg base);
+    void lh(Reg rt, int16_t offset, Reg base);
+    void lwl(Reg rt, int16_t offset, Reg base);
+    void lw(Reg rt, int16_t offset, Reg base);
+    void lbu(Reg rt, int16_t offset, Reg base);
+    void lhu(Reg rt, int16_t offset, Reg base);
+    void lwr(Reg rt, int16_t offset, Reg base);
+    void sb(Reg rt, int16_t offset, Reg base);
+    void sh(Reg rt, int16_t offset, Reg base);
+    void swl(Reg rt, int16_t offset, Reg base);
+    void sw(Reg rt, int16_t offset, Reg base);
+    void swr(Reg rt, int16_t offset, Reg base);
+
+    // Jumps and branches
+    void j(Label target);
+    void jal(Label target);
+    void jr(Reg rs);
+    void jalr(Reg rd, Reg rs);
+    void beq(Reg rs, Reg rt, Label target);
+    void bne(Reg rs, Reg rt, Label target);
+    void blez(Reg rs, Label target);
+    void bgtz(Reg rs, Label target);
+    void bltz(Reg rs, Label target);
+    void bgez(Reg rs, Label target);
+
+    // Coprocessor 0
+    void mfc0(Reg rt, Cop0RegAlias rd);
+    void mtc0(Reg rt, Cop0RegAlias rd);
+
+    // Pseudo instructions
+    void nop() {
+        word(0);
+    }
+    // One instruction when val fits in 16 bits, two otherwise
+    void li(Reg rt, uint32_t val);
+    // Always two instructions, so it can load labels before they're bound
+    void la(Reg rt, Label label);
+    void move(Reg rd, Reg rs) {
+        addu(rd, rs, Reg::zero);
+    }
+    void b(Label target) {
+        beq(Reg::zero, Reg::zero, target);
+    }
+
+    // Resolves the references to labels and returns the code. Branches out
+    // of range or labels never bound are logged and left as zero.
+    std::vector<uint32_t> finish();
+
+private:
+    enum class Fixup : uint8_t {
+        Branch,
+        Jump,
+        Hi16,
+        Lo16,
+    };
+    struct Reference {
+        size_t index;
+        uint32_t label;
+        Fixup kind;
+    };
+
+    void emitR(uint8_t funct, Reg rs, Reg rt, Reg rd, uint8_t shamt = 0);
+    void emitI(uint8_t opcode, Reg rs, Reg rt, uint16_t imm);
+    void emitRef(uint32_t word, Label label, Fixup kind);
+
+    uint32_t base;
+    std::vector<uint32_t> code;
+    // Offset into code of each label, unbound_label if not bound yet
+    std::vector<uint32_t> labels;
+    std::vector<Reference> references;
+
+    static constexpr uint32_t unbound_label = 0xffffffff;
+};
+
+#endif // ASSEMBLER_H
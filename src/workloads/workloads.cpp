@@ -0,0 +1,393 @@
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+
+#include "workloads.h"
+#include "core/cpu.h"
+#include "core/psexe.h"
+
+namespace {
+    using Reg = RegAlias;
+
+    // Stops the CPU, the nop keeps the invalid word out of a delay slot
+    void emitStop(Assembler& as) {
+        as.nop();
+        as.word(0xffffffff);
+    }
+
+    // Counts s0 down from count around body, which must leave s0 alone
+    template<typename F>
+    void emitLoop(Assembler& as, uint32_t count, F body) {
+        as.li(Reg::s0, count);
+        const auto loop = as.bindNew();
+        body();
+        as.addiu(Reg::s0, Reg::s0, -1);
+        as.bne(Reg::s0, Reg::zero, loop);
+        as.nop();
+    }
+
+    // Fills the workload_copy_size bytes at workload_src with a pattern
+    void emitFillSource(Assembler& as) {
+        as.li(Reg::t0, workload_src);
+        as.li(Reg::t1, 0x12345678);
+        as.li(Reg::t2, 0x9e3779b9);
+        as.li(Reg::t3, workload_copy_size / 4);
+        const auto fill = as.bindNew();
+        as.sw(Reg::t1, 0, Reg::t0);
+        as.addu(Reg::t1, Reg::t1, Reg::t2);
+        as.addiu(Reg::t3, Reg::t3, -1);
+        as.bne(Reg::t3, Reg::zero, fill);
+        as.addiu(Reg::t0, Reg::t0, 4);
+    }
+
+    // Register to register ops only, no load is ever pending
+    void buildAluLoop(Assembler& as) {
+        constexpr Reg regs[] = {Reg::t0, Reg::t1, Reg::t2, Reg::t3, Reg::t4, Reg::t5, Reg::t6, Reg::t7};
+        for(const Reg reg : regs) {
+            as.li(reg, 0);
+        }
+        as.li(Reg::s1, 0x01234567);
+        emitLoop(as, 20000, [&] {
+            for(int i = 0; i < 64; ++i) {
+                const Reg rd = regs[i % 8];
+                const Reg rs = regs[(i + 3) % 8];
+                switch(i % 4) {
+                case 0:
+                    as.addu(rd, rd, Reg::s1);
+                    break;
+                case 1:
+                    as.addiu(rd, rs, static_cast<int16_t>(i));
+                    break;
+                case 2:
+                    as.sll(rd, rs, 1);
+                    break;
+                case 3:
+                    as.or_(rd, rd, rs);
+                    break;
+                }
+            }
+        });
+        emitStop(as);
+    }
+
+    // Every other op is a load, so the load delay slot is always busy
+    void buildLoadLoop(Assembler& as) {
+        constexpr Reg regs[] = {Reg::t0, Reg::t1, Reg::t2, Reg::t3, Reg::t4, Reg::t5, Reg::t6, Reg::t7};
+        emitFillSource(as);
+        for(const Reg reg : regs) {
+            as.li(reg, 0);
+        }
+        as.li(Reg::s1, workload_src);
+        as.li(Reg::s2, 0x11);
+        emitLoop(as, 20000, [&] {
+            for(int i = 0; i < 64; ++i) {
+                const Reg rd = regs[i % 8];
+                if(i % 2)
+                    as.lw(rd, static_cast<int16_t>(4 * i), Reg::s1);
+                else
+                    as.addu(rd, rd, Reg::s2);
+            }
+        });
+        emitStop(as);
+    }
+
+    // Word copies unrolled by four, like a libc memcpy of aligned buffers
+    void buildMemcpyWords(Assembler& as) {
+        emitFillSource(as);
+        emitLoop(as, 8, [&] {
+            as.li(Reg::s1, workload_src);
+            as.li(Reg::s2, workload_dst);
+            as.li(Reg::s3, workload_copy_size / 16);
+            const auto copy = as.bindNew();
+            as.lw(Reg::t0, 0, Reg::s1);
+            as.lw(Reg::t1, 4, Reg::s1);
+            as.lw(Reg::t2, 8, Reg::s1);
+            as.lw(Reg::t3, 12, Reg::s1);
+            as.addiu(Reg::s1, Reg::s1, 16);
+            as.sw(Reg::t0, 0, Reg::s2);
+            as.sw(Reg::t1, 4, Reg::s2);
+            as.sw(Reg::t2, 8, Reg::s2);
+            as.sw(Reg::t3, 12, Reg::s2);
+            as.addiu(Reg::s3, Reg::s3, -1);
+            as.bne(Reg::s3, Reg::zero, copy);
+            as.addiu(Reg::s2, Reg::s2, 16);
+        });
+        emitStop(as);
+    }
+
+    // Byte copies between buffers of different alignment
+    void buildMemcpyBytes(Assembler& as) {
+        emitFillSource(as);
+        emitLoop(as, 2, [&] {
+            as.li(Reg::s1, workload_src + 1);
+            as.li(Reg::s2, workload_dst + 3);
+            as.li(Reg::s3, workload_copy_size - 4);
+            const auto copy = as.bindNew();
+            as.lbu(Reg::t0, 0, Reg::s1);
+            as.addiu(Reg::s1, Reg::s1, 1);
+            as.sb(Reg::t0, 0, Reg::s2);
+            as.addiu(Reg::s3, Reg::s3, -1);
+            as.bne(Reg::s3, Reg::zero, copy);
+            as.addiu(Reg::s2, Reg::s2, 1);
+        });
+        emitStop(as);
+    }
+
+    // Unaligned word copies with LWL/LWR and SWL/SWR pairs
+    void buildUnalignedCopy(Assembler& as) {
+        emitFillSource(as);
+        emitLoop(as, 4, [&] {
+            as.li(Reg::s1, workload_src + 1);
+            as.li(Reg::s2, workload_dst + 2);
+            as.li(Reg::s3, workload_copy_size / 4 - 1);
+            const auto copy = as.bindNew();
+            as.lwr(Reg::t0, 0, Reg::s1);
+            as.lwl(Reg::t0, 3, Reg::s1);
+            as.addiu(Reg::s1, Reg::s1, 4);
+            as.swr(Reg::t0, 0, Reg::s2);
+            as.swl(Reg::t0, 3, Reg::s2);
+            as.addiu(Reg::s3, Reg::s3, -1);
+            as.bne(Reg::s3, Reg::zero, copy);
+            as.addiu(Reg::s2, Reg::s2, 4);
+        });
+        emitStop(as);
+    }
+
+    // Data dependent branches on bits of a linear congruential generator,
+    // hard to predict for the host and full of short blocks for the cache
+    void buildBranches(Assembler& as) {
+        as.li(Reg::s1, 0x2545f491);
+        for(const Reg reg : {Reg::s2, Reg::s3, Reg::s4, Reg::s5}) {
+            as.li(reg, 0);
+        }
+        emitLoop(as, 50000, [&] {
+            const auto odd = as.newLabel();
+            const auto next = as.newLabel();
+            const auto skip = as.newLabel();
+            // s1 = s1 * 33 + 0x3b9
+            as.sll(Reg::t0, Reg::s1, 5);
+            as.addu(Reg::s1, Reg::s1, Reg::t0);
+            as.addiu(Reg::s1, Reg::s1, 0x3b9);
+            as.andi(Reg::t1, Reg::s1, 0x1000);
+            as.bne(Reg::t1, Reg::zero, odd);
+            as.nop();
+            as.addiu(Reg::s2, Reg::s2, 1);
+            as.j(next);
+            as.nop();
+            as.bind(odd);
+            as.andi(Reg::t1, Reg::s1, 0x0400);
+            as.bne(Reg::t1, Reg::zero, next);
+            as.addiu(Reg::s3, Reg::s3, 1);
+            as.addiu(Reg::s4, Reg::s4, 1);
+            as.bind(next);
+            as.sltu(Reg::t2, Reg::s2, Reg::s3);
+            as.bne(Reg::t2, Reg::zero, skip);
+            as.nop();
+            as.addu(Reg::s5, Reg::s5, Reg::s1);
+            as.bind(skip);
+        });
+        emitStop(as);
+    }
+
+    // Calls to a leaf function and to one that saves ra on the stack
+    void buildCalls(Assembler& as) {
+        const auto leaf = as.newLabel();
+        const auto nested = as.newLabel();
+        as.li(Reg::sp, 0x801ffff0);
+        as.li(Reg::v0, 0);
+        as.li(Reg::v1, 0);
+        emitLoop(as, 20000, [&] {
+            as.jal(leaf);
+            as.move(Reg::a0, Reg::s0);
+            as.jal(nested);
+            as.nop();
+        });
+        emitStop(as);
+
+        as.bind(leaf);
+        as.addu(Reg::v0, Reg::v0, Reg::a0);
+        as.jr(Reg::ra);
+        as.addiu(Reg::v1, Reg::v1, 1);
+
+        as.bind(nested);
+        as.addiu(Reg::sp, Reg::sp, -8);
+        as.sw(Reg::ra, 0, Reg::sp);
+        as.jal(leaf);
+        as.ori(Reg::a0, Reg::zero, 3);
+        as.lw(Reg::ra, 0, Reg::sp);
+        as.nop();
+        as.jr(Reg::ra);
+        as.addiu(Reg::sp, Reg::sp, 8);
+    }
+
+    // Waits on GPUSTAT with a timeout, the way games wait for hardware
+    void buildMmioPoll(Assembler& as) {
+        const auto ready = as.newLabel();
+        as.li(Reg::s1, 0x1f801000);
+        as.li(Reg::s0, 20000);
+        const auto poll = as.bindNew();
+        as.lw(Reg::t0, 0x814, Reg::s1);
+        as.addiu(Reg::s0, Reg::s0, -1);
+        as.andi(Reg::t0, Reg::t0, 0x0400);
+        as.bne(Reg::t0, Reg::zero, ready);
+        as.nop();
+        as.bne(Reg::s0, Reg::zero, poll);
+        as.nop();
+        as.bind(ready);
+        emitStop(as);
+    }
+
+    // Fills the scratchpad through KUSEG and sums it back through KSEG0 a
+    // halfword and a byte per word, then copies it to workload_dst
+    void buildScratchpad(Assembler& as) {
+        as.li(Reg::v0, 0);
+        as.li(Reg::s2, 0x01030507);
+        emitLoop(as, 200, [&] {
+            as.li(Reg::s1, scratchpad_addr);
+            as.li(Reg::t1, scratchpad_size / 4);
+            as.or_(Reg::t2, Reg::s0, Reg::zero);
+            const auto fill = as.bindNew();
+            as.sw(Reg::t2, 0, Reg::s1);
+            as.addu(Reg::t2, Reg::t2, Reg::s2);
+            as.addiu(Reg::t1, Reg::t1, -1);
+            as.bne(Reg::t1, Reg::zero, fill);
+            as.addiu(Reg::s1, Reg::s1, 4);
+
+            as.li(Reg::s1, 0x80000000 | scratchpad_addr);
+            as.li(Reg::t1, scratchpad_size / 4);
+            const auto sum = as.bindNew();
+            as.lhu(Reg::t0, 0, Reg::s1);
+            as.lbu(Reg::t3, 3, Reg::s1);
+            as.addu(Reg::v0, Reg::v0, Reg::t0);
+            as.addiu(Reg::s1, Reg::s1, 4);
+            as.addiu(Reg::t1, Reg::t1, -1);
+            as.bne(Reg::t1, Reg::zero, sum);
+            as.addu(Reg::v0, Reg::v0, Reg::t3);
+        });
+        as.li(Reg::s1, scratchpad_addr);
+        as.li(Reg::s3, workload_dst);
+        as.li(Reg::t1, scratchpad_size / 4);
+        const auto copy = as.bindNew();
+        as.lw(Reg::t0, 0, Reg::s1);
+        as.addiu(Reg::s1, Reg::s1, 4);
+        as.sw(Reg::t0, 0, Reg::s3);
+        as.addiu(Reg::t1, Reg::t1, -1);
+        as.bne(Reg::t1, Reg::zero, copy);
+        as.addiu(Reg::s3, Reg::s3, 4);
+        emitStop(as);
+    }
+
+    // Patches the immediate of an instruction in a function before each
+    // call, so its block is invalidated and compiled again every time
+    void buildSelfModifying(Assembler& as) {
+        Assembler patch(0);
+        patch.addiu(Reg::v0, Reg::v0, 0);
+        const uint32_t patched_op = patch.finish()[0];
+
+        const auto fn = as.newLabel();
+        as.la(Reg::s1, fn);
+        as.li(Reg::s2, patched_op);
+        as.li(Reg::v0, 0);
+        emitLoop(as, 2000, [&] {
+            as.andi(Reg::t0, Reg::s0, 0xff);
+            as.or_(Reg::t0, Reg::t0, Reg::s2);
+            as.sw(Reg::t0, 0, Reg::s1);
+            as.jal(fn);
+            as.nop();
+        });
+        emitStop(as);
+
+        as.bind(fn);
+        as.word(patched_op);
+        as.jr(Reg::ra);
+        as.nop();
+    }
+
+    // Copies the payload assembled at workload_origin from the BIOS to RAM
+    // and jumps to it
+    std::vector<uint32_t> buildLoader(const std::vector<uint32_t>& payload) {
+        Assembler as(bios_addr);
+        const auto data = as.newLabel();
+        as.la(Reg::t0, data);
+        as.li(Reg::t1, workload_origin);
+        as.li(Reg::t2, 4 * static_cast<uint32_t>(payload.size()));
+        const auto copy = as.bindNew();
+        as.lw(Reg::t3, 0, Reg::t0);
+        as.addiu(Reg::t0, Reg::t0, 4);
+        as.sw(Reg::t3, 0, Reg::t1);
+        as.addiu(Reg::t2, Reg::t2, -4);
+        as.bne(Reg::t2, Reg::zero, copy);
+        as.addiu(Reg::t1, Reg::t1, 4);
+        as.li(Reg::t0, workload_origin);
+        as.jr(Reg::t0);
+        as.nop();
+        as.bind(data);
+        for(const uint32_t word : payload) {
+            as.word(word);
+        }
+        return as.finish();
+    }
+} // Anonymous namespace
+
+const std::vector<Workload>& workloadCorpus() {
+    static const std::vector<Workload> corpus = {
+        {"alu_loop", "Tight loop of register ALU ops", &buildAluLoop},
+        {"load_loop", "Loop alternating ALU ops and loads from RAM", &buildLoadLoop},
+        {"memcpy_words", "Aligned word copies, unrolled by four", &buildMemcpyWords},
+        {"memcpy_bytes", "Byte copies between misaligned buffers", &buildMemcpyBytes},
+        {"unaligned_copy", "Word copies with LWL/LWR and SWL/SWR", &buildUnalignedCopy},
+        {"branches", "Data dependent branches and jumps", &buildBranches},
+        {"calls", "Function calls through JAL and JR", &buildCalls},
+        {"mmio_poll", "Polling a hardware register with a timeout", &buildMmioPoll},
+        {"self_modifying", "Code patching itself before every call", &buildSelfModifying},
+        {"scratchpad", "Word stores and narrow loads on the scratchpad", &buildScratchpad},
+    };
+    return corpus;
+}
+
+const Workload* findWorkload(const std::string& name) {
+    for(const Workload& workload : workloadCorpus()) {
+        if(name == workload.name)
+            return &workload;
+    }
+    return nullptr;
+}
+
+std::vector<uint8_t> buildBiosImage(const std::vector<uint32_t>& code) {
+    std::vector<uint8_t> image(bios_size, 0);
+    for(size_t i = 0; i < code.size() && i < bios_size / 4; ++i) {
+        writeLE<uint32_t>(image.data() + 4 * i, code[i]);
+    }
+    return image;
+}
+
+std::vector<uint8_t> buildWorkloadBios(const Workload& workload) {
+    Assembler as(workload_origin);
+    workload.build(as);
+    return buildBiosImage(buildLoader(as.finish()));
+}
+
+std::vector<uint8_t> buildWorkloadExe(const Workload& workload) {
+    Assembler as(workload_origin);
+    workload.build(as);
+    const std::vector<uint32_t> code = as.finish();
+
+    std::vector<uint8_t> exe(psexe_header_size + 4 * code.size(), 0);
+    std::copy(std::begin(psexe_magic), std::end(psexe_magic), exe.begin());
+    writeLE<uint32_t>(exe.data() + 0x10, workload_origin);
+    writeLE<uint32_t>(exe.data() + 0x18, workload_origin);
+    writeLE<uint32_t>(exe.data() + 0x1c, 4 * static_cast<uint32_t>(code.size()));
+    for(size_t i = 0; i < code.size(); ++i) {
+        writeLE<uint32_t>(exe.data() + psexe_header_size + 4 * i, code[i]);
+    }
+    return exe;
+}
+
+std::string writeBiosImage(const std::vector<uint8_t>& image, const std::string& name) {
+    const auto path = (std::filesystem::temp_directory_path() / name).string();
+    std::ofstream file(path, std::ios::out | std::ios::binary);
+    file.write(reinterpret_cast<const char*>(image.data()), image.size());
+    if(!file)
+        return "";
+    return path;
+}
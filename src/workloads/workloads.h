@@ -0,0 +1,46 @@
+#ifndef WORKLOADS_H
+#define WORKLOADS_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "assembler.h"
+
+// Synthetic guest programs, shared by the tests and the benchmarks so both
+// run exactly the same code on any machine without a real BIOS.
+//
+// A workload runs from RAM at workload_origin. buildWorkloadBios wraps it
+// in a BIOS image whose reset vector copies it there and jumps to it.
+// Workloads only use instructions the CPU implements and stop it with an
+// invalid instruction once done. Registers start out as garbage, so they
+// set every register they read first.
+constexpr uint32_t workload_origin = 0x80010000;
+
+// Buffers the memory workloads copy between
+constexpr uint32_t workload_src = 0x80100000;
+constexpr uint32_t workload_dst = 0x80140000;
+constexpr uint32_t workload_copy_size = 16 * 1024;
+
+struct Workload {
+    const char* name;
+    const char* description;
+    // Emits the program at the origin of as
+    void (*build)(Assembler& as);
+};
+
+const std::vector<Workload>& workloadCorpus();
+// Returns null if there's no workload called name
+const Workload* findWorkload(const std::string& name);
+
+// A bios_size image with code at the reset vector
+std::vector<uint8_t> buildBiosImage(const std::vector<uint32_t>& code);
+std::vector<uint8_t> buildWorkloadBios(const Workload& workload);
+// The workload as a PS-X EXE to sideload, which skips the BIOS loader
+std::vector<uint8_t> buildWorkloadExe(const Workload& workload);
+
+// Writes image, a BIOS or an executable, to name in the temp directory and returns its path, or an
+// empty string if it can't be written
+std::string writeBiosImage(const std::vector<uint8_t>& image, const std::string& name);
+
+#endif // WORKLOADS_H